@@ -0,0 +1,188 @@
+/**
+ * @file BenchmarkRunner.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Runs the pass through opt (or llvm-lto2) over generated modules, and compares the results.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENCHMARK_RUNNER_H_
+#define _BENCHMARK_RUNNER_H_
+
+#include "IRGenerator.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+
+#include <string>
+#include <vector>
+
+// Timer groups printed by opt -time-passes
+#define PASS_TIMING_GROUP "Pass execution timing report"
+#define PHASE_TIMING_GROUP "Call obfuscator phases" // CALL_OBF_TIMER_GROUP_DESC in the plugin
+
+// Peak rss reported for children is the highest among every child waited for, so each
+// opt run goes through a fresh copy of the benchmark tool, that only has one child.
+#define MEASURE_CHILD_FLAG "--measure-child"
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorbench
+{
+    struct BenchmarkCase
+    {
+        string name;
+        string sweep;        // Parameter being scaled, cases of the same sweep are compared to each other
+        unsigned long value; // Value of the scaled parameter
+        GeneratorOptions options;
+    };
+
+    struct BenchmarkResult
+    {
+        BenchmarkCase benchmarkCase;
+        double wallMs = 0;       // Best wall time of the whole opt process
+        double wallMedianMs = 0; // Median wall time of the whole opt process
+        double passMs = 0;       // Time inside the pass, for the best run
+        double coldConfigMs = 0; // Reading the config when there is no compiled copy yet
+        uint64_t peakRssKb = 0;  // Highest peak rss among all runs
+        StringMap<double> phasesMs;
+    };
+
+    struct LTOBenchmarkCase
+    {
+        string name;
+        string mode;              // thin or full
+        unsigned int modules;     // Translation units linked together
+        GeneratorOptions options; // Shape of each module
+    };
+
+    struct LTOBenchmarkResult
+    {
+        LTOBenchmarkCase benchmarkCase;
+        double compileMs = 0;          // Pre link opt runs, one after the other
+        uint64_t compilePeakRssKb = 0; // Highest peak rss among the pre link runs
+        double linkWallMs = 0;         // Best wall time of the link
+        double linkWallMedianMs = 0;   // Median wall time of the link
+        uint64_t linkPeakRssKb = 0;    // Highest peak rss among all links
+    };
+
+    struct RunnerOptions
+    {
+        string selfPath; // Benchmark tool, used as MEASURE_CHILD_FLAG wrapper
+        string optPath;
+        string ltoPath; // llvm-lto2, only for the LTO suite
+        string pluginPath;
+        string workDir;
+        unsigned int repetitions = 5;
+        unsigned int thinLTOThreads = 0; // 0 for llvm-lto2 default
+        vector<string> extraOptArgs;
+    };
+
+    /**
+     * @brief Default suite. Each sweep scales a single parameter (functions, config size,
+     *        hooked apis, calls per function) while the others stay fixed.
+     *
+     * @param scale Multiplier for the size of every case.
+     * @return vector<BenchmarkCase> Cases, grouped by sweep and sorted by value.
+     */
+    vector<BenchmarkCase> defaultSuite(double scale);
+
+    /**
+     * @brief LTO suite. The same multi module program is linked with full LTO and with
+     *        ThinLTO, for a few program sizes.
+     *
+     * @param scale Multiplier for the size of every case.
+     * @return vector<LTOBenchmarkCase> Cases, sorted by size and mode.
+     */
+    vector<LTOBenchmarkCase> ltoSuite(double scale);
+
+    /**
+     * @brief Generates the case modules and config into the work dir, runs the pre link
+     *        pipeline with the pass on each module through opt, and links them with
+     *        llvm-lto2, with the plugin loaded. The pre link runs are timed once, the link
+     *        as many times as repetitions.
+     *
+     * @param options Runner options.
+     * @param benchmarkCase Case to run.
+     * @param result [OUT] Returns the measurements.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool runLTOCase(const RunnerOptions &options, const LTOBenchmarkCase &benchmarkCase, LTOBenchmarkResult &result, string &error);
+
+    /**
+     * @brief Generates the case module and config into the work dir, and runs the pass
+     *        on it through opt. The first run has no compiled config, and is only used
+     *        for coldConfigMs, the rest are timed.
+     *
+     * @param options Runner options.
+     * @param benchmarkCase Case to run.
+     * @param result [OUT] Returns the measurements.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool runCase(const RunnerOptions &options, const BenchmarkCase &benchmarkCase, BenchmarkResult &result, string &error);
+
+    /**
+     * @brief Entry point of the MEASURE_CHILD_FLAG wrapper. Runs the given command, and
+     *        writes its wall time (ms) and peak rss (KB) to the given file.
+     *
+     * @param args Output file, followed by the command and its arguments.
+     * @return int Exit code of the command, or 1 if it could not be run.
+     */
+    int runMeasuredChild(ArrayRef<const char *> args);
+
+    /**
+     * @brief Extracts the time of the pass and of each of its phases from a -time-passes report.
+     *
+     * @param report Contents of the report.
+     * @param passMs [OUT] Returns the time spent in the pass.
+     * @param phasesMs [OUT] Returns the time of each phase, by description.
+     * @return true The pass was found in the report.
+     */
+    bool parseTimingReport(StringRef report, double &passMs, StringMap<double> &phasesMs);
+
+    /**
+     * @brief Scaling exponent of the pass time for each sweep, measured between the
+     *        smallest and the biggest case: 1 is linear, 2 quadratic...
+     *
+     * @param results Results of the suite.
+     * @return StringMap<double> Sweep -> exponent.
+     */
+    StringMap<double> scalingExponents(const vector<BenchmarkResult> &results);
+
+    /**
+     * @brief Serializes the results of a suite, along with a comparison to the baseline
+     *        if given.
+     *
+     * @param results Results of the suite.
+     * @param ltoResults Results of the LTO suite.
+     * @param p_baseline Previous results, or NULL.
+     * @param threshold Ratio to the baseline considered a regression.
+     * @param regressions [OUT] Returns the number of regressions found.
+     * @return json::Value Report.
+     */
+    json::Value createReport(const vector<BenchmarkResult> &results, const vector<LTOBenchmarkResult> &ltoResults,
+                             const json::Value *p_baseline, double threshold, unsigned int &regressions);
+}
+
+#endif
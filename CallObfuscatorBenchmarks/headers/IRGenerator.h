@@ -0,0 +1,73 @@
+/**
+ * @file IRGenerator.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Generation of synthetic modules and configs to benchmark the pass.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IR_GENERATOR_H_
+#define _IR_GENERATOR_H_
+
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorbench
+{
+    struct GeneratorOptions
+    {
+        unsigned int functions = 1000;         // Defined functions, each one calling apis
+        unsigned int hookedDeclarations = 100; // Declared apis listed in the config
+        unsigned int plainDeclarations = 100;  // Declared apis not listed in the config
+        unsigned int callsPerFunction = 4;     // Api calls in each defined function
+        unsigned int configHooks = 1000;       // Functions in the config, at least hookedDeclarations
+        unsigned int dlls = 16;                // Dlls the config hooks are spread across
+        string functionPrefix = "Function";    // Defined functions are named prefix + index, unique per module
+        bool fullLTO = false;                  // Add the module flags clang sets for full LTO (opt -thinlto-bc sets the thin ones)
+    };
+
+    /**
+     * @brief Writes a module with the given shape as bitcode. Calls go round robin over
+     *        every declared api, hooked ones first, and each call uses the result of
+     *        the previous one, so none of them is dead.
+     *
+     * @param options Shape of the module.
+     * @param path Output bitcode file.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool generateModule(const GeneratorOptions &options, StringRef path, string &error);
+
+    /**
+     * @brief Writes a config hooking every hookedDeclarations api of the generated module,
+     *        plus enough functions not present in it to reach configHooks entries.
+     *
+     * @param options Shape of the config.
+     * @param path Output json file.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool generateConfig(const GeneratorOptions &options, StringRef path, string &error);
+}
+
+#endif
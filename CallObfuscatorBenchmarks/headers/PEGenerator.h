@@ -0,0 +1,82 @@
+/**
+ * @file PEGenerator.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Generation of synthetic PE32+ dlls, with any number of exports, to run the
+ *        helpers that walk in-memory PEs without windows binaries.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PE_GENERATOR_H_
+#define _PE_GENERATOR_H_
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorbench
+{
+    // How the exported names are made up
+    enum class NameDistribution
+    {
+        Random,     // Random letters, of a random length between minNameLength and maxNameLength
+        Api,        // Windows like: a prefix (Nt, Rtl, Get...), some words, and A/W/Ex suffixes
+        Sequential, // namePrefix + index, every name shares all but the last characters
+    };
+
+    struct PEGeneratorOptions
+    {
+        unsigned int exports = 2000; // Exported names, each one for its own function (up to 65536, then aliases)
+        NameDistribution names = NameDistribution::Api;
+        unsigned int minNameLength = 4;  // Only for random names
+        unsigned int maxNameLength = 24; // Only for random names
+        string namePrefix = "Export";    // Only for sequential names
+        string dllName = "synthetic.dll";
+        unsigned int seed = 1;
+    };
+
+    /**
+     * @brief Builds a dll as a linker would: a .text section with a ret per function,
+     *        an export directory in .rdata, with the names sorted, and a .pdata entry
+     *        per function. Names are given to the functions in a shuffled order, so the
+     *        ordinals table is not the identity.
+     *
+     * @param options Shape of the dll.
+     * @param file [OUT] Returns the contents of the PE file.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool generatePE(const PEGeneratorOptions &options, vector<char> &file, string &error);
+
+    /**
+     * @brief Parses the name of a distribution.
+     *
+     * @param name random, api or sequential.
+     * @param distribution [OUT] Returns the distribution.
+     * @return true The name is known.
+     */
+    bool parseNameDistribution(StringRef name, NameDistribution &distribution);
+}
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * @file PEImage.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Maps PE files as the windows loader lays them out, so the helpers that walk
+ *        in-memory PEs can be run on any host.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PE_IMAGE_H_
+#define _PE_IMAGE_H_
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/MemoryBufferRef.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorbench
+{
+    struct PEExport
+    {
+        string name;
+        uint32_t rva; // Of the function, or of the forwarder string
+    };
+
+    struct PEImage
+    {
+        string name;
+        sys::OwningMemoryBlock memory; // Page aligned, as the loader would map it
+        uint32_t size = 0;             // SizeOfImage
+        vector<PEExport> exports;      // Every exported name, in AddressOfNames order
+        uint32_t exceptionRVA = 0;     // Exception directory, 0 if there is none
+        uint32_t exceptionSize = 0;
+        uint32_t codeRVA = 0;          // First section with code, 0 if there is none
+        uint32_t codeSize = 0;         // Its SizeOfRawData, as the helpers take it
+
+        void *base() const { return memory.base(); }
+    };
+
+    /**
+     * @brief Maps a PE32+ image: the headers and each section are copied to their rva,
+     *        and the rest is zeroed up to SizeOfImage. Nothing is relocated nor imported,
+     *        which is enough for the helpers that only read the image. The exports, the
+     *        exception directory and the code section are read with LLVM, not with the
+     *        helpers, so they can be checked against them.
+     *
+     * @param file Contents of the PE file.
+     * @param name Name of the image, for the errors.
+     * @param image [OUT] Returns the mapped image.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool mapPEImage(MemoryBufferRef file, StringRef name, PEImage &image, string &error);
+
+    /**
+     * @brief Same as mapPEImage, reading the file from disk.
+     *
+     * @param path Path to the PE file.
+     * @param image [OUT] Returns the mapped image.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Success.
+     */
+    bool mapPEFile(StringRef path, PEImage &image, string &error);
+}
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * @file WinDef.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Windows base types, with the sizes they have on windows x64, to build the
+ *        helpers that dont call into windows on any host.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOST_WINDEF_H_
+#define _HOST_WINDEF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Only what the helpers use. Long is 32 bits on windows, so nothing here is declared with it.
+
+#define TRUE 1
+#define FALSE 0
+
+#define _In_
+#define _Return_type_success_(expr)
+#define OPTIONAL
+
+#define _M_X64 100
+#define _WIN64 1
+
+typedef void VOID;
+typedef void *PVOID, *LPVOID;
+typedef PVOID HANDLE, HMODULE;
+
+typedef char CHAR, *PCHAR, *PSTR, *LPSTR;
+typedef const char *LPCSTR;
+typedef uint8_t BYTE, UCHAR, BOOLEAN, *PBYTE, *PUCHAR;
+typedef uint16_t WORD, USHORT, WCHAR, *PWORD, *PUSHORT, *PWCHAR, *PWSTR;
+typedef int16_t SHORT, *PSHORT;
+typedef uint32_t DWORD, DWORD32, ULONG, UINT, UINT32, LCID, *PDWORD, *PULONG;
+typedef int32_t LONG, INT, BOOL, *PLONG;
+typedef uint64_t DWORD64, ULONGLONG, UINT64, ULONG_PTR, DWORD_PTR, SIZE_T, *PULONG_PTR;
+typedef int64_t LONGLONG, LONG_PTR;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        DWORD HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER, *PULARGE_INTEGER;
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _GUID
+{
+    DWORD Data1;
+    WORD Data2;
+    WORD Data3;
+    BYTE Data4[8];
+} GUID;
+
+typedef struct _PROCESSOR_NUMBER
+{
+    WORD Group;
+    BYTE Number;
+    BYTE Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _NT_TIB
+{
+    PVOID ExceptionList;
+    PVOID StackBase;
+    PVOID StackLimit;
+    PVOID SubSystemTib;
+    PVOID FiberData;
+    PVOID ArbitraryUserPointer;
+    struct _NT_TIB *Self;
+} NT_TIB, *PNT_TIB;
+
+#endif
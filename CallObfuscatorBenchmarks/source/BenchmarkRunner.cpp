@@ -0,0 +1,765 @@
+/**
+ * @file BenchmarkRunner.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Runs the pass through opt (or llvm-lto2) over generated modules, and compares the results.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BenchmarkRunner.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+
+// Same env variable read by the pass (LLVM_CALL_OBF_CONFIG_PATH)
+#define LLVM_CALL_OBF_CONFIG_PATH "LLVM_OBF_FUNCTIONS"
+
+// Differences below these are noise, no matter the ratio
+#define TIME_NOISE_FLOOR_MS 2.0
+#define RSS_NOISE_FLOOR_KB 8192.0
+#define SCALING_TOLERANCE 0.3
+
+using namespace std;
+using namespace llvm;
+
+#if LLVM_VERSION_MAJOR >= 16
+template <typename T>
+using OptionalValue = std::optional<T>;
+#else
+template <typename T>
+using OptionalValue = llvm::Optional<T>;
+#endif
+
+namespace callobfuscatorbench
+{
+    vector<BenchmarkCase> defaultSuite(double scale)
+    {
+        auto scaled = [scale](unsigned int value)
+        { return max(1u, (unsigned int)(value * scale)); };
+
+        vector<BenchmarkCase> suite;
+        GeneratorOptions base;
+        base.functions = scaled(1000);
+        base.hookedDeclarations = scaled(100);
+        base.plainDeclarations = scaled(100);
+        base.callsPerFunction = 4;
+        base.configHooks = scaled(1000);
+        base.dlls = 16;
+
+        for (unsigned int value : {1000, 4000, 16000})
+        {
+            BenchmarkCase benchmarkCase = {"", "functions", scaled(value), base};
+            benchmarkCase.options.functions = scaled(value);
+            suite.push_back(benchmarkCase);
+        }
+
+        for (unsigned int value : {1000, 10000, 100000})
+        {
+            BenchmarkCase benchmarkCase = {"", "config_hooks", scaled(value), base};
+            benchmarkCase.options.configHooks = scaled(value);
+            suite.push_back(benchmarkCase);
+        }
+
+        for (unsigned int value : {100, 1000, 10000})
+        {
+            BenchmarkCase benchmarkCase = {"", "hooked_apis", scaled(value), base};
+            benchmarkCase.options.functions = scaled(2000);
+            benchmarkCase.options.hookedDeclarations = scaled(value);
+            benchmarkCase.options.configHooks = max(scaled(value), base.configHooks);
+            suite.push_back(benchmarkCase);
+        }
+
+        for (unsigned int value : {1, 8, 32})
+        {
+            BenchmarkCase benchmarkCase = {"", "calls_per_function", value, base};
+            benchmarkCase.options.functions = scaled(2000);
+            benchmarkCase.options.callsPerFunction = value;
+            suite.push_back(benchmarkCase);
+        }
+
+        for (BenchmarkCase &benchmarkCase : suite)
+            benchmarkCase.name = benchmarkCase.sweep + "_" + to_string(benchmarkCase.value);
+
+        return suite;
+    }
+
+    vector<LTOBenchmarkCase> ltoSuite(double scale)
+    {
+        auto scaled = [scale](unsigned int value)
+        { return max(1u, (unsigned int)(value * scale)); };
+
+        GeneratorOptions base;
+        base.functions = scaled(500);
+        base.hookedDeclarations = scaled(100);
+        base.plainDeclarations = scaled(100);
+        base.callsPerFunction = 4;
+        base.configHooks = scaled(1000);
+        base.dlls = 16;
+
+        vector<LTOBenchmarkCase> suite;
+        for (unsigned int modules : {8, 32})
+            for (const char *mode : {"full", "thin"})
+                suite.push_back({"lto_" + string(mode) + "_" + to_string(modules), mode, modules, base});
+
+        return suite;
+    }
+
+    int runMeasuredChild(ArrayRef<const char *> args)
+    {
+        if (args.size() < 2)
+            return 1;
+
+        StringRef outputPath = args[0];
+        SmallVector<StringRef, 16> command(args.begin() + 1, args.end());
+
+        OptionalValue<sys::ProcessStatistics> statistics;
+        string errorMessage;
+
+        auto start = chrono::steady_clock::now();
+        int result = sys::ExecuteAndWait(command[0], command, {}, {}, 0, 0, &errorMessage, nullptr, &statistics);
+        double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        if (result < 0)
+        {
+            errs() << "[ERROR] " << command[0] << " could not be run: " << errorMessage << "\n";
+            return 1;
+        }
+
+        error_code ec;
+        raw_fd_ostream out(outputPath, ec, sys::fs::OF_Text);
+        if (ec)
+            return 1;
+
+        out << format("%f %llu\n", wallMs, (unsigned long long)(statistics ? statistics->PeakMemory : 0));
+        return result;
+    }
+
+    static void setConfigPath(StringRef configPath)
+    {
+#ifdef _WIN32
+        _putenv_s(LLVM_CALL_OBF_CONFIG_PATH, configPath.str().c_str());
+#else
+        setenv(LLVM_CALL_OBF_CONFIG_PATH, configPath.str().c_str(), 1);
+#endif
+    }
+
+    /**
+     * @brief Runs a command through the MEASURE_CHILD_FLAG wrapper.
+     *
+     * @return true The command ended successfully.
+     */
+    static bool runMeasured(const RunnerOptions &options, ArrayRef<StringRef> command, StringRef stderrPath,
+                            StringRef measurePath, double &wallMs, uint64_t &peakRssKb, string &error)
+    {
+        sys::fs::remove(measurePath);
+
+        SmallVector<StringRef, 16> args = {options.selfPath, MEASURE_CHILD_FLAG, measurePath};
+        args.append(command.begin(), command.end());
+
+        OptionalValue<StringRef> redirects[] = {StringRef(""), StringRef(""), stderrPath};
+        string errorMessage;
+
+        int result = sys::ExecuteAndWait(options.selfPath, args, {}, redirects, 0, 0, &errorMessage);
+
+        if (result != 0)
+        {
+            error = sys::path::stem(command[0]).str() + " failed";
+            if (!errorMessage.empty())
+                error += ": " + errorMessage;
+
+            ErrorOr<unique_ptr<MemoryBuffer>> output = MemoryBuffer::getFile(stderrPath);
+            if (output)
+                error += "\n" + output.get()->getBuffer().str();
+
+            return false;
+        }
+
+        ErrorOr<unique_ptr<MemoryBuffer>> measures = MemoryBuffer::getFile(measurePath);
+        if (!measures)
+        {
+            error = "Cant read measures: " + measures.getError().message();
+            return false;
+        }
+
+        pair<StringRef, StringRef> values = measures.get()->getBuffer().trim().split(' ');
+        if (values.first.getAsDouble(wallMs) || values.second.getAsInteger(10, peakRssKb))
+        {
+            error = "Measures are malformed";
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Runs the pass once through opt, with -time-passes.
+     *
+     * @return true opt ended successfully.
+     */
+    static bool runOpt(const RunnerOptions &options, StringRef modulePath, StringRef configPath, StringRef timingPath,
+                       StringRef stderrPath, StringRef measurePath, double &wallMs, uint64_t &peakRssKb, string &error)
+    {
+        setConfigPath(configPath);
+
+        // -info-output-file appends, stale reports would be parsed again
+        sys::fs::remove(timingPath);
+
+        string pluginArg = "-load-pass-plugin=" + options.pluginPath;
+        string timingArg = "-info-output-file=" + timingPath.str();
+
+        SmallVector<StringRef, 16> command = {options.optPath};
+#if LLVM_VERSION_MAJOR < 15
+        command.push_back("-opaque-pointers"); // The pass creates opaque pointer types
+#endif
+        command.append({pluginArg, "-passes=callobfuscator-pass", "-time-passes", timingArg, "-disable-output"});
+        for (const string &arg : options.extraOptArgs)
+            command.push_back(arg);
+        command.push_back(modulePath);
+
+        return runMeasured(options, command, stderrPath, measurePath, wallMs, peakRssKb, error);
+    }
+
+    /**
+     * @brief Writes the symbol resolutions llvm-lto2 needs for the given inputs, as a
+     *        response file. Every definition is kept visible, and the first one of each
+     *        symbol prevails, as a linker would do with COMDATs.
+     *
+     * @return true Success.
+     */
+    static bool writeResolutions(const vector<string> &inputs, StringRef path, string &error)
+    {
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            error = ec.message();
+            return false;
+        }
+
+        StringMap<bool> defined;
+        for (const string &input : inputs)
+        {
+            ErrorOr<unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(input);
+            if (!buffer)
+            {
+                error = "Cant read " + input + ": " + buffer.getError().message();
+                return false;
+            }
+
+            Expected<unique_ptr<lto::InputFile>> inputFile = lto::InputFile::create(buffer.get()->getMemBufferRef());
+            if (!inputFile)
+            {
+                error = "Cant read symbols of " + input + ": " + toString(inputFile.takeError());
+                return false;
+            }
+
+            for (const lto::InputFile::Symbol &symbol : inputFile.get()->symbols())
+            {
+                StringRef flags = "";
+                if (!symbol.isUndefined() && defined.try_emplace(symbol.getName(), true).second)
+                    flags = "px";
+
+                out << "-r=" << input << "," << symbol.getName() << "," << flags << "\n";
+            }
+        }
+
+        return true;
+    }
+
+    bool runLTOCase(const RunnerOptions &options, const LTOBenchmarkCase &benchmarkCase, LTOBenchmarkResult &result, string &error)
+    {
+        if (error_code ec = sys::fs::create_directories(options.workDir))
+        {
+            error = "Cant create work dir: " + ec.message();
+            return false;
+        }
+
+        SmallString<256> basePath(options.workDir);
+        sys::path::append(basePath, benchmarkCase.name);
+
+        string configPath = (basePath + ".json").str();
+        string stderrPath = (basePath + ".stderr").str();
+        string measurePath = (basePath + ".measures").str();
+        string resolutionsPath = (basePath + ".rsp").str();
+        string outputPath = (basePath + ".out").str();
+        bool thin = benchmarkCase.mode == "thin";
+
+        if (!generateConfig(benchmarkCase.options, configPath, error))
+            return false;
+
+        sys::fs::remove(configPath + ".compiled");
+        setConfigPath(configPath);
+
+        result = LTOBenchmarkResult();
+        result.benchmarkCase = benchmarkCase;
+
+        string pluginArg = "-load-pass-plugin=" + options.pluginPath;
+        vector<string> inputs;
+
+        for (unsigned int i = 0; i < benchmarkCase.modules; i++)
+        {
+            GeneratorOptions moduleOptions = benchmarkCase.options;
+            moduleOptions.functionPrefix = "Module" + to_string(i) + "_Function";
+            moduleOptions.fullLTO = !thin;
+
+            string sourcePath = (basePath + "." + Twine(i) + ".bc").str();
+            string inputPath = (basePath + "." + Twine(i) + ".lto.bc").str();
+
+            if (!generateModule(moduleOptions, sourcePath, error))
+                return false;
+
+            SmallVector<StringRef, 16> command = {options.optPath};
+#if LLVM_VERSION_MAJOR < 15
+            command.push_back("-opaque-pointers");
+#endif
+            command.append({pluginArg, thin ? "-passes=thinlto-pre-link<O2>" : "-passes=lto-pre-link<O2>"});
+            if (thin)
+                command.push_back("-thinlto-bc");
+            for (const string &arg : options.extraOptArgs)
+                command.push_back(arg);
+            command.append({sourcePath, "-o", inputPath});
+
+            double wallMs;
+            uint64_t peakRssKb;
+            if (!runMeasured(options, command, stderrPath, measurePath, wallMs, peakRssKb, error))
+                return false;
+
+            result.compileMs += wallMs;
+            result.compilePeakRssKb = max(result.compilePeakRssKb, peakRssKb);
+            inputs.push_back(inputPath);
+        }
+
+        if (!writeResolutions(inputs, resolutionsPath, error))
+            return false;
+
+        string ltoPluginArg = "--load-pass-plugin=" + options.pluginPath;
+        string threadsArg = "--thinlto-threads=" + to_string(options.thinLTOThreads);
+        string resolutionsArg = "@" + resolutionsPath;
+
+        SmallVector<StringRef, 16> command = {options.ltoPath, "run"};
+#if LLVM_VERSION_MAJOR < 15
+        command.push_back("-opaque-pointers");
+#endif
+        command.append({ltoPluginArg, "-O2", "-o", outputPath});
+        if (options.thinLTOThreads)
+            command.push_back(threadsArg);
+        for (const string &input : inputs)
+            command.push_back(input);
+        command.push_back(resolutionsArg);
+
+        vector<double> wallTimes;
+        for (unsigned int run = 0; run < options.repetitions; run++)
+        {
+            double wallMs;
+            uint64_t peakRssKb;
+            if (!runMeasured(options, command, stderrPath, measurePath, wallMs, peakRssKb, error))
+                return false;
+
+            wallTimes.push_back(wallMs);
+            result.linkPeakRssKb = max(result.linkPeakRssKb, peakRssKb);
+        }
+
+        llvm::sort(wallTimes);
+        result.linkWallMs = wallTimes.front();
+        result.linkWallMedianMs = wallTimes[wallTimes.size() / 2];
+        return true;
+    }
+
+    bool runCase(const RunnerOptions &options, const BenchmarkCase &benchmarkCase, BenchmarkResult &result, string &error)
+    {
+        if (error_code ec = sys::fs::create_directories(options.workDir))
+        {
+            error = "Cant create work dir: " + ec.message();
+            return false;
+        }
+
+        SmallString<256> basePath(options.workDir);
+        sys::path::append(basePath, benchmarkCase.name);
+
+        string modulePath = (basePath + ".bc").str();
+        string configPath = (basePath + ".json").str();
+        string timingPath = (basePath + ".timing").str();
+        string stderrPath = (basePath + ".stderr").str();
+        string measurePath = (basePath + ".measures").str();
+
+        if (!generateModule(benchmarkCase.options, modulePath, error) || !generateConfig(benchmarkCase.options, configPath, error))
+            return false;
+
+        // Every case starts without a compiled config
+        sys::fs::remove(configPath + ".compiled");
+
+        result = BenchmarkResult();
+        result.benchmarkCase = benchmarkCase;
+
+        vector<double> wallTimes;
+        double bestWallMs = 0;
+
+        for (unsigned int run = 0; run <= options.repetitions; run++)
+        {
+            double wallMs;
+            uint64_t peakRssKb;
+
+            if (!runOpt(options, modulePath, configPath, timingPath, stderrPath, measurePath, wallMs, peakRssKb, error))
+                return false;
+
+            ErrorOr<unique_ptr<MemoryBuffer>> report = MemoryBuffer::getFile(timingPath);
+            if (!report)
+            {
+                error = "Cant read timing report: " + report.getError().message();
+                return false;
+            }
+
+            double passMs = 0;
+            StringMap<double> phasesMs;
+            if (!parseTimingReport(report.get()->getBuffer(), passMs, phasesMs))
+            {
+                error = "Pass not found in timing report, is the plugin loading?";
+                return false;
+            }
+
+            result.peakRssKb = max(result.peakRssKb, peakRssKb);
+
+            // First run compiles the config, it is only kept for that
+            if (run == 0)
+            {
+                result.coldConfigMs = phasesMs.lookup("Read config");
+                continue;
+            }
+
+            wallTimes.push_back(wallMs);
+            if (wallTimes.size() == 1 || wallMs < bestWallMs)
+            {
+                bestWallMs = wallMs;
+                result.passMs = passMs;
+                result.phasesMs = std::move(phasesMs);
+            }
+        }
+
+        llvm::sort(wallTimes);
+        result.wallMs = bestWallMs;
+        result.wallMedianMs = wallTimes.empty() ? 0 : wallTimes[wallTimes.size() / 2];
+        return true;
+    }
+
+    /**
+     * @brief Splits a -time-passes row, as in "0.1 ( 42.1%) ... 0.2 ( 40.0%)  Name".
+     *        The wall time is always the last column.
+     *
+     * @return true The line is a row.
+     */
+    static bool parseTimingRow(StringRef line, StringRef &name, double &wallSeconds)
+    {
+        size_t lastParenthesis = line.rfind(')');
+        if (lastParenthesis == StringRef::npos)
+            return false;
+
+        name = line.substr(lastParenthesis + 1).trim();
+
+        StringRef values = line.substr(0, lastParenthesis);
+        size_t lastPercentage = values.rfind('(');
+        if (lastPercentage == StringRef::npos)
+            return false;
+
+        StringRef wall = values.substr(0, lastPercentage).rtrim();
+        wall = wall.substr(wall.find_last_of(' ') + 1);
+
+        return !name.empty() && !wall.getAsDouble(wallSeconds);
+    }
+
+    bool parseTimingReport(StringRef report, double &passMs, StringMap<double> &phasesMs)
+    {
+        SmallVector<StringRef, 64> lines;
+        report.split(lines, '\n');
+
+        StringRef group;
+        StringRef lastLines[2]; // Previous line, and the one before it
+        bool passFound = false;
+
+        for (StringRef line : lines)
+        {
+            // Group titles go between separator lines, as in "===---===\n  ... Title ...\n===---==="
+            if (line.startswith("===") && lastLines[1].startswith("==="))
+                group = lastLines[0].trim(" .");
+
+            lastLines[1] = lastLines[0];
+            lastLines[0] = line;
+
+            StringRef name;
+            double wallSeconds;
+            if (!parseTimingRow(line, name, wallSeconds) || name == "Total")
+                continue;
+
+            if (group == PASS_TIMING_GROUP && name.endswith("CallObfuscatorPass"))
+            {
+                passMs = wallSeconds * 1000;
+                passFound = true;
+            }
+            else if (group == PHASE_TIMING_GROUP)
+            {
+                phasesMs[name] = wallSeconds * 1000;
+            }
+        }
+
+        return passFound;
+    }
+
+    StringMap<double> scalingExponents(const vector<BenchmarkResult> &results)
+    {
+        StringMap<pair<const BenchmarkResult *, const BenchmarkResult *>> sweeps; // First and last case
+
+        for (const BenchmarkResult &result : results)
+        {
+            auto inserted = sweeps.try_emplace(result.benchmarkCase.sweep, &result, &result);
+            inserted.first->second.second = &result;
+        }
+
+        StringMap<double> exponents;
+        for (const auto &sweep : sweeps)
+        {
+            const BenchmarkResult *p_first = sweep.getValue().first;
+            const BenchmarkResult *p_last = sweep.getValue().second;
+
+            if (p_first->passMs <= 0 || p_last->benchmarkCase.value <= p_first->benchmarkCase.value)
+                continue;
+
+            exponents[sweep.getKey()] = log(p_last->passMs / p_first->passMs) /
+                                        log((double)p_last->benchmarkCase.value / p_first->benchmarkCase.value);
+        }
+
+        return exponents;
+    }
+
+    /**
+     * @brief Rounds to microseconds, the reports dont have more precision than that.
+     */
+    static double roundMs(double value)
+    {
+        return round(value * 1000) / 1000;
+    }
+
+    static json::Object caseToJson(const BenchmarkResult &result)
+    {
+        const GeneratorOptions &options = result.benchmarkCase.options;
+
+        json::Object phases;
+        for (const auto &phase : result.phasesMs)
+            phases[phase.getKey()] = roundMs(phase.getValue());
+
+        return json::Object{
+            {"name", result.benchmarkCase.name},
+            {"sweep", result.benchmarkCase.sweep},
+            {"value", (int64_t)result.benchmarkCase.value},
+            {"functions", (int64_t)options.functions},
+            {"hooked_declarations", (int64_t)options.hookedDeclarations},
+            {"plain_declarations", (int64_t)options.plainDeclarations},
+            {"calls_per_function", (int64_t)options.callsPerFunction},
+            {"config_hooks", (int64_t)options.configHooks},
+            {"dlls", (int64_t)options.dlls},
+            {"wall_ms", roundMs(result.wallMs)},
+            {"wall_median_ms", roundMs(result.wallMedianMs)},
+            {"pass_ms", roundMs(result.passMs)},
+            {"cold_config_ms", roundMs(result.coldConfigMs)},
+            {"peak_rss_kb", (int64_t)result.peakRssKb},
+            {"phases_ms", std::move(phases)},
+        };
+    }
+
+    /**
+     * @brief Adds a comparison entry, and counts it if it is a regression.
+     */
+    static void compareMetric(json::Array &entries, StringRef caseName, StringRef metric, double baseline, double current,
+                              bool regression, unsigned int &regressions)
+    {
+        if (regression)
+            regressions++;
+
+        entries.push_back(json::Object{
+            {"case", caseName},
+            {"metric", metric},
+            {"baseline", baseline},
+            {"current", current},
+            {"ratio", baseline > 0 ? current / baseline : 0},
+            {"regression", regression},
+        });
+    }
+
+    static json::Value ltoCaseToJson(const LTOBenchmarkResult &result)
+    {
+        return json::Object{
+            {"name", result.benchmarkCase.name},
+            {"mode", result.benchmarkCase.mode},
+            {"modules", (int64_t)result.benchmarkCase.modules},
+            {"functions_per_module", (int64_t)result.benchmarkCase.options.functions},
+            {"compile_ms", result.compileMs},
+            {"compile_peak_rss_kb", (int64_t)result.compilePeakRssKb},
+            {"link_wall_ms", result.linkWallMs},
+            {"link_wall_median_ms", result.linkWallMedianMs},
+            {"link_peak_rss_kb", (int64_t)result.linkPeakRssKb},
+        };
+    }
+
+    json::Value createReport(const vector<BenchmarkResult> &results, const vector<LTOBenchmarkResult> &ltoResults,
+                             const json::Value *p_baseline, double threshold, unsigned int &regressions)
+    {
+        regressions = 0;
+
+        json::Array cases;
+        for (const BenchmarkResult &result : results)
+            cases.push_back(caseToJson(result));
+
+        json::Array ltoCases;
+        for (const LTOBenchmarkResult &result : ltoResults)
+            ltoCases.push_back(ltoCaseToJson(result));
+
+        StringMap<double> exponents = scalingExponents(results);
+        json::Object scaling;
+        for (const auto &exponent : exponents)
+            scaling[exponent.getKey()] = exponent.getValue();
+
+        json::Object report{
+            {"llvm_version", LLVM_VERSION_STRING},
+            {"cases", std::move(cases)},
+            {"scaling", std::move(scaling)},
+            {"lto_cases", std::move(ltoCases)},
+        };
+
+        const json::Object *p_baselineReport = p_baseline ? p_baseline->getAsObject() : nullptr;
+        if (!p_baselineReport)
+            return json::Value(std::move(report));
+
+        // Index the baseline cases by name, so suites dont need to match exactly
+        StringMap<const json::Object *> baselineCases;
+        for (StringRef key : {"cases", "lto_cases"})
+        {
+            const json::Array *p_cases = p_baselineReport->getArray(key);
+            if (!p_cases)
+                continue;
+
+            for (const json::Value &entry : *p_cases)
+            {
+                const json::Object *p_case = entry.getAsObject();
+                if (!p_case)
+                    continue;
+
+                auto name = p_case->getString("name");
+                if (name)
+                    baselineCases[*name] = p_case;
+            }
+        }
+
+        auto isTimeRegression = [threshold](double baseline, double current)
+        { return current > baseline * threshold && current - baseline > TIME_NOISE_FLOOR_MS; };
+
+        json::Array entries;
+        for (const BenchmarkResult &result : results)
+        {
+            const json::Object *p_case = baselineCases.lookup(result.benchmarkCase.name);
+            if (!p_case)
+                continue;
+
+            StringRef name = result.benchmarkCase.name;
+
+            auto passMs = p_case->getNumber("pass_ms");
+            if (passMs)
+                compareMetric(entries, name, "pass_ms", *passMs, result.passMs, isTimeRegression(*passMs, result.passMs), regressions);
+
+            auto wallMs = p_case->getNumber("wall_ms");
+            if (wallMs)
+                compareMetric(entries, name, "wall_ms", *wallMs, result.wallMs, isTimeRegression(*wallMs, result.wallMs), regressions);
+
+            auto peakRssKb = p_case->getNumber("peak_rss_kb");
+            if (peakRssKb)
+                compareMetric(entries, name, "peak_rss_kb", *peakRssKb, result.peakRssKb,
+                              result.peakRssKb > *peakRssKb * threshold && result.peakRssKb - *peakRssKb > RSS_NOISE_FLOOR_KB,
+                              regressions);
+
+            const json::Object *p_phases = p_case->getObject("phases_ms");
+            if (!p_phases)
+                continue;
+
+            for (const auto &phase : result.phasesMs)
+            {
+                auto phaseMs = p_phases->getNumber(phase.getKey());
+                if (phaseMs)
+                    compareMetric(entries, name, ("phase:" + phase.getKey()).str(), *phaseMs, phase.getValue(),
+                                  isTimeRegression(*phaseMs, phase.getValue()), regressions);
+            }
+        }
+
+        for (const LTOBenchmarkResult &result : ltoResults)
+        {
+            const json::Object *p_case = baselineCases.lookup(result.benchmarkCase.name);
+            if (!p_case)
+                continue;
+
+            StringRef name = result.benchmarkCase.name;
+
+            auto compileMs = p_case->getNumber("compile_ms");
+            if (compileMs)
+                compareMetric(entries, name, "compile_ms", *compileMs, result.compileMs,
+                              isTimeRegression(*compileMs, result.compileMs), regressions);
+
+            auto linkWallMs = p_case->getNumber("link_wall_ms");
+            if (linkWallMs)
+                compareMetric(entries, name, "link_wall_ms", *linkWallMs, result.linkWallMs,
+                              isTimeRegression(*linkWallMs, result.linkWallMs), regressions);
+
+            auto linkPeakRssKb = p_case->getNumber("link_peak_rss_kb");
+            if (linkPeakRssKb)
+                compareMetric(entries, name, "link_peak_rss_kb", *linkPeakRssKb, result.linkPeakRssKb,
+                              result.linkPeakRssKb > *linkPeakRssKb * threshold &&
+                                  result.linkPeakRssKb - *linkPeakRssKb > RSS_NOISE_FLOOR_KB,
+                              regressions);
+        }
+
+        // A change in the exponent means the cost grows differently, even if small cases are still fast
+        if (const json::Object *p_scaling = p_baselineReport->getObject("scaling"))
+        {
+            for (const auto &exponent : exponents)
+            {
+                auto baselineExponent = p_scaling->getNumber(exponent.getKey());
+                if (baselineExponent)
+                    compareMetric(entries, exponent.getKey(), "scaling", *baselineExponent, exponent.getValue(),
+                                  exponent.getValue() - *baselineExponent > SCALING_TOLERANCE, regressions);
+            }
+        }
+
+        report["comparison"] = json::Object{
+            {"threshold", threshold},
+            {"regressions", (int64_t)regressions},
+            {"entries", std::move(entries)},
+        };
+
+        return json::Value(std::move(report));
+    }
+}
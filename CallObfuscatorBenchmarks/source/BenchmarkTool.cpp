@@ -0,0 +1,193 @@
+/**
+ * @file BenchmarkTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Compile time benchmark of the pass, over a suite of generated modules.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BenchmarkRunner.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorbench;
+
+#ifndef CALLOBF_BENCH_OPT_PATH
+#define CALLOBF_BENCH_OPT_PATH "opt"
+#endif
+#ifndef CALLOBF_BENCH_PLUGIN_PATH
+#define CALLOBF_BENCH_PLUGIN_PATH ""
+#endif
+#ifndef CALLOBF_BENCH_LTO_PATH
+#define CALLOBF_BENCH_LTO_PATH "llvm-lto2"
+#endif
+
+static cl::opt<string> optPath("opt", cl::desc("Path to opt"), cl::init(CALLOBF_BENCH_OPT_PATH));
+static cl::opt<string> ltoPath("llvm-lto2", cl::desc("Path to llvm-lto2, only used by the lto suite"), cl::init(CALLOBF_BENCH_LTO_PATH));
+static cl::opt<string> pluginPath("plugin", cl::desc("Path to the CallObfuscatorPlugin library"), cl::init(CALLOBF_BENCH_PLUGIN_PATH));
+static cl::opt<string> workDir("work-dir", cl::desc("Folder for the generated modules and configs"), cl::init("callobf-bench"));
+static cl::opt<string> outputPath("o", cl::desc("Output json report (- for stdout)"), cl::init("-"));
+static cl::opt<string> baselinePath("baseline", cl::desc("Json report of a previous run to compare against"));
+static cl::opt<double> threshold("threshold", cl::desc("Ratio to the baseline considered a regression"), cl::init(1.25));
+static cl::opt<unsigned int> repetitions("repetitions", cl::desc("Timed runs per case"), cl::init(5));
+static cl::opt<double> scale("scale", cl::desc("Multiplier for the size of every case"), cl::init(1.0));
+static cl::list<string> sweeps("sweep", cl::desc("Only run the given sweeps (functions, config_hooks, hooked_apis, calls_per_function)"));
+static cl::opt<bool> failOnRegression("fail-on-regression", cl::desc("Exit with an error if any regression is found"));
+static cl::list<string> extraOptArgs("opt-arg", cl::desc("Extra argument for opt"));
+static cl::opt<string> suite("suite", cl::desc("Suite to run (pass, lto or all)"), cl::init("pass"));
+static cl::opt<unsigned int> thinLTOThreads("thinlto-threads", cl::desc("ThinLTO backend threads (0 for the llvm-lto2 default)"), cl::init(0));
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && StringRef(argv[1]) == MEASURE_CHILD_FLAG)
+        return runMeasuredChild(ArrayRef<const char *>(argv + 2, argc - 2));
+
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator pass compile time benchmark\n");
+
+    if (pluginPath.empty())
+    {
+        errs() << "[ERROR] Plugin path not given, use -plugin\n";
+        return 1;
+    }
+
+    if (suite != "pass" && suite != "lto" && suite != "all")
+    {
+        errs() << "[ERROR] Unknown suite \"" << suite << "\", expected pass, lto or all\n";
+        return 1;
+    }
+
+    // Read before running anything, a bad baseline should not waste a whole run
+    json::Value baseline = nullptr;
+    if (!baselinePath.empty())
+    {
+        ErrorOr<unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(baselinePath);
+        if (!buffer)
+        {
+            errs() << "[ERROR] Baseline could not be read: " << buffer.getError().message() << "\n";
+            return 1;
+        }
+
+        Expected<json::Value> parseResult = json::parse(buffer.get()->getBuffer());
+        if (Error E = parseResult.takeError())
+        {
+            errs() << "[ERROR] Baseline could not be parsed: " << E << "\n";
+            consumeError(std::move(E));
+            return 1;
+        }
+
+        baseline = std::move(*parseResult);
+    }
+
+    RunnerOptions options;
+    options.selfPath = sys::fs::getMainExecutable(argv[0], (void *)&main);
+    options.optPath = optPath;
+    options.pluginPath = pluginPath;
+    options.workDir = workDir;
+    options.repetitions = max(1u, (unsigned int)repetitions);
+    options.extraOptArgs.assign(extraOptArgs.begin(), extraOptArgs.end());
+    options.ltoPath = ltoPath;
+    options.thinLTOThreads = thinLTOThreads;
+
+    vector<BenchmarkResult> results;
+    for (const BenchmarkCase &benchmarkCase : suite != "lto" ? defaultSuite(scale) : vector<BenchmarkCase>())
+    {
+        if (!sweeps.empty() && find(sweeps.begin(), sweeps.end(), benchmarkCase.sweep) == sweeps.end())
+            continue;
+
+        errs() << "[INFO] Running " << benchmarkCase.name << "\n";
+
+        BenchmarkResult result;
+        string error;
+        if (!runCase(options, benchmarkCase, result, error))
+        {
+            errs() << "[ERROR] " << benchmarkCase.name << ": " << error << "\n";
+            return 1;
+        }
+
+        errs() << format("[INFO]   pass %.2f ms, wall %.2f ms, peak rss %llu KB\n", result.passMs, result.wallMs,
+                         (unsigned long long)result.peakRssKb);
+        results.push_back(std::move(result));
+    }
+
+    vector<LTOBenchmarkResult> ltoResults;
+    for (const LTOBenchmarkCase &benchmarkCase : suite != "pass" ? ltoSuite(scale) : vector<LTOBenchmarkCase>())
+    {
+        errs() << "[INFO] Running " << benchmarkCase.name << "\n";
+
+        LTOBenchmarkResult result;
+        string error;
+        if (!runLTOCase(options, benchmarkCase, result, error))
+        {
+            errs() << "[ERROR] " << benchmarkCase.name << ": " << error << "\n";
+            return 1;
+        }
+
+        errs() << format("[INFO]   compile %.2f ms, link %.2f ms, link peak rss %llu KB\n", result.compileMs,
+                         result.linkWallMs, (unsigned long long)result.linkPeakRssKb);
+        ltoResults.push_back(std::move(result));
+    }
+
+    unsigned int regressions;
+    json::Value report = createReport(results, ltoResults, baselinePath.empty() ? nullptr : &baseline, threshold, regressions);
+
+    error_code ec;
+    raw_fd_ostream out(outputPath, ec, sys::fs::OF_Text);
+    if (ec)
+    {
+        errs() << "[ERROR] Report could not be written: " << ec.message() << "\n";
+        return 1;
+    }
+
+    out << formatv("{0:2}", report) << "\n";
+
+    for (const auto &exponent : scalingExponents(results))
+        errs() << format("[INFO] Scaling of %s: %.2f\n", exponent.getKey().str().c_str(), exponent.getValue());
+
+    if (!baselinePath.empty())
+    {
+        if (const json::Object *p_comparison = report.getAsObject()->getObject("comparison"))
+        {
+            for (const json::Value &entry : *p_comparison->getArray("entries"))
+            {
+                const json::Object *p_entry = entry.getAsObject();
+                if (!*p_entry->getBoolean("regression"))
+                    continue;
+
+                errs() << format("[ERROR] Regression in %s %s: %.2f -> %.2f\n", p_entry->getString("case")->str().c_str(),
+                                 p_entry->getString("metric")->str().c_str(), *p_entry->getNumber("baseline"),
+                                 *p_entry->getNumber("current"));
+            }
+        }
+
+        errs() << "[INFO] " << regressions << " regressions against " << baselinePath << "\n";
+    }
+
+    return failOnRegression && regressions ? 2 : 0;
+}
@@ -0,0 +1,255 @@
+/**
+ * @file EntryStressTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Stress test of the entry state machine of the helpers, with a mocked resolver.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// The windows types entryState.h needs, with the sizes they have on windows x64
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef void *PVOID;
+#define TRUE 1
+#define FALSE 0
+
+#include "callDispatcher/entryState.h"
+
+using namespace std;
+using namespace llvm;
+
+static cl::opt<unsigned int> threads("j", cl::desc("Threads calling at once (0 for two per core)"), cl::Prefix, cl::init(0));
+static cl::opt<unsigned int> entries("entries", cl::desc("Function entries in the table"), cl::init(64));
+static cl::opt<unsigned int> rounds("rounds", cl::desc("Times the table is reset and raced on again"), cl::init(200));
+static cl::opt<unsigned int> calls("calls", cl::desc("Calls made by each thread in each round"), cl::init(20000));
+static cl::opt<unsigned int> work("work", cl::desc("Spins inside the resolver, to widen the race windows"), cl::init(500));
+static cl::opt<unsigned int> failEvery("fail-every", cl::desc("The first resolution of every Nth entry fails (0 to never fail)"),
+                                       cl::init(4));
+static cl::opt<bool> unsynchronized("unsynchronized",
+                                    cl::desc("Check the function pointer and resolve without the state machine, as the "
+                                             "helpers used to, to see the races it removes"));
+
+namespace
+{
+#pragma pack(push, 1)
+    // Same layout as FUNCTION_TABLE_ENTRY in the helpers
+    struct StressEntry
+    {
+        PVOID functionPtr;
+        uint16_t ssn;
+        uint8_t argCount;
+        uint8_t flags;
+        DWORD state;
+    };
+#pragma pack(pop)
+
+    static_assert(sizeof(StressEntry) == 16, "Must match FUNCTION_TABLE_ENTRY");
+
+    // As the tables keep them, 16 byte aligned
+    struct alignas(16) StressSlot
+    {
+        StressEntry entry;
+    };
+
+    struct EntryCounters
+    {
+        atomic<unsigned int> attempts{0};  // Resolver calls
+        atomic<unsigned int> published{0}; // Resolver calls that filled the entry
+        atomic<unsigned int> inFlight{0};  // Resolvers running right now
+    };
+
+    struct StressTable
+    {
+        vector<StressSlot> slots;
+        unique_ptr<EntryCounters[]> counters;
+        atomic<uint64_t> violations{0};
+    };
+
+    struct ResolveCtx
+    {
+        StressTable *p_table;
+        unsigned int index;
+    };
+
+    PVOID expectedFunction(unsigned int index)
+    {
+        return (PVOID)(uintptr_t)(0x7FF000000000ull + index * 0x10ull);
+    }
+
+    uint8_t expectedFlags(unsigned int index)
+    {
+        return index % 2; // Every other entry is a syscall
+    }
+
+    // Mocks __callobf_loadFunction: clears the fields, spins as if walking exports, then
+    // fills them, pointer last. Fails the first time for every failEvery-th entry.
+    BOOL mockResolver(PVOID p_ctx)
+    {
+        ResolveCtx *p_resolveCtx = (ResolveCtx *)p_ctx;
+        StressEntry &entry = p_resolveCtx->p_table->slots[p_resolveCtx->index].entry;
+        EntryCounters &counters = p_resolveCtx->p_table->counters[p_resolveCtx->index];
+
+        unsigned int attempt = counters.attempts.fetch_add(1);
+
+        // Only a race when the state machine is bypassed, but counted either way
+        if (counters.inFlight.fetch_add(1) != 0 && !unsynchronized)
+            p_resolveCtx->p_table->violations++;
+
+        ((volatile StressEntry &)entry).ssn = 0;
+        ((volatile StressEntry &)entry).flags = 0;
+
+        for (volatile unsigned int i = 0; i < work; i++)
+            ENTRY_STATE_SPIN();
+
+        bool fail = failEvery && p_resolveCtx->index % failEvery == 0 && attempt == 0;
+        if (!fail)
+        {
+            ((volatile StressEntry &)entry).ssn = (uint16_t)p_resolveCtx->index;
+            ((volatile StressEntry &)entry).flags = expectedFlags(p_resolveCtx->index);
+            __atomic_store_n((PVOID *)(PVOID)&entry.functionPtr, expectedFunction(p_resolveCtx->index), __ATOMIC_RELEASE);
+            counters.published++;
+        }
+
+        counters.inFlight--;
+        return !fail;
+    }
+
+    // What a dispatcher does with an entry before calling, then checks what it would call
+    bool dispatch(StressTable &table, unsigned int index)
+    {
+        StressEntry &entry = table.slots[index].entry;
+        ResolveCtx resolveCtx = {&table, index};
+
+        if (unsynchronized)
+        {
+            if (!__atomic_load_n((PVOID *)(PVOID)&entry.functionPtr, __ATOMIC_ACQUIRE) && !mockResolver(&resolveCtx))
+                return false;
+        }
+        else
+        {
+            volatile DWORD *p_state = (volatile DWORD *)(PVOID)&entry.state;
+            if (!__callobf_isEntryReady(p_state) && !__callobf_resolveEntryOnce(p_state, mockResolver, &resolveCtx))
+                return false;
+        }
+
+        volatile StressEntry &ready = entry;
+        if (ready.functionPtr != expectedFunction(index) || ready.ssn != (uint16_t)index || ready.flags != expectedFlags(index))
+            table.violations++;
+
+        return true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator entry state machine stress test\n");
+
+    unsigned int threadCount = threads ? threads : 2 * max(1u, thread::hardware_concurrency());
+    if (!entries)
+    {
+        errs() << "[ERROR] At least one entry is needed\n";
+        return 1;
+    }
+
+    StressTable table;
+    table.slots.resize(entries);
+
+    uint64_t failedCalls = 0;
+    uint64_t extraResolutions = 0;
+    double elapsedMs = 0;
+
+    for (unsigned int round = 0; round < rounds; round++)
+    {
+        // Every round starts as the pass emits the table
+        for (StressSlot &slot : table.slots)
+            slot.entry = StressEntry{nullptr, 0, 0, 0, ENTRY_STATE_UNINITIALIZED};
+        table.counters.reset(new EntryCounters[entries]);
+
+        atomic<unsigned int> waiting{threadCount};
+        atomic<uint64_t> roundFailedCalls{0};
+        vector<thread> workers;
+
+        auto start = chrono::steady_clock::now();
+        for (unsigned int t = 0; t < threadCount; t++)
+        {
+            workers.emplace_back(
+                [&, t]()
+                {
+                    // Released together, so the first calls to every entry race
+                    waiting--;
+                    while (waiting)
+                        ENTRY_STATE_SPIN();
+
+                    uint64_t failed = 0;
+                    unsigned int index = (t * 7919u) % entries;
+                    for (unsigned int call = 0; call < calls; call++)
+                    {
+                        if (!dispatch(table, index))
+                            failed++;
+                        index = (index + 1 + t) % entries;
+                    }
+                    roundFailedCalls += failed;
+                });
+        }
+
+        for (thread &worker : workers)
+            worker.join();
+        elapsedMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        // A published entry is never filled again
+        for (unsigned int index = 0; index < entries; index++)
+        {
+            unsigned int published = table.counters[index].published;
+            if (published > 1)
+                extraResolutions += published - 1;
+            if (!published && !unsynchronized)
+                table.violations++;
+        }
+
+        failedCalls += roundFailedCalls;
+    }
+
+    uint64_t totalCalls = (uint64_t)rounds * threadCount * calls;
+    outs() << "[INFO] " << (unsynchronized ? "Unsynchronized" : "State machine") << ": " << threadCount << " threads, "
+           << entries << " entries, " << rounds << " rounds, " << totalCalls << " calls in " << format("%.2f", elapsedMs)
+           << " ms (" << format("%.2f", elapsedMs * 1e6 / totalCalls) << " ns per call)\n";
+    outs() << "[INFO]   failed calls " << failedCalls << " (resolver failures, retried), entries resolved again "
+           << extraResolutions << ", violations " << table.violations << "\n";
+
+    if (table.violations || extraResolutions)
+    {
+        errs() << "[ERROR] Entries were resolved twice, or read before they were ready\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file ExportIndexTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Checks the export index of the helpers against a walk of the names, and
+ *        against LLVM, on PE files mapped on the host, and times both lookups.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PEImage.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include "common/commonUtils.h"
+#include "pe/exportIndex.h"
+#include "pe/peUtils.h"
+}
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorbench;
+
+static cl::list<string> inputs(cl::Positional, cl::desc("<PE files>"), cl::OneOrMore);
+static cl::opt<unsigned int> lookups("lookups",
+                                     cl::desc("Names looked up when timing, spread over the exports (0 for all of them, "
+                                              "walking the names of every one is quadratic)"),
+                                     cl::init(4096));
+static cl::opt<unsigned int> rounds("rounds", cl::desc("Times each measure is taken, the best one is reported"), cl::init(5));
+
+namespace
+{
+    // Best time of rounds runs of measured, in ms
+    template <typename Measured>
+    double bestOf(Measured measured)
+    {
+        double bestMs = 0;
+        for (unsigned int round = 0; round < max(1u, rounds.getValue()); round++)
+        {
+            auto start = chrono::steady_clock::now();
+            measured();
+            double elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (!round || elapsedMs < bestMs)
+                bestMs = elapsedMs;
+        }
+        return bestMs;
+    }
+
+    double perSecond(size_t count, double elapsedMs)
+    {
+        return elapsedMs > 0 ? count * 1000.0 / elapsedMs : 0;
+    }
+
+    // Checks and times one image, returns the number of wrong lookups
+    uint64_t runImage(const PEImage &image)
+    {
+        PVOID p_module = image.base();
+        uint64_t errors = 0;
+
+        // What a walk of the names must find: the first name with each hash
+        DenseMap<uint32_t, uint32_t> expected;
+        vector<uint32_t> hashes;
+        for (const PEExport &exported : image.exports)
+        {
+            hashes.push_back(__callobf_hashA((PCHAR)exported.name.c_str()));
+            expected.try_emplace(hashes.back(), exported.rva);
+        }
+
+        auto expectedFunction = [&](uint32_t hash) -> PVOID
+        {
+            auto found = expected.find(hash);
+            return found == expected.end() ? NULL : (PVOID)((uintptr_t)p_module + found->second);
+        };
+
+        DWORD indexSize = __callobf_getExportIndexSize(p_module);
+        unique_ptr<uint64_t[]> indexBuffer(new uint64_t[indexSize / 8 + 1]);
+        PEXPORT_INDEX p_index = NULL;
+
+        double buildMs = bestOf([&]()
+                                { p_index = __callobf_buildExportIndex(p_module, indexBuffer.get(), indexSize); });
+
+        if (image.exports.empty())
+        {
+            outs() << "[INFO] " << image.name << ": no exported names\n";
+            return p_index ? 1 : 0;
+        }
+
+        if (!p_index || p_index->count != expected.size() || p_index->count + p_index->collisions != image.exports.size())
+        {
+            errs() << "[ERROR] " << image.name << ": index has " << (p_index ? p_index->count : 0) << " entries, expected "
+                   << expected.size() << "\n";
+            return 1;
+        }
+
+        // Every name, and a name that is not there for each, through the index
+        for (uint32_t hash : hashes)
+            for (uint32_t lookup : {hash, hash ^ 0x5bd1e995u})
+                if (__callobf_findExportH(p_index, lookup) != expectedFunction(lookup))
+                    errors++;
+
+        // The timed names, spread over the exports, are also checked walking the names, and through an index slot
+        size_t count = lookups ? min<size_t>(lookups, hashes.size()) : hashes.size();
+        vector<uint32_t> timed;
+        for (size_t i = 0; i < count; i++)
+            timed.push_back(hashes[i * hashes.size() / count]);
+
+        PVOID p_slot = NULL;
+        for (uint32_t hash : timed)
+            if (__callobf_getFunctionAddrH(p_module, hash) != expectedFunction(hash) ||
+                __callobf_getFunctionAddrIndexedH(p_module, &p_slot, hash) != expectedFunction(hash))
+                errors++;
+
+        volatile uintptr_t sink = 0;
+        double linearMs = bestOf([&]()
+                                 { for (uint32_t hash : timed) sink += (uintptr_t)__callobf_getFunctionAddrH(p_module, hash); });
+        double indexedMs = bestOf([&]()
+                                  { for (uint32_t hash : timed) sink += (uintptr_t)__callobf_findExportH(p_index, hash); });
+
+        outs() << "[INFO] " << image.name << ": " << image.exports.size() << " names, " << p_index->collisions
+               << " hash collisions, index of " << indexSize << " bytes built in " << format("%.3f", buildMs) << " ms"
+               << (p_slot == EXPORT_INDEX_NONE ? " (no room left in the arena, the slot walks the names)" : "") << "\n";
+        outs() << "[INFO]   " << count << " lookups: walking the names " << format("%.0f", perSecond(count, linearMs))
+               << " lookups/s, indexed " << format("%.0f", perSecond(count, indexedMs)) << " lookups/s ("
+               << format("%.1f", indexedMs > 0 ? linearMs / indexedMs : 0) << "x)\n";
+        outs() << "[INFO]   resolving them all: walking the names " << format("%.3f", linearMs)
+               << " ms, building the index and looking them up " << format("%.3f", buildMs + indexedMs) << " ms\n";
+
+        if (errors)
+            errs() << "[ERROR] " << image.name << ": " << errors << " lookups found the wrong function\n";
+
+        return errors;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator export index check and benchmark\n");
+
+    uint64_t errors = 0;
+    for (const string &input : inputs)
+    {
+        PEImage image;
+        string error;
+
+        if (!mapPEFile(input, image, error))
+        {
+            errs() << "[ERROR] Couldnt map " << input << ": " << error << "\n";
+            errors++;
+            continue;
+        }
+
+        errors += runImage(image);
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,259 @@
+/**
+ * @file HashTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Checks every variant of the hash shared by the pass and the helpers against a
+ *        plain one character at a time hash, on random strings, and optionally times them.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "common/commonUtils.h"
+#include "syscalls/syscalls.h"
+}
+
+using namespace std;
+using namespace llvm;
+
+static cl::OptionCategory hashCategory("Hash check options");
+static cl::opt<unsigned int> strings("strings", cl::desc("Random strings checked, and hashed when timing"), cl::init(100000),
+                                     cl::cat(hashCategory));
+static cl::opt<unsigned int> maxLength("max-length", cl::desc("Longest random string"), cl::init(64), cl::cat(hashCategory));
+static cl::opt<unsigned int> seed("seed", cl::desc("Seed of the random strings"), cl::init(1), cl::cat(hashCategory));
+static cl::opt<bool> timeHashes("time", cl::desc("Also measure the throughput of every variant"), cl::init(false),
+                                cl::cat(hashCategory));
+static cl::opt<unsigned int> rounds("rounds", cl::desc("Times each measure is taken, the best one is reported"), cl::init(5),
+                                    cl::cat(hashCategory));
+
+// Every variant can be taken at compile time, as the pass does with the names it hashes
+static_assert(__callobf_hashLengthA("LoadLibraryA", 12) == LOADLIBRARYA_HASH, "");
+static_assert(__callobf_hashContinueA(__callobf_hashStep(__callobf_hashStep(0, 'n'), 't'), "Close") ==
+                  __callobf_hashStringA("NtClose"),
+              "");
+
+namespace
+{
+    struct KnownHash
+    {
+        uint32_t hash;
+        const char *constant;
+        const char *name;
+    };
+
+#define KNOWN_HASH_ENTRY(constant, name) {constant, #constant, name},
+    const KnownHash knownHashes[] = {KNOWN_HASHES(KNOWN_HASH_ENTRY)};
+#undef KNOWN_HASH_ENTRY
+
+    // What the helpers did before sharing the hash, as written then: one character at a time,
+    // with CHAR signed. It is the reference every variant is checked against.
+    uint32_t referenceHashA(const char *p_str)
+    {
+        uint32_t h = 0;
+        for (const char *p = p_str; *p != '\0'; p++)
+        {
+            signed char c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
+            h = 37 * h + c;
+        }
+        return h;
+    }
+
+    uint32_t referenceHashW(const uint16_t *p_str)
+    {
+        uint32_t h = 0;
+        for (const uint16_t *p = p_str; *p != 0; p++)
+        {
+            uint16_t c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
+            h = 37 * h + c;
+        }
+        return h;
+    }
+
+    // And what the pass did: a 64 bit accumulator, truncated when emitted
+    uint32_t referenceHashPass(StringRef str)
+    {
+        unsigned long long h = 0;
+        for (char p : str)
+        {
+            signed char c = (p >= 65 && p <= 90) ? p + 32 : p;
+            h = 37 * h + c;
+        }
+        return (uint32_t)h;
+    }
+
+    // Best time of rounds runs of measured, in ms
+    template <typename Measured>
+    double bestOf(Measured measured)
+    {
+        double bestMs = 0;
+        for (unsigned int round = 0; round < max(1u, rounds.getValue()); round++)
+        {
+            auto start = chrono::steady_clock::now();
+            measured();
+            double elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (!round || elapsedMs < bestMs)
+                bestMs = elapsedMs;
+        }
+        return bestMs;
+    }
+
+    double megabytesPerSecond(size_t bytes, double elapsedMs)
+    {
+        return elapsedMs > 0 ? bytes / 1000.0 / elapsedMs : 0;
+    }
+
+    // Any length up to maxLength, so every tail of the unrolled loops is taken. Most characters are
+    // letters, with digits, symbols and bytes over 0x7f, which are negative as CHAR
+    string randomString(mt19937 &rng)
+    {
+        static const char symbols[] = "0123456789_.@?$";
+        string str(uniform_int_distribution<unsigned int>(0, maxLength)(rng), 'a');
+
+        for (char &c : str)
+        {
+            unsigned int kind = uniform_int_distribution<unsigned int>(0, 9)(rng);
+            if (kind < 4)
+                c = 'a' + uniform_int_distribution<int>(0, 25)(rng);
+            else if (kind < 8)
+                c = 'A' + uniform_int_distribution<int>(0, 25)(rng);
+            else if (kind < 9)
+                c = symbols[uniform_int_distribution<size_t>(0, sizeof(symbols) - 2)(rng)];
+            else
+                c = (char)uniform_int_distribution<int>(0x80, 0xff)(rng);
+        }
+
+        return str;
+    }
+
+    // The same string widened, with some characters out of the ascii range
+    vector<uint16_t> widen(const string &str, mt19937 &rng)
+    {
+        vector<uint16_t> wide;
+        for (char c : str)
+            wide.push_back(uniform_int_distribution<int>(0, 15)(rng) ? (uint8_t)c
+                                                                       : uniform_int_distribution<uint16_t>(0x100, 0xffff)(rng));
+        wide.push_back(0);
+        return wide;
+    }
+
+    // Returns the number of variants that do not match the reference for this string
+    uint64_t checkString(const string &str, const vector<uint16_t> &wide)
+    {
+        uint64_t errors = 0;
+        PCHAR p_str = (PCHAR)str.c_str();
+        uint32_t expected = referenceHashA(p_str);
+        uint32_t expectedWide = referenceHashW(wide.data());
+
+        errors += __callobf_hashA(p_str) != expected;
+        errors += __callobf_hashStringA(p_str) != expected;
+        errors += __callobf_hashLengthA(p_str, str.size()) != expected;
+        errors += referenceHashPass(str) != expected;
+
+        UNICODE_STRING unicode;
+        unicode.Buffer = (PWCHAR)wide.data();
+        unicode.Length = (USHORT)((wide.size() - 1) * sizeof(WCHAR));
+        unicode.MaximumLength = (USHORT)(wide.size() * sizeof(WCHAR));
+
+        errors += __callobf_hashW((PWCHAR)wide.data()) != expectedWide;
+        errors += __callobf_hashU(&unicode) != expectedWide;
+
+        // Syscalls are hashed as Nt and as Zw, whatever their first two characters are
+        if (str.size() >= 2)
+        {
+            errors += __callobf_hashSyscallAsNt(p_str) != referenceHashA(("Nt" + str.substr(2)).c_str());
+            errors += __callobf_hashSyscallAsZw(p_str) != referenceHashA(("Zw" + str.substr(2)).c_str());
+        }
+
+        if (errors)
+            errs() << "[ERROR] " << errors << " variants do not match the reference for \"" << str << "\"\n";
+
+        return errors;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::HideUnrelatedOptions(hashCategory);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator hash check and benchmark\n");
+
+    uint64_t errors = 0;
+    mt19937 rng(seed);
+
+    vector<string> corpus;
+    for (unsigned int i = 0; i < strings; i++)
+        corpus.push_back(randomString(rng));
+
+    for (const string &str : corpus)
+        errors += checkString(str, widen(str, rng));
+
+    for (const KnownHash &known : knownHashes)
+    {
+        if (__callobf_hashA((PCHAR)known.name) != known.hash)
+        {
+            errs() << "[ERROR] " << known.constant << " is not the hash of " << known.name << "\n";
+            errors++;
+        }
+    }
+
+    outs() << "[INFO] " << corpus.size() << " strings of up to " << maxLength << " characters checked\n";
+
+    if (errors)
+    {
+        errs() << "[ERROR] " << errors << " hashes do not match the reference\n";
+        return 1;
+    }
+
+    if (!timeHashes)
+        return 0;
+
+    size_t bytes = 0;
+    for (const string &str : corpus)
+        bytes += str.size();
+
+    volatile uint32_t sink = 0;
+    double referenceMs = bestOf([&]()
+                                { for (const string &str : corpus) sink += referenceHashA(str.c_str()); });
+    double helpersMs = bestOf([&]()
+                              { for (const string &str : corpus) sink += __callobf_hashA((PCHAR)str.c_str()); });
+    double inlineMs = bestOf([&]()
+                             { for (const string &str : corpus) sink += __callobf_hashStringA(str.c_str()); });
+    double lengthMs = bestOf([&]()
+                             { for (const string &str : corpus) sink += __callobf_hashLengthA(str.data(), str.size()); });
+
+    outs() << "[INFO]   " << bytes << " bytes: one character at a time " << format("%.0f", megabytesPerSecond(bytes, referenceMs))
+           << " MB/s, __callobf_hashA " << format("%.0f", megabytesPerSecond(bytes, helpersMs))
+           << " MB/s, inlined " << format("%.0f", megabytesPerSecond(bytes, inlineMs))
+           << " MB/s, with the length " << format("%.0f", megabytesPerSecond(bytes, lengthMs)) << " MB/s\n";
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file HostTeb.c
+ * @author Alejandro González (@httpyxel)
+ * @brief Teb of the host builds of the helpers, with no modules loaded.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common/commonUtils.h"
+
+// The helpers only ask for the teb to find loaded modules, there are none on the host, and
+// to keep the last error, which is per thread as on windows
+struct _TEB *NtCurrentTeb(void)
+{
+    static PEB_LDR_DATA ldr;
+    static PEB peb;
+    static __thread TEB teb;
+
+    ldr.InLoadOrderModuleList.Flink = ldr.InLoadOrderModuleList.Blink = &ldr.InLoadOrderModuleList;
+    peb.Ldr = &ldr;
+    teb.ProcessEnvironmentBlock = &peb;
+    return &teb;
+}
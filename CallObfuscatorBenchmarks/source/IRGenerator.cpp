@@ -0,0 +1,161 @@
+/**
+ * @file IRGenerator.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Generation of synthetic modules and configs to benchmark the pass.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "IRGenerator.h"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+// Same names as the config keys read by the pass
+#define DLL_HOOKS_KEY "dll_hooks"
+#define DLL_NAME_KEY "dll_name"
+#define FUNCTION_HOOKS_KEY "hooked_functions"
+
+namespace callobfuscatorbench
+{
+    bool generateModule(const GeneratorOptions &options, StringRef path, string &error)
+    {
+        LLVMContext ctx;
+        Module mod("callobf-bench", ctx);
+        mod.setTargetTriple("x86_64-pc-windows-msvc");
+        mod.setDataLayout("e-m:w-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128");
+
+        if (options.fullLTO)
+        {
+            mod.addModuleFlag(Module::Error, "EnableSplitLTOUnit", 0u);
+            mod.addModuleFlag(Module::Error, "ThinLTO", 0u);
+        }
+
+        Type *p_i64 = Type::getInt64Ty(ctx);
+        Type *p_i32 = Type::getInt32Ty(ctx);
+
+        // Integer only signatures, so the module is the same with typed and opaque pointers
+        FunctionType *p_apiType = FunctionType::get(p_i64, {p_i64, p_i32}, false);
+        FunctionType *p_functionType = FunctionType::get(p_i64, {p_i64}, false);
+
+        vector<Function *> apis;
+        for (unsigned int i = 0; i < options.hookedDeclarations; i++)
+            apis.push_back(Function::Create(p_apiType, GlobalValue::ExternalLinkage, "HookedApi" + Twine(i), mod));
+        for (unsigned int i = 0; i < options.plainDeclarations; i++)
+            apis.push_back(Function::Create(p_apiType, GlobalValue::ExternalLinkage, "PlainApi" + Twine(i), mod));
+
+        if (apis.empty() && options.callsPerFunction)
+        {
+            error = "No apis to call";
+            return false;
+        }
+
+        IRBuilder<> builder(ctx);
+        unsigned long callCount = 0;
+
+        for (unsigned int i = 0; i < options.functions; i++)
+        {
+            Function *p_function = Function::Create(p_functionType, GlobalValue::ExternalLinkage, options.functionPrefix + Twine(i), mod);
+            builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", p_function));
+
+            Value *p_value = p_function->getArg(0);
+            for (unsigned int j = 0; j < options.callsPerFunction; j++)
+            {
+                Function *p_api = apis[callCount++ % apis.size()];
+                p_value = builder.CreateCall(p_api, {p_value, builder.getInt32(j)});
+            }
+
+            builder.CreateRet(p_value);
+        }
+
+        if (verifyModule(mod, &errs()))
+        {
+            error = "Generated module is not valid";
+            return false;
+        }
+
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_None);
+        if (ec)
+        {
+            error = ec.message();
+            return false;
+        }
+
+        WriteBitcodeToFile(mod, out);
+        return true;
+    }
+
+    bool generateConfig(const GeneratorOptions &options, StringRef path, string &error)
+    {
+        unsigned int configHooks = max(options.configHooks, options.hookedDeclarations);
+        unsigned int dlls = max(options.dlls, 1u);
+
+        error_code ec;
+        raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            error = ec.message();
+            return false;
+        }
+
+        json::OStream json(out);
+        json.objectBegin();
+        json.attributeBegin(DLL_HOOKS_KEY);
+        json.arrayBegin();
+
+        // Hooks are spread round robin, so every dll gets a similar amount
+        for (unsigned int dll = 0; dll < dlls; dll++)
+        {
+            json.objectBegin();
+            json.attribute(DLL_NAME_KEY, ("bench" + Twine(dll) + ".dll").str());
+            json.attributeBegin(FUNCTION_HOOKS_KEY);
+            json.arrayBegin();
+
+            for (unsigned int i = dll; i < configHooks; i += dlls)
+            {
+                if (i < options.hookedDeclarations)
+                    json.value(("HookedApi" + Twine(i)).str());
+                else
+                    json.value(("MissingApi" + Twine(i)).str());
+            }
+
+            json.arrayEnd();
+            json.attributeEnd();
+            json.objectEnd();
+        }
+
+        json.arrayEnd();
+        json.attributeEnd();
+        json.objectEnd();
+
+        return true;
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * @file IRGeneratorTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Writes a synthetic module and config, to benchmark the pass by hand.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "IRGenerator.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorbench;
+
+static cl::opt<string> modulePath("o", cl::desc("Output bitcode file"), cl::Required);
+static cl::opt<string> configPath("config", cl::desc("Output json config file"), cl::Required);
+static cl::opt<unsigned int> functions("functions", cl::desc("Defined functions"), cl::init(1000));
+static cl::opt<unsigned int> hookedDeclarations("hooked-apis", cl::desc("Declared apis listed in the config"), cl::init(100));
+static cl::opt<unsigned int> plainDeclarations("plain-apis", cl::desc("Declared apis not listed in the config"), cl::init(100));
+static cl::opt<unsigned int> callsPerFunction("calls-per-function", cl::desc("Api calls in each defined function"), cl::init(4));
+static cl::opt<unsigned int> configHooks("config-hooks", cl::desc("Functions in the config"), cl::init(1000));
+static cl::opt<unsigned int> dlls("dlls", cl::desc("Dlls in the config"), cl::init(16));
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator synthetic module generator\n");
+
+    GeneratorOptions options;
+    options.functions = functions;
+    options.hookedDeclarations = hookedDeclarations;
+    options.plainDeclarations = plainDeclarations;
+    options.callsPerFunction = callsPerFunction;
+    options.configHooks = configHooks;
+    options.dlls = dlls;
+
+    string error;
+    if (!generateModule(options, modulePath, error) || !generateConfig(options, configPath, error))
+    {
+        errs() << "[ERROR] " << error << "\n";
+        return 1;
+    }
+
+    return 0;
+}
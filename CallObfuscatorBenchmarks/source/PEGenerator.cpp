@@ -0,0 +1,305 @@
+/**
+ * @file PEGenerator.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Generation of synthetic PE32+ dlls, with any number of exports, to run the
+ *        helpers that walk in-memory PEs without windows binaries.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PEGenerator.h"
+
+#include "llvm/ADT/StringSet.h"
+#include "llvm/BinaryFormat/COFF.h"
+#include "llvm/Object/COFF.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <random>
+
+// Same as link.exe and lld
+#define SECTION_ALIGNMENT 0x1000
+#define FILE_ALIGNMENT 0x200
+#define IMAGE_BASE 0x180000000ull
+
+#define FUNCTION_SIZE 16 // A ret, padded with int3
+#define SECTION_COUNT 3  // .text, .rdata and .pdata
+
+// Ordinals are 16 bits, past this many names they are aliases of the functions
+#define MAX_FUNCTIONS 0x10000
+#define MAX_EXPORTS 0x100000
+
+using namespace std;
+using namespace llvm;
+using namespace llvm::object;
+
+namespace callobfuscatorbench
+{
+    static const char *apiPrefixes[] = {"Nt", "Zw", "Rtl", "Ldr", "Get", "Set", "Create", "Open", "Query", "Enum", "Reg",
+                                        "Crypt", "Virtual", "Heap", "Close", "Delete", "Find", "Load", "Read", "Write"};
+    static const char *apiWords[] = {"Process", "Thread", "File", "Key", "Value", "Object", "Memory", "Section",
+                                     "Token", "Information", "Handle", "Event", "Mutex", "Module", "Library", "Window",
+                                     "Message", "Buffer", "String", "Path", "Directory", "Device", "Service", "Context",
+                                     "Security", "Time", "System", "Volume", "Pipe", "Port", "Job", "Atom",
+                                     "Class", "Icon", "Menu", "Font", "Console", "Environment", "Variable", "Locale"};
+    static const char *apiSuffixes[] = {"", "", "", "A", "W", "Ex", "ExA", "ExW", "2", "Internal"};
+
+    template <typename T, size_t N>
+    static const char *pick(mt19937 &rng, const T (&values)[N])
+    {
+        return values[rng() % N];
+    }
+
+    static string makeName(const PEGeneratorOptions &options, mt19937 &rng, unsigned int index, unsigned int digits)
+    {
+        string name;
+        switch (options.names)
+        {
+        case NameDistribution::Random:
+        {
+            static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+            unsigned int length = options.minNameLength + rng() % (options.maxNameLength - options.minNameLength + 1);
+            for (unsigned int i = 0; i < length; i++)
+                name += letters[rng() % (sizeof(letters) - 1)];
+            break;
+        }
+        case NameDistribution::Api:
+        {
+            name = pick(rng, apiPrefixes);
+            for (unsigned int words = 1 + rng() % 3; words; words--)
+                name += pick(rng, apiWords);
+            name += pick(rng, apiSuffixes);
+            break;
+        }
+        case NameDistribution::Sequential:
+        {
+            string number = to_string(index);
+            name = options.namePrefix + string(digits - min<size_t>(digits, number.size()), '0') + number;
+            break;
+        }
+        }
+        return name;
+    }
+
+    static bool makeNames(const PEGeneratorOptions &options, vector<string> &names, string &error)
+    {
+        mt19937 rng(options.seed);
+        StringSet<> used;
+        unsigned int digits = to_string(options.exports).size();
+
+        if (options.names == NameDistribution::Random &&
+            (!options.minNameLength || options.minNameLength > options.maxNameLength))
+        {
+            error = "bad name lengths";
+            return false;
+        }
+
+        // Repeated names get a number, so there are always enough of them
+        for (unsigned int attempt = 0; names.size() < options.exports; attempt++)
+        {
+            string name = makeName(options, rng, names.size(), digits);
+            if (attempt > 4ull * options.exports)
+                name += to_string(attempt);
+
+            if (used.insert(name).second)
+                names.push_back(name);
+        }
+
+        // The linker sorts them, so windows can binary search them by name
+        std::sort(names.begin(), names.end());
+        return true;
+    }
+
+    template <typename T>
+    static T *at(vector<char> &file, uint64_t offset)
+    {
+        return (T *)(file.data() + offset);
+    }
+
+    static void writeSection(vector<char> &file, unsigned int index, const char *p_name, uint32_t rva, uint32_t size,
+                             uint32_t fileOffset, uint32_t characteristics)
+    {
+        uint64_t offset = sizeof(dos_header) + sizeof(COFF::PEMagic) + sizeof(coff_file_header) + sizeof(pe32plus_header) +
+                          COFF::NUM_DATA_DIRECTORIES * sizeof(data_directory) + index * sizeof(coff_section);
+        coff_section *p_section = at<coff_section>(file, offset);
+
+        strncpy(p_section->Name, p_name, COFF::NameSize);
+        p_section->VirtualSize = size;
+        p_section->VirtualAddress = rva;
+        p_section->SizeOfRawData = alignTo(size, FILE_ALIGNMENT);
+        p_section->PointerToRawData = fileOffset;
+        p_section->Characteristics = characteristics;
+    }
+
+    bool generatePE(const PEGeneratorOptions &options, vector<char> &file, string &error)
+    {
+        vector<string> names;
+
+        if (!options.exports || options.exports > MAX_EXPORTS)
+        {
+            error = "exports must be between 1 and " + to_string(MAX_EXPORTS);
+            return false;
+        }
+
+        if (!makeNames(options, names, error))
+            return false;
+
+        // Every function gets a name, in a shuffled order, the names past MAX_FUNCTIONS are aliases
+        uint32_t functions = min<uint32_t>(names.size(), MAX_FUNCTIONS);
+        vector<uint32_t> functionOfName(names.size());
+        iota(functionOfName.begin(), functionOfName.end(), 0);
+        std::shuffle(functionOfName.begin(), functionOfName.end(), mt19937(options.seed + 1));
+        for (uint32_t &function : functionOfName)
+            function %= functions;
+
+        // .rdata: unwind info shared by every function, export directory, dll name, and the export tables
+        uint32_t unwindOffset = 0;
+        uint32_t directoryOffset = 8;
+        uint32_t dllNameOffset = directoryOffset + sizeof(export_directory_table_entry);
+        uint32_t functionsOffset = alignTo(dllNameOffset + options.dllName.size() + 1, 4);
+        uint32_t namesOffset = functionsOffset + functions * 4;
+        uint32_t ordinalsOffset = namesOffset + names.size() * 4;
+        uint32_t stringsOffset = ordinalsOffset + names.size() * 2;
+        uint32_t rdataSize = stringsOffset;
+        for (const string &name : names)
+            rdataSize += name.size() + 1;
+
+        uint32_t textSize = functions * FUNCTION_SIZE;
+        uint32_t pdataSize = functions * sizeof(coff_runtime_function_x64);
+
+        uint32_t headersSize = alignTo(sizeof(dos_header) + sizeof(COFF::PEMagic) + sizeof(coff_file_header) +
+                                           sizeof(pe32plus_header) + COFF::NUM_DATA_DIRECTORIES * sizeof(data_directory) +
+                                           SECTION_COUNT * sizeof(coff_section),
+                                       FILE_ALIGNMENT);
+        uint32_t textRVA = SECTION_ALIGNMENT;
+        uint32_t rdataRVA = alignTo(textRVA + textSize, SECTION_ALIGNMENT);
+        uint32_t pdataRVA = alignTo(rdataRVA + rdataSize, SECTION_ALIGNMENT);
+        uint32_t imageSize = alignTo(pdataRVA + pdataSize, SECTION_ALIGNMENT);
+
+        uint32_t textOffset = headersSize;
+        uint32_t rdataOffset = textOffset + alignTo(textSize, FILE_ALIGNMENT);
+        uint32_t pdataOffset = rdataOffset + alignTo(rdataSize, FILE_ALIGNMENT);
+        file.assign(pdataOffset + alignTo(pdataSize, FILE_ALIGNMENT), 0);
+
+        // Headers, right after a dos header without stub
+        dos_header *p_dos = at<dos_header>(file, 0);
+        memcpy(p_dos->Magic, "MZ", 2);
+        p_dos->AddressOfNewExeHeader = sizeof(dos_header);
+        memcpy(at<char>(file, sizeof(dos_header)), COFF::PEMagic, sizeof(COFF::PEMagic));
+
+        coff_file_header *p_fileHeader = at<coff_file_header>(file, sizeof(dos_header) + sizeof(COFF::PEMagic));
+        p_fileHeader->Machine = COFF::IMAGE_FILE_MACHINE_AMD64;
+        p_fileHeader->NumberOfSections = SECTION_COUNT;
+        p_fileHeader->SizeOfOptionalHeader = sizeof(pe32plus_header) + COFF::NUM_DATA_DIRECTORIES * sizeof(data_directory);
+        p_fileHeader->Characteristics = COFF::IMAGE_FILE_EXECUTABLE_IMAGE | COFF::IMAGE_FILE_LARGE_ADDRESS_AWARE | COFF::IMAGE_FILE_DLL;
+
+        pe32plus_header *p_header = (pe32plus_header *)(p_fileHeader + 1);
+        p_header->Magic = COFF::PE32Header::PE32_PLUS;
+        p_header->SizeOfCode = alignTo(textSize, FILE_ALIGNMENT);
+        p_header->SizeOfInitializedData = alignTo(rdataSize, FILE_ALIGNMENT) + alignTo(pdataSize, FILE_ALIGNMENT);
+        p_header->BaseOfCode = textRVA;
+        p_header->ImageBase = IMAGE_BASE;
+        p_header->SectionAlignment = SECTION_ALIGNMENT;
+        p_header->FileAlignment = FILE_ALIGNMENT;
+        p_header->MajorOperatingSystemVersion = 6;
+        p_header->MajorSubsystemVersion = 6;
+        p_header->SizeOfImage = imageSize;
+        p_header->SizeOfHeaders = headersSize;
+        p_header->Subsystem = COFF::IMAGE_SUBSYSTEM_WINDOWS_GUI;
+        p_header->DLLCharacteristics = COFF::IMAGE_DLL_CHARACTERISTICS_HIGH_ENTROPY_VA |
+                                       COFF::IMAGE_DLL_CHARACTERISTICS_DYNAMIC_BASE | COFF::IMAGE_DLL_CHARACTERISTICS_NX_COMPAT;
+        p_header->SizeOfStackReserve = 0x100000;
+        p_header->SizeOfStackCommit = 0x1000;
+        p_header->SizeOfHeapReserve = 0x100000;
+        p_header->SizeOfHeapCommit = 0x1000;
+        p_header->NumberOfRvaAndSize = COFF::NUM_DATA_DIRECTORIES;
+
+        data_directory *p_directories = (data_directory *)(p_header + 1);
+        p_directories[COFF::EXPORT_TABLE].RelativeVirtualAddress = rdataRVA + directoryOffset;
+        p_directories[COFF::EXPORT_TABLE].Size = rdataSize - directoryOffset;
+        p_directories[COFF::EXCEPTION_TABLE].RelativeVirtualAddress = pdataRVA;
+        p_directories[COFF::EXCEPTION_TABLE].Size = pdataSize;
+
+        writeSection(file, 0, ".text", textRVA, textSize, textOffset,
+                     COFF::IMAGE_SCN_CNT_CODE | COFF::IMAGE_SCN_MEM_EXECUTE | COFF::IMAGE_SCN_MEM_READ);
+        writeSection(file, 1, ".rdata", rdataRVA, rdataSize, rdataOffset,
+                     COFF::IMAGE_SCN_CNT_INITIALIZED_DATA | COFF::IMAGE_SCN_MEM_READ);
+        writeSection(file, 2, ".pdata", pdataRVA, pdataSize, pdataOffset,
+                     COFF::IMAGE_SCN_CNT_INITIALIZED_DATA | COFF::IMAGE_SCN_MEM_READ);
+
+        // .text
+        memset(at<char>(file, textOffset), 0xCC, textSize);
+        for (uint32_t function = 0; function < functions; function++)
+            *at<uint8_t>(file, textOffset + function * FUNCTION_SIZE) = 0xC3;
+
+        // .rdata, a leaf function with no prolog only needs the version of its unwind info
+        *at<uint8_t>(file, rdataOffset + unwindOffset) = 1;
+
+        export_directory_table_entry *p_exports = at<export_directory_table_entry>(file, rdataOffset + directoryOffset);
+        p_exports->NameRVA = rdataRVA + dllNameOffset;
+        p_exports->OrdinalBase = 1;
+        p_exports->AddressTableEntries = functions;
+        p_exports->NumberOfNamePointers = names.size();
+        p_exports->ExportAddressTableRVA = rdataRVA + functionsOffset;
+        p_exports->NamePointerRVA = rdataRVA + namesOffset;
+        p_exports->OrdinalTableRVA = rdataRVA + ordinalsOffset;
+        memcpy(at<char>(file, rdataOffset + dllNameOffset), options.dllName.c_str(), options.dllName.size() + 1);
+
+        uint32_t stringOffset = stringsOffset;
+        for (uint32_t i = 0; i < names.size(); i++)
+        {
+            uint32_t function = functionOfName[i];
+
+            *at<support::ulittle32_t>(file, rdataOffset + functionsOffset + function * 4) = textRVA + function * FUNCTION_SIZE;
+            *at<support::ulittle32_t>(file, rdataOffset + namesOffset + i * 4) = rdataRVA + stringOffset;
+            *at<support::ulittle16_t>(file, rdataOffset + ordinalsOffset + i * 2) = function;
+
+            memcpy(at<char>(file, rdataOffset + stringOffset), names[i].c_str(), names[i].size() + 1);
+            stringOffset += names[i].size() + 1;
+        }
+
+        // .pdata
+        for (uint32_t function = 0; function < functions; function++)
+        {
+            coff_runtime_function_x64 *p_runtimeFunction =
+                at<coff_runtime_function_x64>(file, pdataOffset + function * sizeof(coff_runtime_function_x64));
+            p_runtimeFunction->BeginAddress = textRVA + function * FUNCTION_SIZE;
+            p_runtimeFunction->EndAddress = textRVA + function * FUNCTION_SIZE + 1;
+            p_runtimeFunction->UnwindInformation = rdataRVA + unwindOffset;
+        }
+
+        return true;
+    }
+
+    bool parseNameDistribution(StringRef name, NameDistribution &distribution)
+    {
+        if (name == "random")
+            distribution = NameDistribution::Random;
+        else if (name == "api")
+            distribution = NameDistribution::Api;
+        else if (name == "sequential")
+            distribution = NameDistribution::Sequential;
+        else
+            return false;
+
+        return true;
+    }
+}
@@ -0,0 +1,346 @@
+/**
+ * @file PEHarnessTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Runs the PE helpers over PE files, or over synthetic dlls with any number of
+ *        exports, mapped on the host. Checks them against LLVM and times the lookups.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PEGenerator.h"
+#include "PEImage.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include "common/commonUtils.h"
+#include "pe/exportIndex.h"
+#include "pe/peUtils.h"
+}
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorbench;
+
+static cl::list<string> inputs(cl::Positional, cl::desc("[PE files, a synthetic dll is generated if none is given]"));
+static cl::opt<unsigned int> exports("exports", cl::desc("Exported names of the synthetic dll"), cl::init(100000));
+static cl::opt<string> names("names", cl::desc("Names of the synthetic dll: random, api or sequential"), cl::init("api"));
+static cl::opt<unsigned int> minNameLength("min-name-length", cl::desc("Shortest random name"), cl::init(4));
+static cl::opt<unsigned int> maxNameLength("max-name-length", cl::desc("Longest random name"), cl::init(24));
+static cl::opt<unsigned int> seed("seed", cl::desc("Seed of the synthetic dll"), cl::init(1));
+static cl::opt<string> outputPath("o", cl::desc("Writes the synthetic dll to this file"), cl::value_desc("path"));
+static cl::opt<unsigned int> lookups("lookups",
+                                     cl::desc("Names looked up when timing, spread over the exports (0 for all of them, "
+                                              "walking the names of every one is quadratic)"),
+                                     cl::init(256));
+static cl::opt<unsigned int> tableSize("table", cl::desc("Functions of the table resolved as a whole, spread over the exports"),
+                                       cl::init(512));
+static cl::opt<unsigned int> rounds("rounds", cl::desc("Times each measure is taken, the best one is reported"), cl::init(5));
+
+namespace
+{
+    // Same as the one of the dispatcher on eager resolution: a single walk of the names, the table is scanned for each
+    struct TableCtx
+    {
+        const vector<uint32_t> *p_hashes;
+        vector<PVOID> *p_functions;
+        size_t pending;
+    };
+
+    BOOL resolveTableExport(UINT32 nameHash, PVOID p_function, PVOID p_ctx)
+    {
+        TableCtx *p_tableCtx = (TableCtx *)p_ctx;
+
+        for (size_t i = 0; i < p_tableCtx->p_hashes->size(); i++)
+        {
+            if ((*p_tableCtx->p_hashes)[i] == nameHash && !(*p_tableCtx->p_functions)[i])
+            {
+                (*p_tableCtx->p_functions)[i] = p_function;
+                p_tableCtx->pending--;
+            }
+        }
+
+        return p_tableCtx->pending != 0;
+    }
+
+    // Best time of rounds runs of measured, in ms
+    template <typename Measured>
+    double bestOf(Measured measured)
+    {
+        double bestMs = 0;
+        for (unsigned int round = 0; round < max(1u, rounds.getValue()); round++)
+        {
+            auto start = chrono::steady_clock::now();
+            measured();
+            double elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (!round || elapsedMs < bestMs)
+                bestMs = elapsedMs;
+        }
+        return bestMs;
+    }
+
+    double perSecond(size_t count, double elapsedMs)
+    {
+        return elapsedMs > 0 ? count * 1000.0 / elapsedMs : 0;
+    }
+
+    // Hashes of count exports, spread over all of them
+    vector<uint32_t> spread(const vector<uint32_t> &hashes, size_t count)
+    {
+        vector<uint32_t> spreaded;
+        count = count ? min(count, hashes.size()) : hashes.size();
+        for (size_t i = 0; i < count; i++)
+            spreaded.push_back(hashes[i * hashes.size() / count]);
+        return spreaded;
+    }
+
+    // Returns the number of directories the helpers got wrong
+    uint64_t checkDirectories(const PEImage &image)
+    {
+        uint8_t *p_module = (uint8_t *)image.base();
+        uint64_t errors = 0;
+
+        DWORD exceptionSize = 0;
+        PVOID p_exception = __callobf_getExceptionDirectoryAddress(p_module, &exceptionSize);
+        if (p_exception != (image.exceptionRVA ? p_module + image.exceptionRVA : NULL) ||
+            (p_exception && exceptionSize != image.exceptionSize))
+        {
+            errs() << "[ERROR] " << image.name << ": wrong exception directory, rva "
+                   << (p_exception ? (uint8_t *)p_exception - p_module : 0) << " of " << exceptionSize << " bytes, expected rva "
+                   << image.exceptionRVA << " of " << image.exceptionSize << " bytes\n";
+            errors++;
+        }
+
+        PVOID p_codeBase = NULL;
+        PVOID p_codeTop = NULL;
+        BOOL found = __callobf_getCodeBoundaries(p_module, &p_codeBase, &p_codeTop);
+        if (found != (image.codeRVA && image.codeSize) ||
+            (found && (p_codeBase != p_module + image.codeRVA || p_codeTop != p_module + image.codeRVA + image.codeSize)))
+        {
+            errs() << "[ERROR] " << image.name << ": wrong code boundaries\n";
+            errors++;
+        }
+
+        return errors;
+    }
+
+    // Checks and times one image, returns the number of errors
+    uint64_t runImage(const PEImage &image)
+    {
+        PVOID p_module = image.base();
+        uint64_t errors = checkDirectories(image);
+
+        if (image.exports.empty())
+        {
+            outs() << "[INFO] " << image.name << ": no exported names\n";
+            return errors;
+        }
+
+        // What a walk of the names must find: the first name with each hash,
+        // and the export hint the pass would emit for it
+        DenseMap<uint32_t, uint32_t> expected;
+        DenseMap<uint32_t, DWORD> exportHints;
+        vector<uint32_t> hashes;
+        for (const PEExport &exported : image.exports)
+        {
+            hashes.push_back(__callobf_hashA((PCHAR)exported.name.c_str()));
+            expected.try_emplace(hashes.back(), exported.rva);
+            exportHints.try_emplace(hashes.back(), (DWORD)hashes.size());
+        }
+
+        auto expectedFunction = [&](uint32_t hash) -> PVOID
+        {
+            auto found = expected.find(hash);
+            return found == expected.end() ? NULL : (PVOID)((uintptr_t)p_module + found->second);
+        };
+
+        // Lookups, each one walking the names, as the lazy resolution does. A name that is not
+        // there walks all of them, so only a few of those are checked
+        vector<uint32_t> timed = spread(hashes, lookups);
+        for (size_t i = 0; i < timed.size(); i++)
+            if (__callobf_getFunctionAddrH(p_module, timed[i]) != expectedFunction(timed[i]) ||
+                (i < 16 && __callobf_getFunctionAddrH(p_module, timed[i] ^ 0x5bd1e995u) != expectedFunction(timed[i] ^ 0x5bd1e995u)))
+                errors++;
+
+        volatile uintptr_t sink = 0;
+        double lookupsMs = bestOf([&]()
+                                  { for (uint32_t hash : timed) sink += (uintptr_t)__callobf_getFunctionAddrH(p_module, hash); });
+
+        // A whole table, walking the names for each function, in a single walk, and through the index
+        vector<uint32_t> table = spread(hashes, tableSize);
+        vector<PVOID> walked(table.size());
+        vector<PVOID> indexed(table.size());
+
+        double lazyMs = bestOf([&]()
+                               {
+                                   for (size_t i = 0; i < table.size(); i++)
+                                       walked[i] = __callobf_getFunctionAddrH(p_module, table[i]);
+                               });
+
+        DWORD indexSize = __callobf_getExportIndexSize(p_module);
+        unique_ptr<uint64_t[]> indexBuffer(new uint64_t[indexSize / 8 + 1]);
+        double indexMs = bestOf([&]()
+                                {
+                                    PEXPORT_INDEX p_index = __callobf_buildExportIndex(p_module, indexBuffer.get(), indexSize);
+                                    for (size_t i = 0; i < table.size(); i++)
+                                        indexed[i] = p_index ? __callobf_findExportH(p_index, table[i]) : NULL;
+                                });
+
+        for (size_t i = 0; i < table.size(); i++)
+            if (walked[i] != expectedFunction(table[i]) || indexed[i] != expectedFunction(table[i]))
+                errors++;
+
+        // The same table with the hints of the pass. A stale hint, pointing to the next name, or out
+        // of the names, must never give a function with another hash
+        vector<PVOID> hinted(table.size());
+        double hintedMs = bestOf([&]()
+                                 {
+                                     for (size_t i = 0; i < table.size(); i++)
+                                         hinted[i] = __callobf_getFunctionAddrHintedH(p_module, table[i], exportHints[table[i]]);
+                                 });
+
+        for (size_t i = 0; i < table.size(); i++)
+        {
+            DWORD staleHint = exportHints[table[i]] % hashes.size() + 1;
+            PVOID p_stale = __callobf_getFunctionAddrHintedH(p_module, table[i], staleHint);
+
+            if (hinted[i] != expectedFunction(table[i]) || (p_stale && hashes[staleHint - 1] != table[i]) ||
+                __callobf_getFunctionAddrHintedH(p_module, table[i], (DWORD)hashes.size() + 1) ||
+                __callobf_getFunctionAddrHintedH(p_module, table[i], EXPORT_HINT_NONE))
+                errors++;
+        }
+
+        // Names sharing a hash are only resolved once, as the table of the pass only has one entry per function
+        vector<uint32_t> uniqueTable;
+        for (uint32_t hash : table)
+            if (find(uniqueTable.begin(), uniqueTable.end(), hash) == uniqueTable.end())
+                uniqueTable.push_back(hash);
+
+        vector<PVOID> eager(uniqueTable.size());
+        double eagerMs = bestOf([&]()
+                                {
+                                    fill(eager.begin(), eager.end(), nullptr);
+                                    TableCtx tableCtx = {&uniqueTable, &eager, uniqueTable.size()};
+                                    __callobf_forEachExportH(p_module, resolveTableExport, &tableCtx);
+                                });
+
+        for (size_t i = 0; i < uniqueTable.size(); i++)
+            if (eager[i] != expectedFunction(uniqueTable[i]))
+                errors++;
+
+        outs() << "[INFO] " << image.name << ": " << image.exports.size() << " names, " << image.exports.size() - expected.size()
+               << " hash collisions, exception directory of " << image.exceptionSize << " bytes, code section of "
+               << image.codeSize << " bytes\n";
+        outs() << "[INFO]   " << timed.size() << " lookups walking the names: "
+               << format("%.0f", perSecond(timed.size(), lookupsMs)) << " lookups/s\n";
+        outs() << "[INFO]   resolving a table of " << table.size() << " functions: walking the names for each "
+               << format("%.3f", lazyMs) << " ms, a single walk " << format("%.3f", eagerMs)
+               << " ms, building the index and looking them up " << format("%.3f", indexMs) << " ms, with export hints "
+               << format("%.3f", hintedMs) << " ms\n";
+
+        if (errors)
+            errs() << "[ERROR] " << image.name << ": " << errors << " lookups found the wrong function\n";
+
+        return errors;
+    }
+
+    bool generateImage(PEImage &image, string &error)
+    {
+        PEGeneratorOptions options;
+        vector<char> file;
+
+        options.exports = exports;
+        options.minNameLength = minNameLength;
+        options.maxNameLength = maxNameLength;
+        options.seed = seed;
+        if (!parseNameDistribution(names, options.names))
+        {
+            error = "unknown name distribution " + names;
+            return false;
+        }
+
+        if (!generatePE(options, file, error))
+            return false;
+
+        if (!outputPath.empty())
+        {
+            error_code ec;
+            raw_fd_ostream output(outputPath, ec, sys::fs::OF_None);
+            if (ec)
+            {
+                error = "couldnt write " + outputPath + ": " + ec.message();
+                return false;
+            }
+            output.write(file.data(), file.size());
+        }
+
+        string name = options.dllName + " (" + to_string(options.exports) + " " + names + " names)";
+        return mapPEImage(MemoryBufferRef(StringRef(file.data(), file.size()), name), name, image, error);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator PE helpers check and benchmark\n");
+
+    uint64_t errors = 0;
+    if (inputs.empty())
+    {
+        PEImage image;
+        string error;
+
+        if (!generateImage(image, error))
+        {
+            errs() << "[ERROR] Couldnt generate the synthetic dll: " << error << "\n";
+            return 1;
+        }
+
+        errors += runImage(image);
+    }
+
+    for (const string &input : inputs)
+    {
+        PEImage image;
+        string error;
+
+        if (!mapPEFile(input, image, error))
+        {
+            errs() << "[ERROR] Couldnt map " << input << ": " << error << "\n";
+            errors++;
+            continue;
+        }
+
+        errors += runImage(image);
+    }
+
+    return errors ? 1 : 0;
+}
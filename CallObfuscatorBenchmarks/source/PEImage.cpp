@@ -0,0 +1,187 @@
+/**
+ * @file PEImage.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Maps PE files as the windows loader lays them out, so the helpers that walk
+ *        in-memory PEs can be run on any host.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PEImage.h"
+
+#include "llvm/BinaryFormat/COFF.h"
+#include "llvm/Object/COFF.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace llvm;
+using namespace llvm::object;
+
+namespace callobfuscatorbench
+{
+    // Every rva read from the image is checked against it, the file may be anything
+    static bool inImage(const PEImage &image, uint64_t rva, uint64_t size)
+    {
+        return rva <= image.size && size <= image.size - rva;
+    }
+
+    static bool readExports(const COFFObjectFile &coff, PEImage &image, string &error)
+    {
+        const data_directory *p_directory = coff.getDataDirectory(COFF::EXPORT_TABLE);
+        const uint8_t *p_base = (const uint8_t *)image.base();
+
+        if (!p_directory || !p_directory->RelativeVirtualAddress)
+            return true;
+
+        if (!inImage(image, p_directory->RelativeVirtualAddress, sizeof(export_directory_table_entry)))
+        {
+            error = "export directory out of the image";
+            return false;
+        }
+
+        const export_directory_table_entry *p_exports =
+            (const export_directory_table_entry *)(p_base + p_directory->RelativeVirtualAddress);
+        uint32_t names = p_exports->NumberOfNamePointers;
+        uint32_t functions = p_exports->AddressTableEntries;
+
+        if (!inImage(image, p_exports->NamePointerRVA, names * 4ull) ||
+            !inImage(image, p_exports->OrdinalTableRVA, names * 2ull) ||
+            !inImage(image, p_exports->ExportAddressTableRVA, functions * 4ull))
+        {
+            error = "export tables out of the image";
+            return false;
+        }
+
+        const support::ulittle32_t *p_namesTable = (const support::ulittle32_t *)(p_base + p_exports->NamePointerRVA);
+        const support::ulittle16_t *p_ordinalsTable = (const support::ulittle16_t *)(p_base + p_exports->OrdinalTableRVA);
+        const support::ulittle32_t *p_functionsTable = (const support::ulittle32_t *)(p_base + p_exports->ExportAddressTableRVA);
+
+        image.exports.reserve(names);
+        for (uint32_t i = 0; i < names; i++)
+        {
+            uint32_t nameRVA = p_namesTable[i];
+            if (!inImage(image, nameRVA, 1) || p_ordinalsTable[i] >= functions)
+            {
+                error = "export " + to_string(i) + " out of the image";
+                return false;
+            }
+
+            const char *p_name = (const char *)(p_base + nameRVA);
+            size_t length = strnlen(p_name, image.size - nameRVA);
+            if (length == image.size - nameRVA)
+            {
+                error = "export " + to_string(i) + " has no terminator";
+                return false;
+            }
+
+            image.exports.push_back(PEExport{string(p_name, length), p_functionsTable[p_ordinalsTable[i]]});
+        }
+
+        return true;
+    }
+
+    bool mapPEImage(MemoryBufferRef file, StringRef name, PEImage &image, string &error)
+    {
+        image = PEImage();
+        image.name = name.str();
+
+        Expected<unique_ptr<COFFObjectFile>> coff = COFFObjectFile::create(file);
+        if (!coff)
+        {
+            error = toString(coff.takeError());
+            return false;
+        }
+
+        const pe32plus_header *p_header = coff.get()->getPE32PlusHeader();
+        if (!p_header)
+        {
+            error = "not a PE32+ image";
+            return false;
+        }
+
+        if (!p_header->SizeOfImage || p_header->SizeOfHeaders > p_header->SizeOfImage ||
+            p_header->SizeOfHeaders > file.getBufferSize())
+        {
+            error = "bad image size";
+            return false;
+        }
+
+        error_code ec;
+        image.size = p_header->SizeOfImage;
+        image.memory = sys::OwningMemoryBlock(sys::Memory::allocateMappedMemory(
+            image.size, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, ec));
+        if (ec)
+        {
+            error = ec.message();
+            return false;
+        }
+
+        // Mapped memory comes zeroed, so only the file contents are copied
+        uint8_t *p_base = (uint8_t *)image.base();
+        memcpy(p_base, file.getBufferStart(), p_header->SizeOfHeaders);
+
+        for (const SectionRef &section : coff.get()->sections())
+        {
+            const coff_section *p_section = coff.get()->getCOFFSection(section);
+            uint64_t size = p_section->SizeOfRawData;
+
+            if (p_section->VirtualSize)
+                size = min<uint64_t>(size, p_section->VirtualSize);
+
+            if (!inImage(image, p_section->VirtualAddress, size) ||
+                (uint64_t)p_section->PointerToRawData + size > file.getBufferSize())
+            {
+                error = "section out of the image or the file";
+                return false;
+            }
+
+            memcpy(p_base + p_section->VirtualAddress, file.getBufferStart() + p_section->PointerToRawData, size);
+
+            if (!image.codeRVA && (p_section->Characteristics & COFF::IMAGE_SCN_CNT_CODE))
+            {
+                image.codeRVA = p_section->VirtualAddress;
+                image.codeSize = p_section->SizeOfRawData;
+            }
+        }
+
+        const data_directory *p_exception = coff.get()->getDataDirectory(COFF::EXCEPTION_TABLE);
+        if (p_exception)
+        {
+            image.exceptionRVA = p_exception->RelativeVirtualAddress;
+            image.exceptionSize = p_exception->Size;
+        }
+
+        return readExports(*coff.get(), image, error);
+    }
+
+    bool mapPEFile(StringRef path, PEImage &image, string &error)
+    {
+        ErrorOr<unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path, false, false);
+        if (!buffer)
+        {
+            error = buffer.getError().message();
+            return false;
+        }
+
+        return mapPEImage(buffer.get()->getMemBufferRef(), path, image, error);
+    }
+}
@@ -0,0 +1,148 @@
+/**
+ * @file BatchDriver.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Obfuscates many modules at once, in a single process and over a thread pool.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BATCH_DRIVER_H_
+#define _BATCH_DRIVER_H_
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/MemoryBufferRef.h"
+#include "llvm/Support/JSON.h"
+
+#include "CallObfuscatorPass.h"
+#include "ObfuscationCache.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatordriver
+{
+    struct DriverOptions
+    {
+        string configPath;            // Json config, read once and shared by every module
+        string tables = "fragments";  // fragments: every module apart. module: inputs merged into outputPath
+        string dispatch = "variadic"; // variadic or arity, dispatcher called by the rewritten calls
+        string resolve = "lazy";      // lazy or eager, when the entries are resolved
+        string outputDir;             // Empty to write every output next to its input
+        string outputPath;            // Merged output, only used with module tables
+        bool emitObject = false;      // Objects for the target of each module, instead of bitcode
+        unsigned int optLevel = 0;    // Default pipeline run after the pass (0 for none), and codegen level
+        unsigned int threads = 0;     // Worker threads, 0 for one per core
+        string cacheDir;              // Outputs stored by content, empty to disable the cache
+        string cachePolicy;           // llvm cache pruning policy applied after the batch, empty for none
+        string executablePath;        // Running executable, the cache is tied to it
+    };
+
+    struct ModuleResult
+    {
+        string inputPath;
+        string outputPath;
+        unsigned int inputs = 1; // Inputs merged into this module
+        bool changed = false;    // The pass modified the module
+        double readMs = 0;
+        double obfuscateMs = 0;
+        double optimizeMs = 0;
+        double writeMs = 0;
+        bool cached = false; // Output taken from the cache, nothing was parsed nor obfuscated
+        double savedMs = 0;  // Time the cache saved, from the cost stored with the entry
+        string error;        // Empty on success
+    };
+
+    struct BatchResult
+    {
+        vector<ModuleResult> modules;
+        unsigned int threads = 0;
+        double configMs = 0; // Time to read (or compile) the config
+        double wallMs = 0;   // From the config read to the last module written
+        bool cacheEnabled = false;
+    };
+
+    /**
+     * @brief Obfuscates every input. With fragments tables, each input is read, obfuscated
+     *        and written by a worker, in its own LLVMContext, all of them sharing the config.
+     *        With module tables, the program must have a single table, so the inputs are
+     *        linked into one module first, and processed in the calling thread.
+     *        With a cache dir, outputs are looked up by the content of their inputs, the
+     *        config and the options, and only misses are parsed and obfuscated.
+     *
+     * @param options Driver options.
+     * @param inputs Bitcode (or textual IR) files.
+     * @param result [OUT] Returns the timings of every module. A module failing does not
+     *        stop the others, its error is stored in its result.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return true Every module was processed. False if the batch could not start (bad
+     *         options or config), or if any module failed.
+     */
+    bool runBatch(const DriverOptions &options, ArrayRef<string> inputs, BatchResult &result, string &error);
+
+    /**
+     * @brief Key of the output of the given inputs: their contents, the config, and the
+     *        options the output depends on, and the reference dlls of LLVM_OBF_HINTS (name,
+     *        size and modification time). Used by both the batch and the server.
+     *
+     * @param cache Enabled cache.
+     * @param inputs Input modules, in the order they are linked.
+     * @param configHash Content hash of the config.
+     * @param tables Table layout.
+     * @param dispatch Dispatcher called by the rewritten calls.
+     * @param resolve When the entries are resolved.
+     * @param emitObject Objects are written instead of bitcode.
+     * @param optLevel Optimization level after the pass.
+     * @return string Key, in hex.
+     */
+    string cacheKey(const ObfuscationCache &cache, ArrayRef<MemoryBufferRef> inputs, uint64_t configHash, StringRef tables,
+                    StringRef dispatch, StringRef resolve, bool emitObject, unsigned int optLevel);
+
+    /**
+     * @brief Obfuscates a single module given in memory, as the batch does with every file,
+     *        in a context of its own. Used by the server, for every request.
+     *
+     * @param passOptions Options of the pass, with the config already loaded.
+     * @param name Module identifier, only used in messages.
+     * @param buffer Module bitcode, or textual IR.
+     * @param output [OUT] Returns the obfuscated bitcode.
+     * @param result [OUT] Returns the timings, and the error, if any.
+     * @return true Success.
+     */
+    bool obfuscateBuffer(const callobfuscatorpass::CallObfuscatorPassOptions &passOptions, StringRef name, StringRef buffer,
+                         string &output, ModuleResult &result);
+
+    /**
+     * @brief Builds the json report of a batch: aggregated timings, throughput, and the
+     *        timings of every module.
+     *
+     * @param result Result of runBatch.
+     * @return json::Value Report.
+     */
+    json::Value createReport(const BatchResult &result);
+
+    /**
+     * @return double Modules obfuscated per second of wall time, counting merged inputs apart.
+     */
+    double throughput(const BatchResult &result);
+}
+
+#endif
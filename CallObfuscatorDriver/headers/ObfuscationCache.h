@@ -0,0 +1,124 @@
+/**
+ * @file ObfuscationCache.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Content addressed cache of obfuscated modules.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OBFUSCATION_CACHE_H_
+#define _OBFUSCATION_CACHE_H_
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+
+// Every entry is a file named CACHE_ENTRY_PREFIX<sha256 of the key, in hex>, so it can be
+// pruned by llvm::pruneCache (which only looks at llvmcache-* files).
+//
+// > char[8] magic
+// > u_int32 version
+// > u_int32 flags (CACHE_ENTRY_CHANGED)
+// > u_int64 costMs (double, time spent producing the output, to report the time saved)
+// > char[] output
+//
+// Every value is little endian.
+#define CACHE_ENTRY_PREFIX "llvmcache-callobf-"
+#define CACHE_ENTRY_MAGIC "CALLOBFE"
+#define CACHE_ENTRY_VERSION 1
+#define CACHE_ENTRY_HEADER_SIZE 24
+#define CACHE_ENTRY_CHANGED 1 // The pass modified the module
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatordriver
+{
+    class ObfuscationCache
+    {
+    private:
+        string directory;
+        string salt; // Version of the pass and hash of the running executable
+
+    public:
+        /**
+         * @brief Creates the cache folder, and ties the cache to the running executable, so
+         *        a rebuilt pass never reads entries written by a previous one.
+         *
+         * @param directory Cache folder.
+         * @param executablePath Path of the running executable.
+         * @param error [OUT] Returns the reason of the failure, if any.
+         * @return true Success.
+         */
+        bool init(StringRef directory, StringRef executablePath, string &error);
+
+        /**
+         * @return true init succeeded, so the cache can be used.
+         */
+        bool isEnabled() const;
+
+        /**
+         * @brief Builds the key of an output: the inputs, in order, the config they were
+         *        obfuscated with, and anything else the output depends on.
+         *
+         * @param inputs Contents of the input modules.
+         * @param configHash Content hash of the config.
+         * @param options Options the output depends on (table layout, output kind...).
+         * @return string Key, in hex.
+         */
+        string key(ArrayRef<StringRef> inputs, uint64_t configHash, StringRef options) const;
+
+        /**
+         * @brief Reads the output stored for the given key.
+         *
+         * @param key Key, from key().
+         * @param output [OUT] Returns the output.
+         * @param costMs [OUT] Returns the time it took to produce the output.
+         * @param changed [OUT] Returns whether the pass modified the module.
+         * @return true Hit. False if missing or not a valid entry.
+         */
+        bool lookup(StringRef key, string &output, double &costMs, bool &changed) const;
+
+        /**
+         * @brief Stores an output. The entry is written under a temporary name and then
+         *        renamed, so concurrent readers never see partial entries.
+         *
+         * @param key Key, from key().
+         * @param output Output to store.
+         * @param costMs Time it took to produce the output.
+         * @param changed The pass modified the module.
+         * @return true Success.
+         */
+        bool store(StringRef key, StringRef output, double costMs, bool changed) const;
+
+        /**
+         * @brief Removes entries as given by an llvm cache pruning policy, as in
+         *        "prune_after=24h:cache_size=10%".
+         *
+         * @param policy Pruning policy.
+         * @param error [OUT] Returns the reason of the failure, if any.
+         * @return true Success.
+         */
+        bool prune(StringRef policy, string &error) const;
+    };
+}
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file ObfuscationServer.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Long lived process obfuscating the modules sent by its clients.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OBFUSCATION_SERVER_H_
+#define _OBFUSCATION_SERVER_H_
+
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/JSON.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CallObfuscatorConfig.h"
+#include "ObfuscationCache.h"
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorconfig;
+
+namespace callobfuscatorserver
+{
+    struct ServerOptions
+    {
+        string socketPath;
+        string configPath;            // Reloaded whenever its content changes
+        string tables = "fragments";  // Used by requests not asking for a layout
+        string dispatch = "variadic"; // Dispatcher called by the rewritten calls, variadic or arity
+        string resolve = "lazy";      // When the entries are resolved, lazy or eager
+        unsigned int threads = 0;     // Requests handled at once, 0 for one per core
+        unsigned int idleTimeout = 0; // Seconds without requests before exiting, 0 to never exit
+        unsigned int ioTimeout = 30;  // Seconds a client may stall a read or write, 0 to wait forever
+        string cacheDir;              // Outputs stored by content, empty to disable the cache
+        string cachePolicy;           // llvm cache pruning policy applied on exit, empty for none
+        string executablePath;        // Running executable, the cache is tied to it
+    };
+
+    class ObfuscationServer
+    {
+    private:
+        ServerOptions options;
+        int listenFd = -1;
+        atomic<bool> stopping{false};
+        callobfuscatordriver::ObfuscationCache cache;
+
+        mutex configMutex; // Guards the config and its stamp
+        shared_ptr<const CallObfuscatorConfig> config;
+        uint64_t configHash = 0;
+        sys::TimePoint<> configModified;
+        uint64_t configSize = 0;
+
+        mutex statsMutex; // Guards the stats below
+        vector<double> latenciesMs;
+        uint64_t failedRequests = 0;
+        uint64_t configReloads = 0;
+        uint64_t cacheHits = 0;
+        uint64_t cacheMisses = 0;
+        double cacheSavedMs = 0;
+        chrono::steady_clock::time_point startTime;
+        chrono::steady_clock::time_point lastRequestTime;
+
+    public:
+        ObfuscationServer(ServerOptions options);
+        ~ObfuscationServer();
+
+        /**
+         * @brief Loads the config, opens the cache, if any, and starts listening. Errors are
+         *        reported through errs().
+         *
+         * @return true Success.
+         */
+        bool start();
+
+        /**
+         * @brief Handles requests until a shutdown request, stop() or the idle timeout.
+         *        Each connection is handled by a worker of a thread pool. The cache is
+         *        pruned on exit.
+         */
+        void serve();
+
+        /**
+         * @brief Makes serve() return once the requests being handled are done. Only sets
+         *        a flag, so it can be called from a signal handler.
+         */
+        void stop();
+
+        /**
+         * @brief Stats since the server started: requests, latency percentiles, config
+         *        reloads, cache hits, and memory of the process.
+         *
+         * @return json::Value Stats.
+         */
+        json::Value stats();
+
+    private:
+        /**
+         * @brief Returns the config to use for a request, loading it again if the file
+         *        changed. The file is only hashed when its size or time changed, and only
+         *        loaded when its hash changed.
+         *
+         * @param error [OUT] Returns the reason of the failure, if any.
+         * @param p_contentHash [OUT] Optional, returns the content hash of the config.
+         * @return shared_ptr<const CallObfuscatorConfig> Config, null on failure.
+         */
+        shared_ptr<const CallObfuscatorConfig> currentConfig(string &error, uint64_t *p_contentHash = nullptr);
+
+        /**
+         * @brief Reads a request from the connection, answers it, and closes it.
+         *
+         * @param fd Connected socket.
+         */
+        void handleConnection(int fd);
+
+        /**
+         * @brief Obfuscates the module of a request, or answers with the cached output.
+         *
+         * @return true Success.
+         */
+        bool handleObfuscate(int fd, uint32_t tables, const string &name, const string &payload);
+    };
+}
+
+#endif
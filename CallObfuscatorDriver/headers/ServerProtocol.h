@@ -0,0 +1,145 @@
+/**
+ * @file ServerProtocol.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Messages between the obfuscation server and its clients, over a unix socket.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SERVER_PROTOCOL_H_
+#define _SERVER_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Kept free of LLVM, so the client starts as fast as a process can.
+//
+// A client connects, sends a single request, reads a single response, and closes.
+//
+// > _REQUEST_HEADER {char[4] magic, u_int32 version, u_int32 type, u_int32 tables, u_int64 nameSize, u_int64 payloadSize}
+// > char[nameSize] name (module identifier, only used in messages)
+// > char[payloadSize] payload (module bitcode, or textual IR)
+//
+// > _RESPONSE_HEADER {char[4] magic, u_int32 status, u_int32 changed, u_int32 padding, u_int64 payloadSize}
+// > char[payloadSize] payload (obfuscated bitcode, stats json, or error message)
+//
+// Both ends run on the same host, so values are in native byte order.
+#define LLVM_CALL_OBF_SERVER_SOCKET "LLVM_OBF_SERVER_SOCKET"
+
+#define SERVER_REQUEST_MAGIC "COBQ"
+#define SERVER_RESPONSE_MAGIC "COBR"
+#define SERVER_PROTOCOL_VERSION 1
+
+#define REQUEST_OBFUSCATE 0
+#define REQUEST_STATS 1
+#define REQUEST_SHUTDOWN 2
+
+#define REQUEST_TABLES_DEFAULT 0 // The ones the server was started with
+#define REQUEST_TABLES_FRAGMENTS 1
+#define REQUEST_TABLES_MODULE 2
+
+#define RESPONSE_OK 0
+#define RESPONSE_ERROR 1
+
+#define SERVER_MAX_PAYLOAD_SIZE (1ull << 32)
+
+using namespace std;
+
+namespace callobfuscatorserver
+{
+    struct RequestHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t type;
+        uint32_t tables;
+        uint64_t nameSize;
+        uint64_t payloadSize;
+    };
+
+    struct ResponseHeader
+    {
+        char magic[4];
+        uint32_t status;
+        uint32_t changed;
+        uint32_t padding;
+        uint64_t payloadSize;
+    };
+
+    /**
+     * @brief Writes the whole buffer, retrying on partial writes and interruptions.
+     *
+     * @return true Success.
+     */
+    bool sendAll(int fd, const void *p_buffer, size_t size);
+
+    /**
+     * @brief Reads exactly size bytes, retrying on partial reads and interruptions.
+     *
+     * @return true Success. False on errors, or if the peer closed before size bytes.
+     */
+    bool receiveAll(int fd, void *p_buffer, size_t size);
+
+    /**
+     * @brief Bounds how long a single read or write on the socket may block, so a
+     *        stalled peer makes sendAll and receiveAll fail with EAGAIN.
+     *
+     * @param fd Connected socket.
+     * @param seconds Timeout, 0 to block forever.
+     * @return true Success.
+     */
+    bool setSocketTimeout(int fd, unsigned int seconds);
+
+    /**
+     * @brief Connects to the server listening at the given path.
+     *
+     * @param path Path of the unix socket.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return int Connected socket, -1 on failure.
+     */
+    int connectSocket(const string &path, string &error);
+
+    /**
+     * @brief Creates a unix socket listening at the given path. A leftover socket file
+     *        is replaced, unless a server still answers on it. Fails if the path is
+     *        anything but a socket.
+     *
+     * @param path Path of the unix socket.
+     * @param error [OUT] Returns the reason of the failure, if any.
+     * @return int Listening socket, -1 on failure.
+     */
+    int listenSocket(const string &path, string &error);
+
+    /**
+     * @brief Sends a request with its name and payload.
+     *
+     * @return true Success.
+     */
+    bool sendRequest(int fd, uint32_t type, uint32_t tables, const string &name, const string &payload);
+
+    /**
+     * @brief Sends a response with its payload.
+     *
+     * @return true Success.
+     */
+    bool sendResponse(int fd, uint32_t status, bool changed, const char *p_payload, size_t payloadSize);
+}
+
+#endif
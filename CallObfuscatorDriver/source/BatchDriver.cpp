@@ -0,0 +1,677 @@
+/**
+ * @file BatchDriver.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Obfuscates many modules at once, in a single process and over a thread pool.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BatchDriver.h"
+
+#include "CallObfuscator.h"
+#include "CallObfuscatorPass.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <chrono>
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorpass;
+
+#if LLVM_VERSION_MAJOR >= 18
+using CodeGenLevel = CodeGenOptLevel;
+#define OBJECT_FILE_TYPE CodeGenFileType::ObjectFile
+#else
+using CodeGenLevel = CodeGenOpt::Level;
+#define OBJECT_FILE_TYPE CGFT_ObjectFile
+#endif
+
+namespace callobfuscatordriver
+{
+    static double elapsedMs(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Shared by every worker of a batch
+    struct BatchContext
+    {
+        const DriverOptions &options;
+        CallObfuscatorPassOptions passOptions;
+        ObfuscationCache cache;
+        uint64_t configHash = 0;
+    };
+
+    /**
+     * @brief Target triple of a module, without parsing it, so it is known on cache hits.
+     */
+    static string tripleOf(MemoryBufferRef buffer)
+    {
+        if (isBitcode((const unsigned char *)buffer.getBufferStart(), (const unsigned char *)buffer.getBufferEnd()))
+        {
+            Expected<string> triple = getBitcodeTargetTriple(buffer);
+            if (!triple)
+            {
+                consumeError(triple.takeError());
+                return "";
+            }
+            return *triple;
+        }
+
+        // target triple = "..."
+        StringRef text = buffer.getBuffer();
+        size_t position = text.find("\ntarget triple");
+        if (position == StringRef::npos)
+            return "";
+
+        StringRef line = text.drop_front(position + 1).split('\n').first;
+        return line.split('"').second.split('"').first.str();
+    }
+
+    static string outputPathFor(const DriverOptions &options, StringRef inputPath, StringRef triple)
+    {
+        SmallString<256> path(options.outputDir.empty() ? sys::path::parent_path(inputPath) : StringRef(options.outputDir));
+        sys::path::append(path, sys::path::stem(inputPath));
+
+        if (!options.emitObject)
+            path += ".obf.bc";
+        else
+            path += Triple(triple.empty() ? sys::getDefaultTargetTriple() : triple.str()).isOSWindows() ? ".obj" : ".o";
+
+        return path.str().str();
+    }
+
+    static unique_ptr<TargetMachine> createTargetMachine(const Module &M, unsigned int optLevel, string &error)
+    {
+        string triple = M.getTargetTriple();
+        if (triple.empty())
+            triple = sys::getDefaultTargetTriple();
+
+        const Target *p_target = TargetRegistry::lookupTarget(triple, error);
+        if (!p_target)
+            return nullptr;
+
+        static const CodeGenLevel levels[] = {CodeGenLevel::None, CodeGenLevel::Less, CodeGenLevel::Default, CodeGenLevel::Aggressive};
+
+        return unique_ptr<TargetMachine>(
+            p_target->createTargetMachine(triple, "", "", TargetOptions(), {}, {}, levels[min(optLevel, 3u)]));
+    }
+
+    /**
+     * @brief Runs the pass over a module, and then the default pipeline if requested, with
+     *        analysis managers of its own, so modules can be processed in parallel.
+     */
+    static void obfuscateModule(const DriverOptions &options, const CallObfuscatorPassOptions &passOptions, Module &M,
+                                TargetMachine *p_targetMachine, ModuleResult &result)
+    {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+
+        PassBuilder PB(p_targetMachine);
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        auto start = chrono::steady_clock::now();
+        {
+            ModulePassManager MPM;
+            MPM.addPass(CallObfuscatorPass(passOptions));
+            result.changed = !MPM.run(M, MAM).areAllPreserved();
+        }
+        result.obfuscateMs = elapsedMs(start);
+
+        if (!options.optLevel)
+            return;
+
+        static const OptimizationLevel levels[] = {OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2,
+                                                   OptimizationLevel::O3};
+
+        start = chrono::steady_clock::now();
+        ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(levels[min(options.optLevel, 3u)]);
+        MPM.run(M, MAM);
+        result.optimizeMs = elapsedMs(start);
+    }
+
+    /**
+     * @brief Writes the module as bitcode, or as an object, into memory.
+     */
+    static bool emitModule(const DriverOptions &options, Module &M, TargetMachine *p_targetMachine, SmallVectorImpl<char> &output,
+                           ModuleResult &result)
+    {
+        auto start = chrono::steady_clock::now();
+        raw_svector_ostream out(output);
+
+        if (options.emitObject)
+        {
+            legacy::PassManager codegen;
+            if (p_targetMachine->addPassesToEmitFile(codegen, out, nullptr, OBJECT_FILE_TYPE))
+            {
+                result.error = "Target cant emit objects";
+                return false;
+            }
+
+            codegen.run(M);
+        }
+        else
+        {
+            WriteBitcodeToFile(M, out);
+        }
+
+        result.writeMs += elapsedMs(start);
+        return true;
+    }
+
+    static bool writeOutput(StringRef data, ModuleResult &result)
+    {
+        auto start = chrono::steady_clock::now();
+
+        error_code ec;
+        raw_fd_ostream out(result.outputPath, ec, sys::fs::OF_None);
+        if (ec)
+        {
+            result.error = "Cant open " + result.outputPath + ": " + ec.message();
+            return false;
+        }
+
+        out << data;
+        out.close();
+        if (out.has_error())
+        {
+            out.clear_error();
+            result.error = "Cant write " + result.outputPath;
+            return false;
+        }
+
+        result.writeMs += elapsedMs(start);
+        return true;
+    }
+
+    /**
+     * @brief Obfuscates a module, and emits it. The module has the given context to itself
+     *        (or the caller holds every module sharing it), so only the config is shared.
+     */
+    static bool processModule(const DriverOptions &options, const CallObfuscatorPassOptions &passOptions, Module &M,
+                              SmallVectorImpl<char> &output, ModuleResult &result)
+    {
+        unique_ptr<TargetMachine> targetMachine;
+        if (options.emitObject || options.optLevel)
+        {
+            targetMachine = createTargetMachine(M, options.optLevel, result.error);
+            if (!targetMachine)
+                return false;
+
+            M.setDataLayout(targetMachine->createDataLayout());
+        }
+
+        obfuscateModule(options, passOptions, M, targetMachine.get(), result);
+        return emitModule(options, M, targetMachine.get(), output, result);
+    }
+
+    static bool readInput(StringRef path, unique_ptr<MemoryBuffer> &buffer, ModuleResult &result)
+    {
+        auto start = chrono::steady_clock::now();
+
+        ErrorOr<unique_ptr<MemoryBuffer>> input = MemoryBuffer::getFile(path);
+        if (!input)
+        {
+            result.error = "Could not open input file: " + input.getError().message();
+            return false;
+        }
+
+        buffer = std::move(input.get());
+        result.readMs += elapsedMs(start);
+        return true;
+    }
+
+    static unique_ptr<Module> readModule(MemoryBufferRef buffer, LLVMContext &ctx, ModuleResult &result)
+    {
+        auto start = chrono::steady_clock::now();
+
+#if LLVM_VERSION_MAJOR < 15
+        ctx.enableOpaquePointers(); // The pass creates opaque pointer types
+#endif
+
+        SMDiagnostic diagnostic;
+        unique_ptr<Module> M = parseIR(buffer, diagnostic, ctx);
+        if (!M)
+            result.error = diagnostic.getMessage().str();
+
+        result.readMs += elapsedMs(start);
+        return M;
+    }
+
+    /**
+     * @brief Writes the stored output for the given key, if any.
+     *
+     * @return true Hit, the output was written (or failed to, then the error is set).
+     */
+    static bool useCached(const BatchContext &batch, StringRef key, ModuleResult &result, chrono::steady_clock::time_point start)
+    {
+        string output;
+        double costMs;
+        if (!batch.cache.lookup(key, output, costMs, result.changed))
+            return false;
+
+        result.cached = true;
+        if (writeOutput(output, result))
+            result.savedMs = max(0.0, costMs - elapsedMs(start));
+
+        return true;
+    }
+
+    /**
+     * @brief Describes the reference dlls the pass takes the export hints from: the folder,
+     *        and the name, size and modification time of every file in it, so replacing a
+     *        dll changes the key.
+     */
+    static string hintsKey(StringRef folder)
+    {
+        string key = "hints=" + folder.str();
+        if (folder.empty())
+            return key;
+
+        vector<string> files;
+        error_code ec;
+        for (sys::fs::directory_iterator it(folder, ec), end; it != end && !ec; it.increment(ec))
+        {
+            sys::fs::file_status status;
+            if (sys::fs::status(it->path(), status) || !sys::fs::is_regular_file(status))
+                continue;
+
+            files.push_back(sys::path::filename(it->path()).str() + ":" + to_string(status.getSize()) + ":" +
+                            to_string(status.getLastModificationTime().time_since_epoch().count()));
+        }
+
+        // The order of the listing depends on the file system
+        llvm::sort(files);
+        for (const string &file : files)
+            key += ";dll=" + file;
+
+        return key;
+    }
+
+    string cacheKey(const ObfuscationCache &cache, ArrayRef<MemoryBufferRef> inputs, uint64_t configHash, StringRef tables,
+                    StringRef dispatch, StringRef resolve, bool emitObject, unsigned int optLevel)
+    {
+        // Output paths are left out, so moved modules still hit. Textual IR without a
+        // source_filename takes the identifier as one, which ends in the output. The pass
+        // takes the reference dlls for the export hints from the environment.
+        string options = "tables=" + tables.str() + ";dispatch=" + dispatch.str() + ";resolve=" + resolve.str() +
+                         ";emit-obj=" + to_string(emitObject) + ";O=" + to_string(optLevel) + ";" +
+                         hintsKey(StringRef(getenv(LLVM_CALL_OBF_HINTS)).trim());
+
+        vector<StringRef> contents;
+        for (MemoryBufferRef input : inputs)
+        {
+            contents.push_back(input.getBuffer());
+            if (!isBitcode((const unsigned char *)input.getBufferStart(), (const unsigned char *)input.getBufferEnd()))
+                options += ";source=" + input.getBufferIdentifier().str();
+        }
+
+        return cache.key(contents, configHash, options);
+    }
+
+    bool obfuscateBuffer(const CallObfuscatorPassOptions &passOptions, StringRef name, StringRef buffer, string &output,
+                         ModuleResult &result)
+    {
+        result = ModuleResult();
+        result.inputPath = name.str();
+
+        LLVMContext ctx;
+        unique_ptr<Module> M = readModule(MemoryBufferRef(buffer, name), ctx, result);
+        if (!M)
+            return false;
+
+        obfuscateModule(DriverOptions(), passOptions, *M, nullptr, result);
+
+        auto start = chrono::steady_clock::now();
+        raw_string_ostream out(output);
+        WriteBitcodeToFile(*M, out);
+        out.flush();
+        result.writeMs = elapsedMs(start);
+
+        return true;
+    }
+
+    static void runFragments(const BatchContext &batch, ArrayRef<string> inputs, BatchResult &result)
+    {
+        ThreadPool pool(hardware_concurrency(batch.options.threads));
+        result.threads = pool.getThreadCount();
+        result.modules.resize(inputs.size());
+
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            pool.async(
+                [&batch, &inputs, &result, i]()
+                {
+                    auto start = chrono::steady_clock::now();
+
+                    ModuleResult &moduleResult = result.modules[i];
+                    moduleResult.inputPath = inputs[i];
+
+                    unique_ptr<MemoryBuffer> input;
+                    if (!readInput(inputs[i], input, moduleResult))
+                        return;
+
+                    moduleResult.outputPath = outputPathFor(batch.options, inputs[i], tripleOf(input->getMemBufferRef()));
+
+                    string key;
+                    if (batch.cache.isEnabled())
+                    {
+                        key = cacheKey(batch.cache, {input->getMemBufferRef()}, batch.configHash, batch.options.tables,
+                                       batch.options.dispatch, batch.options.resolve, batch.options.emitObject,
+                                       batch.options.optLevel);
+                        if (useCached(batch, key, moduleResult, start))
+                            return;
+                    }
+
+                    LLVMContext ctx;
+                    unique_ptr<Module> M = readModule(input->getMemBufferRef(), ctx, moduleResult);
+                    if (!M)
+                        return;
+
+                    SmallVector<char, 0> output;
+                    if (!processModule(batch.options, batch.passOptions, *M, output, moduleResult))
+                        return;
+
+                    StringRef outputData(output.data(), output.size());
+                    if (!writeOutput(outputData, moduleResult))
+                        return;
+
+                    if (batch.cache.isEnabled())
+                        batch.cache.store(key, outputData, elapsedMs(start), moduleResult.changed);
+                });
+        }
+
+        pool.wait();
+    }
+
+    static void runMerged(const BatchContext &batch, ArrayRef<string> inputs, BatchResult &result)
+    {
+        auto start = chrono::steady_clock::now();
+
+        result.threads = 1;
+        result.modules.resize(1);
+
+        ModuleResult &moduleResult = result.modules[0];
+        moduleResult.inputPath = inputs[0];
+        moduleResult.inputs = inputs.size();
+        moduleResult.outputPath = batch.options.outputPath;
+
+        vector<unique_ptr<MemoryBuffer>> buffers(inputs.size());
+        vector<MemoryBufferRef> contents;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            if (!readInput(inputs[i], buffers[i], moduleResult))
+            {
+                moduleResult.error = inputs[i] + ": " + moduleResult.error;
+                return;
+            }
+            contents.push_back(buffers[i]->getMemBufferRef());
+        }
+
+        string key;
+        if (batch.cache.isEnabled())
+        {
+            key = cacheKey(batch.cache, contents, batch.configHash, batch.options.tables, batch.options.dispatch,
+                           batch.options.resolve, batch.options.emitObject, batch.options.optLevel);
+            if (useCached(batch, key, moduleResult, start))
+                return;
+        }
+
+        // The default handler exits on linking errors, keep them to report the module instead
+        LLVMContext ctx;
+        ctx.setDiagnosticHandlerCallBack(
+            [](const DiagnosticInfo &diagnostic, void *p_context)
+            {
+                if (diagnostic.getSeverity() != DS_Error)
+                    return;
+
+                string &error = *static_cast<string *>(p_context);
+                raw_string_ostream stream(error);
+                DiagnosticPrinterRawOStream printer(stream);
+                stream << (error.empty() ? "" : ", ");
+                diagnostic.print(printer);
+            },
+            &moduleResult.error);
+
+        unique_ptr<Module> merged = readModule(buffers[0]->getMemBufferRef(), ctx, moduleResult);
+        if (!merged)
+            return;
+
+        Linker linker(*merged);
+        for (size_t i = 1; i < inputs.size(); i++)
+        {
+            unique_ptr<Module> M = readModule(buffers[i]->getMemBufferRef(), ctx, moduleResult);
+            if (!M)
+                return;
+
+            // Linking is part of reading the merged module
+            auto linkStart = chrono::steady_clock::now();
+            bool failed = linker.linkInModule(std::move(M));
+            moduleResult.readMs += elapsedMs(linkStart);
+
+            if (failed)
+            {
+                moduleResult.error = "Cant link " + inputs[i] + ": " + moduleResult.error;
+                return;
+            }
+        }
+
+        SmallVector<char, 0> output;
+        if (!processModule(batch.options, batch.passOptions, *merged, output, moduleResult))
+            return;
+
+        StringRef outputData(output.data(), output.size());
+        if (!writeOutput(outputData, moduleResult))
+            return;
+
+        if (batch.cache.isEnabled())
+            batch.cache.store(key, outputData, elapsedMs(start), moduleResult.changed);
+    }
+
+    bool runBatch(const DriverOptions &options, ArrayRef<string> inputs, BatchResult &result, string &error)
+    {
+        result = BatchResult();
+
+        if (inputs.empty())
+        {
+            error = "No input modules";
+            return false;
+        }
+
+        if (options.tables != "module" && options.tables != "fragments")
+        {
+            error = "Tables must be module or fragments";
+            return false;
+        }
+
+        if (options.dispatch != "variadic" && options.dispatch != "arity")
+        {
+            error = "Dispatch must be variadic or arity";
+            return false;
+        }
+
+        if (options.resolve != "lazy" && options.resolve != "eager")
+        {
+            error = "Resolve must be lazy or eager";
+            return false;
+        }
+
+        if (options.tables == "module" && options.outputPath.empty())
+        {
+            error = "Module tables merge every input, an output file is needed";
+            return false;
+        }
+
+        if (!options.outputDir.empty())
+        {
+            if (error_code ec = sys::fs::create_directories(options.outputDir))
+            {
+                error = "Cant create output dir: " + ec.message();
+                return false;
+            }
+        }
+
+        BatchContext batch{options, CallObfuscatorPassOptions(), ObfuscationCache()};
+
+        if (!options.cacheDir.empty() && !batch.cache.init(options.cacheDir, options.executablePath, error))
+            return false;
+
+        auto start = chrono::steady_clock::now();
+
+        // Read once, every worker only queries it
+        shared_ptr<CallObfuscatorConfig> config = make_shared<CallObfuscatorConfig>();
+        if (!CallObfuscatorPass::loadConfig(options.configPath, *config, &batch.configHash))
+        {
+            error = "Config could not be loaded";
+            return false;
+        }
+
+        result.configMs = elapsedMs(start);
+
+        batch.passOptions.tables = options.tables;
+        batch.passOptions.dispatch = options.dispatch;
+        batch.passOptions.resolve = options.resolve;
+        batch.passOptions.config = config;
+        result.cacheEnabled = batch.cache.isEnabled();
+
+        if (options.tables == "fragments")
+            runFragments(batch, inputs, result);
+        else
+            runMerged(batch, inputs, result);
+
+        result.wallMs = elapsedMs(start);
+
+        if (batch.cache.isEnabled() && !options.cachePolicy.empty() && !batch.cache.prune(options.cachePolicy, error))
+            return false;
+
+        unsigned int failed = 0;
+        for (const ModuleResult &moduleResult : result.modules)
+            failed += !moduleResult.error.empty();
+
+        if (failed)
+        {
+            error = to_string(failed) + " modules failed";
+            return false;
+        }
+
+        return true;
+    }
+
+    double throughput(const BatchResult &result)
+    {
+        unsigned int inputs = 0;
+        for (const ModuleResult &moduleResult : result.modules)
+            inputs += moduleResult.inputs;
+
+        return result.wallMs > 0 ? inputs / (result.wallMs / 1000) : 0;
+    }
+
+    json::Value createReport(const BatchResult &result)
+    {
+        double readMs = 0, obfuscateMs = 0, optimizeMs = 0, writeMs = 0, savedMs = 0;
+        int64_t inputs = 0, changed = 0, hits = 0;
+
+        json::Array modules;
+        for (const ModuleResult &moduleResult : result.modules)
+        {
+            readMs += moduleResult.readMs;
+            obfuscateMs += moduleResult.obfuscateMs;
+            optimizeMs += moduleResult.optimizeMs;
+            writeMs += moduleResult.writeMs;
+            inputs += moduleResult.inputs;
+            changed += moduleResult.changed;
+            hits += moduleResult.cached;
+            savedMs += moduleResult.savedMs;
+
+            json::Object entry{
+                {"input", moduleResult.inputPath},
+                {"output", moduleResult.outputPath},
+                {"inputs", (int64_t)moduleResult.inputs},
+                {"changed", moduleResult.changed},
+                {"read_ms", moduleResult.readMs},
+                {"obfuscate_ms", moduleResult.obfuscateMs},
+                {"optimize_ms", moduleResult.optimizeMs},
+                {"write_ms", moduleResult.writeMs},
+            };
+            if (result.cacheEnabled)
+                entry["cached"] = moduleResult.cached;
+            if (!moduleResult.error.empty())
+                entry["error"] = moduleResult.error;
+
+            modules.push_back(std::move(entry));
+        }
+
+        // Phase times are summed over every worker, so they may add up to more than the wall time
+        json::Object report{
+            {"llvm_version", LLVM_VERSION_STRING},
+            {"threads", (int64_t)result.threads},
+            {"inputs", inputs},
+            {"changed", changed},
+            {"config_ms", result.configMs},
+            {"wall_ms", result.wallMs},
+            {"modules_per_second", throughput(result)},
+            {"read_ms", readMs},
+            {"obfuscate_ms", obfuscateMs},
+            {"optimize_ms", optimizeMs},
+            {"write_ms", writeMs},
+            {"modules", std::move(modules)},
+        };
+
+        if (result.cacheEnabled)
+        {
+            int64_t lookups = result.modules.size();
+            report["cache"] = json::Object{
+                {"hits", hits},
+                {"misses", lookups - hits},
+                {"hit_rate", lookups ? (double)hits / lookups : 0},
+                {"saved_ms", savedMs},
+            };
+        }
+
+        return report;
+    }
+}
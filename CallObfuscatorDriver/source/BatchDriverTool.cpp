@@ -0,0 +1,158 @@
+/**
+ * @file BatchDriverTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Command line entry point of the batch driver.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BatchDriver.h"
+
+#include "CallObfuscator.h"
+#include "CallObfuscatorPass.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatordriver;
+
+static cl::list<string> inputs(cl::Positional, cl::desc("<input bitcode files>"), cl::OneOrMore);
+static cl::opt<string> configPath("config", cl::desc("Json config (defaults to " LLVM_CALL_OBF_CONFIG_PATH ")"));
+static cl::opt<string> tables("tables", cl::desc("Table layout, fragments (every module apart) or module (inputs merged)"),
+                              cl::init("fragments"));
+static cl::opt<string> dispatch("dispatch", cl::desc("Dispatcher for rewritten calls, variadic or arity (one per argument count)"),
+                                cl::init("variadic"));
+static cl::opt<string> resolve("resolve", cl::desc("When entries are resolved, lazy (on first call) or eager (all at startup)"),
+                               cl::init("lazy"));
+static cl::opt<string> outputDir("output-dir", cl::desc("Folder for the outputs (defaults to the folder of each input)"));
+static cl::opt<string> outputPath("o", cl::desc("Output file, only for module tables"));
+static cl::opt<bool> emitObject("emit-obj", cl::desc("Write objects instead of bitcode"));
+static cl::opt<unsigned int> optLevel("O", cl::desc("Optimization level after the pass (0-3), also used for codegen"), cl::Prefix,
+                                      cl::init(0));
+static cl::opt<unsigned int> threads("j", cl::desc("Worker threads (0 for one per core)"), cl::Prefix, cl::init(0));
+static cl::opt<string> cacheDir("cache-dir", cl::desc("Folder to store outputs by content, unchanged inputs skip the pass"));
+static cl::opt<string> cachePolicy("cache-policy",
+                                   cl::desc("Pruning applied to the cache after the batch, as in prune_after=24h:cache_size=10%"));
+static cl::opt<string> reportPath("report", cl::desc("Json report with the timings of every module"));
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator batch driver\n");
+
+    DriverOptions options;
+    options.configPath = configPath;
+    options.tables = tables;
+    options.dispatch = dispatch;
+    options.resolve = resolve;
+    options.outputDir = outputDir;
+    options.outputPath = outputPath;
+    options.emitObject = emitObject;
+    options.optLevel = optLevel;
+    options.threads = threads;
+    options.cacheDir = cacheDir;
+    options.cachePolicy = cachePolicy;
+    options.executablePath = sys::fs::getMainExecutable(argv[0], (void *)&main);
+
+    if (options.configPath.empty())
+    {
+        const char *p_configPath = getenv(LLVM_CALL_OBF_CONFIG_PATH);
+        options.configPath = p_configPath ? p_configPath : "";
+    }
+
+    if (options.configPath.empty())
+    {
+        errs() << "[ERROR] No config given, use -config or set " LLVM_CALL_OBF_CONFIG_PATH " env variable\n";
+        return 1;
+    }
+
+    // Messages of the pass go to outs() as they are produced, so they would mix
+    callobfuscatorpass::CallObfuscatorPass::readVerbosity();
+    if (callobfuscator::verbosity > VERBOSITY_SILENT && options.threads != 1)
+    {
+        errs() << "[INFO] Verbose pass messages, running modules one at a time\n";
+        options.threads = 1;
+    }
+
+    BatchResult result;
+    string error;
+    bool success = runBatch(options, inputs, result, error);
+
+    for (const ModuleResult &moduleResult : result.modules)
+    {
+        if (!moduleResult.error.empty())
+            errs() << "[ERROR] " << moduleResult.inputPath << ": " << moduleResult.error << "\n";
+    }
+
+    if (!success && result.modules.empty())
+    {
+        errs() << "[ERROR] " << error << "\n";
+        return 1;
+    }
+
+    json::Value report = createReport(result);
+    const json::Object *p_report = report.getAsObject();
+
+    errs() << format("[INFO] %lld modules (%lld changed) in %.2f ms with %u threads, %.1f modules/s\n",
+                     (long long)*p_report->getInteger("inputs"), (long long)*p_report->getInteger("changed"), result.wallMs,
+                     result.threads, throughput(result));
+    errs() << format("[INFO]   config %.2f ms, read %.2f ms, obfuscate %.2f ms, optimize %.2f ms, write %.2f ms (summed over threads)\n",
+                     result.configMs, *p_report->getNumber("read_ms"), *p_report->getNumber("obfuscate_ms"),
+                     *p_report->getNumber("optimize_ms"), *p_report->getNumber("write_ms"));
+
+    if (const json::Object *p_cache = p_report->getObject("cache"))
+        errs() << format("[INFO]   cache %lld hits / %zu (%.1f%%), saved %.2f ms\n", (long long)*p_cache->getInteger("hits"),
+                         result.modules.size(), *p_cache->getNumber("hit_rate") * 100, *p_cache->getNumber("saved_ms"));
+
+    if (!reportPath.empty())
+    {
+        error_code ec;
+        raw_fd_ostream out(reportPath, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << "[ERROR] Report could not be written: " << ec.message() << "\n";
+            return 1;
+        }
+
+        out << formatv("{0:2}", report) << "\n";
+    }
+
+    if (!success)
+    {
+        errs() << "[ERROR] " << error << "\n";
+        return 1;
+    }
+
+    return 0;
+}
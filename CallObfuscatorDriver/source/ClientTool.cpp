@@ -0,0 +1,170 @@
+/**
+ * @file ClientTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Sends a module to the obfuscation server, in place of running opt. Does not use LLVM, so it starts fast.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ServerProtocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+using namespace std;
+using namespace callobfuscatorserver;
+
+static const char usage[] =
+    "Usage: CallObfuscatorClient [-socket=<path>] [-tables=fragments|module] <input> -o <output>\n"
+    "       CallObfuscatorClient [-socket=<path>] -stats|-shutdown\n"
+    "\n"
+    "Sends <input> (bitcode or textual IR) to the obfuscation server, and writes the obfuscated bitcode\n"
+    "to <output>. The socket defaults to the " LLVM_CALL_OBF_SERVER_SOCKET " env variable.\n";
+
+static bool readFile(const string &path, string &contents)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+
+    ostringstream buffer;
+    buffer << in.rdbuf();
+    contents = buffer.str();
+    return !in.bad();
+}
+
+static bool writeFile(const string &path, const string &contents)
+{
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(contents.data(), contents.size());
+    out.close();
+    return !out.fail();
+}
+
+int main(int argc, char **argv)
+{
+    string socketPath, inputPath, outputPath;
+    uint32_t type = REQUEST_OBFUSCATE;
+    uint32_t tables = REQUEST_TABLES_DEFAULT;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg.rfind("-socket=", 0) == 0)
+            socketPath = arg.substr(8);
+        else if (arg == "-tables=fragments")
+            tables = REQUEST_TABLES_FRAGMENTS;
+        else if (arg == "-tables=module")
+            tables = REQUEST_TABLES_MODULE;
+        else if (arg == "-stats")
+            type = REQUEST_STATS;
+        else if (arg == "-shutdown")
+            type = REQUEST_SHUTDOWN;
+        else if (arg == "-o" && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (arg.rfind("-o=", 0) == 0)
+            outputPath = arg.substr(3);
+        else if (arg == "-h" || arg == "-help" || arg == "--help")
+        {
+            fputs(usage, stdout);
+            return 0;
+        }
+        else if (arg[0] != '-' && inputPath.empty())
+            inputPath = arg;
+        else
+        {
+            fprintf(stderr, "[ERROR] Unknown argument: %s\n%s", arg.c_str(), usage);
+            return 1;
+        }
+    }
+
+    if (socketPath.empty())
+    {
+        const char *p_socketPath = getenv(LLVM_CALL_OBF_SERVER_SOCKET);
+        socketPath = p_socketPath ? p_socketPath : "";
+    }
+
+    if (socketPath.empty() || (type == REQUEST_OBFUSCATE && (inputPath.empty() || outputPath.empty())))
+    {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    string payload;
+    if (type == REQUEST_OBFUSCATE && !readFile(inputPath, payload))
+    {
+        fprintf(stderr, "[ERROR] Cant read %s\n", inputPath.c_str());
+        return 1;
+    }
+
+    string error;
+    int fd = connectSocket(socketPath, error);
+    if (fd < 0)
+    {
+        fprintf(stderr, "[ERROR] %s\n", error.c_str());
+        return 1;
+    }
+
+    ResponseHeader header;
+    string response;
+
+    bool received = sendRequest(fd, type, tables, inputPath, payload) && receiveAll(fd, &header, sizeof(header)) &&
+                    !memcmp(header.magic, SERVER_RESPONSE_MAGIC, 4) && header.payloadSize <= SERVER_MAX_PAYLOAD_SIZE;
+    if (received)
+    {
+        response.resize(header.payloadSize);
+        received = receiveAll(fd, &response[0], response.size());
+    }
+    close(fd);
+
+    if (!received)
+    {
+        fprintf(stderr, "[ERROR] No valid response from the server\n");
+        return 1;
+    }
+
+    if (header.status != RESPONSE_OK)
+    {
+        fprintf(stderr, "[ERROR] %s: %s\n", inputPath.c_str(), response.c_str());
+        return 1;
+    }
+
+    if (type == REQUEST_STATS)
+    {
+        fwrite(response.data(), 1, response.size(), stdout);
+        fputc('\n', stdout);
+        return 0;
+    }
+
+    if (type == REQUEST_OBFUSCATE && !writeFile(outputPath, response))
+    {
+        fprintf(stderr, "[ERROR] Cant write %s\n", outputPath.c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file ObfuscationCache.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Content addressed cache of obfuscated modules.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ObfuscationCache.h"
+
+#include "CallObfuscatorPass.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatordriver
+{
+    bool ObfuscationCache::init(StringRef directory, StringRef executablePath, string &error)
+    {
+        if (error_code ec = sys::fs::create_directories(directory))
+        {
+            error = "Cant create cache dir: " + ec.message();
+            return false;
+        }
+
+        ErrorOr<unique_ptr<MemoryBuffer>> executable =
+            MemoryBuffer::getFile(executablePath, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!executable)
+        {
+            error = "Cant read " + executablePath.str() + ": " + executable.getError().message();
+            return false;
+        }
+
+        this->directory = directory.str();
+        salt = CALL_OBF_PLUGIN_VERSION "-" + utohexstr(xxHash64(executable.get()->getBuffer()));
+        return true;
+    }
+
+    bool ObfuscationCache::isEnabled() const
+    {
+        return !directory.empty();
+    }
+
+    string ObfuscationCache::key(ArrayRef<StringRef> inputs, uint64_t configHash, StringRef options) const
+    {
+        using namespace support::endian;
+
+        SHA256 hasher;
+        char size[8];
+
+        // Every field goes with its size, so their boundaries are part of the key
+        auto update = [&hasher, &size](StringRef data)
+        {
+            write64le(size, data.size());
+            hasher.update(StringRef(size, 8));
+            hasher.update(data);
+        };
+
+        update(salt);
+        update(options);
+
+        write64le(size, configHash);
+        hasher.update(StringRef(size, 8));
+
+        for (StringRef input : inputs)
+            update(input);
+
+        auto digest = hasher.final();
+        return toHex(digest, /*LowerCase*/ true);
+    }
+
+    bool ObfuscationCache::lookup(StringRef key, string &output, double &costMs, bool &changed) const
+    {
+        using namespace support::endian;
+
+        SmallString<256> path(directory);
+        sys::path::append(path, CACHE_ENTRY_PREFIX + key);
+
+        ErrorOr<unique_ptr<MemoryBuffer>> entry = MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!entry)
+            return false;
+
+        StringRef data = entry.get()->getBuffer();
+        if (data.size() < CACHE_ENTRY_HEADER_SIZE || memcmp(data.data(), CACHE_ENTRY_MAGIC, 8) ||
+            read32le(data.data() + 8) != CACHE_ENTRY_VERSION)
+            return false;
+
+        uint64_t costBits = read64le(data.data() + 16);
+        memcpy(&costMs, &costBits, sizeof(costMs));
+        changed = read32le(data.data() + 12) & CACHE_ENTRY_CHANGED;
+
+        output = data.drop_front(CACHE_ENTRY_HEADER_SIZE).str();
+        return true;
+    }
+
+    bool ObfuscationCache::store(StringRef key, StringRef output, double costMs, bool changed) const
+    {
+        using namespace support::endian;
+
+        SmallString<256> path(directory);
+        sys::path::append(path, CACHE_ENTRY_PREFIX + key);
+
+        char header[CACHE_ENTRY_HEADER_SIZE] = {};
+        uint64_t costBits;
+        memcpy(&costBits, &costMs, sizeof(costBits));
+
+        memcpy(header, CACHE_ENTRY_MAGIC, 8);
+        write32le(header + 8, CACHE_ENTRY_VERSION);
+        write32le(header + 12, changed ? CACHE_ENTRY_CHANGED : 0);
+        write64le(header + 16, costBits);
+
+        // Not named as an entry, so pruning never takes it
+        SmallString<256> tmpModel(directory);
+        sys::path::append(tmpModel, "tmp-" + key + "-%%%%%%%%");
+
+        int fd;
+        SmallString<256> tmpPath;
+        if (sys::fs::createUniqueFile(tmpModel, fd, tmpPath))
+            return false;
+
+        {
+            raw_fd_ostream out(fd, /*shouldClose*/ true);
+            out.write(header, sizeof(header));
+            out << output;
+            out.close();
+
+            if (out.has_error())
+            {
+                out.clear_error();
+                sys::fs::remove(tmpPath);
+                return false;
+            }
+        }
+
+        if (sys::fs::rename(tmpPath, path))
+        {
+            sys::fs::remove(tmpPath);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ObfuscationCache::prune(StringRef policy, string &error) const
+    {
+        Expected<CachePruningPolicy> parsed = parseCachePruningPolicy(policy);
+        if (!parsed)
+        {
+            error = "Bad cache policy: " + toString(parsed.takeError());
+            return false;
+        }
+
+        pruneCache(directory, *parsed);
+        return true;
+    }
+}
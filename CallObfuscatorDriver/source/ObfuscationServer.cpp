@@ -0,0 +1,389 @@
+/**
+ * @file ObfuscationServer.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Long lived process obfuscating the modules sent by its clients.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ObfuscationServer.h"
+
+#include "BatchDriver.h"
+#include "CallObfuscatorPass.h"
+#include "ServerProtocol.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define POLL_INTERVAL_MS 200 // How often serve() checks stop() and the idle timeout
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatordriver;
+using namespace callobfuscatorpass;
+
+namespace callobfuscatorserver
+{
+    static double elapsedMs(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    static uint64_t residentSetKb()
+    {
+        ErrorOr<unique_ptr<MemoryBuffer>> statm = MemoryBuffer::getFileAsStream("/proc/self/statm");
+        if (!statm)
+            return 0;
+
+        uint64_t residentPages = 0;
+        StringRef fields = statm.get()->getBuffer();
+        if (fields.split(' ').second.split(' ').first.getAsInteger(10, residentPages))
+            return 0;
+
+        return residentPages * sys::Process::getPageSizeEstimate() / 1024;
+    }
+
+    static uint64_t peakResidentSetKb()
+    {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage))
+            return 0;
+
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // Bytes there
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+
+    ObfuscationServer::ObfuscationServer(ServerOptions options) : options(std::move(options))
+    {
+        startTime = lastRequestTime = chrono::steady_clock::now();
+    }
+
+    ObfuscationServer::~ObfuscationServer()
+    {
+        if (listenFd < 0)
+            return;
+
+        close(listenFd);
+        unlink(options.socketPath.c_str());
+    }
+
+    bool ObfuscationServer::start()
+    {
+        string error;
+        if (!currentConfig(error))
+        {
+            errs() << "[ERROR] " << error << "\n";
+            return false;
+        }
+
+        if (!options.cacheDir.empty() && !cache.init(options.cacheDir, options.executablePath, error))
+        {
+            errs() << "[ERROR] " << error << "\n";
+            return false;
+        }
+
+        listenFd = listenSocket(options.socketPath, error);
+        if (listenFd < 0)
+        {
+            errs() << "[ERROR] " << error << "\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    void ObfuscationServer::stop()
+    {
+        stopping = true;
+    }
+
+    shared_ptr<const CallObfuscatorConfig> ObfuscationServer::currentConfig(string &error, uint64_t *p_contentHash)
+    {
+        lock_guard<mutex> lock(configMutex);
+
+        sys::fs::file_status status;
+        if (error_code ec = sys::fs::status(options.configPath, status))
+        {
+            error = "Config file could not be read: " + ec.message();
+            return nullptr;
+        }
+
+        if (config && status.getLastModificationTime() == configModified && status.getSize() == configSize)
+        {
+            if (p_contentHash)
+                *p_contentHash = configHash;
+            return config;
+        }
+
+        ErrorOr<unique_ptr<MemoryBuffer>> buffer =
+            MemoryBuffer::getFile(options.configPath, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!buffer)
+        {
+            error = "Config file could not be read: " + buffer.getError().message();
+            return nullptr;
+        }
+
+        // Touched but not changed, as when a build system regenerates it
+        uint64_t contentHash = CallObfuscatorConfig::hashContent(buffer.get()->getBuffer());
+        if (!config || contentHash != configHash)
+        {
+            shared_ptr<CallObfuscatorConfig> loaded = make_shared<CallObfuscatorConfig>();
+            if (!CallObfuscatorPass::loadConfig(options.configPath, *loaded))
+            {
+                error = "Config could not be loaded";
+                return nullptr;
+            }
+
+            if (config)
+            {
+                errs() << "[INFO] Config changed, reloaded: " << options.configPath << "\n";
+                lock_guard<mutex> statsLock(statsMutex);
+                configReloads++;
+            }
+
+            config = std::move(loaded);
+            configHash = contentHash;
+        }
+
+        configModified = status.getLastModificationTime();
+        configSize = status.getSize();
+        if (p_contentHash)
+            *p_contentHash = configHash;
+        return config;
+    }
+
+    bool ObfuscationServer::handleObfuscate(int fd, uint32_t tables, const string &name, const string &payload)
+    {
+        auto start = chrono::steady_clock::now();
+
+        string error;
+        uint64_t configHash;
+        CallObfuscatorPassOptions passOptions;
+        passOptions.config = currentConfig(error, &configHash);
+
+        if (!passOptions.config)
+        {
+            sendResponse(fd, RESPONSE_ERROR, false, error.data(), error.size());
+            return false;
+        }
+
+        passOptions.tables = options.tables;
+        if (tables == REQUEST_TABLES_FRAGMENTS)
+            passOptions.tables = "fragments";
+        else if (tables == REQUEST_TABLES_MODULE)
+            passOptions.tables = "module";
+
+        passOptions.dispatch = options.dispatch;
+        passOptions.resolve = options.resolve;
+
+        string key, output;
+        if (cache.isEnabled())
+        {
+            double costMs;
+            bool changed;
+            key = cacheKey(cache, {MemoryBufferRef(payload, name)}, configHash, passOptions.tables, passOptions.dispatch,
+                           passOptions.resolve, false, 0);
+
+            if (cache.lookup(key, output, costMs, changed))
+            {
+                {
+                    lock_guard<mutex> lock(statsMutex);
+                    cacheHits++;
+                    cacheSavedMs += max(0.0, costMs - elapsedMs(start));
+                }
+                return sendResponse(fd, RESPONSE_OK, changed, output.data(), output.size());
+            }
+
+            lock_guard<mutex> lock(statsMutex);
+            cacheMisses++;
+        }
+
+        ModuleResult result;
+        if (!obfuscateBuffer(passOptions, name, payload, output, result))
+        {
+            sendResponse(fd, RESPONSE_ERROR, false, result.error.data(), result.error.size());
+            return false;
+        }
+
+        if (cache.isEnabled())
+            cache.store(key, output, elapsedMs(start), result.changed);
+
+        return sendResponse(fd, RESPONSE_OK, result.changed, output.data(), output.size());
+    }
+
+    void ObfuscationServer::handleConnection(int fd)
+    {
+        auto start = chrono::steady_clock::now();
+        bool success = false;
+
+        RequestHeader header;
+        string name, payload;
+
+        bool received = receiveAll(fd, &header, sizeof(header));
+        if (!received && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            static const char message[] = "Request timed out";
+            sendResponse(fd, RESPONSE_ERROR, false, message, sizeof(message) - 1);
+        }
+        else if (!received || memcmp(header.magic, SERVER_REQUEST_MAGIC, 4) ||
+                 header.version != SERVER_PROTOCOL_VERSION || header.nameSize > SERVER_MAX_PAYLOAD_SIZE ||
+                 header.payloadSize > SERVER_MAX_PAYLOAD_SIZE)
+        {
+            static const char message[] = "Malformed request";
+            sendResponse(fd, RESPONSE_ERROR, false, message, sizeof(message) - 1);
+        }
+        else if (header.type == REQUEST_STATS)
+        {
+            string statsJson;
+            raw_string_ostream out(statsJson);
+            out << formatv("{0:2}", stats());
+            out.flush();
+
+            sendResponse(fd, RESPONSE_OK, false, statsJson.data(), statsJson.size());
+            close(fd);
+            return; // Not counted as a request
+        }
+        else if (header.type == REQUEST_SHUTDOWN)
+        {
+            stop();
+            sendResponse(fd, RESPONSE_OK, false, nullptr, 0);
+            close(fd);
+            return;
+        }
+        else
+        {
+            name.resize(header.nameSize);
+            payload.resize(header.payloadSize);
+
+            if (receiveAll(fd, &name[0], name.size()) && receiveAll(fd, &payload[0], payload.size()))
+                success = handleObfuscate(fd, header.tables, name, payload);
+        }
+
+        close(fd);
+
+        lock_guard<mutex> lock(statsMutex);
+        latenciesMs.push_back(elapsedMs(start));
+        failedRequests += !success;
+        lastRequestTime = chrono::steady_clock::now();
+    }
+
+    void ObfuscationServer::serve()
+    {
+        ThreadPool pool(hardware_concurrency(options.threads));
+
+        pollfd listenPoll = {listenFd, POLLIN, 0};
+        while (!stopping)
+        {
+            int ready = poll(&listenPoll, 1, POLL_INTERVAL_MS);
+            if (ready < 0 && errno != EINTR)
+            {
+                errs() << "[ERROR] Cant wait for connections: " << strerror(errno) << "\n";
+                break;
+            }
+
+            if (ready <= 0)
+            {
+                if (!options.idleTimeout)
+                    continue;
+
+                lock_guard<mutex> lock(statsMutex);
+                if (chrono::steady_clock::now() - lastRequestTime > chrono::seconds(options.idleTimeout))
+                {
+                    errs() << "[INFO] Idle for " << options.idleTimeout << " seconds, exiting\n";
+                    break;
+                }
+                continue;
+            }
+
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+
+            // A stalled client would hold its thread, and pool.wait() on exit, forever
+            if (!setSocketTimeout(fd, options.ioTimeout))
+                errs() << "[ERROR] Cant set the timeout of a connection: " << strerror(errno) << "\n";
+
+            pool.async([this, fd]()
+                       { handleConnection(fd); });
+        }
+
+        pool.wait();
+
+        string error;
+        if (cache.isEnabled() && !options.cachePolicy.empty() && !cache.prune(options.cachePolicy, error))
+            errs() << "[ERROR] " << error << "\n";
+    }
+
+    json::Value ObfuscationServer::stats()
+    {
+        lock_guard<mutex> lock(statsMutex);
+
+        vector<double> sorted = latenciesMs;
+        llvm::sort(sorted);
+
+        auto percentile = [&sorted](double fraction)
+        { return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, (size_t)(fraction * sorted.size()))]; };
+
+        double totalMs = 0;
+        for (double latency : sorted)
+            totalMs += latency;
+
+        return json::Object{
+            {"requests", (int64_t)sorted.size()},
+            {"failed", (int64_t)failedRequests},
+            {"config_reloads", (int64_t)configReloads},
+            {"uptime_s", elapsedMs(startTime) / 1000},
+            {"latency_ms",
+             json::Object{
+                 {"mean", sorted.empty() ? 0.0 : totalMs / sorted.size()},
+                 {"p50", percentile(0.5)},
+                 {"p95", percentile(0.95)},
+                 {"p99", percentile(0.99)},
+                 {"max", sorted.empty() ? 0.0 : sorted.back()},
+             }},
+            {"cache",
+             json::Object{
+                 {"enabled", cache.isEnabled()},
+                 {"hits", (int64_t)cacheHits},
+                 {"misses", (int64_t)cacheMisses},
+                 {"hit_rate", cacheHits + cacheMisses ? (double)cacheHits / (cacheHits + cacheMisses) : 0.0},
+                 {"saved_ms", cacheSavedMs},
+             }},
+            {"rss_kb", (int64_t)residentSetKb()},
+            {"peak_rss_kb", (int64_t)peakResidentSetKb()},
+        };
+    }
+}
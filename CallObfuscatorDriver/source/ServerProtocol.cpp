@@ -0,0 +1,208 @@
+/**
+ * @file ServerProtocol.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Messages between the obfuscation server and its clients, over a unix socket.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ServerProtocol.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Not everywhere, the server ignores SIGPIPE anyway
+#endif
+
+using namespace std;
+
+namespace callobfuscatorserver
+{
+    bool sendAll(int fd, const void *p_buffer, size_t size)
+    {
+        const char *p_data = static_cast<const char *>(p_buffer);
+
+        while (size)
+        {
+            ssize_t written = send(fd, p_data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            p_data += written;
+            size -= written;
+        }
+
+        return true;
+    }
+
+    bool receiveAll(int fd, void *p_buffer, size_t size)
+    {
+        char *p_data = static_cast<char *>(p_buffer);
+
+        while (size)
+        {
+            ssize_t received = recv(fd, p_data, size, 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                return false;
+
+            p_data += received;
+            size -= received;
+        }
+
+        return true;
+    }
+
+    bool setSocketTimeout(int fd, unsigned int seconds)
+    {
+        timeval timeout = {(time_t)seconds, 0};
+
+        return !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) &&
+               !setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    static bool socketAddress(const string &path, sockaddr_un &address, string &error)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+        {
+            error = "Socket path is empty or too long: " + path;
+            return false;
+        }
+
+        memcpy(address.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    int connectSocket(const string &path, string &error)
+    {
+        sockaddr_un address;
+        if (!socketAddress(path, address, error))
+            return -1;
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            error = string("Cant create socket: ") + strerror(errno);
+            return -1;
+        }
+
+        if (connect(fd, (sockaddr *)&address, sizeof(address)))
+        {
+            error = "Cant connect to " + path + ": " + strerror(errno);
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    int listenSocket(const string &path, string &error)
+    {
+        sockaddr_un address;
+        if (!socketAddress(path, address, error))
+            return -1;
+
+        // A socket file left by a server that died is only a file, but a live one must be kept
+        string connectError;
+        int probe = connectSocket(path, connectError);
+        if (probe >= 0)
+        {
+            close(probe);
+            error = "A server is already listening at " + path;
+            return -1;
+        }
+
+        // Only a stale socket is removed, any other file at the path is left alone
+        struct stat status;
+        if (!lstat(path.c_str(), &status))
+        {
+            if (!S_ISSOCK(status.st_mode))
+            {
+                error = "Cant listen at " + path + ": it exists and is not a socket";
+                return -1;
+            }
+
+            if (unlink(path.c_str()))
+            {
+                error = "Cant remove the stale socket " + path + ": " + strerror(errno);
+                return -1;
+            }
+        }
+        else if (errno != ENOENT)
+        {
+            error = "Cant check " + path + ": " + strerror(errno);
+            return -1;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            error = string("Cant create socket: ") + strerror(errno);
+            return -1;
+        }
+
+        if (bind(fd, (sockaddr *)&address, sizeof(address)) || listen(fd, SOMAXCONN))
+        {
+            error = "Cant listen at " + path + ": " + strerror(errno);
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    bool sendRequest(int fd, uint32_t type, uint32_t tables, const string &name, const string &payload)
+    {
+        RequestHeader header;
+        memcpy(header.magic, SERVER_REQUEST_MAGIC, 4);
+        header.version = SERVER_PROTOCOL_VERSION;
+        header.type = type;
+        header.tables = tables;
+        header.nameSize = name.size();
+        header.payloadSize = payload.size();
+
+        return sendAll(fd, &header, sizeof(header)) && sendAll(fd, name.data(), name.size()) &&
+               sendAll(fd, payload.data(), payload.size());
+    }
+
+    bool sendResponse(int fd, uint32_t status, bool changed, const char *p_payload, size_t payloadSize)
+    {
+        ResponseHeader header;
+        memcpy(header.magic, SERVER_RESPONSE_MAGIC, 4);
+        header.status = status;
+        header.changed = changed;
+        header.padding = 0;
+        header.payloadSize = payloadSize;
+
+        return sendAll(fd, &header, sizeof(header)) && sendAll(fd, p_payload, payloadSize);
+    }
+}
@@ -0,0 +1,171 @@
+/**
+ * @file ServerTool.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Command line entry point of the obfuscation server.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ObfuscationServer.h"
+
+#include "CallObfuscator.h"
+#include "CallObfuscatorPass.h"
+#include "ServerProtocol.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <csignal>
+#include <cstdlib>
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscatorserver;
+
+static cl::opt<string> socketPath("socket", cl::desc("Unix socket to listen at (defaults to " LLVM_CALL_OBF_SERVER_SOCKET ")"));
+static cl::opt<string> configPath("config", cl::desc("Json config (defaults to " LLVM_CALL_OBF_CONFIG_PATH ")"));
+static cl::opt<string> tables("tables", cl::desc("Table layout for requests not asking for one, fragments or module"),
+                              cl::init("fragments"));
+static cl::opt<string> dispatch("dispatch", cl::desc("Dispatcher for rewritten calls, variadic or arity (one per argument count)"),
+                                cl::init("variadic"));
+static cl::opt<string> resolve("resolve", cl::desc("When entries are resolved, lazy (on first call) or eager (all at startup)"),
+                               cl::init("lazy"));
+static cl::opt<unsigned int> threads("j", cl::desc("Requests handled at once (0 for one per core)"), cl::Prefix, cl::init(0));
+static cl::opt<unsigned int> idleTimeout("idle-timeout", cl::desc("Seconds without requests before exiting (0 to never exit)"),
+                                         cl::init(0));
+static cl::opt<unsigned int> ioTimeout("io-timeout",
+                                       cl::desc("Seconds a client may stall sending or reading, before its request fails (0 to wait forever)"),
+                                       cl::init(30));
+static cl::opt<string> cacheDir("cache-dir", cl::desc("Folder to store outputs by content, repeated requests skip the pass"));
+static cl::opt<string> cachePolicy("cache-policy",
+                                   cl::desc("Pruning applied to the cache on exit, as in prune_after=24h:cache_size=10%"));
+static cl::opt<string> reportPath("report", cl::desc("Json file to write the stats to, on exit"));
+
+static ObfuscationServer *p_server = nullptr;
+
+static void stopServer(int)
+{
+    if (p_server)
+        p_server->stop();
+}
+
+static string fromEnv(const string &value, const char *p_name)
+{
+    if (!value.empty())
+        return value;
+
+    const char *p_value = getenv(p_name);
+    return p_value ? p_value : "";
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM init(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Call obfuscator compile server\n");
+
+    ServerOptions options;
+    options.socketPath = fromEnv(socketPath, LLVM_CALL_OBF_SERVER_SOCKET);
+    options.configPath = fromEnv(configPath, LLVM_CALL_OBF_CONFIG_PATH);
+    options.tables = tables;
+    options.dispatch = dispatch;
+    options.resolve = resolve;
+    options.threads = threads;
+    options.idleTimeout = idleTimeout;
+    options.ioTimeout = ioTimeout;
+    options.cacheDir = cacheDir;
+    options.cachePolicy = cachePolicy;
+    options.executablePath = sys::fs::getMainExecutable(argv[0], (void *)&main);
+
+    if (options.socketPath.empty() || options.configPath.empty())
+    {
+        errs() << "[ERROR] Socket and config are required, use -socket and -config, or set " LLVM_CALL_OBF_SERVER_SOCKET
+                  " and " LLVM_CALL_OBF_CONFIG_PATH " env variables\n";
+        return 1;
+    }
+
+    if (options.tables != "fragments" && options.tables != "module")
+    {
+        errs() << "[ERROR] Tables must be fragments or module\n";
+        return 1;
+    }
+
+    if (options.dispatch != "variadic" && options.dispatch != "arity")
+    {
+        errs() << "[ERROR] Dispatch must be variadic or arity\n";
+        return 1;
+    }
+
+    if (options.resolve != "lazy" && options.resolve != "eager")
+    {
+        errs() << "[ERROR] Resolve must be lazy or eager\n";
+        return 1;
+    }
+
+    // Messages of the pass go to outs() as they are produced, so they would mix
+    callobfuscatorpass::CallObfuscatorPass::readVerbosity();
+    if (callobfuscator::verbosity > VERBOSITY_SILENT && options.threads != 1)
+    {
+        errs() << "[INFO] Verbose pass messages, handling requests one at a time\n";
+        options.threads = 1;
+    }
+
+    ObfuscationServer server(options);
+    if (!server.start())
+        return 1;
+
+    // Without SA_RESTART, so poll() returns on signals
+    struct sigaction action = {};
+    action.sa_handler = stopServer;
+    p_server = &server;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN); // Clients may go away before reading the response
+
+    errs() << "[INFO] Listening at " << options.socketPath << "\n";
+    server.serve();
+    p_server = nullptr;
+
+    json::Value stats = server.stats();
+    const json::Object *p_stats = stats.getAsObject();
+    const json::Object *p_latency = p_stats->getObject("latency_ms");
+
+    errs() << format("[INFO] %lld requests (%lld failed), latency p50 %.2f ms, p95 %.2f ms, max %.2f ms, peak rss %lld KB\n",
+                     (long long)*p_stats->getInteger("requests"), (long long)*p_stats->getInteger("failed"),
+                     *p_latency->getNumber("p50"), *p_latency->getNumber("p95"), *p_latency->getNumber("max"),
+                     (long long)*p_stats->getInteger("peak_rss_kb"));
+
+    if (!reportPath.empty())
+    {
+        error_code ec;
+        raw_fd_ostream out(reportPath, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << "[ERROR] Report could not be written: " << ec.message() << "\n";
+            return 1;
+        }
+
+        out << formatv("{0:2}", stats) << "\n";
+    }
+
+    return 0;
+}
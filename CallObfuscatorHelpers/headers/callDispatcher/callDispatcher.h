@@ -27,6 +27,7 @@
 
 #include "common/common.h"
 #include "common/wintypes/typedefs.h"
+#include "callDispatcher/entryState.h"
 #include "stackSpoof/stackSpoof.h"
 
 // ==============================================================================
@@ -37,20 +38,31 @@ typedef struct _DLL_TABLE_ENTRY
 {
     PCHAR name;
     PVOID handle;
+    PVOID exportIndex; // Slot of the EXPORT_INDEX of the dll, built on its first lookup, see exportIndex.h
+    DWORD hash;        // Of the name, computed by the pass
+    DWORD __padding;
 } DLL_TABLE_ENTRY, *PDLL_TABLE_ENTRY;
 
+// Everything needed to dispatch a call once the function is loaded. 16 bytes, and the
+// tables keep them 16 byte aligned, so each call only touches one cache line. The rest of
+// the fields are only read once state is ENTRY_STATE_READY, and never written after.
 typedef struct _FUNCTION_TABLE_ENTRY
 {
-    DWORD hash;
-    DWORD moduleIndex;
-    DWORD argCount;
-    DWORD ssn; // As any other time that ssn is defined as a 4byte value, the
-               // lower bytes are set to either 0xFF or 0x00, and it means if
-               // it is actually a valid ssn. So we can check if the function
-               // is a syscall by checking if any of thos bits are set to 1.
     PVOID functionPtr;
+    WORD ssn;
+    BYTE argCount;
+    BYTE flags; // FUNCTION_ENTRY_* flags
+    DWORD state; // ENTRY_STATE_*, only accessed through ENTRY_STATE_PTR
 } FUNCTION_TABLE_ENTRY, *PFUNCTION_TABLE_ENTRY;
 
+// Only needed to load the function, the first time it is called
+typedef struct _FUNCTION_LOAD_ENTRY
+{
+    DWORD hash;
+    WORD moduleIndex;
+    WORD exportHint; // EXPORT_HINT_*, see __callobf_getFunctionAddrHintedH. Names past 65535 get none
+} FUNCTION_LOAD_ENTRY, *PFUNCTION_LOAD_ENTRY;
+
 typedef struct _DLL_TABLE
 {
     DWORD count;
@@ -58,22 +70,94 @@ typedef struct _DLL_TABLE
     DLL_TABLE_ENTRY entries[];
 } DLL_TABLE, *PDLL_TABLE;
 
+// Aligned to a cache line by the pass, with the entries right after the header. The load
+// entries go apart, in __callobf_functionLoadTable, in the same order.
 typedef struct _FUNCTION_TABLE
 {
     DWORD count;
-    DWORD __padding;
+    DWORD __padding[3];
     FUNCTION_TABLE_ENTRY entries[];
 } FUNCTION_TABLE, *PFUNCTION_TABLE;
+
+// Entry emitted by modules obfuscated in fragments mode. Each one lives in its own
+// COMDAT inside FRAGMENT_SECTION, and the linker merges them between the markers.
+// 16 byte aligned, and 32 bytes long, so they are laid out without gaps.
+typedef struct _FUNCTION_FRAGMENT
+{
+    FUNCTION_TABLE_ENTRY entry;
+    DWORD hash;
+    DWORD exportHint;
+    PDLL_TABLE_ENTRY p_dllEntry;
+} FUNCTION_FRAGMENT, *PFUNCTION_FRAGMENT;
 #pragma pack(pop)
 
+// ==============================================================================
+// ============================= MACRO DEFINITIONS ==============================
+
+// The function is a syscall, functionPtr points to a syscall instruction, and ssn is set
+#define FUNCTION_ENTRY_SYSCALL 0x1
+
+// State of an entry, for the functions in entryState.h. Entries are packed, but always 16
+// byte aligned, so the state is 4 byte aligned and atomics on it need no lock.
+#define ENTRY_STATE_PTR(p_fEntry) ((volatile DWORD *)(PVOID)(&(p_fEntry)->state))
+
+// Alignment of the function table, and of every fragment
+#define FUNCTION_TABLE_ALIGNMENT 64
+#define FUNCTION_FRAGMENT_ALIGNMENT 16
+
+// Sections are sorted by the text after $, so entries (.callobf$m) end up between the markers
+#define FRAGMENT_START_SECTION ".callobf$a"
+#define FRAGMENT_END_SECTION ".callobf$z"
+
+// Built with __CALLOBF_EAGER, the dispatchers have no lazy load branch: every entry must have
+// been resolved by __callobf_resolveFunctions before the first call, as the constructor the
+// pass emits with resolve=eager does. Calls to entries left unresolved fail.
+
+// Highest argument count with a fixed arity dispatcher, calls with more arguments use the
+// variadic one, which reads stack arguments in place instead of copying them. Must match
+// CALL_DISPATCHER_MAX_ARITY in the pass.
+#define CALL_DISPATCHER_MAX_ARITY 4
+
+// Parameters (after the index or entry) and arguments of the fixed arity dispatchers. Every
+// argument is widened to a register by the pass, as the variadic convention would do.
+#define DISPATCHER_PARAMS_0
+#define DISPATCHER_PARAMS_1 DISPATCHER_PARAMS_0, ULONG_PTR arg0
+#define DISPATCHER_PARAMS_2 DISPATCHER_PARAMS_1, ULONG_PTR arg1
+#define DISPATCHER_PARAMS_3 DISPATCHER_PARAMS_2, ULONG_PTR arg2
+#define DISPATCHER_PARAMS_4 DISPATCHER_PARAMS_3, ULONG_PTR arg3
+
+#define DISPATCHER_ARGS_0
+#define DISPATCHER_ARGS_1 DISPATCHER_ARGS_0 arg0,
+#define DISPATCHER_ARGS_2 DISPATCHER_ARGS_1 arg1,
+#define DISPATCHER_ARGS_3 DISPATCHER_ARGS_2 arg2,
+#define DISPATCHER_ARGS_4 DISPATCHER_ARGS_3 arg3,
+
+// Applies macro to every arity with a fixed arity dispatcher
+#define FOR_EACH_DISPATCHER_ARITY(macro) \
+    macro(0) \
+    macro(1) \
+    macro(2) \
+    macro(3) \
+    macro(4)
+
 // ==============================================================================
 // =============================== GLOBALS ======================================
 
+// Markers delimiting the function entries of every module obfuscated in fragments mode
+extern FUNCTION_FRAGMENT __callobf_fragmentsStart;
+extern FUNCTION_FRAGMENT __callobf_fragmentsEnd;
+
 // ==============================================================================
 // =========================== EXTERNAL GLOBALS =================================
 
-extern DLL_TABLE __callobf_dllTable;
-extern FUNCTION_TABLE __callobf_functionTable;
+// Weak, since programs made only of modules obfuscated in fragments mode dont define them
+extern DLL_TABLE __callobf_dllTable __attribute__((weak));
+extern FUNCTION_TABLE __callobf_functionTable __attribute__((weak));
+extern FUNCTION_LOAD_ENTRY __callobf_functionLoadTable[] __attribute__((weak));
+
+// Where LoadLibraryA is, emitted by the pass: its index in the function table, or its fragment
+extern DWORD __callobf_loadLibraryIndex __attribute__((weak));
+extern PFUNCTION_FRAGMENT __callobf_loadLibraryFragment __attribute__((weak));
 
 // ==============================================================================
 // =========================== EXTERNAL FUNCTIONS ===============================
@@ -120,15 +204,62 @@ extern void *__callobf_doCall(
  */
 void *__callobf_callDispatcher(DWORD32 index, ...);
 
+/**
+ * @brief Same as __callobf_callDispatcher, for modules obfuscated in fragments mode,
+ *        where calls reference their function entry directly.
+ *
+ * @param p_fragment Function entry, as emitted by the pass.
+ * @param ... Function call arguments.
+ * @return void* Return value of the replaced function.
+ */
+void *__callobf_callDispatcherFragment(PFUNCTION_FRAGMENT p_fragment, ...);
+
+/**
+ * @brief Same as __callobf_callDispatcher, for calls with exactly n arguments. Emitted by
+ *        the pass when dispatching by arity, arguments are taken as they come in, and the
+ *        argument count is a constant, so there is no va_list to walk.
+ *
+ * @param index Index to the function table.
+ * @param ... The n function call arguments, each one widened to ULONG_PTR.
+ * @return void* Return value of the replaced function.
+ */
+#define DECLARE_ARITY_DISPATCHER(n) void *__callobf_callDispatcher##n(DWORD32 index DISPATCHER_PARAMS_##n);
+FOR_EACH_DISPATCHER_ARITY(DECLARE_ARITY_DISPATCHER)
+
+/**
+ * @brief Same as __callobf_callDispatcherFragment, for calls with exactly n arguments.
+ *
+ * @param p_fragment Function entry, as emitted by the pass.
+ * @param ... The n function call arguments, each one widened to ULONG_PTR.
+ * @return void* Return value of the replaced function.
+ */
+#define DECLARE_ARITY_FRAGMENT_DISPATCHER(n) void *__callobf_callDispatcherFragment##n(PFUNCTION_FRAGMENT p_fragment DISPATCHER_PARAMS_##n);
+FOR_EACH_DISPATCHER_ARITY(DECLARE_ARITY_FRAGMENT_DISPATCHER)
+
+/**
+ * @brief Resolves every function entry at once, from the module tables and from the
+ *        fragments, instead of each one on its first call. Entries are grouped by dll,
+ *        so the exports of each dll are walked a single time. Entries already loaded
+ *        are skipped, so it can be called more than once. Called at startup by the
+ *        constructor the pass emits with resolve=eager.
+ *
+ * @return BOOL TRUE if every entry was resolved.
+ */
+BOOL __callobf_resolveFunctions(void);
+
 // ==============================================================================
 // =========================== PRIVATE  FUNCTIONS ===============================
 
 /**
- * @brief Given a function entry, loads all it non initialized fields.
+ * @brief Given a function entry, loads all it non initialized fields. Must only be
+ *        called by the thread owning the entry, see entryState.h.
  *
  * @param p_fEntry Pointer to a function table entry.
+ * @param hash Hash of the function name.
+ * @param exportHint Hint of the pass on where the name is in the exports, checked before taking it.
+ * @param p_dllEntry Pointer to the entry of the dll exporting the function.
  * @return void* Pointer to function, or NULL.
  */
-void *__callobf_loadFunction(PFUNCTION_TABLE_ENTRY p_fEntry);
+void *__callobf_loadFunction(PFUNCTION_TABLE_ENTRY p_fEntry, DWORD32 hash, DWORD exportHint, PDLL_TABLE_ENTRY p_dllEntry);
 
 #endif
\ No newline at end of file
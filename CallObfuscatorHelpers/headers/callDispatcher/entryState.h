@@ -0,0 +1,124 @@
+/**
+ * @file entryState.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Once initialization of function entries, safe to race on from any thread.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ENTRY_STATE_H_
+#define _ENTRY_STATE_H_
+
+// Only uses DWORD, BOOL and PVOID, which must be declared before including it (common/common.h
+// does). Nothing else from the helpers is needed, so the host stress test includes it alone.
+
+// ==============================================================================
+// ============================= MACRO DEFINITIONS ==============================
+
+// Every entry starts uninitialized (as emitted by the pass). A single thread moves it to
+// resolving, fills it, and then publishes it as ready, or leaves it uninitialized again if it
+// could not be resolved, so a later call retries. Once ready, the entry is never written again.
+#define ENTRY_STATE_UNINITIALIZED 0
+#define ENTRY_STATE_RESOLVING 1
+#define ENTRY_STATE_READY 2
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENTRY_STATE_SPIN() __builtin_ia32_pause()
+#else
+#define ENTRY_STATE_SPIN()
+#endif
+
+// ==============================================================================
+// ============================ STRUCT DEFINITIONS ==============================
+
+/**
+ * @brief Fills an entry, called by the thread that owns it.
+ *
+ * @param p_ctx Context given to __callobf_resolveEntryOnce.
+ * @return BOOL TRUE if the entry was filled.
+ */
+typedef BOOL (*ENTRY_RESOLVER)(PVOID p_ctx);
+
+// ==============================================================================
+// ============================ PUBLIC  FUNCTIONS ===============================
+
+/**
+ * @brief Checks if an entry is ready. Everything written to the entry before it was
+ *        published can be read after this returns TRUE.
+ *
+ * @param p_state Pointer to the state of the entry.
+ * @return BOOL TRUE if ready.
+ */
+static inline BOOL __callobf_isEntryReady(volatile DWORD *p_state)
+{
+    return __atomic_load_n(p_state, __ATOMIC_ACQUIRE) == ENTRY_STATE_READY;
+}
+
+/**
+ * @brief Takes an uninitialized entry to fill it, without waiting.
+ *
+ * @param p_state Pointer to the state of the entry.
+ * @return BOOL TRUE if the entry is now owned by this thread, and must be released.
+ */
+static inline BOOL __callobf_tryAcquireEntry(volatile DWORD *p_state)
+{
+    DWORD expected = ENTRY_STATE_UNINITIALIZED;
+    return __atomic_compare_exchange_n(p_state, &expected, ENTRY_STATE_RESOLVING, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Releases an entry taken with __callobf_tryAcquireEntry.
+ *
+ * @param p_state Pointer to the state of the entry.
+ * @param ready TRUE to publish the entry, FALSE to leave it uninitialized.
+ */
+static inline void __callobf_releaseEntry(volatile DWORD *p_state, BOOL ready)
+{
+    __atomic_store_n(p_state, ready ? ENTRY_STATE_READY : ENTRY_STATE_UNINITIALIZED, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Makes sure an entry is ready, filling it with resolver if no other thread is,
+ *        or waiting for the one that is. If that thread fails, this one tries again.
+ *
+ * @param p_state Pointer to the state of the entry.
+ * @param resolver Fills the entry.
+ * @param p_ctx Passed to resolver.
+ * @return BOOL TRUE if the entry is ready, FALSE if resolver failed in this thread.
+ */
+static inline BOOL __callobf_resolveEntryOnce(volatile DWORD *p_state, ENTRY_RESOLVER resolver, PVOID p_ctx)
+{
+    BOOL ready;
+
+    while (!__callobf_isEntryReady(p_state))
+    {
+        if (__callobf_tryAcquireEntry(p_state))
+        {
+            ready = resolver(p_ctx);
+            __callobf_releaseEntry(p_state, ready);
+            return ready;
+        }
+
+        ENTRY_STATE_SPIN();
+    }
+
+    return TRUE;
+}
+
+#endif
@@ -32,7 +32,6 @@
 // ============================= MACRO DEFINITIONS ==============================
 
 // Constants:
-#define HASH_MULTIPLIER 37
 #define RAND_SEED 123456
 
 // Utils:
@@ -122,16 +121,19 @@ PVOID __callobf_getStackBase();
 PVOID __callobf_getStackLimit();
 
 /**
- * @brief Sets last error to given value.
+ * @brief Sets the last error of the calling thread, kept in its TEB, where GetLastError
+ *        reads it. No thread local storage is needed, which the helpers can not set up.
  *
- * @param error 0 for success, 1 for error.
+ * @param error 0 to clear it. The dispatchers set 1 (ERROR_INVALID_FUNCTION) when a call
+ *              could not be made.
  * @return VOID
  */
 VOID __callobf_setLastError(DWORD32 error);
 
 /**
- * @brief Returns the las value set by __callobf_setLastError
- *        0 means success, eny other case means error.
+ * @brief Returns the last error of the calling thread. As with windows functions, the
+ *        dispatchers only set it on failure: it is only meaningful after a dispatcher
+ *        returned NULL, or if it was cleared before the call.
  * @return DWORD32  error
  */
 DWORD32 __callobf_getLastError();
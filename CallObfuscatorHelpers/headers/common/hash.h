@@ -0,0 +1,260 @@
+/**
+ * @file hash.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Hash of the names of dlls and functions, shared by the helpers (C) and by the
+ *        pass (C++, where every function is constexpr).
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _HASH_H_
+#define _HASH_H_
+
+// Only needs the freestanding headers, and nothing from windows, so the pass and the host
+// tools include it alone.
+#include <stddef.h>
+#include <stdint.h>
+
+// ==============================================================================
+// ============================= MACRO DEFINITIONS ==============================
+
+// h = HASH_MULTIPLIER * h + c for each character, ascii letters lowercased, truncated to 32 bits
+#define HASH_MULTIPLIER 37
+
+// Four steps at once: h * m^4 + c0 * m^3 + c1 * m^2 + c2 * m + c3. The multiplications do not
+// depend on each other, so they are not chained as in four single steps
+#define HASH_MULTIPLIER_2 (HASH_MULTIPLIER * HASH_MULTIPLIER)
+#define HASH_MULTIPLIER_3 (HASH_MULTIPLIER_2 * HASH_MULTIPLIER)
+#define HASH_MULTIPLIER_4 (HASH_MULTIPLIER_3 * HASH_MULTIPLIER)
+
+#define HASH_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+
+// Hashes the helpers use without the pass. They must stay integer constants for C, so they are
+// written by hand, and checked against the name in the list below by every C++ file including
+// this header.
+#define NTDLL_HASH 0xE59C2120
+#define KERNEL32_HASH 0x70B456D4
+#define KERNELBASE_HASH 0xBD145C12
+
+#define MESSAGEBOXA_HASH 0x35FC1883
+#define LOADLIBRARYA_HASH 0x15E7E6C2
+#define BASETRHEADINITTHUNK_HASH 0xA2EC03A5
+#define RTLUSERTHREADSTART_HASH 0x362F51AF
+
+#define KNOWN_HASHES(X)                                 \
+    X(NTDLL_HASH, "ntdll.dll")                          \
+    X(KERNEL32_HASH, "kernel32.dll")                    \
+    X(KERNELBASE_HASH, "kernelbase.dll")                \
+    X(MESSAGEBOXA_HASH, "MessageBoxA")                  \
+    X(LOADLIBRARYA_HASH, "LoadLibraryA")                \
+    X(BASETRHEADINITTHUNK_HASH, "BaseThreadInitThunk")  \
+    X(RTLUSERTHREADSTART_HASH, "RtlUserThreadStart")
+
+#ifdef __cplusplus
+#define HASH_FUNCTION static constexpr
+#else
+#define HASH_FUNCTION static inline
+#endif
+
+// Wide characters are 16 bits on windows, the host tools use the same width
+#ifdef _WIN32
+typedef wchar_t HASH_WCHAR;
+#else
+typedef uint16_t HASH_WCHAR;
+#endif
+
+// ==============================================================================
+// ============================ PUBLIC  FUNCTIONS ===============================
+
+/**
+ * @brief Adds one character to the hash.
+ *
+ * @param h Hash of the previous characters.
+ * @param c Character, already lowercased and widened.
+ * @return uint32_t Hash with the character.
+ */
+HASH_FUNCTION uint32_t __callobf_hashStep(uint32_t h, int32_t c)
+{
+    return (uint32_t)HASH_MULTIPLIER * h + (uint32_t)c;
+}
+
+/**
+ * @brief Adds four characters to the hash, same as four calls to __callobf_hashStep.
+ *
+ * @param h Hash of the previous characters.
+ * @param c0 First character, already lowercased and widened.
+ * @param c1 Second character.
+ * @param c2 Third character.
+ * @param c3 Fourth character.
+ * @return uint32_t Hash with the characters.
+ */
+HASH_FUNCTION uint32_t __callobf_hashStep4(uint32_t h, int32_t c0, int32_t c1, int32_t c2, int32_t c3)
+{
+    return (uint32_t)HASH_MULTIPLIER_4 * h + (uint32_t)HASH_MULTIPLIER_3 * (uint32_t)c0 +
+           (uint32_t)HASH_MULTIPLIER_2 * (uint32_t)c1 + (uint32_t)HASH_MULTIPLIER * (uint32_t)c2 + (uint32_t)c3;
+}
+
+/**
+ * @brief Widens and lowercases an ascii character. Characters are signed, as CHAR is on
+ *        windows, whatever the signedness of char on the host running the pass.
+ *
+ * @param c Character.
+ * @return int32_t Value added to the hash.
+ */
+HASH_FUNCTION int32_t __callobf_hashCharA(char c)
+{
+    return HASH_LOWER((int32_t)(signed char)c);
+}
+
+/**
+ * @brief Widens and lowercases a wide character.
+ *
+ * @param c Character.
+ * @return int32_t Value added to the hash.
+ */
+HASH_FUNCTION int32_t __callobf_hashCharW(HASH_WCHAR c)
+{
+    return HASH_LOWER((int32_t)(uint16_t)c);
+}
+
+/**
+ * @brief Adds a NULL terminated string to the hash, four characters per step. Each
+ *        character is only read once the previous one is known not to be the terminator.
+ *
+ * @param h Hash of the previous characters, 0 to hash the string alone.
+ * @param p_str NULL terminated string.
+ * @return uint32_t Hash with the string.
+ */
+HASH_FUNCTION uint32_t __callobf_hashContinueA(uint32_t h, const char *p_str)
+{
+    for (;; p_str += 4)
+    {
+        if (!p_str[0])
+            return h;
+        if (!p_str[1])
+            return __callobf_hashStep(h, __callobf_hashCharA(p_str[0]));
+        if (!p_str[2])
+            return __callobf_hashStep(__callobf_hashStep(h, __callobf_hashCharA(p_str[0])), __callobf_hashCharA(p_str[1]));
+        if (!p_str[3])
+            return __callobf_hashStep(
+                __callobf_hashStep(__callobf_hashStep(h, __callobf_hashCharA(p_str[0])), __callobf_hashCharA(p_str[1])),
+                __callobf_hashCharA(p_str[2]));
+
+        h = __callobf_hashStep4(h, __callobf_hashCharA(p_str[0]), __callobf_hashCharA(p_str[1]),
+                                __callobf_hashCharA(p_str[2]), __callobf_hashCharA(p_str[3]));
+    }
+}
+
+/**
+ * @brief Adds length characters to the hash, four per step.
+ *
+ * @param h Hash of the previous characters, 0 to hash the string alone.
+ * @param p_str Characters, the terminator is not needed.
+ * @param length Number of characters.
+ * @return uint32_t Hash with the characters.
+ */
+HASH_FUNCTION uint32_t __callobf_hashContinueLengthA(uint32_t h, const char *p_str, size_t length)
+{
+    for (; length >= 4; length -= 4, p_str += 4)
+        h = __callobf_hashStep4(h, __callobf_hashCharA(p_str[0]), __callobf_hashCharA(p_str[1]),
+                                __callobf_hashCharA(p_str[2]), __callobf_hashCharA(p_str[3]));
+
+    for (; length; length--, p_str++)
+        h = __callobf_hashStep(h, __callobf_hashCharA(*p_str));
+
+    return h;
+}
+
+/**
+ * @brief Same as __callobf_hashContinueA, for wide strings.
+ *
+ * @param h Hash of the previous characters, 0 to hash the string alone.
+ * @param p_str NULL terminated wide string.
+ * @return uint32_t Hash with the string.
+ */
+HASH_FUNCTION uint32_t __callobf_hashContinueW(uint32_t h, const HASH_WCHAR *p_str)
+{
+    for (;; p_str += 4)
+    {
+        if (!p_str[0])
+            return h;
+        if (!p_str[1])
+            return __callobf_hashStep(h, __callobf_hashCharW(p_str[0]));
+        if (!p_str[2])
+            return __callobf_hashStep(__callobf_hashStep(h, __callobf_hashCharW(p_str[0])), __callobf_hashCharW(p_str[1]));
+        if (!p_str[3])
+            return __callobf_hashStep(
+                __callobf_hashStep(__callobf_hashStep(h, __callobf_hashCharW(p_str[0])), __callobf_hashCharW(p_str[1])),
+                __callobf_hashCharW(p_str[2]));
+
+        h = __callobf_hashStep4(h, __callobf_hashCharW(p_str[0]), __callobf_hashCharW(p_str[1]),
+                                __callobf_hashCharW(p_str[2]), __callobf_hashCharW(p_str[3]));
+    }
+}
+
+/**
+ * @brief Same as __callobf_hashContinueLengthA, for wide strings.
+ *
+ * @param h Hash of the previous characters, 0 to hash the string alone.
+ * @param p_str Wide characters, the terminator is not needed.
+ * @param length Number of characters (not bytes).
+ * @return uint32_t Hash with the characters.
+ */
+HASH_FUNCTION uint32_t __callobf_hashContinueLengthW(uint32_t h, const HASH_WCHAR *p_str, size_t length)
+{
+    for (; length >= 4; length -= 4, p_str += 4)
+        h = __callobf_hashStep4(h, __callobf_hashCharW(p_str[0]), __callobf_hashCharW(p_str[1]),
+                                __callobf_hashCharW(p_str[2]), __callobf_hashCharW(p_str[3]));
+
+    for (; length; length--, p_str++)
+        h = __callobf_hashStep(h, __callobf_hashCharW(*p_str));
+
+    return h;
+}
+
+/**
+ * @brief Hash of a NULL terminated string. In C++ it can be taken at compile time.
+ *
+ * @param p_str NULL terminated string.
+ * @return uint32_t 32 bit value representing the string.
+ */
+HASH_FUNCTION uint32_t __callobf_hashStringA(const char *p_str)
+{
+    return __callobf_hashContinueA(0, p_str);
+}
+
+/**
+ * @brief Hash of length characters, as the pass takes it from the names in the module.
+ *
+ * @param p_str Characters, the terminator is not needed.
+ * @param length Number of characters.
+ * @return uint32_t 32 bit value representing the string.
+ */
+HASH_FUNCTION uint32_t __callobf_hashLengthA(const char *p_str, size_t length)
+{
+    return __callobf_hashContinueLengthA(0, p_str, length);
+}
+
+#ifdef __cplusplus
+#define CHECK_KNOWN_HASH(constant, name) \
+    static_assert(__callobf_hashStringA(name) == (constant), #constant " is not the hash of " name);
+KNOWN_HASHES(CHECK_KNOWN_HASH)
+#undef CHECK_KNOWN_HASH
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * @file exportIndex.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Index of the exported names of a module, to find functions by hash without
+ *        walking and hashing every name.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EXPORT_INDEX_H_
+#define _EXPORT_INDEX_H_
+
+#include "common/common.h"
+#include "common/wintypes/typedefs.h"
+
+// ==============================================================================
+// ============================= MACRO DEFINITIONS ==============================
+
+// Indexes are taken from a static arena, there is no heap to use. 8 bytes per exported
+// name, so the default fits around 16k names (ntdll and kernel32 together are ~4.5k).
+// Once full, the modules left are looked up walking their names, as without an index.
+#ifndef EXPORT_INDEX_ARENA_SIZE
+#define EXPORT_INDEX_ARENA_SIZE 0x20000
+#endif
+
+// Values of an index slot besides a pointer to the index (NULL until first used)
+#define EXPORT_INDEX_BUILDING ((PVOID)1)  // Being built by another thread
+#define EXPORT_INDEX_NONE ((PVOID)-1)     // No exports, or no room left in the arena
+
+// ==============================================================================
+// ============================ STRUCT DEFINITIONS ==============================
+
+#pragma pack(push, 1)
+typedef struct _EXPORT_INDEX_ENTRY
+{
+    DWORD hash;
+    DWORD rva;
+} EXPORT_INDEX_ENTRY, *PEXPORT_INDEX_ENTRY;
+
+// Entries sorted by hash, one per hash. Names sharing a hash keep the first one in
+// AddressOfNames, the one a walk of the names would find.
+typedef struct _EXPORT_INDEX
+{
+    PVOID p_module;
+    DWORD count;
+    DWORD collisions; // Names dropped for sharing the hash of a previous one
+    EXPORT_INDEX_ENTRY entries[];
+} EXPORT_INDEX, *PEXPORT_INDEX;
+#pragma pack(pop)
+
+// ==============================================================================
+// ============================ PUBLIC  FUNCTIONS ===============================
+
+/**
+ * @brief Returns the size of the index of a module, to build it with
+ *        __callobf_buildExportIndex.
+ *
+ * @param p_module Pointer to module to index.
+ * @return DWORD Size in bytes, or 0 if the module exports no names.
+ */
+DWORD __callobf_getExportIndexSize(const PVOID p_module);
+
+/**
+ * @brief Hashes every exported name of a module once, and sorts them into an index.
+ *
+ * @param p_module Pointer to module to index.
+ * @param p_buffer Where the index is built, 8 byte aligned.
+ * @param bufferSize Size of p_buffer, at least __callobf_getExportIndexSize.
+ * @return PEXPORT_INDEX The index (at p_buffer), or NULL if the module exports no
+ *                       names or the buffer is too small.
+ */
+PEXPORT_INDEX __callobf_buildExportIndex(
+    const PVOID p_module,
+    PVOID p_buffer,
+    const DWORD bufferSize);
+
+/**
+ * @brief Finds a function in an index, with a binary search over the hashes.
+ *
+ * @param p_index Index of the module exporting the function.
+ * @param functionHash Function hash.
+ * @return PVOID Pointer to function if found, else NULL.
+ */
+PVOID __callobf_findExportH(
+    const PEXPORT_INDEX p_index,
+    const UINT32 functionHash);
+
+/**
+ * @brief Returns the index of a module kept in a slot. The first call for a slot builds
+ *        it in the arena, calls from other threads meanwhile dont wait for it.
+ *
+ * @param p_module Pointer to module indexed.
+ * @param pp_index Slot of the index of p_module, NULL until the first call.
+ * @return PEXPORT_INDEX The index, or NULL if it is being built, or could not be built.
+ */
+PEXPORT_INDEX __callobf_getExportIndex(
+    const PVOID p_module,
+    PVOID *pp_index);
+
+/**
+ * @brief Same as __callobf_getFunctionAddrH, through the index of the module kept in
+ *        a slot (see __callobf_getExportIndex). Walks the names when there is no index.
+ *
+ * @param p_module Pointer to module to search in.
+ * @param pp_index Slot of the index of p_module, NULL until the first call.
+ * @param functionHash Function hash.
+ * @return PVOID Pointer to function if found, else NULL.
+ */
+PVOID __callobf_getFunctionAddrIndexedH(
+    const PVOID p_module,
+    PVOID *pp_index,
+    const UINT32 functionHash);
+
+#endif
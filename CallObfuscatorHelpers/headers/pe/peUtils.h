@@ -32,6 +32,20 @@
 extern PTEB NtCurrentTeb(void);
 #endif
 
+/**
+ * @brief Called by __callobf_forEachExportH for every exported name.
+ *
+ * @param nameHash Hash of the exported name.
+ * @param p_function Pointer to the exported function.
+ * @param p_ctx Context given to __callobf_forEachExportH.
+ * @return BOOL TRUE to keep walking the exports, FALSE to stop.
+ */
+typedef BOOL (*EXPORT_CALLBACK)(UINT32 nameHash, PVOID p_function, PVOID p_ctx);
+
+// Export hint of a function the pass found no reference dll for. Any other hint is
+// 1 + the index of the name in AddressOfNames of the reference dll.
+#define EXPORT_HINT_NONE 0
+
 // ==============================================================================
 // ============================ PUBLIC  FUNCTIONS ===============================
 
@@ -96,6 +110,35 @@ PVOID __callobf_getFunctionAddrH(
     const PVOID p_module,
     const UINT32 funtionHash);
 
+/**
+ * @brief Takes the export the pass hinted, if the name there has the given hash. The dll
+ *        may not be the one the hint was taken from, so it is only a guess, but checking
+ *        it costs a single hash, no matter how many names the dll exports.
+ *
+ * @param p_module Pointer to module to search in.
+ * @param functionHash Function hash.
+ * @param exportHint Hint of the pass, or EXPORT_HINT_NONE.
+ * @return PVOID Pointer to function if the hint is right, else NULL.
+ */
+PVOID __callobf_getFunctionAddrHintedH(
+    const PVOID p_module,
+    const UINT32 functionHash,
+    const DWORD exportHint);
+
+/**
+ * @brief Walks the exported names of a module once, hashing each of them, so many
+ *        functions can be looked up for the cost of a single lookup.
+ *
+ * @param p_module Pointer to module to walk.
+ * @param callback Called for every exported name, until it returns FALSE.
+ * @param p_ctx Passed to every call to callback.
+ * @return BOOL TRUE if the module has an export directory.
+ */
+BOOL __callobf_forEachExportH(
+    const PVOID p_module,
+    EXPORT_CALLBACK callback,
+    PVOID p_ctx);
+
 /**
  * @brief Returns the exception directory address if any.
  *
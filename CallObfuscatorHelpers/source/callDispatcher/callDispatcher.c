@@ -25,73 +25,132 @@
 #include "callDispatcher/callDispatcher.h"
 #include "common/commonUtils.h"
 #include "pe/peUtils.h"
+#include "pe/exportIndex.h"
 #include "syscalls/syscalls.h"
 #include "common/debug.h"
 
-HMODULE __callobf_loadLibrary(PCHAR p_dllName)
+// Layout shared with the pass, see createFunctionTableEntryType and insertFragments
+CASSERT((sizeof(FUNCTION_TABLE_ENTRY) == 16));
+CASSERT((sizeof(FUNCTION_LOAD_ENTRY) == 8));
+CASSERT((sizeof(FUNCTION_TABLE) == 16));
+CASSERT((sizeof(FUNCTION_FRAGMENT) == 32));
+CASSERT((sizeof(DLL_TABLE_ENTRY) == 32));
+
+// Markers delimiting the fragments merged by the linker, aligned as the pass aligns the entries
+__attribute__((section(FRAGMENT_START_SECTION), aligned(FUNCTION_FRAGMENT_ALIGNMENT))) FUNCTION_FRAGMENT __callobf_fragmentsStart = {0};
+__attribute__((section(FRAGMENT_END_SECTION), aligned(FUNCTION_FRAGMENT_ALIGNMENT))) FUNCTION_FRAGMENT __callobf_fragmentsEnd = {0};
+
+// Entries of a dll still pending while its exports are walked by __callobf_resolveFunctions
+typedef struct _RESOLVE_CTX
 {
-    DWORD loadLibraryIndex = -1;
+    PDLL_TABLE_ENTRY p_dllEntry;
+    DWORD pending;
+} RESOLVE_CTX, *PRESOLVE_CTX;
 
-    if (!p_dllName)
-        return NULL;
+// What __callobf_loadFunction needs, for the thread that gets to resolve the entry
+typedef struct _LOAD_CTX
+{
+    PFUNCTION_TABLE_ENTRY p_fEntry;
+    DWORD32 hash;
+    DWORD exportHint;
+    PDLL_TABLE_ENTRY p_dllEntry;
+} LOAD_CTX, *PLOAD_CTX;
 
-    for (DWORD i = 0; i < __callobf_functionTable.count; i++)
-        if (__callobf_functionTable.entries[i].hash == LOADLIBRARYA_HASH)
-            loadLibraryIndex = i;
+static __attribute__((noinline)) void *__callobf_loadTableFunction(DWORD32 index);
+static __attribute__((noinline)) void *__callobf_loadFragmentFunction(PFUNCTION_FRAGMENT p_fragment);
 
-    if (loadLibraryIndex == (DWORD)-1)
-        return NULL;
+// The lazy load branch of the dispatchers, gone when every entry is resolved at startup
+#ifdef __CALLOBF_EAGER
+#define LOAD_TABLE_FUNCTION(index) NULL
+#define LOAD_FRAGMENT_FUNCTION(p_fragment) NULL
+#else
+#define LOAD_TABLE_FUNCTION(index) __callobf_loadTableFunction(index)
+#define LOAD_FRAGMENT_FUNCTION(p_fragment) __callobf_loadFragmentFunction(p_fragment)
+#endif
 
-    return __callobf_callDispatcher(loadLibraryIndex, p_dllName);
+// Function of the entry if it is ready, else NULL. A single load on x64, as reading the pointer was
+static inline __attribute__((always_inline)) PVOID __callobf_readyFunction(PFUNCTION_TABLE_ENTRY p_fEntry)
+{
+    return __callobf_isEntryReady(ENTRY_STATE_PTR(p_fEntry)) ? p_fEntry->functionPtr : NULL;
 }
 
-void *__callobf_loadFunction(PFUNCTION_TABLE_ENTRY p_fEntry)
+HMODULE __callobf_loadLibrary(PCHAR p_dllName)
 {
-    PDLL_TABLE_ENTRY p_dllEntry = NULL;
-    DWORD32 moduleHash = 0;
-    USHORT ssn = 0;
-    PVOID p_function = NULL;
-    BOOL isSyscall = FALSE;
+    PFUNCTION_FRAGMENT p_fragment = NULL;
 
-    if (!p_fEntry)
+    if (!p_dllName)
         return NULL;
 
-    p_dllEntry = &__callobf_dllTable.entries[p_fEntry->moduleIndex];
-    moduleHash = __callobf_hashA(p_dllEntry->name);
+    // Loaded here, so dlls can be loaded while resolving the entries, even without the lazy load branch
+    if (&__callobf_loadLibraryIndex && &__callobf_functionTable && __callobf_loadLibraryIndex < __callobf_functionTable.count)
+    {
+        if (!__callobf_readyFunction(&__callobf_functionTable.entries[__callobf_loadLibraryIndex]) &&
+            !__callobf_loadTableFunction(__callobf_loadLibraryIndex))
+            return NULL;
+        return __callobf_callDispatcher(__callobf_loadLibraryIndex, p_dllName);
+    }
 
-    DEBUG_PRINT("Loading function: %lX", p_fEntry->hash);
+    if (&__callobf_loadLibraryFragment && (p_fragment = __callobf_loadLibraryFragment))
+    {
+        if (!__callobf_readyFunction(&p_fragment->entry) && !__callobf_loadFragmentFunction(p_fragment))
+            return NULL;
+        return __callobf_callDispatcherFragment(p_fragment, p_dllName);
+    }
 
+    return NULL;
+}
+
+static PVOID __callobf_loadDll(PDLL_TABLE_ENTRY p_dllEntry)
+{
+    // Threads resolving functions of the same dll may both load it, getting the same handle
     if (!p_dllEntry->handle)
     {
         DEBUG_PRINT("Loading module: %s", p_dllEntry->name);
-        p_dllEntry->handle = __callobf_getModuleAddrH(moduleHash);
+        p_dllEntry->handle = __callobf_getModuleAddrH(p_dllEntry->hash);
         if (!p_dllEntry->handle)
             p_dllEntry->handle = __callobf_loadLibrary(p_dllEntry->name);
     }
 
-    if (!p_dllEntry->handle)
+    return p_dllEntry->handle;
+}
+
+void *__callobf_loadFunction(PFUNCTION_TABLE_ENTRY p_fEntry, DWORD32 hash, DWORD exportHint, PDLL_TABLE_ENTRY p_dllEntry)
+{
+    USHORT ssn = 0;
+    PVOID p_function = NULL;
+    BOOL isSyscall = FALSE;
+
+    if (!p_fEntry || !p_dllEntry)
+        return NULL;
+
+    DEBUG_PRINT("Loading function: %lX", hash);
+
+    if (!__callobf_loadDll(p_dllEntry))
     {
         DEBUG_PRINT("Error, couldnt load dll");
         return NULL;
     }
 
     p_fEntry->ssn = 0;
-    if (moduleHash == NTDLL_HASH)
+    p_fEntry->flags = 0;
+    if (p_dllEntry->hash == NTDLL_HASH)
     {
         DEBUG_PRINT("Is ntdll");
-        if (__callobf_loadSyscall(p_fEntry->hash, p_dllEntry->handle, &ssn, &p_function))
+        if (__callobf_loadSyscall(hash, p_dllEntry->handle, &ssn, &p_function))
         {
             isSyscall = TRUE;
 
-            p_fEntry->ssn = (((DWORD32)ssn) | 0xFFFF0000);
+            p_fEntry->ssn = ssn;
+            p_fEntry->flags = FUNCTION_ENTRY_SYSCALL;
             p_fEntry->functionPtr = p_function;
 
-            DEBUG_PRINT("Loaded function 0x%08lX as syscall with ssn 0x%04X at %p", p_fEntry->hash, ssn, p_function);
+            DEBUG_PRINT("Loaded function 0x%08lX as syscall with ssn 0x%04X at %p", hash, ssn, p_function);
         }
     };
 
-    if (!isSyscall)
-        p_fEntry->functionPtr = __callobf_getFunctionAddrH(p_dllEntry->handle, p_fEntry->hash);
+    // The hint costs a single hash when right, the index is only built for the functions it misses
+    if (!isSyscall && !(p_fEntry->functionPtr = __callobf_getFunctionAddrHintedH(p_dllEntry->handle, hash, exportHint)))
+        p_fEntry->functionPtr = __callobf_getFunctionAddrIndexedH(p_dllEntry->handle, &p_dllEntry->exportIndex, hash);
 
     if (!p_fEntry->functionPtr)
     {
@@ -102,16 +161,197 @@ void *__callobf_loadFunction(PFUNCTION_TABLE_ENTRY p_fEntry)
     return p_fEntry->functionPtr;
 }
 
-void *__callobf_callDispatcher(DWORD32 index, ...)
+// Only reached the first time an entry is dispatched, so the load entries stay out of the
+// cache lines touched by every call.
+static BOOL __callobf_loadEntry(PVOID p_ctx)
+{
+    PLOAD_CTX p_loadCtx = p_ctx;
+    return __callobf_loadFunction(p_loadCtx->p_fEntry, p_loadCtx->hash, p_loadCtx->exportHint, p_loadCtx->p_dllEntry) != NULL;
+}
+
+static __attribute__((noinline)) void *__callobf_loadTableFunction(DWORD32 index)
+{
+    PFUNCTION_LOAD_ENTRY p_lEntry = &__callobf_functionLoadTable[index];
+    LOAD_CTX loadCtx = {&__callobf_functionTable.entries[index], p_lEntry->hash, p_lEntry->exportHint,
+                        &__callobf_dllTable.entries[p_lEntry->moduleIndex]};
+
+    if (!__callobf_resolveEntryOnce(ENTRY_STATE_PTR(loadCtx.p_fEntry), __callobf_loadEntry, &loadCtx))
+        return NULL;
+
+    return loadCtx.p_fEntry->functionPtr;
+}
+
+static __attribute__((noinline)) void *__callobf_loadFragmentFunction(PFUNCTION_FRAGMENT p_fragment)
+{
+    LOAD_CTX loadCtx = {&p_fragment->entry, p_fragment->hash, p_fragment->exportHint, p_fragment->p_dllEntry};
+
+    if (!__callobf_resolveEntryOnce(ENTRY_STATE_PTR(loadCtx.p_fEntry), __callobf_loadEntry, &loadCtx))
+        return NULL;
+
+    return loadCtx.p_fEntry->functionPtr;
+}
+
+// Called for every export of the dll being resolved, fills the pending entries it matches
+static BOOL __callobf_resolveTableExport(UINT32 nameHash, PVOID p_function, PVOID p_ctx)
+{
+    PRESOLVE_CTX p_resolveCtx = p_ctx;
+
+    for (DWORD i = 0; i < __callobf_functionTable.count; i++)
+    {
+        PFUNCTION_TABLE_ENTRY p_fEntry = &__callobf_functionTable.entries[i];
+
+        if (__callobf_functionLoadTable[i].hash == nameHash && __callobf_functionLoadTable[i].exportHint == EXPORT_HINT_NONE &&
+            !__callobf_isEntryReady(ENTRY_STATE_PTR(p_fEntry)) &&
+            &__callobf_dllTable.entries[__callobf_functionLoadTable[i].moduleIndex] == p_resolveCtx->p_dllEntry)
+        {
+            // Taken by another thread, it will be ready once that thread is done
+            if (__callobf_tryAcquireEntry(ENTRY_STATE_PTR(p_fEntry)))
+            {
+                p_fEntry->ssn = 0;
+                p_fEntry->flags = 0;
+                p_fEntry->functionPtr = p_function;
+                __callobf_releaseEntry(ENTRY_STATE_PTR(p_fEntry), TRUE);
+            }
+            p_resolveCtx->pending--;
+        }
+    }
+
+    return p_resolveCtx->pending != 0;
+}
+
+static BOOL __callobf_resolveFragmentExport(UINT32 nameHash, PVOID p_function, PVOID p_ctx)
+{
+    PRESOLVE_CTX p_resolveCtx = p_ctx;
+
+    for (PFUNCTION_FRAGMENT p_fragment = &__callobf_fragmentsStart + 1; p_fragment < &__callobf_fragmentsEnd; p_fragment++)
+    {
+        PFUNCTION_TABLE_ENTRY p_fEntry = &p_fragment->entry;
+
+        if (p_fragment->hash == nameHash && p_fragment->exportHint == EXPORT_HINT_NONE &&
+            !__callobf_isEntryReady(ENTRY_STATE_PTR(p_fEntry)) && p_fragment->p_dllEntry == p_resolveCtx->p_dllEntry)
+        {
+            if (__callobf_tryAcquireEntry(ENTRY_STATE_PTR(p_fEntry)))
+            {
+                p_fEntry->ssn = 0;
+                p_fEntry->flags = 0;
+                p_fEntry->functionPtr = p_function;
+                __callobf_releaseEntry(ENTRY_STATE_PTR(p_fEntry), TRUE);
+            }
+            p_resolveCtx->pending--;
+        }
+    }
+
+    return p_resolveCtx->pending != 0;
+}
+
+// Walks the exports of the dll once, for all its pending entries, unless it can be indexed. Ntdll
+// entries may be syscalls, which are found walking the syscall stubs instead, so they are left to the loader.
+// So are the entries with a hint, which the loader checks first.
+static void __callobf_resolveDll(PRESOLVE_CTX p_resolveCtx, EXPORT_CALLBACK callback)
+{
+    if (!p_resolveCtx->pending || p_resolveCtx->p_dllEntry->hash == NTDLL_HASH)
+        return;
+
+    if (!__callobf_loadDll(p_resolveCtx->p_dllEntry))
+    {
+        DEBUG_PRINT("Error, couldnt load dll");
+        return;
+    }
+
+    // Once indexed, each entry is a lookup for the loaders, instead of comparing every export with every entry
+    if (__callobf_getExportIndex(p_resolveCtx->p_dllEntry->handle, &p_resolveCtx->p_dllEntry->exportIndex))
+        return;
+
+    DEBUG_PRINT("Resolving %lu functions from %s", p_resolveCtx->pending, p_resolveCtx->p_dllEntry->name);
+    __callobf_forEachExportH(p_resolveCtx->p_dllEntry->handle, callback, p_resolveCtx);
+}
+
+BOOL __callobf_resolveFunctions(void)
+{
+    RESOLVE_CTX resolveCtx = {0};
+    BOOL resolved = TRUE;
+
+    if (&__callobf_functionTable)
+    {
+        for (DWORD moduleIndex = 0; moduleIndex < __callobf_dllTable.count; moduleIndex++)
+        {
+            resolveCtx.p_dllEntry = &__callobf_dllTable.entries[moduleIndex];
+            resolveCtx.pending = 0;
+
+            for (DWORD i = 0; i < __callobf_functionTable.count; i++)
+                if (__callobf_functionLoadTable[i].moduleIndex == moduleIndex &&
+                    __callobf_functionLoadTable[i].exportHint == EXPORT_HINT_NONE &&
+                    !__callobf_readyFunction(&__callobf_functionTable.entries[i]))
+                    resolveCtx.pending++;
+
+            __callobf_resolveDll(&resolveCtx, __callobf_resolveTableExport);
+        }
+
+        // Whatever is left (hinted entries, entries of indexed dlls, syscalls, or names the walk didnt find) is loaded as a first call would
+        for (DWORD i = 0; i < __callobf_functionTable.count; i++)
+            if (!__callobf_readyFunction(&__callobf_functionTable.entries[i]) && !__callobf_loadTableFunction(i))
+                resolved = FALSE;
+    }
+
+    // Fragments have no dll index, each dll is resolved from the first fragment pointing to it
+    for (PFUNCTION_FRAGMENT p_fragment = &__callobf_fragmentsStart + 1; p_fragment < &__callobf_fragmentsEnd; p_fragment++)
+    {
+        PFUNCTION_FRAGMENT p_other = &__callobf_fragmentsStart + 1;
+
+        if (!p_fragment->p_dllEntry)
+            continue;
+
+        while (p_other < p_fragment && p_other->p_dllEntry != p_fragment->p_dllEntry)
+            p_other++;
+
+        if (p_other != p_fragment)
+            continue;
+
+        resolveCtx.p_dllEntry = p_fragment->p_dllEntry;
+        resolveCtx.pending = 0;
+
+        for (; p_other < &__callobf_fragmentsEnd; p_other++)
+            if (p_other->p_dllEntry == resolveCtx.p_dllEntry && p_other->exportHint == EXPORT_HINT_NONE &&
+                !__callobf_readyFunction(&p_other->entry))
+                resolveCtx.pending++;
+
+        __callobf_resolveDll(&resolveCtx, __callobf_resolveFragmentExport);
+    }
+
+    for (PFUNCTION_FRAGMENT p_fragment = &__callobf_fragmentsStart + 1; p_fragment < &__callobf_fragmentsEnd; p_fragment++)
+        if (p_fragment->p_dllEntry && !__callobf_readyFunction(&p_fragment->entry) && !__callobf_loadFragmentFunction(p_fragment))
+            resolved = FALSE;
+
+    return resolved;
+}
+
+// Inlined, so the return address and the arguments are the ones of the calling dispatcher.
+// The argument count is the one in the entry, or a constant for fixed arity dispatchers.
+static inline __attribute__((always_inline)) void *__callobf_dispatch(
+    PFUNCTION_TABLE_ENTRY p_fEntry,
+    PVOID p_function,
+    DWORD32 argCount,
+    PVOID p_args,
+    PVOID p_returnAddress)
 {
-    PVOID p_returnAddress = __builtin_frame_address(0) - 0x8;
-    PVOID p_function = NULL;
     USHORT ssn = 0;
     BOOL isSyscall = FALSE;
-    DWORD32 argCount = 0;
-    PFUNCTION_TABLE_ENTRY p_fEntry = NULL;
 
-    __callobf_setLastError(0);
+    if (p_fEntry->flags & FUNCTION_ENTRY_SYSCALL)
+    {
+        ssn = p_fEntry->ssn;
+        isSyscall = TRUE;
+    }
+
+    BREAKPOINT();
+    return __callobf_doCall(p_function, ssn, isSyscall, argCount, p_args, p_returnAddress, &__callobf_globalFrameTable);
+}
+
+void *__callobf_callDispatcher(DWORD32 index, ...)
+{
+    PVOID p_returnAddress = __builtin_frame_address(0) - 0x8;
+    PFUNCTION_TABLE_ENTRY p_fEntry = NULL;
+    PVOID p_function = NULL;
 
 #ifdef __clang__
     __builtin_ms_va_list p_args;
@@ -121,7 +361,7 @@ void *__callobf_callDispatcher(DWORD32 index, ...)
 
     __builtin_ms_va_start(p_args, index);
 
-    if (index > __callobf_functionTable.count)
+    if (!&__callobf_functionTable || index >= __callobf_functionTable.count)
     {
         __callobf_setLastError(1);
         return NULL;
@@ -129,25 +369,96 @@ void *__callobf_callDispatcher(DWORD32 index, ...)
 
     p_fEntry = &(__callobf_functionTable.entries[index]);
 
-    if (!(p_function = p_fEntry->functionPtr))
+    if (!(p_function = __callobf_readyFunction(p_fEntry)) && !(p_function = LOAD_TABLE_FUNCTION(index)))
     {
-        if (!(p_function = __callobf_loadFunction(p_fEntry)))
-        {
-            __callobf_setLastError(1);
-            return NULL;
-        }
+        __callobf_setLastError(1);
+        return NULL;
     }
 
-    argCount = p_fEntry->argCount;
+    DEBUG_PRINT("Dispatching index %u", index);
+    return __callobf_dispatch(p_fEntry, p_function, p_fEntry->argCount, p_args, p_returnAddress);
+}
+
+void *__callobf_callDispatcherFragment(PFUNCTION_FRAGMENT p_fragment, ...)
+{
+    PVOID p_returnAddress = __builtin_frame_address(0) - 0x8;
+    PVOID p_function = NULL;
+
+#ifdef __clang__
+    __builtin_ms_va_list p_args;
+#else
+    __builtin_va_list p_args;
+#endif
+
+    __builtin_ms_va_start(p_args, p_fragment);
 
-    if ((p_fEntry->ssn & 0xFFFF0000))
+    if (!p_fragment)
     {
-        p_fEntry->ssn &= 0x0000FFFF;
-        ssn = (USHORT)(p_fEntry->ssn);
-        isSyscall = TRUE;
+        __callobf_setLastError(1);
+        return NULL;
     }
 
-    DEBUG_PRINT("Dispatching index %u", index);
-    BREAKPOINT();
-    return __callobf_doCall(p_function, ssn, isSyscall, argCount, p_args, p_returnAddress, &__callobf_globalFrameTable);
-}
\ No newline at end of file
+    if (!(p_function = __callobf_readyFunction(&p_fragment->entry)) && !(p_function = LOAD_FRAGMENT_FUNCTION(p_fragment)))
+    {
+        __callobf_setLastError(1);
+        return NULL;
+    }
+
+    DEBUG_PRINT("Dispatching entry 0x%08lX", p_fragment->hash);
+    return __callobf_dispatch(&p_fragment->entry, p_function, p_fragment->entry.argCount, p_args, p_returnAddress);
+}
+
+// The arguments are copied as __callobf_doCall takes them: one slot each, in order, with
+// at least the 4 register slots, since it always loads them.
+#define DEFINE_ARITY_DISPATCHER(n)                                                                                       \
+    void *__callobf_callDispatcher##n(DWORD32 index DISPATCHER_PARAMS_##n)                                               \
+    {                                                                                                                    \
+        PVOID p_returnAddress = __builtin_frame_address(0) - 0x8;                                                        \
+        ULONG_PTR args[n < 4 ? 4 : n] = {DISPATCHER_ARGS_##n};                                                           \
+        PFUNCTION_TABLE_ENTRY p_fEntry = NULL;                                                                           \
+        PVOID p_function = NULL;                                                                                         \
+                                                                                                                         \
+        if (!&__callobf_functionTable || index >= __callobf_functionTable.count)                                         \
+        {                                                                                                                \
+            __callobf_setLastError(1);                                                                                   \
+            return NULL;                                                                                                 \
+        }                                                                                                                \
+                                                                                                                         \
+        p_fEntry = &(__callobf_functionTable.entries[index]);                                                            \
+                                                                                                                         \
+        if (!(p_function = __callobf_readyFunction(p_fEntry)) && !(p_function = LOAD_TABLE_FUNCTION(index)))             \
+        {                                                                                                                \
+            __callobf_setLastError(1);                                                                                   \
+            return NULL;                                                                                                 \
+        }                                                                                                                \
+                                                                                                                         \
+        DEBUG_PRINT("Dispatching index %u with %u arguments", index, n);                                                 \
+        return __callobf_dispatch(p_fEntry, p_function, n, args, p_returnAddress);                                       \
+    }
+
+#define DEFINE_ARITY_FRAGMENT_DISPATCHER(n)                                                                              \
+    void *__callobf_callDispatcherFragment##n(PFUNCTION_FRAGMENT p_fragment DISPATCHER_PARAMS_##n)                       \
+    {                                                                                                                    \
+        PVOID p_returnAddress = __builtin_frame_address(0) - 0x8;                                                        \
+        ULONG_PTR args[n < 4 ? 4 : n] = {DISPATCHER_ARGS_##n};                                                           \
+        PVOID p_function = NULL;                                                                                         \
+                                                                                                                         \
+        if (!p_fragment)                                                                                                 \
+        {                                                                                                                \
+            __callobf_setLastError(1);                                                                                   \
+            return NULL;                                                                                                 \
+        }                                                                                                                \
+                                                                                                                         \
+        if (!(p_function = __callobf_readyFunction(&p_fragment->entry)) &&                                               \
+            !(p_function = LOAD_FRAGMENT_FUNCTION(p_fragment)))                                                          \
+        {                                                                                                                \
+            __callobf_setLastError(1);                                                                                   \
+            return NULL;                                                                                                 \
+        }                                                                                                                \
+                                                                                                                         \
+        DEBUG_PRINT("Dispatching entry 0x%08lX with %u arguments", p_fragment->hash, n);                                 \
+        return __callobf_dispatch(&p_fragment->entry, p_function, n, args, p_returnAddress);                             \
+    }
+
+FOR_EACH_DISPATCHER_ARITY(DEFINE_ARITY_DISPATCHER)
+FOR_EACH_DISPATCHER_ARITY(DEFINE_ARITY_FRAGMENT_DISPATCHER)
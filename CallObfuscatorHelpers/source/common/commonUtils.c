@@ -25,11 +25,6 @@
 #include "common/commonUtils.h"
 #include "common/debug.h"
 
-// ==============================================================================
-// ================================= GLOBALS ====================================
-
-unsigned long __callobf_lastError = 0;
-
 BOOL __callobf_srand(PDWORD p_ctx, DWORD seed)
 {
     if (!p_ctx)
@@ -50,65 +45,34 @@ DWORD __callobf_rand(PDWORD p_ctx) // RAND_MAX assumed as 256 + 20
 
 /**
  * @brief Simple hash function to produce 32 bit values from NULL terminated strings.
- *        Any other 32 bit hash like djb2 would work.
+ *        Any other 32 bit hash like djb2 would work. It is defined in hash.h, shared
+ *        with the pass, which must compute the very same values.
  *
  * @param p_str Pointer to NULL terminated string.
  * @return UINT32 32 bit value representing the string.
  */
 UINT32 __callobf_hashA(const PCHAR p_str)
 {
-    UINT h;
-    PCHAR p;
-    CHAR c;
-
     if (!p_str)
         return 0;
 
-    h = 0;
-    for (p = p_str; *p != '\0'; p++)
-    {
-        c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
-        h = HASH_MULTIPLIER * h + c;
-    }
-    return h;
+    return __callobf_hashContinueA(0, p_str);
 }
 
 UINT32 __callobf_hashW(const PWCHAR p_str)
 {
-    UINT h;
-    PWCHAR p;
-    WCHAR c;
-
     if (!p_str)
         return 0;
 
-    h = 0;
-    for (p = p_str; *p != 0; p++)
-    {
-        c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
-        h = HASH_MULTIPLIER * h + c;
-    }
-    return h;
+    return __callobf_hashContinueW(0, p_str);
 }
 
 UINT32 __callobf_hashU(const PUNICODE_STRING p_str)
 {
-    UINT32 h;
-    PWCHAR p;
-    WCHAR c;
-
     if (!p_str)
         return 0;
 
-    DWORD_PTR p_end = ((DWORD_PTR)p_str->Buffer) + p_str->Length;
-
-    h = 0;
-    for (p = p_str->Buffer; (DWORD_PTR)p < p_end; p++)
-    {
-        c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
-        h = HASH_MULTIPLIER * h + c;
-    }
-    return h;
+    return __callobf_hashContinueLengthW(0, p_str->Buffer, p_str->Length / sizeof(WCHAR));
 }
 
 PVOID __callobf_findBytes(
@@ -168,10 +132,10 @@ DWORD32 __callobf_lfsrXorShift32(DWORD32 prevVal)
 
 DWORD32 __callobf_getLastError()
 {
-    return __callobf_lastError;
+    return NtCurrentTeb()->LastErrorValue;
 }
 
 VOID __callobf_setLastError(DWORD32 error)
 {
-    __callobf_lastError = error;
+    NtCurrentTeb()->LastErrorValue = error;
 }
\ No newline at end of file
@@ -0,0 +1,235 @@
+/**
+ * @file exportIndex.c
+ * @author Alejandro González (@httpyxel)
+ * @brief Index of the exported names of a module, sorted by hash.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pe/exportIndex.h"
+#include "pe/peUtils.h"
+#include "common/commonUtils.h"
+#include "common/debug.h"
+
+CASSERT((sizeof(EXPORT_INDEX_ENTRY) == 8));
+CASSERT((sizeof(EXPORT_INDEX) == 16));
+
+// ==============================================================================
+// ================================= GLOBALS ====================================
+
+// Indexes are only taken, never given back, as the dlls they index stay loaded
+static __attribute__((aligned(16))) BYTE __callobf_exportIndexArena[EXPORT_INDEX_ARENA_SIZE];
+static DWORD __callobf_exportIndexArenaUsed = 0;
+
+static PIMAGE_EXPORT_DIRECTORY __callobf_getExportDirectory(const PVOID p_module)
+{
+    PIMAGE_DOS_HEADER dos;
+    PIMAGE_NT_HEADERS nth;
+    PIMAGE_DATA_DIRECTORY dir;
+
+    if (p_module == NULL)
+        return NULL;
+
+    if (*(PSHORT)p_module != PE_MAGIC)
+        return NULL;
+
+    dos = p_module;
+    nth = (PVOID)((DWORD_PTR)dos + dos->e_lfanew);
+    dir = (PVOID)(&nth->OptionalHeader.DataDirectory[0]);
+
+    if (!dir->VirtualAddress)
+        return NULL;
+
+    return (PVOID)((DWORD_PTR)dos + dir->VirtualAddress);
+}
+
+// Hash first, then the second field, which holds the name index while sorting
+static inline DWORD64 __callobf_indexKey(PEXPORT_INDEX_ENTRY p_entry)
+{
+    return ((DWORD64)p_entry->hash << 32) | p_entry->rva;
+}
+
+static void __callobf_siftDown(PEXPORT_INDEX_ENTRY p_entries, DWORD root, DWORD count)
+{
+    EXPORT_INDEX_ENTRY tmp;
+    DWORD child;
+
+    while ((child = 2 * root + 1) < count)
+    {
+        if (child + 1 < count && __callobf_indexKey(&p_entries[child + 1]) > __callobf_indexKey(&p_entries[child]))
+            child++;
+
+        if (__callobf_indexKey(&p_entries[root]) >= __callobf_indexKey(&p_entries[child]))
+            return;
+
+        tmp = p_entries[root];
+        p_entries[root] = p_entries[child];
+        p_entries[child] = tmp;
+        root = child;
+    }
+}
+
+// Heapsort, in place and without recursion, there is no heap nor much stack to count on
+static void __callobf_sortIndex(PEXPORT_INDEX_ENTRY p_entries, DWORD count)
+{
+    EXPORT_INDEX_ENTRY tmp;
+
+    for (DWORD i = count / 2; i > 0; i--)
+        __callobf_siftDown(p_entries, i - 1, count);
+
+    for (DWORD end = count; end > 1; end--)
+    {
+        tmp = p_entries[0];
+        p_entries[0] = p_entries[end - 1];
+        p_entries[end - 1] = tmp;
+        __callobf_siftDown(p_entries, 0, end - 1);
+    }
+}
+
+DWORD __callobf_getExportIndexSize(const PVOID p_module)
+{
+    PIMAGE_EXPORT_DIRECTORY exp = __callobf_getExportDirectory(p_module);
+
+    if (!exp || !exp->NumberOfNames)
+        return 0;
+
+    return sizeof(EXPORT_INDEX) + exp->NumberOfNames * sizeof(EXPORT_INDEX_ENTRY);
+}
+
+PEXPORT_INDEX __callobf_buildExportIndex(const PVOID p_module, PVOID p_buffer, const DWORD bufferSize)
+{
+    PIMAGE_EXPORT_DIRECTORY exp = __callobf_getExportDirectory(p_module);
+    PEXPORT_INDEX p_index = p_buffer;
+    PDWORD aof;
+    PDWORD aon;
+    PUSHORT ano;
+    DWORD cnt;
+    DWORD last;
+
+    if (!exp || !exp->NumberOfNames || !p_buffer || bufferSize < __callobf_getExportIndexSize(p_module))
+        return NULL;
+
+    aof = (PVOID)((DWORD_PTR)p_module + exp->AddressOfFunctions);
+    aon = (PVOID)((DWORD_PTR)p_module + exp->AddressOfNames);
+    ano = (PVOID)((DWORD_PTR)p_module + exp->AddressOfNameOrdinals);
+
+    // The name index goes where the rva will, so names sharing a hash sort in walk order
+    for (cnt = 0; cnt < exp->NumberOfNames; cnt++)
+    {
+        p_index->entries[cnt].hash = __callobf_hashStringA((PVOID)((DWORD_PTR)p_module + aon[cnt]));
+        p_index->entries[cnt].rva = cnt;
+    }
+
+    __callobf_sortIndex(p_index->entries, exp->NumberOfNames);
+
+    p_index->p_module = p_module;
+    p_index->count = 0;
+    p_index->collisions = 0;
+
+    for (cnt = 0; cnt < exp->NumberOfNames; cnt++)
+    {
+        if (p_index->count && p_index->entries[cnt].hash == p_index->entries[p_index->count - 1].hash)
+        {
+            p_index->collisions++;
+            continue;
+        }
+
+        last = p_index->count++;
+        p_index->entries[last].hash = p_index->entries[cnt].hash;
+        p_index->entries[last].rva = aof[ano[p_index->entries[cnt].rva]];
+    }
+
+    DEBUG_PRINT("Indexed %lu names (%lu collisions)", p_index->count, p_index->collisions);
+    return p_index;
+}
+
+PVOID __callobf_findExportH(const PEXPORT_INDEX p_index, const UINT32 functionHash)
+{
+    DWORD low = 0;
+    DWORD high = p_index->count;
+    DWORD mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (p_index->entries[mid].hash < functionHash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low == p_index->count || p_index->entries[low].hash != functionHash)
+        return NULL;
+
+    return (PVOID)((DWORD_PTR)p_index->p_module + p_index->entries[low].rva);
+}
+
+static PVOID __callobf_allocExportIndex(DWORD size)
+{
+    DWORD used = __atomic_load_n(&__callobf_exportIndexArenaUsed, __ATOMIC_RELAXED);
+
+    // Keeps every index 16 byte aligned
+    size = (size + 15) & ~15;
+
+    do
+    {
+        if (size > EXPORT_INDEX_ARENA_SIZE - used)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&__callobf_exportIndexArenaUsed, &used, used + size, FALSE, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return &__callobf_exportIndexArena[used];
+}
+
+PEXPORT_INDEX __callobf_getExportIndex(const PVOID p_module, PVOID *pp_index)
+{
+    PVOID p_index = NULL;
+    DWORD size;
+
+    if (!p_module || !pp_index)
+        return NULL;
+
+    // Only the thread swapping the slot from NULL builds the index, the rest dont wait for it
+    if (__atomic_compare_exchange_n(pp_index, &p_index, EXPORT_INDEX_BUILDING, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        size = __callobf_getExportIndexSize(p_module);
+        if (!size || !(p_index = __callobf_allocExportIndex(size)) || !__callobf_buildExportIndex(p_module, p_index, size))
+        {
+            DEBUG_PRINT("Couldnt index module %p, walking its names", p_module);
+            p_index = EXPORT_INDEX_NONE;
+        }
+
+        __atomic_store_n(pp_index, p_index, __ATOMIC_RELEASE);
+    }
+
+    if (p_index == EXPORT_INDEX_BUILDING || p_index == EXPORT_INDEX_NONE || ((PEXPORT_INDEX)p_index)->p_module != p_module)
+        return NULL;
+
+    return p_index;
+}
+
+PVOID __callobf_getFunctionAddrIndexedH(const PVOID p_module, PVOID *pp_index, const UINT32 functionHash)
+{
+    PEXPORT_INDEX p_index = __callobf_getExportIndex(p_module, pp_index);
+
+    if (!p_index)
+        return __callobf_getFunctionAddrH(p_module, functionHash);
+
+    return __callobf_findExportH(p_index, functionHash);
+}
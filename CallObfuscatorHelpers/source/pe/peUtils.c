@@ -103,7 +103,7 @@ PVOID __callobf_getFunctionAddrH(const PVOID p_module, const UINT32 funtionHash)
         for (cnt = 0; cnt < exp->NumberOfNames; cnt++)
         {
             str = (PVOID)((DWORD_PTR)dos + aon[cnt]);
-            if (funtionHash == __callobf_hashA(str))
+            if (funtionHash == __callobf_hashStringA(str))
             {
                 return (PVOID)((DWORD_PTR)dos + aof[ano[cnt]]);
             };
@@ -112,6 +112,87 @@ PVOID __callobf_getFunctionAddrH(const PVOID p_module, const UINT32 funtionHash)
     return NULL;
 };
 
+PVOID __callobf_getFunctionAddrHintedH(const PVOID p_module, const UINT32 functionHash, const DWORD exportHint)
+{
+    PIMAGE_DOS_HEADER dos;
+    PIMAGE_NT_HEADERS nth;
+    PIMAGE_DATA_DIRECTORY dir;
+    PIMAGE_EXPORT_DIRECTORY exp;
+    PDWORD aof;
+    PDWORD aon;
+    PUSHORT ano;
+    DWORD cnt;
+
+    if (p_module == NULL || exportHint == EXPORT_HINT_NONE)
+        return NULL;
+
+    if (*(PSHORT)p_module != PE_MAGIC)
+        return NULL;
+
+    dos = p_module;
+    nth = (PVOID)((DWORD_PTR)dos + dos->e_lfanew);
+    dir = (PVOID)(&nth->OptionalHeader.DataDirectory[0]);
+
+    if (!dir->VirtualAddress)
+        return NULL;
+
+    exp = (PVOID)((DWORD_PTR)dos + dir->VirtualAddress);
+    cnt = exportHint - 1;
+
+    // Another version of the dll may have less names, or others at that index
+    if (cnt >= exp->NumberOfNames)
+        return NULL;
+
+    aof = (PVOID)((DWORD_PTR)dos + exp->AddressOfFunctions);
+    aon = (PVOID)((DWORD_PTR)dos + exp->AddressOfNames);
+    ano = (PVOID)((DWORD_PTR)dos + exp->AddressOfNameOrdinals);
+
+    if (functionHash != __callobf_hashStringA((PVOID)((DWORD_PTR)dos + aon[cnt])))
+        return NULL;
+
+    return (PVOID)((DWORD_PTR)dos + aof[ano[cnt]]);
+}
+
+BOOL __callobf_forEachExportH(const PVOID p_module, EXPORT_CALLBACK callback, PVOID p_ctx)
+{
+    PIMAGE_DOS_HEADER dos;
+    PIMAGE_NT_HEADERS nth;
+    PIMAGE_DATA_DIRECTORY dir;
+    PIMAGE_EXPORT_DIRECTORY exp;
+    PDWORD aof;
+    PDWORD aon;
+    PUSHORT ano;
+    PCHAR str;
+    DWORD cnt;
+
+    if (p_module == NULL || callback == NULL)
+        return FALSE;
+
+    if (*(PSHORT)p_module != PE_MAGIC)
+        return FALSE;
+
+    dos = p_module;
+    nth = (PVOID)((DWORD_PTR)dos + dos->e_lfanew);
+    dir = (PVOID)(&nth->OptionalHeader.DataDirectory[0]);
+
+    if (!dir->VirtualAddress)
+        return FALSE;
+
+    exp = (PVOID)((DWORD_PTR)dos + dir->VirtualAddress);
+    aof = (PVOID)((DWORD_PTR)dos + exp->AddressOfFunctions);
+    aon = (PVOID)((DWORD_PTR)dos + exp->AddressOfNames);
+    ano = (PVOID)((DWORD_PTR)dos + exp->AddressOfNameOrdinals);
+
+    for (cnt = 0; cnt < exp->NumberOfNames; cnt++)
+    {
+        str = (PVOID)((DWORD_PTR)dos + aon[cnt]);
+        if (!callback(__callobf_hashStringA(str), (PVOID)((DWORD_PTR)dos + aof[ano[cnt]]), p_ctx))
+            break;
+    };
+
+    return TRUE;
+}
+
 PVOID __callobf_getExceptionDirectoryAddress(const PVOID p_module, PDWORD p_size)
 {
     if (p_module == NULL)
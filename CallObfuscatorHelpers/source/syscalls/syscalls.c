@@ -88,53 +88,27 @@ BOOL __callobf_getNextSyscall(PSYSCALL_ITER_CTX p_ctx, PCHAR *pp_name, PVOID *pp
     return FALSE;
 }
 
-// TODO: Improve this
+// Hash of the name as if it started with Zw, or Nt, whatever its first two characters are
 UINT32 __callobf_hashSyscallAsZw(PCHAR p_str)
 {
-    UINT h = 0;
-    PCHAR p;
-    CHAR c;
-
     if (!p_str)
         return 0;
 
     if (p_str[0] == 0 || p_str[1] == 0)
         return 0;
 
-    h = HASH_MULTIPLIER * h + 'z';
-    h = HASH_MULTIPLIER * h + 'w';
-    p_str += 2;
-
-    for (p = p_str; *p != '\0'; p++)
-    {
-        c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
-        h = HASH_MULTIPLIER * h + c;
-    }
-    return h;
+    return __callobf_hashContinueA(__callobf_hashStep(__callobf_hashStep(0, 'z'), 'w'), p_str + 2);
 }
 
 UINT32 __callobf_hashSyscallAsNt(PCHAR p_str)
 {
-    UINT h = 0;
-    PCHAR p;
-    CHAR c;
-
     if (!p_str)
         return 0;
 
     if (p_str[0] == 0 || p_str[1] == 0)
         return 0;
 
-    h = HASH_MULTIPLIER * h + 'n';
-    h = HASH_MULTIPLIER * h + 't';
-    p_str += 2;
-
-    for (p = p_str; *p != '\0'; p++)
-    {
-        c = (*p >= 65 && *p <= 90) ? *p + 32 : *p;
-        h = HASH_MULTIPLIER * h + c;
-    }
-    return h;
+    return __callobf_hashContinueA(__callobf_hashStep(__callobf_hashStep(0, 'n'), 't'), p_str + 2);
 }
 
 BOOL __callobf_checkHashSyscallA(PCHAR p_functionName, DWORD32 hash)
@@ -25,13 +25,96 @@
 #ifndef _CALL_OBFUSCATOR_H_
 #define _CALL_OBFUSCATOR_H_
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Verbosity levels for [INFO] messages, errors are always printed
+#define VERBOSITY_SILENT 0
+#define VERBOSITY_SUMMARY 1 // Config in use and modules processed
+#define VERBOSITY_DETAIL 2  // Every phase and every hooked function
+
+#define FUNCTION_TABLE_SYMBOL "__callobf_functionTable"
+#define FUNCTION_LOAD_TABLE_SYMBOL "__callobf_functionLoadTable"
+#define DLL_TABLE_SYMBOL "__callobf_dllTable"
+
+// The helpers load dlls through LoadLibraryA, which the pass always hooks. Its place is
+// emitted as a constant, so they dont search the tables for it: its index in the function
+// table, or a COMDAT pointer to its fragment (one for every module, the linker keeps one).
+#define LOAD_LIBRARY_FUNCTION "LoadLibraryA"
+#define LOAD_LIBRARY_DLL "kernel32.dll"
+#define LOAD_LIBRARY_INDEX_SYMBOL "__callobf_loadLibraryIndex"
+#define LOAD_LIBRARY_FRAGMENT_SYMBOL "__callobf_loadLibraryFragment"
+
+// Function entries only hold what a call needs, in 16 bytes, and start 16 byte aligned, so
+// dispatching touches a single cache line. What is only needed to load the function goes
+// in the load table (or after the entry, in fragments). Must match the helpers.
+#define FUNCTION_TABLE_ALIGNMENT 64
+#define FUNCTION_FRAGMENT_ALIGNMENT 16
+#define FUNCTION_ENTRY_SYSCALL 0x1
+
+#define CALL_DISPATCHER_SYMBOL "__callobf_callDispatcher"
+#define FRAGMENT_CALL_DISPATCHER_SYMBOL "__callobf_callDispatcherFragment"
+
+// Dispatching by arity: calls with up to CALL_DISPATCHER_MAX_ARITY arguments go to the
+// dispatcher symbol followed by their argument count (__callobf_callDispatcher2...), which
+// takes each argument as an i64, instead of the variadic one. Above it, copying the stack
+// arguments costs more than walking them. Must match the helpers.
+#define CALL_DISPATCHER_MAX_ARITY 4
+
+// Fragments mode: each module emits its own entries, as COMDATs named after the function
+// (or the lowercase dll name), so every module can be obfuscated alone and the linker keeps
+// a single copy of each entry. Function entries are placed in FRAGMENT_SECTION, the helpers
+// put markers in .callobf$a and .callobf$z, so the linker sorts all of them into one array.
+#define FUNCTION_FRAGMENT_PREFIX "__callobf_function."
+#define DLL_FRAGMENT_PREFIX "__callobf_dll."
+#define FRAGMENT_SECTION ".callobf$m"
+
+// Eager resolution: every module defines EAGER_RESOLVER_SYMBOL in a COMDAT, registered as a
+// constructor tied to it, so the linker keeps a single one, which resolves every entry at
+// startup through the helpers. Runs before constructors with the default priority, since
+// those may already call hooked functions.
+#define RESOLVE_FUNCTIONS_SYMBOL "__callobf_resolveFunctions"
+#define EAGER_RESOLVER_SYMBOL "__callobf_eagerResolver"
+#define EAGER_RESOLVER_PRIORITY 101
+
+#define CALL_OBF_TIMER_GROUP "callobfuscator"
+#define CALL_OBF_TIMER_GROUP_DESC "Call obfuscator phases"
 
 using namespace std;
 using namespace llvm;
 
 namespace callobfuscator
 {
+    extern unsigned int verbosity; // Set with -callobf-verbosity
+
+    /**
+     * @brief Stream for [INFO] messages of the given verbosity level.
+     *
+     * @param level Minimum verbosity level for the message to be shown.
+     * @return raw_ostream& outs() if shown, a null stream otherwise.
+     */
+    raw_ostream &info(unsigned int level);
+
+    /**
+     * @brief Times a phase of the pass, both for -time-passes (as part of the
+     *        CALL_OBF_TIMER_GROUP group) and for -ftime-trace.
+     */
+    class PhaseTimer
+    {
+    private:
+        TimeTraceScope traceScope;
+        NamedRegionTimer regionTimer;
+
+    public:
+        PhaseTimer(StringRef name, StringRef description);
+    };
+
     struct FunctionInfo
     {
         Function &function;
@@ -40,34 +123,68 @@ namespace callobfuscator
         unsigned int ssn;
         unsigned long modIndex = 0;
         unsigned long argCount = 0;
+        uint32_t exportHint = 0; // 1 + index of the name in the exports of a reference dll, 0 if unknown
+    };
+
+    // Bytes the tables of a module take in the image
+    struct TableSizes
+    {
+        uint64_t functionTable = 0; // Function table and load table, or every function fragment
+        uint64_t dllTable = 0;      // Dll table, or every dll fragment
+        uint64_t dllNames = 0;      // Dll name strings
+    };
+
+    struct CallSiteInfo
+    {
+        CallInst *p_call;
+        unsigned long functionTableIndex;
     };
 
     class CallObfuscator
     {
     private:
-        Module &mod;    // We are ensured the ref (Module given by the pass manager) outlives any object of this class... probably, i guess O_o
-        Module *tmpMod; // We are ensured the ref (Module given by the pass manager) outlives any object of this class... probably, i guess O_o
+        Module &mod; // We are ensured the ref (Module given by the pass manager) outlives any object of this class... probably, i guess O_o
 
         bool __changedModule;
         bool __locked; // Once finalized, cant get more hooks
         vector<FunctionInfo> functionList;
+        DenseMap<const Function *, unsigned long> functionIndex; // Function -> index in functionList
 
         vector<StringRef> dllNames;
-        vector<unsigned long> dllHashes;
+        StringMap<unsigned long> dllIndex; // Lowercase dll name -> index in dllNames
 
+        bool useFragments; // Emit per function entries instead of the module tables
+        bool useArityDispatchers; // Call a fixed arity dispatcher instead of the variadic one when possible
+        bool eagerResolution; // Resolve every entry at startup instead of on its first call
         FunctionCallee callDispatcher;
+        vector<FunctionCallee> arityDispatchers; // Declared on first use, indexed by arity
+        vector<Constant *> dispatcherKeys; // First argument of the dispatcher, in functionList order
+
+        SetVector<Function *> modifiedFunctions; // Functions whose body was changed by finalize
+        SmallPtrSet<const CallInst *, 8> exemptCalls; // Calls to hooked functions left direct
 
     public:
-        CallObfuscator(Module &module);
+        CallObfuscator(Module &module, bool useFragments = false, bool useArityDispatchers = false, bool eagerResolution = false);
 
         /**
          * @brief Inserts given function to list of functions that will be hooked on finalize.
+         *        Functions already added are ignored, and dlls are interned by name, ignoring
+         *        case, so each call costs a couple of hash lookups.
          *
          * @param functionInfo Information about the function to be hooked.
          * @return true Success.
          */
         bool addHook(const FunctionInfo &functionInfo);
 
+        /**
+         * @brief Leaves the given call to a hooked function as it is, so it keeps calling the
+         *        function directly instead of going through the dispatcher.
+         *
+         * @param p_call Call to a hooked function.
+         * @return true Success. False if already finalized.
+         */
+        bool exemptCall(const CallInst *p_call);
+
         /**
          * @brief Applies applies hooks, inserts definitions, inserts tables, and briefly
          *        makes every change to the module. Prior to the execution of this function,
@@ -77,40 +194,222 @@ namespace callobfuscator
          */
         bool finalize();
 
+        /**
+         * @brief Does everything finalize does before touching the module: puts the hooks in
+         *        table order, checks every use of the hooked functions, and that the
+         *        dispatcher can be added. The module is
+         *        left unmodified, and no more hooks can be added.
+         *
+         * @return true The module could be finalized.
+         */
+        bool analyze();
+
+        /**
+         * @brief Hooked functions, in table order once finalized (or analyzed).
+         *
+         * @return const vector<FunctionInfo>& Hooked functions.
+         */
+        const vector<FunctionInfo> &getHookedFunctions() const;
+
+        /**
+         * @brief Size of the tables for the hooks added, as they are (or would be) emitted
+         *        for the target of the module. With fragments, entries shared with other
+         *        modules are counted, even if the linker keeps a single copy.
+         *
+         * @return TableSizes Sizes in bytes.
+         */
+        TableSizes getTableSizes() const;
+
         /**
          * @return true Module changed.
          * @return false Module didnt change.
          */
         bool changedModule();
 
+        /**
+         * @brief Check if the module already went through the obfuscator, so running it
+         *        again would only fail.
+         *
+         * @param M Module to check.
+         * @return true The module defines the tables. Modules using fragments are never
+         *         reported, running the pass on them again only hooks calls added since.
+         */
+        static bool isObfuscated(const Module &M);
+
+        /**
+         * @brief Functions whose instructions were changed by finalize. The rest of the
+         *        functions in the module are left exactly as they were, and no function
+         *        ever gets its control flow changed.
+         *
+         * @return const SetVector<Function *>& Modified functions.
+         */
+        const SetVector<Function *> &getModifiedFunctions() const;
+
     private:
-        bool insertTables(vector<StringRef> dllNames, vector<FunctionInfo> functionInfo);
+        /**
+         * @brief Puts dlls in order of their lowercase name, and functions in order of their
+         *        name, so the tables (and every index into them) only depend on what is
+         *        hooked, not on the order functions are declared in or hooks are added in.
+         */
+        void sortHooks();
+
+        /**
+         * @brief Emits the function and dll tables directly into the module, along with
+         *        the dll name strings they point to.
+         *
+         * @param dllNames Names of the dlls, in dll table order.
+         * @param functionInfo Hooked functions, in function table order.
+         * @return true Success.
+         */
+        bool insertTables(const vector<StringRef> &dllNames, const vector<FunctionInfo> &functionInfo);
+
+        /**
+         * @brief Emits an entry for each function and each dll as COMDATs, along with the
+         *        dll name strings they point to. Entries the module already defines (it went
+         *        through the pass before, or was linked with a module that did) are reused.
+         *
+         * @param dllNames Names of the dlls.
+         * @param functionInfo Hooked functions.
+         * @return true Success.
+         */
+        bool insertFragments(const vector<StringRef> &dllNames, const vector<FunctionInfo> &functionInfo);
+
+        /**
+         * @brief Type of the call dispatcher: taking an index for module tables, or an
+         *        entry pointer for fragments.
+         *
+         * @return FunctionType* Type of the dispatcher.
+         */
+        FunctionType *getCallDispatcherType();
+
+        /**
+         * @brief Type of the fixed arity dispatcher: the first argument of the variadic one,
+         *        then arity i64.
+         *
+         * @param arity Number of arguments of the calls it takes.
+         * @return FunctionType* Type of the dispatcher.
+         */
+        FunctionType *getArityDispatcherType(unsigned int arity);
+
+        /**
+         * @brief Checks that the call dispatchers and the eager resolver can be inserted, before
+         *        anything is added to the module, so a conflict leaves it untouched.
+         *
+         * @return true Both can be inserted.
+         */
+        bool checkDispatcherSymbols();
+
         /**
          * @brief Inserts the definition of the call dispatcher, need to
-         *        replace hooked functions.
+         *        replace hooked functions. The one taking an index for module tables,
+         *        or the one taking an entry pointer for fragments.
          *
          * @return true Success.
          */
         bool insertCallDispatcherDef();
 
         /**
-         * @brief Replaces the use of a function, by an equivalent use to the call dispatcher.
-         *        NOTE: In LLVM, Uses represents reads, calls...
+         * @brief Defines the eager resolver, which calls RESOLVE_FUNCTIONS_SYMBOL, and registers
+         *        it in llvm.global_ctors. Nothing is added if the module already defines it.
          *
-         * @param use Use to be replaced.
-         * @param functionTableIndex Index in the function table for the function to be replaced.
          * @return true Success.
          */
-        bool replaceUse(Use &use, int functionTableIndex);
+        bool insertEagerResolver();
 
         /**
-         * @brief Replaces a call instruction, by a call istruction to the call dispatcher.
+         * @brief Gets the fixed arity dispatcher for calls with the given number of arguments,
+         *        declaring it the first time. Takes the same first argument as the variadic one,
+         *        then every argument as an i64.
          *
-         * @param callInstruction Instruction to be replaced.
-         * @param functionTableIndex Index in the function table for the function to be replaced.
+         * @param arity Number of arguments of the call, up to CALL_DISPATCHER_MAX_ARITY.
+         * @return FunctionCallee Dispatcher.
+         */
+        FunctionCallee getArityDispatcher(unsigned int arity);
+
+        /**
+         * @brief Check if a call can go through a fixed arity dispatcher: it has no more
+         *        arguments than CALL_DISPATCHER_MAX_ARITY, and every one of them fits in an i64.
+         *
+         * @param p_call Call to a hooked function.
+         * @return true The call can use a fixed arity dispatcher.
+         */
+        static bool fitsArityDispatcher(const CallInst *p_call);
+
+        /**
+         * @brief Walks the module once, collecting every call to a hooked function. Also
+         *        checks that hooked functions are only used as the callee of direct calls,
+         *        and that their return values can be recovered from the dispatcher one.
+         *        Exempt calls are checked too, but not collected.
+         *        Nothing is modified, so the module can be left untouched on failure.
+         *
+         * @param callSites [OUT] Returns every call site to be rewritten, in module order.
+         * @param siteCounts [OUT] Returns the number of call sites per function table index.
          * @return true Success.
          */
-        bool replaceCall(CallInst *callInstruction, int functionTableIndex);
+        bool collectCallSites(vector<CallSiteInfo> &callSites, vector<unsigned long> &siteCounts);
+
+        /**
+         * @brief Replaces every given call by a call to the call dispatcher, passing the
+         *        function table index (or the function entry) as first argument. Since sites were already collected,
+         *        no use list is iterated while it is being modified. When dispatching by arity, the
+         *        arguments are widened to i64 as the variadic convention would pass them.
+         *
+         * @param callSites Call sites to rewrite.
+         */
+        void rewriteCallSites(const vector<CallSiteInfo> &callSites);
+
+        /**
+         * @brief Builds the attributes for a call to the dispatcher replacing the given call.
+         *        Keeps everything the original call site and callee guaranteed that still
+         *        holds for the dispatcher signature: parameter attributes are shifted by
+         *        one (the index goes first), return attributes that dont fit an i64 are
+         *        dropped, and so are function attributes describing memory, sync or
+         *        allocation behaviour, since the dispatcher updates its tables. Arguments
+         *        widened for a fixed arity dispatcher only keep what is valid on an i64.
+         *
+         * @param ctx Module context.
+         * @param p_call Call being replaced.
+         * @param p_callee Function called by p_call.
+         * @param p_dispatcherType Type of the dispatcher.
+         * @return AttributeList Attributes for the dispatcher call.
+         */
+        static AttributeList createDispatcherCallAttributes(LLVMContext &ctx, const CallInst *p_call, const Function *p_callee,
+                                                            FunctionType *p_dispatcherType);
+
+        /**
+         * @brief Creates the _FUNCTION_TABLE_ENTRY type.
+         *
+         * @param ctx Module context.
+         * @return StructType* Entry type.
+         */
+        static StructType *createFunctionTableEntryType(LLVMContext &ctx);
+
+        /**
+         * @brief Creates an object of type _FUNCTION_TABLE_ENTRY, and partially initializes it.
+         *
+         * @param ctx Module context.
+         * @param p_functionTableEntryStruct Entry type.
+         * @param info Function information to partially initialize the entry.
+         * @return Constant* Value containing the entry.
+         */
+        static Constant *createFunctionTableEntry(LLVMContext &ctx, StructType *p_functionTableEntryStruct, const FunctionInfo &info);
+
+        /**
+         * @brief Creates the _FUNCTION_LOAD_ENTRY type.
+         *
+         * @param ctx Module context.
+         * @return StructType* Entry type.
+         */
+        static StructType *createFunctionLoadEntryType(LLVMContext &ctx);
+
+        /**
+         * @brief Creates an array of objects of type _FUNCTION_LOAD_ENTRY, in function table order.
+         *
+         * @param ctx Module context.
+         * @param functionInfo Function information to initialize the array.
+         * @return Constant* Value containing the array.
+         */
+        static Constant *createFunctionLoadTable(LLVMContext &ctx, const vector<FunctionInfo> &functionInfo);
 
         /**
          * @brief Creates an array of objects of type _FUNCTION_TABLE_ENTRY, and partially initializes it.
@@ -121,7 +420,7 @@ namespace callobfuscator
          * @return Constant* Value containing the array.
          *         NOTE: In LLVM, Values represents functions, variables...
          */
-        static Constant *createFunctionTableArray(LLVMContext &ctx, ArrayType **pp_functionTableEntryStruct, vector<FunctionInfo> functionInfo);
+        static Constant *createFunctionTableArray(LLVMContext &ctx, ArrayType **pp_functionTableEntryStruct, const vector<FunctionInfo> &functionInfo);
 
         /**
          * @brief Creates an array of objects of type _DLL_TABLE_ENTRY, and partially initializes it.
@@ -129,10 +428,12 @@ namespace callobfuscator
          * @param ctx Module context.
          * @param pp_dllTableEntryStruct [OUT] Returns the array definition indicating entry type and size.
          * @param dlls Dll information to partially initialize table
+         * @param dllNames Names of the dlls, in the same order, hashed into the entries.
          * @return Constant* Value containing the array.
          *         NOTE: In LLVM, Values represents functions, variables...
          */
-        static Constant *createDllTableArray(LLVMContext &ctx, ArrayType **pp_dllTableEntryStruct, vector<Constant *> dlls);
+        static Constant *createDllTableArray(LLVMContext &ctx, ArrayType **pp_dllTableEntryStruct, const vector<Constant *> &dlls,
+                                             const vector<StringRef> &dllNames);
 
         /**
          * @brief Creates an objects of type _FUNCTION_TABLE, and partially initializes it.
@@ -143,7 +444,7 @@ namespace callobfuscator
          * @return Constant* Value containing the object.
          *         NOTE: In LLVM, Values represents functions, variables...
          */
-        static Constant *createFunctionTable(LLVMContext &ctx, StructType **pp_functionTableStruct, vector<FunctionInfo> functionInfo);
+        static Constant *createFunctionTable(LLVMContext &ctx, StructType **pp_functionTableStruct, const vector<FunctionInfo> &functionInfo);
 
         /**
          * @brief Creates an objects of type _DLL_TABLE, and partially initializes it.
@@ -151,10 +452,66 @@ namespace callobfuscator
          * @param ctx Module context.
          * @param pp_dllTableEntryStruct [OUT] Returns object definition.
          * @param dlls Dll information to partially initialize table.
+         * @param dllNames Names of the dlls, in the same order.
          * @return Constant* Value containing the object.
          *         NOTE: In LLVM, Values represents functions, variables...
          */
-        static Constant *createDllTable(LLVMContext &ctx, StructType **pp_dllTableEntryStruct, vector<Constant *> dlls);
+        static Constant *createDllTable(LLVMContext &ctx, StructType **pp_dllTableEntryStruct, const vector<Constant *> &dlls,
+                                        const vector<StringRef> &dllNames);
+
+        /**
+         * @brief Creates the _DLL_TABLE_ENTRY type, shared by the dll table and the dll fragments.
+         *
+         * @param ctx Module context.
+         * @return StructType* Entry type.
+         */
+        static StructType *createDllTableEntryType(LLVMContext &ctx);
+
+        /**
+         * @brief Creates an object of type _DLL_TABLE_ENTRY, with the hash of the dll name
+         *        computed here, so the helpers dont hash it on every load.
+         *
+         * @param ctx Module context.
+         * @param p_dllTableEntryStruct Entry type.
+         * @param p_name Name string of the dll.
+         * @param dllName Name of the dll.
+         * @return Constant* Value containing the entry.
+         */
+        static Constant *createDllTableEntry(LLVMContext &ctx, StructType *p_dllTableEntryStruct, Constant *p_name, StringRef dllName);
+
+        /**
+         * @brief Adds every function with an instruction using the given value, directly or
+         *        through constant expressions, to the modified functions.
+         *
+         * @param p_value Value about to be replaced.
+         */
+        void addModifiedUsers(Value *p_value);
+
+        /**
+         * @brief Defines an externally visible table in the module. If the module
+         *        already declares it (but does not define it), the declaration is
+         *        replaced by the definition.
+         *
+         * @param M Module to define the table in.
+         * @param name Symbol name of the table.
+         * @param p_initializer Table contents.
+         * @return GlobalVariable* The table, or NULL if the module already defines it.
+         */
+        static GlobalVariable *defineTable(Module &M, StringRef name, Constant *p_initializer);
+
+        /**
+         * @brief Defines a fragment entry in the module as a COMDAT any, so the linker keeps
+         *        one among all the modules defining it. Declarations are replaced, as in
+         *        defineTable, marking the functions using them as modified, and definitions
+         *        are returned as they are.
+         *
+         * @param M Module to define the entry in.
+         * @param name Symbol name of the entry.
+         * @param p_initializer Entry contents.
+         * @param created [OUT] Returns if the entry was created by this call.
+         * @return GlobalVariable* The entry.
+         */
+        GlobalVariable *getOrInsertFragment(Module &M, StringRef name, Constant *p_initializer, bool &created);
     };
 
 }
@@ -0,0 +1,199 @@
+/**
+ * @file CallObfuscatorConfig.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Validation and indexing of the hook configuration file.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CALL_OBFUSCATOR_CONFIG_H_
+#define _CALL_OBFUSCATOR_CONFIG_H_
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define DLL_HOOKS_KEY "dll_hooks"
+#define DLL_NAME_KEY "dll_name"
+#define FUNCTION_HOOKS_KEY "hooked_functions"
+#define HOTNESS_POLICY_KEY "hotness_policy"
+#define EXEMPT_ABOVE_ENTRY_PERCENT_KEY "exempt_above_entry_percent"
+#define DISPATCH_BUDGET_KEY "dispatch_budget"
+
+// Compiled config, stored next to the json one as <config path>COMPILED_CONFIG_EXTENSION
+//
+// > char[8] magic
+// > u_int32 version
+// > u_int32 padding
+// > u_int64 contentHash (xxHash64 of the json file it was compiled from)
+// > u_int32 dllCount
+// > u_int32 hookCount
+// > u_int32 bucketCount (power of 2, open addressing with linear probing)
+// > u_int32 stringsSize
+// > u_int32 exemptAboveEntryPercent (hotness policy, 0 for none)
+// > u_int32 padding
+// > u_int64 dispatchBudget (hotness policy, 0 for none)
+// > _DLL_RECORD[dllCount] {u_int32 offset, u_int32 length}
+// > _HOOK_BUCKET[bucketCount] {u_int32 djbHash, u_int32 dllId, u_int32 offset, u_int32 length}
+// > char[stringsSize] strings
+//
+// Every value is little endian, and every offset is relative to the strings blob.
+#define COMPILED_CONFIG_EXTENSION ".compiled"
+#define COMPILED_CONFIG_MAGIC "CALLOBFC"
+#define COMPILED_CONFIG_VERSION 2
+#define COMPILED_CONFIG_HEADER_SIZE 56
+#define COMPILED_CONFIG_DLL_RECORD_SIZE 8
+#define COMPILED_CONFIG_BUCKET_SIZE 16
+#define COMPILED_CONFIG_EMPTY_BUCKET 0xFFFFFFFF
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorconfig
+{
+    // Calls to hooked functions left direct because they run too often to go through the
+    // dispatcher. Only applied to modules with profile data.
+    struct HotnessPolicy
+    {
+        uint32_t exemptAboveEntryPercent = 0; // Call sites running more times than this % of the entries of their function, 0 for none
+        uint64_t dispatchBudget = 0;          // Max expected dispatches per run, the hottest call sites are left direct first, 0 for none
+
+        /**
+         * @return true Any of the limits is set.
+         */
+        bool isEnabled() const;
+    };
+
+    class CallObfuscatorConfig
+    {
+    private:
+        BumpPtrAllocator allocator; // Owns the dll names, so they dont depend on the json buffer
+        vector<StringRef> dllNames;
+        StringMap<unsigned int> hookIndex; // Function name -> index in dllNames
+        HotnessPolicy hotnessPolicy;
+
+        // Only set when loaded from a compiled config. Lookups are done in place
+        // over the mapped file, and every returned StringRef points into it.
+        unique_ptr<MemoryBuffer> compiledBuffer;
+        const char *p_compiledBuckets = nullptr;
+        const char *p_compiledStrings = nullptr;
+        uint32_t compiledBucketCount = 0;
+        uint32_t compiledHookCount = 0;
+        uint32_t compiledStringsSize = 0;
+
+    public:
+        /**
+         * @brief Validates the given json config and compiles it into the hook index.
+         *        The whole file is checked once, so any malformed entry is reported
+         *        here through errs(), and the index is left empty.
+         *
+         * @param buffer Contents of the config file.
+         * @return true Success.
+         */
+        bool loadJson(StringRef buffer);
+
+        /**
+         * @brief Uses a compiled config as the hook index, without copying it. The
+         *        buffer is kept alive by this object, and is expected to be a file mapping.
+         *
+         * @param buffer Contents of the compiled config.
+         * @param contentHash Hash of the json config it must have been compiled from.
+         * @return true Success. False if the buffer is not a valid compiled config for
+         *         the given hash (missing, stale or corrupted).
+         */
+        bool loadCompiled(unique_ptr<MemoryBuffer> buffer, uint64_t contentHash);
+
+        /**
+         * @brief Stores the index built by loadJson as a compiled config. The file is
+         *        written under a temporary name and then renamed, so concurrent
+         *        readers never see partial files.
+         *
+         * @param path Path of the compiled config.
+         * @param contentHash Hash of the json config the index was built from.
+         * @return true Success.
+         */
+        bool writeCompiled(StringRef path, uint64_t contentHash) const;
+
+        /**
+         * @brief Hash used to tie a compiled config to the json it was compiled from.
+         *
+         * @param buffer Contents of the json config.
+         * @return uint64_t Content hash.
+         */
+        static uint64_t hashContent(StringRef buffer);
+
+        /**
+         * @return true The index is being served from a compiled config.
+         */
+        bool isCompiled() const;
+
+        /**
+         * @brief Check if the given function is indicated as hooked in the configuration file.
+         *        Costs a single hash lookup.
+         *
+         * @param functionName Name of the function to check.
+         * @param dllName [OUT] Returns dll name, if hooked.
+         * @return true Function is hooked.
+         */
+        bool isFunctionHooked(StringRef functionName, StringRef &dllName) const;
+
+        /**
+         * @return const HotnessPolicy& Policy for hot call sites, disabled if not in the config.
+         */
+        const HotnessPolicy &getHotnessPolicy() const;
+
+        /**
+         * @return size_t Number of hooked functions in the index.
+         */
+        size_t hookCount() const;
+
+        /**
+         * @return size_t Number of different dlls in the index.
+         */
+        size_t dllCount() const;
+
+    private:
+        /**
+         * @brief Returns the id of the given dll name, storing it if not seen before.
+         *
+         * @param dllName Name of the dll.
+         * @param dllIds Dll name -> id, only used while building the index.
+         * @return unsigned int Index in dllNames.
+         */
+        unsigned int internDll(StringRef dllName, StringMap<unsigned int> &dllIds);
+
+        /**
+         * @brief Validates the optional HOTNESS_POLICY_KEY object of the config. Errors are
+         *        reported through errs().
+         *
+         * @param root Root of the json config.
+         * @param policy [OUT] Returns the policy, disabled if not present.
+         * @return true Success.
+         */
+        static bool parseHotnessPolicy(const json::Object &root, HotnessPolicy &policy);
+    };
+}
+
+#endif
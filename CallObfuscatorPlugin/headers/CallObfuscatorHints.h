@@ -0,0 +1,85 @@
+/**
+ * @file CallObfuscatorHints.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Export hints: where each hooked function is in the exports of a reference copy
+ *        of its dll, so the helpers can check it in O(1) before searching by hash.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CALL_OBFUSCATOR_HINTS_H_
+#define _CALL_OBFUSCATOR_HINTS_H_
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+
+// Hint of a function no reference dll knows about, the helpers search it by hash. Must match the helpers.
+#define EXPORT_HINT_NONE 0
+
+// Hints are 16 bits in the load entries, names past this position get none
+#define EXPORT_HINT_MAX 0xFFFF
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorhints
+{
+    /**
+     * @brief Reads the export directories of the reference dlls found in a folder, each one
+     *        the first time a function of it is asked for. A hint is 1 + the index of the
+     *        name in AddressOfNames. It is only a guess: the dll at runtime may be another
+     *        version, so the helpers hash the name at that index before taking it.
+     */
+    class ExportHints
+    {
+    private:
+        string folder;
+        StringMap<StringMap<uint32_t>> dlls; // Lowercase dll name -> exported name -> hint, empty if it couldnt be read
+
+    public:
+        ExportHints(StringRef folder);
+
+        /**
+         * @brief Finds the hint of a function.
+         *
+         * @param dllName Dll exporting the function, looked up in the folder as given, then lowercase.
+         * @param functionName Exported name of the function.
+         * @return uint32_t Hint, or EXPORT_HINT_NONE if the dll or the function are not there, or the
+         *         hint would be over EXPORT_HINT_MAX.
+         */
+        uint32_t getHint(StringRef dllName, StringRef functionName);
+
+        /**
+         * @brief Reads the exported names of a PE32+ dll. Only the headers and the export
+         *        directory are read, every offset is checked against the file.
+         *
+         * @param path Dll file.
+         * @param names [OUT] Returns the hint of every exported name.
+         * @param error [OUT] Returns the reason of the failure, if any.
+         * @return true Success.
+         */
+        static bool readExports(StringRef path, StringMap<uint32_t> &names, string &error);
+    };
+}
+
+#endif
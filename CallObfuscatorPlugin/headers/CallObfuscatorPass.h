@@ -26,29 +26,110 @@
 #define _CALL_OBFUSCATOR_PASS_H_
 
 #include "llvm/IR/PassManager.h"
-#include "llvm/Support/JSON.h"
+
+#include <memory>
+#include <string>
+
+#include "CallObfuscatorConfig.h"
+#include "CallObfuscatorHints.h"
+
+#define CALL_OBF_PASS_NAME "callobfuscator-pass"
+#define CALL_OBF_PLUGIN_VERSION "v0.1"
 
 #define LLVM_CALL_OBF_CONFIG_PATH "LLVM_OBF_FUNCTIONS"
+#define LLVM_CALL_OBF_EXTENSION_POINT "LLVM_OBF_EXTENSION_POINT" // start (default), last, lto or none
+#define LLVM_CALL_OBF_TABLES "LLVM_OBF_TABLES" // module (default) or fragments
+#define LLVM_CALL_OBF_DISPATCH "LLVM_OBF_DISPATCH" // variadic (default) or arity
+#define LLVM_CALL_OBF_RESOLVE "LLVM_OBF_RESOLVE" // lazy (default) or eager
+#define LLVM_CALL_OBF_VERBOSITY "LLVM_OBF_VERBOSITY" // Same as -callobf-verbosity, for drivers that load the plugin after parsing options
+#define LLVM_CALL_OBF_ANALYZE "LLVM_OBF_ANALYZE" // 1 to only analyze modules, leaving them untouched
+#define LLVM_CALL_OBF_REPORT "LLVM_OBF_REPORT" // Json report of the hooked call sites, a file or a folder
+#define LLVM_CALL_OBF_HINTS "LLVM_OBF_HINTS" // Folder with reference dlls, to emit the export hints
 
-#define DLL_HOOKS_KEY "dll_hooks"
-#define DLL_NAME_KEY "dll_name"
-#define FUNCTION_HOOKS_KEY "hooked_functions"
+#ifdef _WIN32
+#define PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define PLUGIN_EXPORT // Exported by default
+#endif
 
 #define DO_PRAGMA(x) _Pragma(#x)
+#ifdef __clang__
 #define NOWARN(warnoption, ...)                  \
     DO_PRAGMA(GCC diagnostic push)               \
     DO_PRAGMA(GCC diagnostic ignored warnoption) \
     __VA_ARGS__                                  \
     DO_PRAGMA(GCC diagnostic pop)
+#else
+#define NOWARN(warnoption, ...) __VA_ARGS__ // Only clang knows the warnings silenced here
+#endif
 
+using namespace std;
 using namespace llvm;
-using namespace json;
+using namespace callobfuscatorconfig;
+
+namespace callobfuscator
+{
+    class CallObfuscator;
+}
+
+namespace callobfuscatorreport
+{
+    struct CallSiteCost;
+}
 
 namespace callobfuscatorpass
 {
+    struct CallObfuscatorPassOptions
+    {
+        string configPath;           // Empty to take it from LLVM_CALL_OBF_CONFIG_PATH
+        string tables;               // module or fragments, empty to take it from LLVM_CALL_OBF_TABLES
+        string dispatch;             // variadic or arity, empty to take it from LLVM_CALL_OBF_DISPATCH
+        string resolve;              // lazy or eager, empty to take it from LLVM_CALL_OBF_RESOLVE
+        int verbosity = -1;          // Negative to keep the one set by -callobf-verbosity or LLVM_CALL_OBF_VERBOSITY
+        bool skipLTOPreLink = false; // Leave modules that will go through full LTO to the link step
+        bool fullLTOLink = false;    // Running over the merged program of a full LTO link, tables can be used
+        bool analysisOnly = false;   // Only report what would be hooked, leaving the module untouched
+        string reportPath;           // Json report of the hooked call sites, empty to take it from LLVM_CALL_OBF_REPORT
+        string hintsPath;            // Folder with reference dlls, empty to take it from LLVM_CALL_OBF_HINTS
+
+        // Already loaded config, shared by every pass built with these options instead of
+        // reading configPath. Only queried, so the passes may run in different threads.
+        shared_ptr<const CallObfuscatorConfig> config;
+    };
+
     class CallObfuscatorPass : public PassInfoMixin<CallObfuscatorPass>
     {
     public:
+        CallObfuscatorPass(CallObfuscatorPassOptions options = CallObfuscatorPassOptions());
+
+        /**
+         * @brief Parses the parameters given in a pipeline, as in
+         *        CALL_OBF_PASS_NAME<config=path;tables=fragments;dispatch=arity;resolve=eager;analyze;report=path;
+         *        hints=path;verbosity=N>. Errors are reported through errs().
+         *
+         * @param params Text between the angle brackets.
+         * @param options [OUT] Returns the parsed options.
+         * @return true Success.
+         */
+        static bool parsePassOptions(StringRef params, CallObfuscatorPassOptions &options);
+
+        /**
+         * @brief Reads the given config file, validates it, and builds the hook index. The
+         *        compiled config next to it is used when up to date, and refreshed otherwise.
+         *
+         * @param configPath Path of the json config.
+         * @param config [OUT] Returns the indexed config.
+         * @param p_contentHash [OUT] Optional, returns the content hash of the json config.
+         * @return true Success.
+         */
+        static bool loadConfig(StringRef configPath, CallObfuscatorConfig &config, uint64_t *p_contentHash = nullptr);
+
+        /**
+         * @brief Applies LLVM_CALL_OBF_VERBOSITY, if set. Only the first call in the process
+         *        reads it, so it can be called from any thread.
+         */
+        static void readVerbosity();
+
         /**
          * @brief Function invoked by opt for each module given.
          *
@@ -59,26 +140,62 @@ namespace callobfuscatorpass
         PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
 
     private:
-        bool configLoaded;
-        bool fileMalformed;
-        Object jsonConfig;
+        CallObfuscatorPassOptions options;
+        bool configLoaded = false;
+        shared_ptr<const CallObfuscatorConfig> config; // Validated and indexed once, queried for every function
+        bool hintsLoaded = false;
+        shared_ptr<callobfuscatorhints::ExportHints> hints; // Null without reference dlls
 
         /**
-         * @brief Check if the given function is indicated as hooked in the configuration file.
+         * @brief Reads config file given in the pass options, or else from LLVM_OBF_FUNCTIONS
+         *        env variable, validates it, and builds the hook index.
          *
-         * @param argFunctionName Name of the function to check.
-         * @param argDllName [OUT] Returns dll name, if hooked.
-         * @return true Function is hooked.
+         * @return true Success.
          */
-        bool isFunctionHooked(StringRef argFunctionName, StringRef &argDllName);
+        bool readConfig();
 
         /**
-         * @brief Reads config file from LLVM_OBF_FUNCTIONS env variable.
+         * @brief Hint of a hooked function, from the reference dlls in the folder given in the
+         *        pass options, or else in LLVM_OBF_HINTS env variable.
          *
-         * @param jsonConfig [OUT] Returns json config.
-         * @return true Success.
+         * @param dllName Dll exporting the function.
+         * @param functionName Name of the function.
+         * @return uint32_t Hint, or EXPORT_HINT_NONE without reference dlls.
+         */
+        uint32_t getExportHint(StringRef dllName, StringRef functionName);
+
+        /**
+         * @brief Check if the module is being prepared for full LTO, so it will be merged and
+         *        go through the pass again at link time.
+         *
+         * @param M Module to check.
+         * @return true Module is a full LTO pre link module.
+         */
+        static bool isLTOPreLink(const Module &M);
+
+        /**
+         * @brief Check if the module was built for LTO, thin or full. Such modules may never be
+         *        seen along the rest of the program by the pass: ThinLTO backends only get their
+         *        own module, and full LTO modules obfuscated before the link are merged with
+         *        others, so they must use fragments. The merged module of a full LTO link keeps
+         *        the flags, it is told apart with CallObfuscatorPassOptions::fullLTOLink.
+         *
+         * @param M Module to check.
+         * @return true Module was built for LTO.
+         */
+        static bool isLTOModule(const Module &M);
+
+        /**
+         * @brief Leaves direct the calls to hooked functions that the hotness policy of the
+         *        config finds too hot to go through the dispatcher, and reports each of them.
+         *        Only meant for modules with profile data, static estimates cant tell how
+         *        often a loop runs.
+         *
+         * @param M Module being obfuscated.
+         * @param obf Obfuscator the hooked functions were added to, not yet finalized.
+         * @param costs [IN/OUT] Calls to the hooked functions, exempt ones are marked.
          */
-        bool readConfig(Object &jsonConfig);
+        void applyHotnessPolicy(Module &M, callobfuscator::CallObfuscator &obf, MutableArrayRef<callobfuscatorreport::CallSiteCost> costs);
     };
 
 }
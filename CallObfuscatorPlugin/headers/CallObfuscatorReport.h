@@ -0,0 +1,114 @@
+/**
+ * @file CallObfuscatorReport.h
+ * @author Alejandro González (@httpyxel)
+ * @brief Cost of the hooked call sites of a module, as a json report and as remarks.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CALL_OBFUSCATOR_REPORT_H_
+#define _CALL_OBFUSCATOR_REPORT_H_
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/JSON.h"
+
+#include <string>
+#include <vector>
+
+#include "CallObfuscator.h"
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscator;
+
+namespace callobfuscatorreport
+{
+    // A call to a hooked function, and how often it is expected to run
+    struct CallSiteCost
+    {
+        const CallInst *p_call; // Only valid until the module is finalized
+        Function *p_callee;
+        Function *p_caller;
+        const BasicBlock *p_block; // Still valid once the call is rewritten
+        DebugLoc location;
+        double entryPercent = 0; // Runs per entry of the caller, in %, from the block frequencies
+        uint64_t count = 0;      // Expected runs per execution, only with profile data
+        bool exempt = false;     // Left direct by the hotness policy
+    };
+
+    /**
+     * @brief Collects every call to the given functions, in module order, along with the
+     *        frequency of its block. Block frequencies are only computed for the callers.
+     *
+     * @param M Module to walk.
+     * @param FAM Function analysis manager of the module.
+     * @param hookedFunctions Functions hooked by the config.
+     * @param costs [OUT] Returns the call sites.
+     */
+    void collectCallSiteCosts(Module &M, FunctionAnalysisManager &FAM, ArrayRef<Function *> hookedFunctions,
+                              vector<CallSiteCost> &costs);
+
+    /**
+     * @brief Builds the json report of a module: per hooked function, its dll, its call
+     *        sites, grouped by caller, and their frequencies, plus the size of the tables.
+     *
+     * @param M Module the call sites belong to.
+     * @param obf Obfuscator of the module, finalized or analyzed.
+     * @param costs Call sites, from collectCallSiteCosts.
+     * @param analysisOnly The module was left untouched.
+     * @param success The module was (or could be) obfuscated.
+     * @param hasProfile Counts come from profile data.
+     * @return json::Value Report.
+     */
+    json::Value createReport(const Module &M, const CallObfuscator &obf, ArrayRef<CallSiteCost> costs, bool analysisOnly,
+                             bool success, bool hasProfile);
+
+    /**
+     * @brief Writes a report. If the path is a folder, the report is written into it as
+     *        <module file name>.<hash>.callobf.json, the hash being the one of the whole
+     *        module identifier, so every module of a build gets its own.
+     *
+     * @param path Report file, or folder.
+     * @param M Module the report is about.
+     * @param report Report, from createReport.
+     * @return true Success. Errors are reported through errs().
+     */
+    bool writeReport(StringRef path, const Module &M, const json::Value &report);
+
+    /**
+     * @brief Emits a remark for every call site, under DEBUG_TYPE, as in -Rpass=callobfuscator.
+     *        Hooked calls are reported as remarks, exempt ones as missed remarks.
+     *
+     * @param costs Call sites, from collectCallSiteCosts.
+     * @param obf Obfuscator of the module, for the dll of every callee.
+     * @param analysisOnly The calls were not rewritten, only analyzed.
+     */
+    void emitRemarks(ArrayRef<CallSiteCost> costs, const CallObfuscator &obf, bool analysisOnly);
+
+    /**
+     * @param M Module being obfuscated.
+     * @return true Remarks of the pass are shown or saved, so they are worth building.
+     */
+    bool remarksEnabled(const Module &M);
+}
+
+#endif
@@ -24,52 +24,76 @@
 
 #include "CallObfuscator.h"
 
+#include "common/hash.h"
+
 #include <typeinfo>
 
 #include "llvm/Support/CommandLine.h"
 
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Attributes.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
 #include "llvm/Support/JSON.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/IR/LLVMContext.h"
-
-#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <ostream>
 #include <iostream>
-#include <format>
 #include <string>
 #include <iomanip>
+#include <numeric>
 
 using namespace std;
 using namespace llvm;
 
+#define DEBUG_TYPE "callobfuscator"
+
+STATISTIC(NumCallSitesRewritten, "Number of call sites rewritten to the dispatcher");
+STATISTIC(NumFunctionTableEntries, "Number of function table entries emitted");
+STATISTIC(NumDllTableEntries, "Number of dll table entries emitted");
+STATISTIC(NumArityDispatches, "Number of call sites rewritten to a fixed arity dispatcher");
+
 namespace callobfuscator
 {
-    CallObfuscator::CallObfuscator(Module &module) : mod(module)
+    unsigned int verbosity = VERBOSITY_SILENT;
+
+    static cl::opt<unsigned int, true> verbosityOption(
+        "callobf-verbosity",
+        cl::desc("Verbosity of the call obfuscator messages (0: silent, 1: summary, 2: detail)"),
+        cl::location(verbosity), cl::Hidden);
+
+    raw_ostream &info(unsigned int level)
+    {
+        if (verbosity >= level)
+            return outs();
+
+        return nulls();
+    }
+
+    PhaseTimer::PhaseTimer(StringRef name, StringRef description)
+        : traceScope(("CallObfuscator " + name).str()),
+          regionTimer(name, description, CALL_OBF_TIMER_GROUP, CALL_OBF_TIMER_GROUP_DESC, TimePassesIsEnabled)
+    {
+    }
+
+    CallObfuscator::CallObfuscator(Module &module, bool useFragments, bool useArityDispatchers, bool eagerResolution)
+        : mod(module), useFragments(useFragments), useArityDispatchers(useArityDispatchers), eagerResolution(eagerResolution)
     {
         __changedModule = false;
         __locked = false;
         functionList = std::vector<callobfuscator::FunctionInfo>();
-
-        tmpMod = new Module("__callobf_tmpMod", module.getContext());
-        tmpMod->setDataLayout(module.getDataLayout());
     }
 
-    unsigned long long hashStr(StringRef str)
+    // The helpers hash the names the same way, both take the hash from common/hash.h
+    uint32_t hashStr(StringRef str)
     {
-        unsigned long long h;
-        char c;
-
-        h = 0;
-        for (char p : str)
-        {
-            c = (p >= 65 && p <= 90) ? p + 32 : p;
-            h = 37 * h + c;
-        }
-        return h;
+        return __callobf_hashLengthA(str.data(), str.size());
     }
 
     bool CallObfuscator::addHook(const FunctionInfo &functionInfo)
@@ -78,68 +102,151 @@ namespace callobfuscator
         if (__locked)
             return false;
 
-        FunctionInfo info = functionInfo;
-        bool found = false;
-        for (auto entry : functionList) // This thing looks so bad
+        // Entries keep the argument count in a byte, and dll indexes in a word
+        if (functionInfo.function.arg_size() > UINT8_MAX || dllNames.size() > UINT16_MAX)
         {
-            if (entry.function.getName().equals(info.function.getName()))
-            {
-                found = true;
-                break;
-            }
+            errs() << "[ERROR] Too many arguments or dlls to hook " << functionInfo.function.getName() << "\n";
+            return false;
         }
 
-        if (!found)
-        {
-            unsigned long dllHash = hashStr(info.dllName);
-            unsigned long functionHash = hashStr(info.dllName);
+        // Registering a function twice is not an error, it is just hooked once
+        auto insertedFunction = functionIndex.try_emplace(&functionInfo.function, functionList.size());
+        if (!insertedFunction.second)
+            return true;
 
-            info.modIndex = find(dllHashes.begin(), dllHashes.end(), dllHash) - dllHashes.begin();
+        FunctionInfo info = functionInfo;
 
-            if (info.modIndex >= dllHashes.size())
-            {
-                info.modIndex = dllHashes.size();
-                dllNames.push_back(info.dllName);
-                dllHashes.push_back(dllHash);
-            }
+        // Dlls were told apart by their (case insensitive) hash, so intern them by lowercase name
+        auto insertedDll = dllIndex.try_emplace(info.dllName.lower(), dllNames.size());
+        if (insertedDll.second)
+            dllNames.push_back(info.dllName);
 
-            info.argCount = info.function.arg_size();
-            functionList.push_back(info);
-        }
+        info.modIndex = insertedDll.first->second;
+        info.argCount = info.function.arg_size();
+        functionList.push_back(info);
 
         return true;
     }
 
-    Constant *CallObfuscator::createFunctionTableArray(LLVMContext &ctx, ArrayType **pp_functionTableEntryStruct, vector<FunctionInfo> functionInfo)
+    bool CallObfuscator::exemptCall(const CallInst *p_call)
     {
+        if (__locked)
+            return false;
 
-        // _FUNCTION_TABLE_ENTRY (24 bytes -> 64bits; 20 bytes -> 32bits)
-        // > u_int32 hash
-        // > u_int32 moduleIndex
-        // > u_int32 argCount
-        // > u_int32 ssn
+        exemptCalls.insert(p_call);
+        return true;
+    }
+
+    void CallObfuscator::sortHooks()
+    {
+        vector<unsigned long> dllOrder(dllNames.size());
+        iota(dllOrder.begin(), dllOrder.end(), 0);
+        llvm::sort(dllOrder, [this](unsigned long a, unsigned long b)
+                   { return dllNames[a].compare_insensitive(dllNames[b]) < 0; });
+
+        vector<unsigned long> newDllIndex(dllNames.size());
+        vector<StringRef> sortedDllNames;
+        for (unsigned long i = 0; i < dllOrder.size(); i++)
+        {
+            newDllIndex[dllOrder[i]] = i;
+            sortedDllNames.push_back(dllNames[dllOrder[i]]);
+        }
+
+        dllNames = std::move(sortedDllNames);
+        for (auto &entry : dllIndex)
+            entry.second = newDllIndex[entry.second];
+
+        // FunctionInfo holds a reference, so the list is rebuilt instead of sorted in place
+        vector<unsigned long> functionOrder(functionList.size());
+        iota(functionOrder.begin(), functionOrder.end(), 0);
+        llvm::sort(functionOrder, [this](unsigned long a, unsigned long b)
+                   { return functionList[a].function.getName() < functionList[b].function.getName(); });
+
+        vector<FunctionInfo> sortedFunctionList;
+        sortedFunctionList.reserve(functionList.size());
+        for (unsigned long i = 0; i < functionOrder.size(); i++)
+        {
+            sortedFunctionList.push_back(functionList[functionOrder[i]]);
+            sortedFunctionList.back().modIndex = newDllIndex[sortedFunctionList.back().modIndex];
+            functionIndex[&sortedFunctionList.back().function] = i;
+        }
+
+        functionList = std::move(sortedFunctionList);
+    }
+
+    StructType *CallObfuscator::createFunctionTableEntryType(LLVMContext &ctx)
+    {
+        // _FUNCTION_TABLE_ENTRY (16 bytes -> 64bits; 12 bytes -> 32bits)
         // > void *functionPtr
+        // > u_int16 ssn
+        // > u_int8 argCount
+        // > u_int8 flags
+        // > u_int32 state (0 until the helpers resolve the entry)
         StructType *p_functionTableEntryStruct = StructType::create(ctx, "_FUNCTION_TABLE_ENTRY");
 
         p_functionTableEntryStruct->setBody(
+            {PointerType::get(ctx, 0),
+             IntegerType::get(ctx, 16),
+             IntegerType::get(ctx, 8),
+             IntegerType::get(ctx, 8),
+             IntegerType::get(ctx, 32)},
+            true);
+
+        return p_functionTableEntryStruct;
+    }
+
+    Constant *CallObfuscator::createFunctionTableEntry(LLVMContext &ctx, StructType *p_functionTableEntryStruct, const FunctionInfo &info)
+    {
+        return ConstantStruct::get(
+            p_functionTableEntryStruct,
+            {ConstantPointerNull::get(PointerType::get(ctx, 0)),
+             ConstantInt::get(IntegerType::get(ctx, 16), info.ssn & 0xFFFF),
+             ConstantInt::get(IntegerType::get(ctx, 8), info.argCount),
+             ConstantInt::get(IntegerType::get(ctx, 8), info.isSyscall ? FUNCTION_ENTRY_SYSCALL : 0),
+             ConstantInt::get(IntegerType::get(ctx, 32), 0)});
+    }
+
+    StructType *CallObfuscator::createFunctionLoadEntryType(LLVMContext &ctx)
+    {
+        // _FUNCTION_LOAD_ENTRY (8 bytes)
+        // > u_int32 hash
+        // > u_int16 moduleIndex
+        // > u_int16 exportHint (1 + index of the name in the exports of the reference dll, 0 if unknown or over EXPORT_HINT_MAX)
+        StructType *p_functionLoadEntryStruct = StructType::create(ctx, "_FUNCTION_LOAD_ENTRY");
+
+        p_functionLoadEntryStruct->setBody(
             {IntegerType::get(ctx, 32),
-             IntegerType::get(ctx, 32),
-             IntegerType::get(ctx, 32),
-             IntegerType::get(ctx, 32),
-             PointerType::get(ctx, 0)},
+             IntegerType::get(ctx, 16),
+             IntegerType::get(ctx, 16)},
             true);
 
-        vector<Constant *> functionTableEntries;
-        for (FunctionInfo info : functionInfo)
-        {
-            functionTableEntries.push_back(ConstantStruct::get(
-                p_functionTableEntryStruct,
+        return p_functionLoadEntryStruct;
+    }
+
+    Constant *CallObfuscator::createFunctionLoadTable(LLVMContext &ctx, const vector<FunctionInfo> &functionInfo)
+    {
+        StructType *p_functionLoadEntryStruct = createFunctionLoadEntryType(ctx);
+
+        vector<Constant *> functionLoadEntries;
+        functionLoadEntries.reserve(functionInfo.size());
+        for (const FunctionInfo &info : functionInfo)
+            functionLoadEntries.push_back(ConstantStruct::get(
+                p_functionLoadEntryStruct,
                 {ConstantInt::get(IntegerType::get(ctx, 32), hashStr(info.function.getName())),
-                 ConstantInt::get(IntegerType::get(ctx, 32), info.modIndex),
-                 ConstantInt::get(IntegerType::get(ctx, 32), info.argCount),
-                 ConstantInt::get(IntegerType::get(ctx, 32), info.ssn),
-                 ConstantPointerNull::get(PointerType::get(ctx, 0))}));
-        }
+                 ConstantInt::get(IntegerType::get(ctx, 16), info.modIndex),
+                 ConstantInt::get(IntegerType::get(ctx, 16), info.exportHint)}));
+
+        return ConstantArray::get(ArrayType::get(p_functionLoadEntryStruct, functionLoadEntries.size()), functionLoadEntries);
+    }
+
+    Constant *CallObfuscator::createFunctionTableArray(LLVMContext &ctx, ArrayType **pp_functionTableEntryStruct, const vector<FunctionInfo> &functionInfo)
+    {
+        StructType *p_functionTableEntryStruct = createFunctionTableEntryType(ctx);
+
+        vector<Constant *> functionTableEntries;
+        functionTableEntries.reserve(functionInfo.size());
+        for (const FunctionInfo &info : functionInfo)
+            functionTableEntries.push_back(createFunctionTableEntry(ctx, p_functionTableEntryStruct, info));
 
         *pp_functionTableEntryStruct = ArrayType::get(p_functionTableEntryStruct, functionTableEntries.size());
 
@@ -148,54 +255,76 @@ namespace callobfuscator
         // TODO: check this by modifying the vector after a call to get
     }
 
-    Constant *CallObfuscator::createFunctionTable(LLVMContext &ctx, StructType **pp_functionTableStruct, vector<FunctionInfo> functionInfo)
+    Constant *CallObfuscator::createFunctionTable(LLVMContext &ctx, StructType **pp_functionTableStruct, const vector<FunctionInfo> &functionInfo)
     {
-        // _FUNCTION_TABLE
+        // _FUNCTION_TABLE (header of 16 bytes, so entries stay 16 byte aligned)
         // > u_int32 entryCount
-        // > u_int32 padding
+        // > u_int32[3] padding
         // > _FUNCTION_TABLE_ENTRY[] entries
         StructType *p_functionTableStruct = StructType::create(ctx, "_FUNCTION_TABLE");
 
         ArrayType *p_functionTableArrayDef;
         Constant *p_functionTableArray = createFunctionTableArray(ctx, &p_functionTableArrayDef, functionInfo);
 
+        ArrayType *p_paddingType = ArrayType::get(IntegerType::get(ctx, 32), 3);
+
         p_functionTableStruct->setBody(
             {IntegerType::get(ctx, 32),
-             IntegerType::get(ctx, 32),
+             p_paddingType,
              p_functionTableArrayDef},
             true);
 
         *pp_functionTableStruct = p_functionTableStruct; // This doesnt seem rigth xd, expecting that the lifetime of p_functionTableStruct is enough :P
 
-        outs() << "[INFO] Number of elements in funcion table: " << p_functionTableArrayDef->getNumElements()
+        info(VERBOSITY_DETAIL) << "[INFO] Number of elements in funcion table: " << p_functionTableArrayDef->getNumElements()
                << "\n";
 
         return ConstantStruct::get(p_functionTableStruct,
                                    {ConstantInt::get(IntegerType::get(ctx, 32), p_functionTableArrayDef->getNumElements()),
-                                    ConstantInt::get(IntegerType::get(ctx, 32), 0),
+                                    ConstantAggregateZero::get(p_paddingType),
                                     p_functionTableArray});
     }
 
-    Constant *CallObfuscator::createDllTableArray(LLVMContext &ctx, ArrayType **pp_dllTableEntryStruct, vector<Constant *> dlls)
+    StructType *CallObfuscator::createDllTableEntryType(LLVMContext &ctx)
     {
-        vector<Constant *> dllTableEntries;
-        // _DLL_TABLE_ENTRY  (16 bytes -> 64bits; 6 bytes-> 32bits)
+        // _DLL_TABLE_ENTRY  (32 bytes -> 64bits; 20 bytes-> 32bits)
         // > char* name
         // > void* handle
+        // > void* exportIndex (null until the helpers index the exports of the dll)
+        // > u_int32 hash (of the name, as the helpers hash it)
+        // > u_int32 padding
         StructType *p_dllTableEntryStruct = StructType::create(ctx, "_DLL_TABLE_ENTRY");
 
         p_dllTableEntryStruct->setBody(
             {PointerType::get(ctx, 0),
-             PointerType::get(ctx, 0)},
+             PointerType::get(ctx, 0),
+             PointerType::get(ctx, 0),
+             IntegerType::get(ctx, 32),
+             IntegerType::get(ctx, 32)},
             true);
 
-        for (Constant *dllName : dlls)
-        {
-            dllTableEntries.push_back(ConstantStruct::get(
-                p_dllTableEntryStruct,
-                {dllName,
-                 ConstantPointerNull::get(PointerType::get(ctx, 0))}));
-        }
+        return p_dllTableEntryStruct;
+    }
+
+    Constant *CallObfuscator::createDllTableEntry(LLVMContext &ctx, StructType *p_dllTableEntryStruct, Constant *p_name, StringRef dllName)
+    {
+        return ConstantStruct::get(
+            p_dllTableEntryStruct,
+            {p_name,
+             ConstantPointerNull::get(PointerType::get(ctx, 0)),
+             ConstantPointerNull::get(PointerType::get(ctx, 0)),
+             ConstantInt::get(IntegerType::get(ctx, 32), hashStr(dllName)),
+             ConstantInt::get(IntegerType::get(ctx, 32), 0)});
+    }
+
+    Constant *CallObfuscator::createDllTableArray(LLVMContext &ctx, ArrayType **pp_dllTableEntryStruct, const vector<Constant *> &dlls,
+                                                  const vector<StringRef> &dllNames)
+    {
+        vector<Constant *> dllTableEntries;
+        StructType *p_dllTableEntryStruct = createDllTableEntryType(ctx);
+
+        for (unsigned long i = 0; i < dlls.size(); i++)
+            dllTableEntries.push_back(createDllTableEntry(ctx, p_dllTableEntryStruct, dlls[i], dllNames[i]));
 
         *pp_dllTableEntryStruct = ArrayType::get(p_dllTableEntryStruct, dllTableEntries.size());
 
@@ -203,7 +332,8 @@ namespace callobfuscator
                                   ArrayRef(dllTableEntries));
     }
 
-    Constant *CallObfuscator::createDllTable(LLVMContext &ctx, StructType **pp_dllTableEntryStruct, vector<Constant *> dlls)
+    Constant *CallObfuscator::createDllTable(LLVMContext &ctx, StructType **pp_dllTableEntryStruct, const vector<Constant *> &dlls,
+                                             const vector<StringRef> &dllNames)
     {
         // _DLL_TABLE
         // > u_int32 entryCount
@@ -212,7 +342,7 @@ namespace callobfuscator
         StructType *p_dllTableStruct = StructType::create(ctx, "_DLL_TABLE");
 
         ArrayType *p_dllTableArrayDef;
-        Constant *p_dllTableArray = createDllTableArray(ctx, &p_dllTableArrayDef, dlls);
+        Constant *p_dllTableArray = createDllTableArray(ctx, &p_dllTableArrayDef, dlls, dllNames);
 
         p_dllTableStruct->setBody(
             {IntegerType::get(ctx, 32),
@@ -228,28 +358,195 @@ namespace callobfuscator
                                     p_dllTableArray});
     }
 
-    vector<Constant *> createDllNames(Module &M, vector<StringRef> dllNames)
+    vector<Constant *> createDllNames(Module &M, const vector<StringRef> &dllNames)
     {
         LLVMContext &ctx = M.getContext();
         vector<Constant *> dllNamesAsCt;
         for (StringRef name : dllNames)
         {
             Constant *stringAsCt = ConstantDataArray::getString(ctx, name, true);
-            Constant *stringGlobalAsCt = M.getOrInsertGlobal((".str.__callobfuscator." + name).str(), stringAsCt->getType()); // TODO: Check size
-            GlobalVariable *stringGlobalAsGv = cast<GlobalVariable>(stringGlobalAsCt);
 
-            stringGlobalAsGv->setConstant(true);
-            stringGlobalAsGv->setLinkage(GlobalValue::InternalLinkage);
-            stringGlobalAsGv->setInitializer(stringAsCt);
-            dllNamesAsCt.push_back(stringGlobalAsCt);
+            // Internal, so if the name is taken, the module just gives it a new one
+            GlobalVariable *stringGlobalAsGv = new GlobalVariable(M, stringAsCt->getType(), true, GlobalValue::InternalLinkage,
+                                                                  stringAsCt, ".str.__callobfuscator." + name);
+            dllNamesAsCt.push_back(stringGlobalAsGv);
         }
 
         return dllNamesAsCt;
     }
 
-    bool CallObfuscator::insertTables(vector<StringRef> dllNames, vector<FunctionInfo> functionInfo)
+    void CallObfuscator::addModifiedUsers(Value *p_value)
+    {
+        for (User *p_user : p_value->users())
+        {
+            if (Instruction *p_instruction = dyn_cast<Instruction>(p_user))
+                modifiedFunctions.insert(p_instruction->getFunction());
+            else if (isa<ConstantExpr>(p_user))
+                addModifiedUsers(p_user);
+        }
+    }
+
+    GlobalVariable *CallObfuscator::defineTable(Module &M, StringRef name, Constant *p_initializer)
+    {
+        GlobalVariable *p_existing = M.getNamedGlobal(name);
+
+        if (p_existing && !p_existing->isDeclaration())
+        {
+            errs() << "[ERROR] " << name << " is already defined in the module\n";
+            return NULL;
+        }
+
+        GlobalVariable *p_table = new GlobalVariable(M, p_initializer->getType(), false, GlobalValue::ExternalLinkage,
+                                                     p_initializer);
+
+        if (p_existing)
+        {
+            // Someone is already referencing the table through a declaration, point them to the definition
+            p_table->takeName(p_existing);
+            p_existing->replaceAllUsesWith(ConstantExpr::getBitCast(p_table, p_existing->getType()));
+            p_existing->eraseFromParent();
+        }
+        else
+        {
+            p_table->setName(name);
+        }
+
+        return p_table;
+    }
+
+    GlobalVariable *CallObfuscator::getOrInsertFragment(Module &M, StringRef name, Constant *p_initializer, bool &created)
     {
-        LLVMContext &ctx = tmpMod->getContext();
+        GlobalVariable *p_existing = M.getNamedGlobal(name);
+        created = false;
+
+        if (p_existing && !p_existing->isDeclaration())
+            return p_existing;
+
+        GlobalVariable *p_fragment = new GlobalVariable(M, p_initializer->getType(), false, GlobalValue::LinkOnceAnyLinkage,
+                                                        p_initializer);
+
+        if (p_existing)
+        {
+            // Code referencing the declaration will be pointed to the definition
+            addModifiedUsers(p_existing);
+            p_fragment->takeName(p_existing);
+            p_existing->replaceAllUsesWith(ConstantExpr::getBitCast(p_fragment, p_existing->getType()));
+            p_existing->eraseFromParent();
+        }
+        else
+        {
+            p_fragment->setName(name);
+        }
+
+        // Any, not odr: modules built with different configs may disagree on the contents
+        p_fragment->setComdat(M.getOrInsertComdat(p_fragment->getName()));
+        p_fragment->setAlignment(Align(8));
+        created = true;
+
+        return p_fragment;
+    }
+
+    bool CallObfuscator::insertFragments(const vector<StringRef> &dllNames, const vector<FunctionInfo> &functionInfo)
+    {
+        LLVMContext &ctx = mod.getContext();
+
+        if (!functionInfo.size())
+        {
+            outs() << "[ERROR] No functions to insert to fragments, aborting";
+            return false;
+        }
+
+        // _DLL_TABLE_ENTRY, same as in the dll table
+        StructType *p_dllEntryStruct = createDllTableEntryType(ctx);
+
+        // _FUNCTION_FRAGMENT (32 bytes, aligned to FUNCTION_FRAGMENT_ALIGNMENT, so they are merged without gaps)
+        // > _FUNCTION_TABLE_ENTRY entry
+        // > u_int32 hash
+        // > u_int32 exportHint
+        // > _DLL_TABLE_ENTRY *dllEntry
+        StructType *p_functionEntryStruct = createFunctionTableEntryType(ctx);
+        StructType *p_functionFragmentStruct = StructType::create(ctx, "_FUNCTION_FRAGMENT");
+        p_functionFragmentStruct->setBody(
+            {p_functionEntryStruct, IntegerType::get(ctx, 32), IntegerType::get(ctx, 32), PointerType::get(ctx, 0)}, true);
+
+        vector<Constant *> dllEntries;
+        for (StringRef dllName : dllNames)
+        {
+            string entryName = (DLL_FRAGMENT_PREFIX + dllName.lower());
+            GlobalVariable *p_existing = mod.getNamedGlobal(entryName);
+
+            if (p_existing && !p_existing->isDeclaration())
+            {
+                dllEntries.push_back(p_existing);
+                continue;
+            }
+
+            // The name goes in the comdat of the entry, so it is dropped along with it
+            Constant *p_nameAsCt = ConstantDataArray::getString(ctx, dllName, true);
+            GlobalVariable *p_name = new GlobalVariable(mod, p_nameAsCt->getType(), true, GlobalValue::PrivateLinkage,
+                                                        p_nameAsCt, ".str.__callobfuscator." + dllName);
+
+            bool created;
+            GlobalVariable *p_dllEntry = getOrInsertFragment(
+                mod, entryName, createDllTableEntry(ctx, p_dllEntryStruct, p_name, dllName), created);
+
+            p_name->setComdat(p_dllEntry->getComdat());
+            dllEntries.push_back(p_dllEntry);
+            __changedModule = true;
+        }
+
+        vector<GlobalValue *> functionEntries;
+        dispatcherKeys.clear();
+        for (const FunctionInfo &info : functionInfo)
+        {
+            // Dlls are referenced by pointer, so the entry is the same in every module
+            bool created;
+            GlobalVariable *p_functionEntry = getOrInsertFragment(
+                mod, FUNCTION_FRAGMENT_PREFIX + info.function.getName().str(),
+                ConstantStruct::get(p_functionFragmentStruct,
+                                    {createFunctionTableEntry(ctx, p_functionEntryStruct, info),
+                                     ConstantInt::get(IntegerType::get(ctx, 32), hashStr(info.function.getName())),
+                                     ConstantInt::get(IntegerType::get(ctx, 32), info.exportHint),
+                                     dllEntries[info.modIndex]}),
+                created);
+
+            if (created)
+            {
+                p_functionEntry->setSection(FRAGMENT_SECTION);
+                p_functionEntry->setAlignment(Align(FUNCTION_FRAGMENT_ALIGNMENT));
+                functionEntries.push_back(p_functionEntry);
+                __changedModule = true;
+            }
+
+            dispatcherKeys.push_back(p_functionEntry);
+        }
+
+        // Every module points to the LoadLibraryA fragment, the linker keeps one of the pointers
+        for (unsigned long i = 0; i < functionInfo.size(); i++)
+        {
+            if (functionInfo[i].function.getName() != LOAD_LIBRARY_FUNCTION)
+                continue;
+
+            bool created;
+            GlobalVariable *p_loadLibraryFragment = getOrInsertFragment(mod, LOAD_LIBRARY_FRAGMENT_SYMBOL, dispatcherKeys[i], created);
+            if (created)
+            {
+                functionEntries.push_back(p_loadLibraryFragment);
+                __changedModule = true;
+            }
+        }
+
+        // The helpers reach some entries without a call to them (LoadLibraryA, or every entry
+        // when resolving eagerly), so they must reach the final image even if no call references them.
+        if (!functionEntries.empty())
+            appendToUsed(mod, functionEntries);
+
+        return true;
+    }
+
+    bool CallObfuscator::insertTables(const vector<StringRef> &dllNames, const vector<FunctionInfo> &functionInfo)
+    {
+        LLVMContext &ctx = mod.getContext();
 
         // ============================= Declare tables =============================
         StructType *p_functionTableDef;
@@ -266,144 +563,588 @@ namespace callobfuscator
             return false;
         }
 
-        vector<Constant *> dllNamesAsCt = createDllNames(*tmpMod, dllNames);
+        // Checked before adding anything, so the module stays untouched on failure
+        for (StringRef tableName : {FUNCTION_TABLE_SYMBOL, FUNCTION_LOAD_TABLE_SYMBOL, DLL_TABLE_SYMBOL, LOAD_LIBRARY_INDEX_SYMBOL})
+        {
+            GlobalVariable *p_existing = mod.getNamedGlobal(tableName);
+            if (p_existing && !p_existing->isDeclaration())
+            {
+                errs() << "[ERROR] Module already defines " << tableName << ", aborting\n";
+                return false;
+            }
+
+            // Code referencing the declaration will be pointed to the definition
+            if (p_existing)
+                addModifiedUsers(p_existing);
+        }
+
+        vector<Constant *> dllNamesAsCt = createDllNames(mod, dllNames);
 
         Constant *p_functionTable = CallObfuscator::createFunctionTable(ctx, &p_functionTableDef, functionInfo);
-        Constant *p_dllTable = CallObfuscator::createDllTable(ctx, &p_dllTableDef, dllNamesAsCt);
+        Constant *p_dllTable = CallObfuscator::createDllTable(ctx, &p_dllTableDef, dllNamesAsCt, dllNames);
 
         // ================= Create global tables ===============
 
-        GlobalVariable *functionTableGlobal = cast<GlobalVariable>(tmpMod->getOrInsertGlobal("__callobf_functionTable", p_functionTableDef));
-        GlobalVariable *dllTableGlobal = cast<GlobalVariable>(tmpMod->getOrInsertGlobal("__callobf_dllTable", p_dllTableDef));
+        GlobalVariable *p_functionTableGv = defineTable(mod, FUNCTION_TABLE_SYMBOL, p_functionTable);
+        if (!p_functionTableGv)
+            return false;
+
+        p_functionTableGv->setAlignment(Align(FUNCTION_TABLE_ALIGNMENT));
+
+        if (!defineTable(mod, FUNCTION_LOAD_TABLE_SYMBOL, createFunctionLoadTable(ctx, functionInfo)))
+            return false;
+
+        if (!defineTable(mod, DLL_TABLE_SYMBOL, p_dllTable))
+            return false;
 
-        functionTableGlobal->setConstant(false);
-        functionTableGlobal->setLinkage(GlobalValue::ExternalLinkage);
-        functionTableGlobal->setInitializer(p_functionTable);
+        for (unsigned long functionTableIndex = 0; functionTableIndex < functionInfo.size(); functionTableIndex++)
+            if (functionInfo[functionTableIndex].function.getName() == LOAD_LIBRARY_FUNCTION &&
+                !defineTable(mod, LOAD_LIBRARY_INDEX_SYMBOL, ConstantInt::get(IntegerType::get(ctx, 32), functionTableIndex)))
+                return false;
 
-        dllTableGlobal->setConstant(false);
-        dllTableGlobal->setLinkage(GlobalValue::ExternalLinkage);
-        dllTableGlobal->setInitializer(p_dllTable);
+        dispatcherKeys.clear();
+        for (unsigned long functionTableIndex = 0; functionTableIndex < functionInfo.size(); functionTableIndex++)
+            dispatcherKeys.push_back(ConstantInt::get(IntegerType::get(ctx, 32), functionTableIndex));
 
+        __changedModule = true;
         return true;
     }
 
-    bool CallObfuscator::replaceCall(CallInst *p_callInstruction, int functionTableIndex)
+    bool CallObfuscator::collectCallSites(vector<CallSiteInfo> &callSites, vector<unsigned long> &siteCounts)
     {
-        LLVMContext &ctx = mod.getContext();
-        if (!p_callInstruction)
-            return false;
+        siteCounts.assign(functionList.size(), 0);
+        vector<unsigned long> useCounts(functionList.size(), 0);
 
-        FunctionType *funcType = callDispatcher.getFunctionType();
-        Value *funcValue = callDispatcher.getCallee();
+        // TODO: Handle invoke instructions and exception stuff (should not happen in C but...)
+        // TODO: Handle indirect calls
+        // TODO: Handle address reads
+        for (Function &F : mod)
+            for (BasicBlock &BB : F)
+                for (Instruction &I : BB)
+                {
+                    CallInst *p_call = dyn_cast<CallInst>(&I);
+                    if (!p_call)
+                        continue;
+
+                    Function *p_callee = dyn_cast<Function>(p_call->getCalledOperand());
+                    if (!p_callee)
+                        continue;
+
+                    auto entry = functionIndex.find(p_callee);
+                    if (entry == functionIndex.end())
+                        continue;
+
+                    Type *p_returnType = p_call->getType();
+                    if (!p_returnType->isVoidTy() && !p_returnType->isPointerTy() &&
+                        !(p_returnType->isIntegerTy() && p_returnType->getIntegerBitWidth() <= 64))
+                    {
+                        errs() << "[ERROR] Unsuported return type in call to " << p_callee->getName() << " from "
+                               << F.getName() << ", aborting\n";
+                        return false;
+                    }
+
+                    useCounts[entry->second]++;
+                    if (exemptCalls.count(p_call))
+                        continue;
+
+                    callSites.push_back({p_call, entry->second});
+                    siteCounts[entry->second]++;
+                }
+
+        // Anything else using a hooked function (address reads, being passed as argument...)
+        // would be left pointing to the original function.
+        for (const FunctionInfo &info : functionList)
+        {
+            if (info.function.getNumUses() != useCounts[functionIndex[&info.function]])
+            {
+                errs() << "[ERROR] Unsuported use of " << info.function.getName() << ", code may break, aborting\n";
+                return false;
+            }
+        }
 
-        vector<Value *> funcArgsVec;
-        funcArgsVec.push_back(ConstantInt::get(IntegerType::get(ctx, 32), functionTableIndex));
-        p_callInstruction->getReturnedArgOperand();
+        return true;
+    }
 
-        for (int i = 0; i < p_callInstruction->arg_size(); i++)
+    AttributeList CallObfuscator::createDispatcherCallAttributes(LLVMContext &ctx, const CallInst *p_call, const Function *p_callee,
+                                                                 FunctionType *p_dispatcherType)
+    {
+        AttributeList callAttributes = p_call->getAttributes();
+        AttributeList calleeAttributes = p_callee->getAttributes();
+
+        // > Function: nounwind, cold... still describe the call. noreturn does not, the dispatcher
+        //   returns when the function can not be loaded
+        AttrBuilder fnAttributes(ctx, calleeAttributes.getFnAttrs());
+        fnAttributes.merge(AttrBuilder(ctx, callAttributes.getFnAttrs()));
+
+        for (Attribute::AttrKind kind : {Attribute::NoReturn, Attribute::ReadNone, Attribute::ReadOnly, Attribute::WriteOnly, Attribute::NoSync,
+                                         Attribute::NoCallback, Attribute::Speculatable, Attribute::AllocSize})
+            fnAttributes.removeAttribute(kind);
+#if LLVM_VERSION_MAJOR >= 16
+        fnAttributes.removeAttribute(Attribute::Memory);
+#else
+        fnAttributes.removeAttribute(Attribute::ArgMemOnly);
+        fnAttributes.removeAttribute(Attribute::InaccessibleMemOnly);
+        fnAttributes.removeAttribute(Attribute::InaccessibleMemOrArgMemOnly);
+#endif
+#if LLVM_VERSION_MAJOR >= 15
+        fnAttributes.removeAttribute(Attribute::AllocKind);
+#endif
+
+        // > Return: only what is valid on the i64 the dispatcher returns
+        AttrBuilder retAttributes(ctx, calleeAttributes.getRetAttrs());
+        retAttributes.merge(AttrBuilder(ctx, callAttributes.getRetAttrs()));
+        retAttributes.remove(AttributeFuncs::typeIncompatible(p_dispatcherType->getReturnType()));
+        retAttributes.removeAttribute(Attribute::ZExt);
+        retAttributes.removeAttribute(Attribute::SExt);
+
+        // > Parameters: same arguments, one position later
+        vector<AttributeSet> argAttributes;
+        argAttributes.push_back(AttributeSet());
+
+        for (unsigned int i = 0; i < p_call->arg_size(); i++)
         {
-            funcArgsVec.push_back(p_callInstruction->getArgOperand(i));
+            AttrBuilder paramAttributes(ctx, callAttributes.getParamAttrs(i));
+            if (i < p_callee->arg_size())
+                paramAttributes.merge(AttrBuilder(ctx, calleeAttributes.getParamAttrs(i)));
+
+            paramAttributes.removeAttribute(Attribute::Returned);
+
+            // Widened by the pass, so nothing is left to extend
+            Type *p_paramType = i + 1 < p_dispatcherType->getNumParams() ? p_dispatcherType->getParamType(i + 1) : nullptr;
+            if (p_paramType && p_paramType != p_call->getArgOperand(i)->getType())
+            {
+                paramAttributes.remove(AttributeFuncs::typeIncompatible(p_paramType));
+                paramAttributes.removeAttribute(Attribute::ZExt);
+                paramAttributes.removeAttribute(Attribute::SExt);
+            }
+#if LLVM_VERSION_MAJOR >= 15
+            paramAttributes.removeAttribute(Attribute::AllocAlign);
+            paramAttributes.removeAttribute(Attribute::AllocatedPointer);
+#endif
+            argAttributes.push_back(AttributeSet::get(ctx, paramAttributes));
         }
 
-        CallInst *p_callReplacement = CallInst::Create(funcType, funcValue, ArrayRef(funcArgsVec));
-        p_callReplacement->insertBefore(p_callInstruction);
+        return AttributeList::get(ctx, AttributeSet::get(ctx, fnAttributes), AttributeSet::get(ctx, retAttributes), argAttributes);
+    }
+
+    void CallObfuscator::rewriteCallSites(const vector<CallSiteInfo> &callSites)
+    {
+        IRBuilder<> builder(mod.getContext());
+        SmallVector<Value *, 16> args;
+        SmallVector<OperandBundleDef, 1> bundles;
+        SmallVector<pair<unsigned int, MDNode *>, 8> metadata;
+
+        for (const CallSiteInfo &site : callSites)
+        {
+            CallInst *p_call = site.p_call;
+            Function *p_callee = p_call->getCalledFunction();
+
+            // Also sets the debug location of everything created here to the one of the call
+            builder.SetInsertPoint(p_call);
+
+            FunctionCallee dispatcher = callDispatcher;
+            args.clear();
+            args.push_back(dispatcherKeys[site.functionTableIndex]);
+
+            if (useArityDispatchers && fitsArityDispatcher(p_call))
+            {
+                dispatcher = getArityDispatcher(p_call->arg_size());
+                NumArityDispatches++;
+
+                // Same bits the variadic convention would leave in the argument register or slot
+                for (unsigned int i = 0; i < p_call->arg_size(); i++)
+                {
+                    Value *p_arg = p_call->getArgOperand(i);
+                    Type *p_argType = p_arg->getType();
+
+                    if (p_argType->isPointerTy())
+                        p_arg = builder.CreatePtrToInt(p_arg, builder.getInt64Ty());
+                    else if (p_argType->isFloatTy() || p_argType->isDoubleTy())
+                        p_arg = builder.CreateZExt(builder.CreateBitCast(p_arg, builder.getIntNTy(p_argType->getPrimitiveSizeInBits())),
+                                                   builder.getInt64Ty());
+                    else if (p_call->paramHasAttr(i, Attribute::SExt) || p_callee->hasParamAttribute(i, Attribute::SExt))
+                        p_arg = builder.CreateSExt(p_arg, builder.getInt64Ty());
+                    else
+                        p_arg = builder.CreateZExt(p_arg, builder.getInt64Ty());
+
+                    args.push_back(p_arg);
+                }
+            }
+            else
+            {
+                args.append(p_call->arg_begin(), p_call->arg_end());
+            }
+
+            // Funclet bundles must be kept, or calls inside SEH/C++ handlers become invalid
+            bundles.clear();
+            p_call->getOperandBundlesAsDefs(bundles);
+
+            CallInst *p_callReplacement = builder.CreateCall(dispatcher, args, bundles);
+
+            // The calling convention stays the one of the dispatcher declaration, any other
+            // would not match its definition.
+            p_callReplacement->setAttributes(createDispatcherCallAttributes(mod.getContext(), p_call, p_callee,
+                                                                            dispatcher.getFunctionType()));
+
+            // musttail requires matching prototypes, which cant be the case anymore
+            CallInst::TailCallKind tailKind = p_call->getTailCallKind();
+            p_callReplacement->setTailCallKind(tailKind == CallInst::TCK_MustTail ? CallInst::TCK_Tail : tailKind);
+
+            // !prof, !srcloc... are kept. Metadata describing the returned value is not, it
+            // was written for the original return type.
+            metadata.clear();
+            p_call->getAllMetadata(metadata);
+            for (auto &entry : metadata)
+            {
+                switch (entry.first)
+                {
+                case LLVMContext::MD_range:
+                case LLVMContext::MD_nonnull:
+                case LLVMContext::MD_noundef:
+                case LLVMContext::MD_align:
+                case LLVMContext::MD_dereferenceable:
+                case LLVMContext::MD_dereferenceable_or_null:
+                case LLVMContext::MD_callees:
+                    break;
+                default:
+                    p_callReplacement->setMetadata(entry.first, entry.second);
+                }
+            }
+
+            // The dispatcher always returns 64 bits, bring them back to the original type
+            Value *p_result = p_callReplacement;
+            Type *p_returnType = p_call->getType();
 
-        int originalRetSize = 0;
-        if (!p_callInstruction->getType()->isVoidTy())
-            originalRetSize = mod.getDataLayout().getTypeSizeInBits(p_callInstruction->getType());
+            if (p_returnType->isPointerTy())
+                p_result = builder.CreateIntToPtr(p_callReplacement, p_returnType);
+            else if (p_returnType->isIntegerTy() && p_returnType != p_callReplacement->getType())
+                p_result = builder.CreateTrunc(p_callReplacement, p_returnType);
 
-        int newRetSize = mod.getDataLayout().getTypeSizeInBits(p_callReplacement->getType());
+            if (!p_returnType->isVoidTy())
+                p_call->replaceAllUsesWith(p_result);
 
-        if (originalRetSize != newRetSize && originalRetSize != 0)
+            modifiedFunctions.insert(p_call->getFunction());
+            p_call->eraseFromParent();
+        }
+    }
+
+    FunctionType *CallObfuscator::getCallDispatcherType()
+    {
+        LLVMContext &ctx = mod.getContext();
+
+        return FunctionType::get(
+            IntegerType::get(ctx, 64),
+            {useFragments ? (Type *)PointerType::get(ctx, 0) : IntegerType::get(ctx, 32)},
+            true);
+    }
+
+    FunctionType *CallObfuscator::getArityDispatcherType(unsigned int arity)
+    {
+        SmallVector<Type *, CALL_DISPATCHER_MAX_ARITY + 1> params(arity + 1, IntegerType::get(mod.getContext(), 64));
+        params[0] = getCallDispatcherType()->getParamType(0);
+
+        return FunctionType::get(IntegerType::get(mod.getContext(), 64), params, false);
+    }
+
+    bool CallObfuscator::checkDispatcherSymbols()
+    {
+        StringRef dispatcherName = useFragments ? FRAGMENT_CALL_DISPATCHER_SYMBOL : CALL_DISPATCHER_SYMBOL;
+
+        // Same conditions as insertCallDispatcherDef and insertEagerResolver
+        Function *p_existing = mod.getFunction(dispatcherName);
+        if (p_existing && (!useFragments || p_existing->getFunctionType() != getCallDispatcherType()))
         {
-            // originalRetSize should never be bigger than newRetSize
-            assert(newRetSize > originalRetSize);
+            errs() << "[ERROR] Module already has " << dispatcherName << ", aborting\n";
+            return false;
+        }
 
-            TruncInst *p_truncInstruction = new TruncInst(p_callReplacement, p_callInstruction->getType());
-            p_truncInstruction->insertAfter(p_callReplacement);
-            p_callInstruction->replaceAllUsesWith(p_truncInstruction);
+        // getOrInsertFunction would hand back any of these as they are, whatever their type
+        for (unsigned int arity = 0; useArityDispatchers && arity <= CALL_DISPATCHER_MAX_ARITY; arity++)
+        {
+            string arityName = dispatcherName.str() + to_string(arity);
+            GlobalValue *p_arityExisting = mod.getNamedValue(arityName);
+            if (!p_arityExisting)
+                continue;
+
+            Function *p_arityFunction = dyn_cast<Function>(p_arityExisting);
+            if (!useFragments || !p_arityFunction || !p_arityFunction->isDeclaration() ||
+                p_arityFunction->getFunctionType() != getArityDispatcherType(arity))
+            {
+                errs() << "[ERROR] Module already has " << arityName << ", aborting\n";
+                return false;
+            }
         }
-        else
+
+        p_existing = mod.getFunction(EAGER_RESOLVER_SYMBOL);
+        if (eagerResolution && p_existing && p_existing->isDeclaration() &&
+            p_existing->getFunctionType() != FunctionType::get(Type::getVoidTy(mod.getContext()), false))
         {
-            p_callInstruction->replaceAllUsesWith(p_callReplacement);
+            errs() << "[ERROR] Module already has " << EAGER_RESOLVER_SYMBOL << " with another type, aborting\n";
+            return false;
         }
 
-        // TODO: Add checks if its safe to delete (It should ¿?)
-        p_callInstruction->eraseFromParent();
         return true;
     }
 
-    bool CallObfuscator::replaceUse(Use &use, int functionTableIndex)
+    bool CallObfuscator::insertCallDispatcherDef()
     {
-        // TODO: Handle invoke instructions and exception stuff (should not happen in C but...)
-        // TODO: Handle indirect calls
-        // TODO: Handle address reads
-        if (Instruction *p_callInstruction = dyn_cast<Instruction>(use.getUser()))
+        LLVMContext &ctx = mod.getContext();
+
+        StringRef dispatcherName = useFragments ? FRAGMENT_CALL_DISPATCHER_SYMBOL : CALL_DISPATCHER_SYMBOL;
+
+        FunctionType *p_dispatcherType = getCallDispatcherType();
+
+        // Modules using fragments may have been through the pass before, then the declaration is reused
+        if (Function *p_existing = mod.getFunction(dispatcherName))
         {
-            if (p_callInstruction->getOpcode() == Instruction::OtherOps::Call)
-                return replaceCall(cast<CallInst>(p_callInstruction), functionTableIndex);
+            if (!useFragments || p_existing->getFunctionType() != p_dispatcherType)
+                return false;
+
+            callDispatcher = FunctionCallee(p_dispatcherType, p_existing);
+            return true;
         }
-        return false;
+
+        // Not nounwind: hooked functions may raise SEH exceptions, which go through the dispatcher.
+        // Each call keeps the nounwind of its callee, if it had it
+        AttributeList dispatcherAttributes = AttributeList::get(
+            ctx,
+            AttributeSet(),
+            AttributeSet::get(ctx, {Attribute::get(ctx, Attribute::NoUndef)}),
+            {AttributeSet::get(ctx, {Attribute::get(ctx, Attribute::NoUndef)})});
+
+        callDispatcher = mod.getOrInsertFunction(dispatcherName, p_dispatcherType, dispatcherAttributes);
+        __changedModule = true;
+        return true;
     }
 
-    bool CallObfuscator::insertCallDispatcherDef()
+    bool CallObfuscator::insertEagerResolver()
     {
         LLVMContext &ctx = mod.getContext();
 
-        FunctionType *p_dispatcherType = FunctionType::get(
-            IntegerType::get(ctx, 64),
-            {IntegerType::get(ctx, 32)},
-            true);
+        // Modules using fragments may have been through the pass before
+        Function *p_existing = mod.getFunction(EAGER_RESOLVER_SYMBOL);
+        if (p_existing && !p_existing->isDeclaration())
+            return true;
 
-        if (mod.getFunction("__callobf_callDispatcher"))
+        FunctionType *p_resolverType = FunctionType::get(Type::getVoidTy(ctx), false);
+        if (p_existing && p_existing->getFunctionType() != p_resolverType)
             return false;
 
-        callDispatcher = mod.getOrInsertFunction("__callobf_callDispatcher", p_dispatcherType);
+        // BOOL __callobf_resolveFunctions(void), the result is only useful to callers in C
+        FunctionCallee resolveFunctions = mod.getOrInsertFunction(
+            RESOLVE_FUNCTIONS_SYMBOL,
+            AttributeList::get(ctx, AttributeList::FunctionIndex, {Attribute::NoUnwind}),
+            IntegerType::get(ctx, 32));
+
+        Function *p_resolver = Function::Create(p_resolverType, GlobalValue::LinkOnceAnyLinkage, "", mod);
+        if (p_existing)
+        {
+            // Code referencing the declaration will be pointed to the definition
+            addModifiedUsers(p_existing);
+            p_resolver->takeName(p_existing);
+            p_existing->replaceAllUsesWith(p_resolver);
+            p_existing->eraseFromParent();
+        }
+        else
+        {
+            p_resolver->setName(EAGER_RESOLVER_SYMBOL);
+        }
+
+        p_resolver->addFnAttr(Attribute::NoUnwind);
+        p_resolver->setComdat(mod.getOrInsertComdat(EAGER_RESOLVER_SYMBOL));
+
+        IRBuilder<> builder(BasicBlock::Create(ctx, "entry", p_resolver));
+        builder.CreateCall(resolveFunctions);
+        builder.CreateRetVoid();
+
+        // Tied to the resolver, so the entries of the copies the linker drops go with them
+        appendToGlobalCtors(mod, p_resolver, EAGER_RESOLVER_PRIORITY, p_resolver);
+
+        __changedModule = true;
         return true;
     }
 
-    bool CallObfuscator::finalize()
+    FunctionCallee CallObfuscator::getArityDispatcher(unsigned int arity)
     {
-        if (__locked)
+        if (arityDispatchers.size() <= arity)
+            arityDispatchers.resize(arity + 1);
+
+        if (arityDispatchers[arity])
+            return arityDispatchers[arity];
+
+        LLVMContext &ctx = mod.getContext();
+
+        FunctionType *p_dispatcherType = getArityDispatcherType(arity);
+
+        // Same attributes as the variadic one, widened arguments may still be undef
+        AttributeList dispatcherAttributes = AttributeList::get(
+            ctx,
+            AttributeSet(),
+            AttributeSet::get(ctx, {Attribute::get(ctx, Attribute::NoUndef)}),
+            {AttributeSet::get(ctx, {Attribute::get(ctx, Attribute::NoUndef)})});
+
+        string dispatcherName = (useFragments ? FRAGMENT_CALL_DISPATCHER_SYMBOL : CALL_DISPATCHER_SYMBOL) + to_string(arity);
+        arityDispatchers[arity] = mod.getOrInsertFunction(dispatcherName, p_dispatcherType, dispatcherAttributes);
+        return arityDispatchers[arity];
+    }
+
+    bool CallObfuscator::fitsArityDispatcher(const CallInst *p_call)
+    {
+        if (p_call->arg_size() > CALL_DISPATCHER_MAX_ARITY)
             return false;
 
-        if (!insertTables(dllNames, functionList))
+        for (const Use &arg : p_call->args())
+        {
+            Type *p_argType = arg->getType();
+            if (!p_argType->isPointerTy() && !p_argType->isFloatTy() && !p_argType->isDoubleTy() &&
+                !(p_argType->isIntegerTy() && p_argType->getIntegerBitWidth() <= 64))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool CallObfuscator::finalize()
+    {
+        if (__locked)
             return false;
 
-        outs() << "[INFO] Inserted tables\n";
         __locked = true;
-        if (Linker::linkModules(mod, std::unique_ptr<Module>(tmpMod)))
+
+        sortHooks();
+
+        vector<CallSiteInfo> callSites;
+        vector<unsigned long> siteCounts;
+
+        {
+            PhaseTimer timer("collectCallSites", "Collect call sites");
+            if (!collectCallSites(callSites, siteCounts))
+                return false;
+        }
+
+        info(VERBOSITY_DETAIL) << "[INFO] Collected " << callSites.size() << " call sites\n";
+
+        // Before the tables, which would be left in the module if the dispatcher could not be added
+        if (!checkDispatcherSymbols())
             return false;
 
-        outs() << "[INFO] Linked modules\n";
+        {
+            PhaseTimer timer("insertTables", "Insert tables");
+            if (!(useFragments ? insertFragments(dllNames, functionList) : insertTables(dllNames, functionList)))
+                return false;
+        }
+
+        NumFunctionTableEntries += functionList.size();
+        NumDllTableEntries += dllNames.size();
+        info(VERBOSITY_DETAIL) << "[INFO] Inserted " << (useFragments ? "fragments" : "tables") << "\n";
 
         if (!insertCallDispatcherDef())
             return false;
 
-        outs() << "[INFO] Inserted dispatcher definition\n";
+        info(VERBOSITY_DETAIL) << "[INFO] Inserted dispatcher definition\n";
+
+        if (eagerResolution)
+        {
+            if (!insertEagerResolver())
+                return false;
+
+            info(VERBOSITY_DETAIL) << "[INFO] Inserted eager resolver\n";
+        }
+
+        {
+            PhaseTimer timer("rewriteCallSites", "Rewrite call sites");
+            rewriteCallSites(callSites);
+        }
 
-        int functionTableIndex = 0;
+        NumCallSitesRewritten += callSites.size();
+        if (!callSites.empty())
+            __changedModule = true;
 
-        for (FunctionInfo &info : functionList)
+        if (verbosity >= VERBOSITY_DETAIL)
         {
-            outs() << "[INFO] Hooking calls to " << info.function.getName() << " using index " << functionTableIndex << " \n";
-            for (auto &use : info.function.uses())
-                if (!replaceUse(use, functionTableIndex))
-                {
-                    outs() << "[ERROR] Unsuported use, code may break, aborting"
-                           << "\n";
+            for (unsigned long functionTableIndex = 0; functionTableIndex < functionList.size(); functionTableIndex++)
+            {
+                outs() << "[INFO] Hooked " << siteCounts[functionTableIndex] << " calls to "
+                       << functionList[functionTableIndex].function.getName();
 
-                    return false;
-                }
-            functionTableIndex++;
+                if (useFragments)
+                    outs() << " using entry " << dispatcherKeys[functionTableIndex]->getName() << "\n";
+                else
+                    outs() << " using index " << functionTableIndex << "\n";
+            }
         }
 
-        __changedModule = true;
+        info(VERBOSITY_SUMMARY) << "[INFO] Hooked " << callSites.size() << " calls to " << functionList.size() << " functions in module: "
+                                << mod.getName() << "\n";
+
         return true;
     }
 
+    bool CallObfuscator::analyze()
+    {
+        if (__locked)
+            return false;
+
+        __locked = true;
+
+        sortHooks();
+
+        vector<CallSiteInfo> callSites;
+        vector<unsigned long> siteCounts;
+
+        {
+            PhaseTimer timer("collectCallSites", "Collect call sites");
+            if (!collectCallSites(callSites, siteCounts))
+                return false;
+        }
+
+        return checkDispatcherSymbols();
+    }
+
+    const vector<FunctionInfo> &CallObfuscator::getHookedFunctions() const
+    {
+        return functionList;
+    }
+
+    TableSizes CallObfuscator::getTableSizes() const
+    {
+        // Every table struct is packed, see createFunctionTableEntryType and createDllTableArray
+        uint64_t pointerSize = mod.getDataLayout().getPointerSize();
+        uint64_t functionEntrySize = pointerSize + 2 + 1 + 1 + 4;
+        uint64_t functionLoadEntrySize = 4 + 2 + 2;
+        uint64_t dllEntrySize = 3 * pointerSize + 4 + 4;
+
+        TableSizes sizes;
+        if (useFragments)
+        {
+            sizes.functionTable = functionList.size() * (functionEntrySize + 4 + 4 + pointerSize); // Plus the hash, the hint and the dll entry pointer
+            sizes.dllTable = dllNames.size() * dllEntrySize;
+        }
+        else
+        {
+            sizes.functionTable = 16 + functionList.size() * (functionEntrySize + functionLoadEntrySize); // Plus the count and padding
+            sizes.dllTable = 8 + dllNames.size() * dllEntrySize;
+        }
+
+        for (StringRef dllName : dllNames)
+            sizes.dllNames += dllName.size() + 1;
+
+        return sizes;
+    }
+
     bool CallObfuscator::changedModule()
     {
         return __changedModule;
     }
+
+    bool CallObfuscator::isObfuscated(const Module &M)
+    {
+        const GlobalVariable *p_functionTable = M.getNamedGlobal(FUNCTION_TABLE_SYMBOL);
+        return p_functionTable && !p_functionTable->isDeclaration();
+    }
+
+    const SetVector<Function *> &CallObfuscator::getModifiedFunctions() const
+    {
+        return modifiedFunctions;
+    }
 }
\ No newline at end of file
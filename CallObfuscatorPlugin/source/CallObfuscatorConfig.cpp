@@ -0,0 +1,427 @@
+/**
+ * @file CallObfuscatorConfig.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Validation and indexing of the hook configuration file.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CallObfuscatorConfig.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace llvm;
+
+namespace callobfuscatorconfig
+{
+    bool HotnessPolicy::isEnabled() const
+    {
+        return exemptAboveEntryPercent || dispatchBudget;
+    }
+
+    unsigned int CallObfuscatorConfig::internDll(StringRef dllName, StringMap<unsigned int> &dllIds)
+    {
+        auto inserted = dllIds.try_emplace(dllName, dllNames.size());
+
+        if (inserted.second)
+            dllNames.push_back(StringSaver(allocator).save(dllName));
+
+        return inserted.first->second;
+    }
+
+    bool CallObfuscatorConfig::parseHotnessPolicy(const json::Object &root, HotnessPolicy &policy)
+    {
+        policy = HotnessPolicy();
+
+        const json::Value *p_value = root.get(HOTNESS_POLICY_KEY);
+        if (!p_value)
+            return true;
+
+        const json::Object *p_policy = p_value->getAsObject();
+        if (!p_policy)
+        {
+            errs() << "[ERROR] Config file malformed, \"" HOTNESS_POLICY_KEY "\" is not an object\n";
+            return false;
+        }
+
+        for (const auto &entry : *p_policy)
+        {
+            StringRef key = entry.first;
+            auto value = entry.second.getAsInteger();
+
+            if (key != EXEMPT_ABOVE_ENTRY_PERCENT_KEY && key != DISPATCH_BUDGET_KEY)
+            {
+                errs() << "[ERROR] Config file malformed, unknown \"" HOTNESS_POLICY_KEY "\" key: " << key << "\n";
+                return false;
+            }
+
+            if (!value || *value < 0 || (key == EXEMPT_ABOVE_ENTRY_PERCENT_KEY && *value > UINT32_MAX))
+            {
+                errs() << "[ERROR] Config file malformed, \"" HOTNESS_POLICY_KEY "\" " << key << " is not a positive integer\n";
+                return false;
+            }
+
+            if (key == EXEMPT_ABOVE_ENTRY_PERCENT_KEY)
+                policy.exemptAboveEntryPercent = *value;
+            else
+                policy.dispatchBudget = *value;
+        }
+
+        return true;
+    }
+
+    bool CallObfuscatorConfig::loadJson(StringRef buffer)
+    {
+        Expected<json::Value> parseResult = json::parse(buffer);
+
+        if (Error E = parseResult.takeError())
+        {
+            errs() << "[ERROR] Config file could not be parsed\n";
+            errs() << E << "\n";
+            consumeError(std::move(E));
+            return false;
+        }
+
+        const json::Object *p_root = parseResult->getAsObject();
+        if (!p_root)
+        {
+            errs() << "[ERROR] Config file malformed, root is not an object\n";
+            return false;
+        }
+
+        const json::Array *p_dllHooks = p_root->getArray(DLL_HOOKS_KEY);
+        if (!p_dllHooks)
+        {
+            errs() << "[ERROR] Config file malformed, cant find \"" DLL_HOOKS_KEY "\" key\n";
+            return false;
+        }
+
+        HotnessPolicy policy;
+        if (!parseHotnessPolicy(*p_root, policy))
+            return false;
+
+        StringMap<unsigned int> dllIds;
+        StringMap<unsigned int> index;
+
+        hookIndex.clear();
+        dllNames.clear();
+        compiledBuffer.reset();
+
+        int entryCount = 0; // Used for error reporting
+        for (const json::Value &entry : *p_dllHooks)
+        {
+            const json::Object *p_dllInfo = entry.getAsObject();
+            if (!p_dllInfo)
+            {
+                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", not an object\n";
+                dllNames.clear();
+                return false;
+            }
+
+            auto dllName = p_dllInfo->getString(DLL_NAME_KEY);
+            if (!dllName)
+            {
+                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", cant find \"" DLL_NAME_KEY "\" key, or is not a string\n";
+                dllNames.clear();
+                return false;
+            }
+
+            const json::Array *p_functionNames = p_dllInfo->getArray(FUNCTION_HOOKS_KEY);
+            if (!p_functionNames)
+            {
+                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", cant find \"" FUNCTION_HOOKS_KEY "\" key, or is not a list\n";
+                dllNames.clear();
+                return false;
+            }
+
+            unsigned int dllId = internDll(*dllName, dllIds);
+
+            int functionCount = 0; // Used for error reporting
+            for (const json::Value &functionEntry : *p_functionNames)
+            {
+                auto functionName = functionEntry.getAsString();
+                if (!functionName)
+                {
+                    errs() << "[ERROR] Config file malformed at entry " << entryCount << ", function list contains errors (element "
+                           << functionCount << " is not a string)\n";
+                    dllNames.clear();
+                    return false;
+                }
+
+                // As when the list was walked in order, the first dll listing a function wins
+                index.try_emplace(*functionName, dllId);
+                functionCount++;
+            }
+
+            entryCount++;
+        }
+
+        hookIndex = std::move(index);
+        hotnessPolicy = policy;
+        return true;
+    }
+
+    bool CallObfuscatorConfig::loadCompiled(unique_ptr<MemoryBuffer> buffer, uint64_t contentHash)
+    {
+        using namespace support::endian;
+
+        if (!buffer)
+            return false;
+
+        StringRef data = buffer->getBuffer();
+        const char *p_data = data.data();
+
+        if (data.size() < COMPILED_CONFIG_HEADER_SIZE)
+            return false;
+
+        if (memcmp(p_data, COMPILED_CONFIG_MAGIC, 8) || read32le(p_data + 8) != COMPILED_CONFIG_VERSION)
+            return false;
+
+        if (read64le(p_data + 16) != contentHash)
+            return false;
+
+        uint64_t dllCount = read32le(p_data + 24);
+        uint64_t hookCount = read32le(p_data + 28);
+        uint64_t bucketCount = read32le(p_data + 32);
+        uint64_t stringsSize = read32le(p_data + 36);
+
+        HotnessPolicy policy;
+        policy.exemptAboveEntryPercent = read32le(p_data + 40);
+        policy.dispatchBudget = read64le(p_data + 48);
+
+        if (!isPowerOf2_64(bucketCount) || hookCount >= bucketCount)
+            return false;
+
+        uint64_t bucketsOffset = COMPILED_CONFIG_HEADER_SIZE + dllCount * COMPILED_CONFIG_DLL_RECORD_SIZE;
+        uint64_t stringsOffset = bucketsOffset + bucketCount * COMPILED_CONFIG_BUCKET_SIZE;
+
+        if (stringsOffset + stringsSize != data.size())
+            return false;
+
+        // Dlls are few, so their names are resolved now. Function names are only
+        // bound checked when a lookup hits them.
+        vector<StringRef> names;
+        for (uint64_t i = 0; i < dllCount; i++)
+        {
+            const char *p_record = p_data + COMPILED_CONFIG_HEADER_SIZE + i * COMPILED_CONFIG_DLL_RECORD_SIZE;
+            uint64_t offset = read32le(p_record);
+            uint64_t length = read32le(p_record + 4);
+
+            if (offset + length > stringsSize)
+                return false;
+
+            names.push_back(StringRef(p_data + stringsOffset + offset, length));
+        }
+
+        hookIndex.clear();
+        dllNames = std::move(names);
+        hotnessPolicy = policy;
+
+        p_compiledBuckets = p_data + bucketsOffset;
+        p_compiledStrings = p_data + stringsOffset;
+        compiledBucketCount = bucketCount;
+        compiledHookCount = hookCount;
+        compiledStringsSize = stringsSize;
+        compiledBuffer = std::move(buffer);
+        return true;
+    }
+
+    bool CallObfuscatorConfig::writeCompiled(StringRef path, uint64_t contentHash) const
+    {
+        using namespace support::endian;
+
+        if (isCompiled())
+            return false;
+
+        uint64_t bucketCount = NextPowerOf2(hookIndex.size() * 2);
+        uint64_t stringsSize = 0;
+
+        for (StringRef dllName : dllNames)
+            stringsSize += dllName.size();
+        for (const auto &entry : hookIndex)
+            stringsSize += entry.getKey().size();
+
+        uint64_t bucketsOffset = COMPILED_CONFIG_HEADER_SIZE + dllNames.size() * COMPILED_CONFIG_DLL_RECORD_SIZE;
+        uint64_t stringsOffset = bucketsOffset + bucketCount * COMPILED_CONFIG_BUCKET_SIZE;
+
+        if (stringsOffset + stringsSize > UINT32_MAX)
+            return false;
+
+        SmallVector<char, 0> data(stringsOffset + stringsSize, 0);
+        char *p_data = data.data();
+
+        memcpy(p_data, COMPILED_CONFIG_MAGIC, 8);
+        write32le(p_data + 8, COMPILED_CONFIG_VERSION);
+        write64le(p_data + 16, contentHash);
+        write32le(p_data + 24, dllNames.size());
+        write32le(p_data + 28, hookIndex.size());
+        write32le(p_data + 32, bucketCount);
+        write32le(p_data + 36, stringsSize);
+        write32le(p_data + 40, hotnessPolicy.exemptAboveEntryPercent);
+        write64le(p_data + 48, hotnessPolicy.dispatchBudget);
+
+        uint32_t stringOffset = 0;
+        for (size_t i = 0; i < dllNames.size(); i++)
+        {
+            char *p_record = p_data + COMPILED_CONFIG_HEADER_SIZE + i * COMPILED_CONFIG_DLL_RECORD_SIZE;
+            write32le(p_record, stringOffset);
+            write32le(p_record + 4, dllNames[i].size());
+
+            memcpy(p_data + stringsOffset + stringOffset, dllNames[i].data(), dllNames[i].size());
+            stringOffset += dllNames[i].size();
+        }
+
+        for (uint64_t i = 0; i < bucketCount; i++)
+            write32le(p_data + bucketsOffset + i * COMPILED_CONFIG_BUCKET_SIZE + 4, COMPILED_CONFIG_EMPTY_BUCKET);
+
+        for (const auto &entry : hookIndex)
+        {
+            StringRef name = entry.getKey();
+            uint32_t hash = djbHash(name);
+            uint64_t bucket = hash & (bucketCount - 1);
+
+            while (read32le(p_data + bucketsOffset + bucket * COMPILED_CONFIG_BUCKET_SIZE + 4) != COMPILED_CONFIG_EMPTY_BUCKET)
+                bucket = (bucket + 1) & (bucketCount - 1);
+
+            char *p_bucket = p_data + bucketsOffset + bucket * COMPILED_CONFIG_BUCKET_SIZE;
+            write32le(p_bucket, hash);
+            write32le(p_bucket + 4, entry.getValue());
+            write32le(p_bucket + 8, stringOffset);
+            write32le(p_bucket + 12, name.size());
+
+            memcpy(p_data + stringsOffset + stringOffset, name.data(), name.size());
+            stringOffset += name.size();
+        }
+
+        int fd;
+        SmallString<256> tmpPath;
+        if (sys::fs::createUniqueFile(path + ".tmp-%%%%%%%%", fd, tmpPath))
+            return false;
+
+        {
+            raw_fd_ostream out(fd, /*shouldClose*/ true);
+            out.write(p_data, data.size());
+            out.close();
+
+            if (out.has_error())
+            {
+                out.clear_error();
+                sys::fs::remove(tmpPath);
+                return false;
+            }
+        }
+
+        if (sys::fs::rename(tmpPath, path))
+        {
+            sys::fs::remove(tmpPath);
+            return false;
+        }
+
+        return true;
+    }
+
+    uint64_t CallObfuscatorConfig::hashContent(StringRef buffer)
+    {
+        return xxHash64(buffer);
+    }
+
+    bool CallObfuscatorConfig::isCompiled() const
+    {
+        return compiledBuffer != nullptr;
+    }
+
+    bool CallObfuscatorConfig::isFunctionHooked(StringRef functionName, StringRef &dllName) const
+    {
+        using namespace support::endian;
+
+        if (isCompiled())
+        {
+            uint32_t hash = djbHash(functionName);
+            uint32_t mask = compiledBucketCount - 1;
+
+            // Compiled files always leave an empty bucket, but one read from disk may not, so
+            // no more than every bucket is probed
+            uint32_t bucket = hash & mask;
+            for (uint32_t probes = 0; probes < compiledBucketCount; probes++, bucket = (bucket + 1) & mask)
+            {
+                const char *p_bucket = p_compiledBuckets + (uint64_t)bucket * COMPILED_CONFIG_BUCKET_SIZE;
+                uint32_t dllId = read32le(p_bucket + 4);
+
+                if (dllId == COMPILED_CONFIG_EMPTY_BUCKET)
+                    return false;
+
+                if (read32le(p_bucket) != hash || read32le(p_bucket + 12) != functionName.size())
+                    continue;
+
+                uint64_t offset = read32le(p_bucket + 8);
+                if (offset + functionName.size() > compiledStringsSize)
+                    return false;
+
+                if (memcmp(p_compiledStrings + offset, functionName.data(), functionName.size()))
+                    continue;
+
+                if (dllId >= dllNames.size())
+                    return false;
+
+                dllName = dllNames[dllId];
+                return true;
+            }
+
+            return false;
+        }
+
+        auto entry = hookIndex.find(functionName);
+
+        if (entry == hookIndex.end())
+            return false;
+
+        dllName = dllNames[entry->second];
+        return true;
+    }
+
+    const HotnessPolicy &CallObfuscatorConfig::getHotnessPolicy() const
+    {
+        return hotnessPolicy;
+    }
+
+    size_t CallObfuscatorConfig::hookCount() const
+    {
+        if (isCompiled())
+            return compiledHookCount;
+
+        return hookIndex.size();
+    }
+
+    size_t CallObfuscatorConfig::dllCount() const
+    {
+        return dllNames.size();
+    }
+}
@@ -0,0 +1,189 @@
+/**
+ * @file CallObfuscatorHints.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Export hints: where each hooked function is in the exports of a reference copy
+ *        of its dll, so the helpers can check it in O(1) before searching by hash.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CallObfuscatorHints.h"
+#include "CallObfuscator.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/BinaryFormat/COFF.h"
+#include "llvm/Object/COFF.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace llvm;
+using namespace llvm::object;
+using namespace callobfuscator;
+
+namespace callobfuscatorhints
+{
+    ExportHints::ExportHints(StringRef folder) : folder(folder.str())
+    {
+    }
+
+    uint32_t ExportHints::getHint(StringRef dllName, StringRef functionName)
+    {
+        auto inserted = dlls.try_emplace(dllName.lower());
+        StringMap<uint32_t> &names = inserted.first->second;
+
+        if (inserted.second)
+        {
+            SmallString<256> path(folder);
+            sys::path::append(path, dllName);
+
+            if (!sys::fs::exists(path))
+            {
+                path = folder;
+                sys::path::append(path, inserted.first->first());
+            }
+
+            string error;
+            if (!sys::fs::exists(path))
+            {
+                info(VERBOSITY_DETAIL) << "[INFO] No reference dll for " << dllName << " in: " << folder << "\n";
+            }
+            else if (!readExports(path, names, error))
+            {
+                errs() << "[ERROR] Reference dll " << path << " could not be read: " << error << "\n";
+                names.clear();
+            }
+            else
+            {
+                info(VERBOSITY_DETAIL) << "[INFO] Using reference dll: " << path << " (" << names.size() << " names)\n";
+            }
+        }
+
+        auto found = names.find(functionName);
+        return found == names.end() || found->second > EXPORT_HINT_MAX ? EXPORT_HINT_NONE : found->second;
+    }
+
+    bool ExportHints::readExports(StringRef path, StringMap<uint32_t> &names, string &error)
+    {
+        ErrorOr<unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+        if (!buffer)
+        {
+            error = buffer.getError().message();
+            return false;
+        }
+
+        StringRef file = buffer.get()->getBuffer();
+        auto inFile = [&](uint64_t offset, uint64_t size)
+        { return offset <= file.size() && size <= file.size() - offset; };
+
+        // > Headers
+        if (!inFile(0, sizeof(dos_header)) || memcmp(file.data(), "MZ", 2))
+        {
+            error = "not a PE file";
+            return false;
+        }
+
+        uint64_t headersOffset = ((const dos_header *)file.data())->AddressOfNewExeHeader;
+        if (!inFile(headersOffset, sizeof(COFF::PEMagic) + sizeof(coff_file_header) + sizeof(pe32plus_header)) ||
+            memcmp(file.data() + headersOffset, COFF::PEMagic, sizeof(COFF::PEMagic)))
+        {
+            error = "not a PE file";
+            return false;
+        }
+
+        const coff_file_header *p_fileHeader = (const coff_file_header *)(file.data() + headersOffset + sizeof(COFF::PEMagic));
+        const pe32plus_header *p_header = (const pe32plus_header *)(p_fileHeader + 1);
+        if (p_header->Magic != COFF::PE32Header::PE32_PLUS)
+        {
+            error = "not a PE32+ dll";
+            return false;
+        }
+
+        uint64_t directoriesOffset = headersOffset + sizeof(COFF::PEMagic) + sizeof(coff_file_header) + sizeof(pe32plus_header);
+        uint64_t sectionsOffset = headersOffset + sizeof(COFF::PEMagic) + sizeof(coff_file_header) + p_fileHeader->SizeOfOptionalHeader;
+        const coff_section *p_sections = (const coff_section *)(file.data() + sectionsOffset);
+
+        if (p_header->NumberOfRvaAndSize <= COFF::EXPORT_TABLE || !inFile(directoriesOffset, sizeof(data_directory)) ||
+            !inFile(sectionsOffset, p_fileHeader->NumberOfSections * sizeof(coff_section)))
+        {
+            error = "bad headers";
+            return false;
+        }
+
+        const data_directory *p_exportDirectory = (const data_directory *)(file.data() + directoriesOffset) + COFF::EXPORT_TABLE;
+        if (!p_exportDirectory->RelativeVirtualAddress)
+            return true;
+
+        // File offset of an rva, through the section holding it
+        auto toOffset = [&](uint32_t rva, uint64_t size, uint64_t &offset)
+        {
+            for (uint16_t i = 0; i < p_fileHeader->NumberOfSections; i++)
+            {
+                if (rva >= p_sections[i].VirtualAddress && rva - p_sections[i].VirtualAddress < p_sections[i].SizeOfRawData)
+                {
+                    offset = p_sections[i].PointerToRawData + (rva - p_sections[i].VirtualAddress);
+                    return inFile(offset, size);
+                }
+            }
+            return false;
+        };
+
+        // > Export directory
+        uint64_t exportsOffset, namesOffset;
+        if (!toOffset(p_exportDirectory->RelativeVirtualAddress, sizeof(export_directory_table_entry), exportsOffset))
+        {
+            error = "export directory out of the file";
+            return false;
+        }
+
+        const export_directory_table_entry *p_exports = (const export_directory_table_entry *)(file.data() + exportsOffset);
+        if (!toOffset(p_exports->NamePointerRVA, p_exports->NumberOfNamePointers * 4ull, namesOffset))
+        {
+            error = "export names out of the file";
+            return false;
+        }
+
+        // Same order the helpers walk them in, so the hint of a name is where they find it first
+        const support::ulittle32_t *p_namesTable = (const support::ulittle32_t *)(file.data() + namesOffset);
+        for (uint32_t i = 0; i < p_exports->NumberOfNamePointers; i++)
+        {
+            uint64_t nameOffset;
+            if (!toOffset(p_namesTable[i], 1, nameOffset))
+            {
+                error = "export " + to_string(i) + " out of the file";
+                return false;
+            }
+
+            size_t length = strnlen(file.data() + nameOffset, file.size() - nameOffset);
+            if (length == file.size() - nameOffset)
+            {
+                error = "export " + to_string(i) + " has no terminator";
+                return false;
+            }
+
+            names.try_emplace(StringRef(file.data() + nameOffset, length), i + 1);
+        }
+
+        return true;
+    }
+}
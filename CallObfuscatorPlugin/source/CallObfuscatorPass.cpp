@@ -24,39 +24,189 @@
 
 #include "CallObfuscatorPass.h"
 #include "CallObfuscator.h"
+#include "CallObfuscatorHints.h"
+#include "CallObfuscatorReport.h"
 
 #include <typeinfo>
 
 #include "llvm/Support/CommandLine.h"
 
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/IRBuilder.h"
 
-#include "llvm/Support/JSON.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/MemoryBuffer.h"
 
 using namespace std;
 using namespace llvm;
-using namespace json;
+using namespace callobfuscator;
+using namespace callobfuscatorreport;
+using namespace callobfuscatorhints;
+
+#define DEBUG_TYPE "callobfuscator"
+
+STATISTIC(NumFunctionsScanned, "Number of functions checked against the config");
+STATISTIC(NumHooksRegistered, "Number of functions registered for hooking");
+STATISTIC(NumHotCallsExempted, "Number of hot call sites left direct by the hotness policy");
 
 namespace callobfuscatorpass
 {
-    bool CallObfuscatorPass::readConfig(Object &jsonConfig)
+    CallObfuscatorPass::CallObfuscatorPass(CallObfuscatorPassOptions options) : options(std::move(options))
+    {
+        config = this->options.config;
+        configLoaded = config != nullptr;
+    }
+
+    bool CallObfuscatorPass::parsePassOptions(StringRef params, CallObfuscatorPassOptions &options)
     {
+        while (!params.empty())
+        {
+            StringRef param;
+            tie(param, params) = params.split(';');
 
-        StringRef config = getenv(LLVM_CALL_OBF_CONFIG_PATH);
+            StringRef key, value;
+            tie(key, value) = param.split('=');
 
-        if (config.empty())
+            if (key == "config" && !value.empty())
+            {
+                options.configPath = value.str();
+            }
+            else if (key == "tables")
+            {
+                if (value != "module" && value != "fragments")
+                {
+                    errs() << "[ERROR] " CALL_OBF_PASS_NAME " tables must be module or fragments: " << value << "\n";
+                    return false;
+                }
+                options.tables = value.str();
+            }
+            else if (key == "dispatch")
+            {
+                if (value != "variadic" && value != "arity")
+                {
+                    errs() << "[ERROR] " CALL_OBF_PASS_NAME " dispatch must be variadic or arity: " << value << "\n";
+                    return false;
+                }
+                options.dispatch = value.str();
+            }
+            else if (key == "resolve")
+            {
+                if (value != "lazy" && value != "eager")
+                {
+                    errs() << "[ERROR] " CALL_OBF_PASS_NAME " resolve must be lazy or eager: " << value << "\n";
+                    return false;
+                }
+                options.resolve = value.str();
+            }
+            else if (key == "analyze" && value.empty())
+            {
+                options.analysisOnly = true;
+            }
+            else if (key == "report" && !value.empty())
+            {
+                options.reportPath = value.str();
+            }
+            else if (key == "hints" && !value.empty())
+            {
+                options.hintsPath = value.str();
+            }
+            else if (key == "verbosity")
+            {
+                unsigned int level;
+                if (value.getAsInteger(10, level))
+                {
+                    errs() << "[ERROR] " CALL_OBF_PASS_NAME " verbosity is not a number: " << value << "\n";
+                    return false;
+                }
+                options.verbosity = level;
+            }
+            else
+            {
+                errs() << "[ERROR] Unknown " CALL_OBF_PASS_NAME " parameter: " << param << "\n";
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool CallObfuscatorPass::isLTOPreLink(const Module &M)
+    {
+        // clang tags modules with this flag before running the pre link pipeline for full LTO
+        return M.getModuleFlag("ThinLTO") != nullptr;
+    }
+
+    bool CallObfuscatorPass::isLTOModule(const Module &M)
+    {
+        // clang sets EnableSplitLTOUnit for both thin and full LTO, and ThinLTO (to 0) for full
+        // LTO only. Both are kept in the bitcode, and in the merged module of a full LTO link
+        return M.getModuleFlag("EnableSplitLTOUnit") != nullptr || M.getModuleFlag("ThinLTO") != nullptr;
+    }
+
+    void CallObfuscatorPass::readVerbosity()
+    {
+        // Once per process, passes running in other threads may be reading it
+        static bool verbosityRead = []()
+        {
+            StringRef verbosityLevel = getenv(LLVM_CALL_OBF_VERBOSITY);
+            if (!verbosityLevel.empty() && verbosityLevel.trim().getAsInteger(10, verbosity))
+                errs() << "[ERROR] " LLVM_CALL_OBF_VERBOSITY " is not a number, ignoring it\n";
+            return true;
+        }();
+        (void)verbosityRead;
+    }
+
+    bool CallObfuscatorPass::readConfig()
+    {
+        StringRef configPath = options.configPath;
+
+        if (configPath.empty())
+            configPath = getenv(LLVM_CALL_OBF_CONFIG_PATH);
+
+        if (configPath.empty())
         {
-            errs() << "[ERROR] " LLVM_CALL_OBF_CONFIG_PATH " env variable not set"
-                   << "\n";
+            errs() << "[ERROR] No config given, set " LLVM_CALL_OBF_CONFIG_PATH " env variable or use " CALL_OBF_PASS_NAME
+                      "<config=path>\n";
             return false;
         }
 
-        config = config.trim(" \t\n\v\f\r\"");
+        shared_ptr<CallObfuscatorConfig> loaded = make_shared<CallObfuscatorConfig>();
+        if (!loadConfig(configPath, *loaded))
+            return false;
+
+        config = std::move(loaded);
+        return true;
+    }
+
+    uint32_t CallObfuscatorPass::getExportHint(StringRef dllName, StringRef functionName)
+    {
+        if (!hintsLoaded)
+        {
+            hintsLoaded = true;
+
+            StringRef hintsPath = options.hintsPath;
+            if (hintsPath.empty())
+                hintsPath = StringRef(getenv(LLVM_CALL_OBF_HINTS)).trim();
+
+            if (!hintsPath.empty())
+                hints = make_shared<ExportHints>(hintsPath);
+        }
+
+        return hints ? hints->getHint(dllName, functionName) : EXPORT_HINT_NONE;
+    }
+
+    bool CallObfuscatorPass::loadConfig(StringRef configPath, CallObfuscatorConfig &config, uint64_t *p_contentHash)
+    {
+        configPath = configPath.trim(" \t\n\v\f\r\"");
 
+        // Not requiring a null terminator allows big files to be mapped instead of copied
         ErrorOr<unique_ptr<MemoryBuffer>> result =
-            MemoryBuffer::getFile(config);
+            MemoryBuffer::getFile(configPath, /*IsText*/ false, /*RequiresNullTerminator*/ false);
 
         error_code ec = result.getError();
 
@@ -66,85 +216,90 @@ namespace callobfuscatorpass
             return false;
         }
 
-        Expected<json::Value> ParseResult =
-            parse(result.get().get()->getBuffer());
+        StringRef jsonBuffer = result.get()->getBuffer();
+        uint64_t contentHash = CallObfuscatorConfig::hashContent(jsonBuffer);
+        if (p_contentHash)
+            *p_contentHash = contentHash;
 
-        if (Error E = ParseResult.takeError())
+        SmallString<256> compiledPath(configPath);
+        compiledPath += COMPILED_CONFIG_EXTENSION;
+
+        ErrorOr<unique_ptr<MemoryBuffer>> compiled =
+            MemoryBuffer::getFile(compiledPath, /*IsText*/ false, /*RequiresNullTerminator*/ false);
+
+        if (compiled && config.loadCompiled(std::move(compiled.get()), contentHash))
         {
-            errs() << "[ERROR] Config file could not be parsed\n";
-            errs() << E << "\n";
-            consumeError(std::move(E));
-            return false;
+            info(VERBOSITY_SUMMARY) << "[INFO] Using config: " << configPath << " (compiled, " << config.hookCount() << " hooks, "
+                                    << config.dllCount() << " dlls)\n";
+            return true;
         }
 
-        outs() << "[INFO] Using config: " << config << "\n";
+        // Missing or stale compiled config, go through the json and refresh it
+        if (!config.loadJson(jsonBuffer))
+            return false;
+
+        if (!config.writeCompiled(compiledPath, contentHash))
+            info(VERBOSITY_SUMMARY) << "[INFO] Compiled config could not be written to: " << compiledPath << "\n";
+
+        info(VERBOSITY_SUMMARY) << "[INFO] Using config: " << configPath << " (" << config.hookCount() << " hooks, "
+                                << config.dllCount() << " dlls)\n";
 
-        jsonConfig = *ParseResult.get().getAsObject();
         return true;
     }
 
-    bool CallObfuscatorPass::isFunctionHooked(StringRef argFunctionName, StringRef &argDllName)
+    void CallObfuscatorPass::applyHotnessPolicy(Module &M, CallObfuscator &obf, MutableArrayRef<CallSiteCost> costs)
     {
-        if (fileMalformed)
-            return false;
+        const HotnessPolicy &policy = config->getHotnessPolicy();
 
-        const json::Array *dllHooks = jsonConfig.getArray(DLL_HOOKS_KEY);
-
-        if (!dllHooks)
+        // > Entry percent: every call site on its own
+        uint64_t remaining = 0;
+        for (CallSiteCost &cost : costs)
         {
-            errs() << "[ERROR] Config file malformed, cant find \"" DLL_HOOKS_KEY "\" key\n";
-            fileMalformed = true;
-            return false;
+            cost.exempt = policy.exemptAboveEntryPercent && cost.entryPercent > policy.exemptAboveEntryPercent;
+            remaining += cost.exempt ? 0 : cost.count;
         }
-        int entryCount = 0; // Used for error reporting
-        for (auto &entry : *dllHooks)
-        {
-            const Object *dllInfo = entry.getAsObject();
-
-            if (!dllInfo)
-            {
-                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", not an object\n";
-                fileMalformed = true;
-                return false;
-            }
 
-            std::optional<llvm::StringRef> dllName = (*dllInfo).getString(DLL_NAME_KEY);
-            if (!dllName.has_value())
-            {
-                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", cant find \"" DLL_NAME_KEY "\" key, or is not a string\n";
-                fileMalformed = true;
-                return false;
-            }
+        // > Budget: the hottest call sites left first, until the rest fits
+        if (policy.dispatchBudget && remaining > policy.dispatchBudget)
+        {
+            vector<CallSiteCost *> hottest;
+            for (CallSiteCost &cost : costs)
+                if (!cost.exempt)
+                    hottest.push_back(&cost);
 
-            const json::Array *functionNames = (*dllInfo).getArray(FUNCTION_HOOKS_KEY);
-            if (!functionNames)
-            {
-                errs() << "[ERROR] Config file malformed at entry " << entryCount << ", cant find \"" FUNCTION_HOOKS_KEY "\" key, or is not a list\n";
-                fileMalformed = true;
-                return false;
-            }
+            stable_sort(hottest.begin(), hottest.end(), [](const CallSiteCost *p_a, const CallSiteCost *p_b)
+                        { return p_a->count > p_b->count; });
 
-            for (auto &functionEntry : *functionNames)
+            for (CallSiteCost *p_cost : hottest)
             {
-                std::optional<llvm::StringRef> functionName = functionEntry.getAsString();
-                if (!functionName.has_value())
-                {
-                    errs() << "[ERROR] Config file malformed at entry " << entryCount << ", function list contains errors\n";
-                    fileMalformed = true;
-                    return false;
-                }
+                if (remaining <= policy.dispatchBudget)
+                    break;
 
-                if (functionName.value().equals(argFunctionName))
-                {
-
-                    argDllName = dllName.value();
-                    return true;
-                }
+                p_cost->exempt = true;
+                remaining -= p_cost->count;
             }
+        }
 
-            entryCount++;
+        uint64_t exempted = 0, avoided = 0;
+        for (const CallSiteCost &cost : costs)
+        {
+            if (!cost.exempt)
+                continue;
+
+            obf.exemptCall(cost.p_call);
+            exempted++;
+            avoided += cost.count;
+
+            info(VERBOSITY_SUMMARY) << "[INFO] Left direct call to " << cost.p_callee->getName() << " in " << cost.p_caller->getName();
+            if (const DILocation *p_location = cost.location.get())
+                info(VERBOSITY_SUMMARY) << " (" << p_location->getFilename() << ":" << p_location->getLine() << ")";
+            info(VERBOSITY_SUMMARY) << ", " << cost.count << " calls expected, " << format("%.0f", cost.entryPercent)
+                                    << "% of entries\n";
         }
-        return false;
+
+        NumHotCallsExempted += exempted;
+        info(VERBOSITY_SUMMARY) << "[INFO] Left " << exempted << " hot calls direct, " << avoided << " of " << avoided + remaining
+                                << " expected dispatches avoided, in module: " << M.getName() << "\n";
     }
 
     // CallObfuscatorPass implementations:
@@ -152,52 +307,188 @@ namespace callobfuscatorpass
                                               ModuleAnalysisManager &AM)
     {
         LLVMContext &ctx = M.getContext();
+
+        readVerbosity();
+
+        // Pipeline parameters win over the env variable
+        if (options.verbosity >= 0)
+            verbosity = options.verbosity;
+
+        if (options.skipLTOPreLink && isLTOPreLink(M))
+        {
+            info(VERBOSITY_DETAIL) << "[INFO] Module will be obfuscated at link time: " << M.getName() << "\n";
+            return PreservedAnalyses::all();
+        }
+
+        // Same pass may be both in the pipeline and at an extension point
+        if (CallObfuscator::isObfuscated(M))
+        {
+            info(VERBOSITY_SUMMARY) << "[INFO] Module already obfuscated: " << M.getName() << "\n";
+            return PreservedAnalyses::all();
+        }
+
         if (!configLoaded)
         {
             configLoaded = true; // No matter the result, try only once
-            bool result = readConfig(jsonConfig);
-            if (!result)
-                return PreservedAnalyses::all();
+            PhaseTimer timer("readConfig", "Read config");
+            readConfig();
+        }
+
+        if (!config)
+            return PreservedAnalyses::all();
+
+        StringRef tables = options.tables;
+        if (tables.empty())
+            tables = StringRef(getenv(LLVM_CALL_OBF_TABLES)).trim();
+
+        if (!tables.empty() && tables != "module" && tables != "fragments")
+        {
+            errs() << "[ERROR] " LLVM_CALL_OBF_TABLES " must be module or fragments\n";
+            return PreservedAnalyses::all();
+        }
+
+        if (tables != "fragments" && !options.fullLTOLink && isLTOModule(M))
+        {
+            info(VERBOSITY_DETAIL) << "[INFO] Using fragments for LTO module: " << M.getName() << "\n";
+            tables = "fragments";
+        }
+
+        StringRef dispatch = options.dispatch;
+        if (dispatch.empty())
+            dispatch = StringRef(getenv(LLVM_CALL_OBF_DISPATCH)).trim();
+
+        if (!dispatch.empty() && dispatch != "variadic" && dispatch != "arity")
+        {
+            errs() << "[ERROR] " LLVM_CALL_OBF_DISPATCH " must be variadic or arity\n";
+            return PreservedAnalyses::all();
         }
 
-        outs() << "[INFO] Analyzing module: " << M.getName() << "\n";
+        StringRef resolve = options.resolve;
+        if (resolve.empty())
+            resolve = StringRef(getenv(LLVM_CALL_OBF_RESOLVE)).trim();
+
+        if (!resolve.empty() && resolve != "lazy" && resolve != "eager")
+        {
+            errs() << "[ERROR] " LLVM_CALL_OBF_RESOLVE " must be lazy or eager\n";
+            return PreservedAnalyses::all();
+        }
 
-        callobfuscator::CallObfuscator obf = callobfuscator::CallObfuscator(M);
+        info(VERBOSITY_DETAIL) << "[INFO] Analyzing module: " << M.getName() << "\n";
+
+        callobfuscator::CallObfuscator obf =
+            callobfuscator::CallObfuscator(M, tables == "fragments", dispatch == "arity", resolve == "eager");
+
+        // Analysis leaves the module untouched, so a declaration added here is removed after
+        bool loadLibraryDeclared = M.getFunction(LOAD_LIBRARY_FUNCTION) != nullptr;
 
         FunctionType *p_loadLibraryType = FunctionType::get(
             PointerType::get(ctx, 0),
             {PointerType::get(ctx, 0)},
             false);
 
-        FunctionCallee c = M.getOrInsertFunction("LoadLibraryA", p_loadLibraryType);
+        FunctionCallee c = M.getOrInsertFunction(LOAD_LIBRARY_FUNCTION, p_loadLibraryType);
         Function &loadLibrary = cast<Function>(*c.getCallee());
-        obf.addHook({loadLibrary, "kernel32.dll", false, 0});
+        FunctionInfo loadLibraryInfo = {loadLibrary, LOAD_LIBRARY_DLL, false, 0};
+        loadLibraryInfo.exportHint = getExportHint(LOAD_LIBRARY_DLL, LOAD_LIBRARY_FUNCTION);
+        obf.addHook(loadLibraryInfo);
 
-        for (Function &F : M)
         {
-            StringRef dllName;
+            PhaseTimer timer("scanHooks", "Scan functions for hooks");
 
-            if (isFunctionHooked(F.getName(), dllName))
+            for (Function &F : M)
             {
-                if (!obf.addHook({F, dllName, false, 0}))
+                StringRef dllName;
+                NumFunctionsScanned++;
+
+                if (config->isFunctionHooked(F.getName(), dllName))
                 {
-                    outs() << "[INFO] Something went wrong while preparing the hooks... "
-                           << "\n";
-                    return PreservedAnalyses::all();
+                    FunctionInfo hook = {F, dllName, false, 0};
+                    hook.exportHint = getExportHint(dllName, F.getName());
+
+                    if (!obf.addHook(hook))
+                    {
+                        outs() << "[INFO] Something went wrong while preparing the hooks... "
+                               << "\n";
+                        return PreservedAnalyses::all();
+                    }
+                    NumHooksRegistered++;
                 }
             }
         }
 
-        if (!obf.finalize())
+        bool analysisOnly = options.analysisOnly || StringRef(getenv(LLVM_CALL_OBF_ANALYZE)).trim() == "1";
+        StringRef reportPath = options.reportPath;
+        if (reportPath.empty())
+            reportPath = StringRef(getenv(LLVM_CALL_OBF_REPORT)).trim();
+
+        const HotnessPolicy &policy = config->getHotnessPolicy();
+        bool withRemarks = remarksEnabled(M);
+        bool hasProfile = false;
+
+        // Block frequencies are only computed when something is going to use them
+        vector<CallSiteCost> costs;
+        if (policy.isEnabled() || analysisOnly || !reportPath.empty() || withRemarks)
+        {
+            PhaseTimer timer("collectCallSiteCosts", "Collect call site costs");
+
+            vector<Function *> hookedFunctions;
+            for (const FunctionInfo &info : obf.getHookedFunctions())
+                hookedFunctions.push_back(&info.function);
+
+            FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+            collectCallSiteCosts(M, FAM, hookedFunctions, costs);
+            hasProfile = AM.getResult<ProfileSummaryAnalysis>(M).hasProfileSummary();
+        }
+
+        // Static estimates cant tell how often a loop runs, so the policy needs profile data
+        if (policy.isEnabled() && !hasProfile)
+            info(VERBOSITY_DETAIL) << "[INFO] No profile data, hotness policy not applied to module: " << M.getName() << "\n";
+
+        if (policy.isEnabled() && hasProfile)
+        {
+            PhaseTimer timer("applyHotnessPolicy", "Apply hotness policy");
+            applyHotnessPolicy(M, obf, costs);
+        }
+
+        bool success = analysisOnly ? obf.analyze() : obf.finalize();
+        if (!success)
             outs() << "[ERROR] Something went wrong\n";
 
-        // Im not really sure wich passes should invalidate, so better to rerun all,
-        // but since we run it as a single pass with opt, doesnt really matter.
+        if (withRemarks)
+            emitRemarks(costs, obf, analysisOnly);
+
+        if (!reportPath.empty())
+            writeReport(reportPath, M, createReport(M, obf, costs, analysisOnly, success, hasProfile));
+
+        if (analysisOnly)
+        {
+            if (!loadLibraryDeclared && loadLibrary.use_empty())
+                loadLibrary.eraseFromParent();
+
+            info(VERBOSITY_SUMMARY) << "[INFO] Analyzed " << costs.size() << " calls to " << obf.getHookedFunctions().size()
+                                    << " functions in module: " << M.getName() << "\n";
+            return PreservedAnalyses::all();
+        }
+
         if (obf.changedModule())
-            return PreservedAnalyses::none();
+        {
+            // Calls are retargeted in place and globals (and the eager resolver) are added, but no block is ever
+            // split, added or removed, so the CFG of every function stays the same.
+            PreservedAnalyses PA;
+            PA.preserveSet<CFGAnalyses>();
+
+            // Only the functions that had calls rewritten need their analyses dropped,
+            // the rest are left cached for the passes that follow in the pipeline.
+            FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+            for (Function *p_function : obf.getModifiedFunctions())
+                FAM.invalidate(*p_function, PA);
+
+            PA.preserveSet<AllAnalysesOn<Function>>();
+            PA.preserve<FunctionAnalysisManagerModuleProxy>();
+            return PA;
+        }
 
-        outs() << "[INFO] Module not modified"
-               << "\n";
+        info(VERBOSITY_SUMMARY) << "[INFO] Module not modified: " << M.getName() << "\n";
 
         return PreservedAnalyses::all();
     }
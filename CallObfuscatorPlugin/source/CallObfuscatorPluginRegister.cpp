@@ -22,48 +22,101 @@
  *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
 
 #include "CallObfuscatorPass.h"
+
+#include <cstdlib>
+
 NOWARN(
     "-Wdll-attribute-on-redeclaration",
-    __declspec(dllexport) extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
+    PLUGIN_EXPORT extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
         llvmGetPassPluginInfo() {
             return {
                 LLVM_PLUGIN_API_VERSION,
-                "CallObfuscatorPlugin", "v0.1",
+                "CallObfuscatorPlugin", CALL_OBF_PLUGIN_VERSION,
                 [](PassBuilder &PB)
                 {
-                    // Allows to run the pass alone, only works with opt.exe
-                    // Enables: opt -load-pass-plugin="<whatever>/LLVMBasePlugin.dll" -passes="base-plugin-pass"
+                    using namespace callobfuscatorpass;
+
+                    // Allows to run the pass alone, with optional parameters
+                    // Enables: opt -load-pass-plugin="<whatever>/CallObfuscatorPlugin.dll" -passes="callobfuscator-pass"
+                    // Enables: opt ... -passes="callobfuscator-pass<config=<path>;verbosity=1>"
                     PB.registerPipelineParsingCallback(
                         [](StringRef Name, ModulePassManager &MPM,
                            ArrayRef<PassBuilder::PipelineElement>)
                         {
-                    if(Name == "callobfuscator-pass"){
-                        MPM.addPass(callobfuscatorpass::CallObfuscatorPass());
-                        return true;
+                    CallObfuscatorPassOptions options;
+
+                    if(Name != CALL_OBF_PASS_NAME){
+                        if(!Name.consume_front(CALL_OBF_PASS_NAME "<") || !Name.consume_back(">"))
+                            return false;
+                        if(!CallObfuscatorPass::parsePassOptions(Name, options))
+                            return false;
                     }
-                    return false; });
 
-                    // This is on test...
-                    // Allows to run the pass as part of the defaults optimization passes
-                    // Enables: clang -O0 -Xclang -disable-O0-optnone -fpass-plugin="<whatever>/LLVMBasePlugin.dll" ...
-                    // Enables: opt -O0 -load-pass-plugin="<whatever>\LLVMBasePlugin.dll" ...
+                    MPM.addPass(CallObfuscatorPass(options));
+                    return true; });
 
-                    // This extension point allows adding optimization passes after most of the
-                    // main optimizations, but before the last cleanup-ish optimizations.
+                    // Allows to run the pass as part of the defaults optimization passes, so the whole
+                    // compilation happens in a single process.
+                    // Enables: clang -O2 -fpass-plugin="<whatever>/CallObfuscatorPlugin.dll" -c ...
+                    // Enables: opt -O2 -load-pass-plugin="<whatever>/CallObfuscatorPlugin.dll" ...
+                    //
+                    // start: Before any optimization, the IR is the closest to the source (default).
+                    // last:  After every optimization, calls turned direct by the optimizer are hooked too.
+                    //        For ThinLTO, this is both at compile time and in every backend.
+                    // lto:   Only at full LTO link time, on the merged module.
+                    // none:  Only when given in a pipeline.
+                    //
+                    // ThinLTO modules are always obfuscated with fragments, at compile time. The thin link
+                    // step cant be extended from a plugin, but fragments need no global layout anyway.
+                    StringRef extensionPoint = getenv(LLVM_CALL_OBF_EXTENSION_POINT);
+                    extensionPoint = extensionPoint.trim();
 
-                    /*PB.registerScalarOptimizerLateEPCallback(
-                        [](FunctionPassManager &FPM, OptimizationLevel opt)
-                        {
-                            FPM.addPass(baseplugin::CallObfuscatorPass());
-                        }); */
-                    PB.registerFullLinkTimeOptimizationEarlyEPCallback(
-                        [](ModulePassManager &MPM, OptimizationLevel opt)
-                        {
-                            MPM.addPass(callobfuscatorpass::CallObfuscatorPass());
-                        });
+                    if (extensionPoint.empty())
+                        extensionPoint = "start";
+
+                    if (extensionPoint != "start" && extensionPoint != "last" && extensionPoint != "lto" && extensionPoint != "none")
+                    {
+                        errs() << "[ERROR] " LLVM_CALL_OBF_EXTENSION_POINT " must be start, last, lto or none, using start\n";
+                        extensionPoint = "start";
+                    }
+
+                    // Modules built for full LTO are left to the link step, where all of them are merged.
+                    // Before LLVM 15 there is no extension point there, so they are obfuscated at compile time.
+                    CallObfuscatorPassOptions compileOptions;
+#if LLVM_VERSION_MAJOR >= 15
+                    compileOptions.skipLTOPreLink = true;
+#endif
+
+                    if (extensionPoint == "start")
+                        PB.registerPipelineStartEPCallback(
+                            [compileOptions](ModulePassManager &MPM, OptimizationLevel)
+                            {
+                                MPM.addPass(CallObfuscatorPass(compileOptions));
+                            });
+
+                    if (extensionPoint == "last")
+                        PB.registerOptimizerLastEPCallback(
+                            [compileOptions](ModulePassManager &MPM, OptimizationLevel)
+                            {
+                                MPM.addPass(CallObfuscatorPass(compileOptions));
+                            });
+
+#if LLVM_VERSION_MAJOR >= 15 // Extension point added in LLVM 15
+                    // The whole program is there, so LLVM_OBF_TABLES=module is honored
+                    CallObfuscatorPassOptions linkOptions;
+                    linkOptions.fullLTOLink = true;
+
+                    if (extensionPoint != "none")
+                        PB.registerFullLinkTimeOptimizationEarlyEPCallback(
+                            [linkOptions](ModulePassManager &MPM, OptimizationLevel)
+                            {
+                                MPM.addPass(CallObfuscatorPass(linkOptions));
+                            });
+#endif
                 }};
         })
\ No newline at end of file
@@ -0,0 +1,279 @@
+/**
+ * @file CallObfuscatorReport.cpp
+ * @author Alejandro González (@httpyxel)
+ * @brief Cost of the hooked call sites of a module, as a json report and as remarks.
+ * @version 0.1
+ * @date 2024-01-14
+ *
+ * @copyright
+ *   Copyright (C) 2024  Alejandro González
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "CallObfuscatorReport.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+using namespace std;
+using namespace llvm;
+using namespace callobfuscator;
+
+#define DEBUG_TYPE "callobfuscator"
+
+namespace callobfuscatorreport
+{
+    void collectCallSiteCosts(Module &M, FunctionAnalysisManager &FAM, ArrayRef<Function *> hookedFunctions,
+                              vector<CallSiteCost> &costs)
+    {
+        SmallPtrSet<const Function *, 16> hooked(hookedFunctions.begin(), hookedFunctions.end());
+
+        // In module order, so reports (and ties in the hotness budget) dont depend on use lists
+        for (Function &F : M)
+        {
+            BlockFrequencyInfo *p_BFI = nullptr; // Only computed for callers of hooked functions
+
+            for (BasicBlock &BB : F)
+                for (Instruction &I : BB)
+                {
+                    const CallInst *p_call = dyn_cast<CallInst>(&I);
+                    if (!p_call || !hooked.count(p_call->getCalledFunction()))
+                        continue;
+
+                    if (!p_BFI)
+                        p_BFI = &FAM.getResult<BlockFrequencyAnalysis>(F);
+
+#if LLVM_VERSION_MAJOR >= 18
+                    uint64_t entryFrequency = p_BFI->getEntryFreq().getFrequency();
+#else
+                    uint64_t entryFrequency = p_BFI->getEntryFreq();
+#endif
+                    CallSiteCost cost;
+                    cost.p_call = p_call;
+                    cost.p_callee = p_call->getCalledFunction();
+                    cost.p_caller = &F;
+                    cost.p_block = &BB;
+                    cost.location = p_call->getDebugLoc();
+
+                    if (entryFrequency)
+                        cost.entryPercent = (double)p_BFI->getBlockFreq(&BB).getFrequency() / entryFrequency * 100;
+
+                    auto count = p_BFI->getBlockProfileCount(&BB);
+                    cost.count = count ? *count : 0;
+
+                    costs.push_back(cost);
+                }
+        }
+    }
+
+    json::Value createReport(const Module &M, const CallObfuscator &obf, ArrayRef<CallSiteCost> costs, bool analysisOnly,
+                             bool success, bool hasProfile)
+    {
+        struct CallerCost
+        {
+            int64_t callSites = 0;
+            int64_t exemptCallSites = 0;
+            double entryPercent = 0;
+            uint64_t count = 0;
+            uint64_t dispatches = 0; // Count of the call sites that are not exempt, the ones going through the dispatcher
+        };
+
+        using CallerCosts = MapVector<const Function *, CallerCost>;
+        DenseMap<const Function *, CallerCosts> callers; // Callee -> caller -> cost
+        const CallerCosts noCallers;
+        for (const CallSiteCost &cost : costs)
+        {
+            CallerCost &caller = callers[cost.p_callee][cost.p_caller];
+            caller.callSites++;
+            caller.exemptCallSites += cost.exempt;
+            caller.entryPercent += cost.entryPercent;
+            caller.count += cost.count;
+            if (!cost.exempt)
+                caller.dispatches += cost.count;
+        }
+
+        int64_t totalCallSites = 0, totalExempt = 0;
+        uint64_t totalDispatches = 0;
+
+        json::Array functions;
+        for (const FunctionInfo &info : obf.getHookedFunctions())
+        {
+            int64_t callSites = 0, exempt = 0;
+            uint64_t dispatches = 0;
+
+            // Found in place, lookup would copy the callers of every function
+            auto found = callers.find(&info.function);
+            const CallerCosts &functionCallers = found == callers.end() ? noCallers : found->second;
+
+            json::Array callerEntries;
+            for (const auto &entry : functionCallers)
+            {
+                const CallerCost &caller = entry.second;
+                callSites += caller.callSites;
+                exempt += caller.exemptCallSites;
+                dispatches += caller.dispatches;
+
+                json::Object callerEntry{
+                    {"function", entry.first->getName()},
+                    {"call_sites", caller.callSites},
+                    {"calls_per_entry", caller.entryPercent / 100},
+                };
+                if (caller.exemptCallSites)
+                    callerEntry["exempt_call_sites"] = caller.exemptCallSites;
+                if (hasProfile)
+                    callerEntry["expected_calls"] = (int64_t)caller.count;
+
+                callerEntries.push_back(std::move(callerEntry));
+            }
+
+            totalCallSites += callSites;
+            totalExempt += exempt;
+            totalDispatches += dispatches;
+
+            json::Object functionEntry{
+                {"name", info.function.getName()},
+                {"dll", info.dllName},
+                {"call_sites", callSites},
+                {"exempt_call_sites", exempt},
+                {"callers", std::move(callerEntries)},
+            };
+            if (hasProfile)
+                functionEntry["expected_dispatches"] = (int64_t)dispatches;
+
+            functions.push_back(std::move(functionEntry));
+        }
+
+        TableSizes sizes = obf.getTableSizes();
+
+        json::Object report{
+            {"module", M.getName()},
+            {"mode", analysisOnly ? "analyze" : "obfuscate"},
+            {"success", success},
+            {"profile", hasProfile},
+            {"hooked_functions", (int64_t)obf.getHookedFunctions().size()},
+            {"call_sites", totalCallSites},
+            {"exempt_call_sites", totalExempt},
+            {"table_sizes",
+             json::Object{
+                 {"function_table", (int64_t)sizes.functionTable},
+                 {"dll_table", (int64_t)sizes.dllTable},
+                 {"dll_names", (int64_t)sizes.dllNames},
+                 {"total", (int64_t)(sizes.functionTable + sizes.dllTable + sizes.dllNames)},
+             }},
+            {"functions", std::move(functions)},
+        };
+        if (hasProfile)
+            report["expected_dispatches"] = (int64_t)totalDispatches;
+
+        return report;
+    }
+
+    bool writeReport(StringRef path, const Module &M, const json::Value &report)
+    {
+        SmallString<256> reportPath(path);
+        if (sys::fs::is_directory(path))
+        {
+            // Modules with the same file name in different folders (a/util.c, b/util.c) would
+            // share it, so the hash of the whole identifier tells them apart
+            sys::path::append(reportPath, formatv("{0}.{1:x-8}.callobf.json", sys::path::filename(M.getName()),
+                                                  (uint32_t)xxHash64(M.getName()))
+                                              .str());
+        }
+
+        error_code ec;
+        raw_fd_ostream out(reportPath, ec, sys::fs::OF_Text);
+        if (ec)
+        {
+            errs() << "[ERROR] Report could not be written to " << reportPath << ": " << ec.message() << "\n";
+            return false;
+        }
+
+        out << formatv("{0:2}", report) << "\n";
+        return true;
+    }
+
+    void emitRemarks(ArrayRef<CallSiteCost> costs, const CallObfuscator &obf, bool analysisOnly)
+    {
+        DenseMap<const Function *, StringRef> dlls;
+        for (const FunctionInfo &info : obf.getHookedFunctions())
+            dlls[&info.function] = info.dllName;
+
+        const Function *p_caller = nullptr;
+        unique_ptr<OptimizationRemarkEmitter> ORE;
+
+        for (const CallSiteCost &cost : costs)
+        {
+            // Sites come grouped by caller
+            if (cost.p_caller != p_caller)
+            {
+                p_caller = cost.p_caller;
+                ORE = make_unique<OptimizationRemarkEmitter>(p_caller);
+            }
+
+            auto addCost = [&cost](DiagnosticInfoOptimizationBase &remark)
+            {
+                remark << " (" << ore::NV("CallsPerEntry", formatv("{0:F2}", cost.entryPercent / 100).str()) << " calls per entry";
+                if (cost.count)
+                    remark << ", " << ore::NV("ExpectedCalls", (unsigned long long)cost.count) << " expected";
+                remark << ")";
+            };
+
+            if (cost.exempt)
+            {
+                ORE->emit(
+                    [&]()
+                    {
+                        OptimizationRemarkMissed remark(DEBUG_TYPE, "HotCallLeftDirect", cost.location, cost.p_block);
+                        remark << "call to " << ore::NV("Callee", cost.p_callee->getName()) << " left direct, too hot to dispatch";
+                        addCost(remark);
+                        return remark;
+                    });
+                continue;
+            }
+
+            ORE->emit(
+                [&]()
+                {
+                    OptimizationRemark remark(DEBUG_TYPE, analysisOnly ? "HookableCall" : "HookedCall", cost.location, cost.p_block);
+                    remark << "call to " << ore::NV("Callee", cost.p_callee->getName()) << " from "
+                           << ore::NV("Dll", dlls.lookup(cost.p_callee))
+                           << (analysisOnly ? " would go" : " goes") << " through the dispatcher";
+                    addCost(remark);
+                    return remark;
+                });
+        }
+    }
+
+    bool remarksEnabled(const Module &M)
+    {
+        const LLVMContext &ctx = M.getContext();
+        return ctx.getLLVMRemarkStreamer() || ctx.getDiagHandlerPtr()->isAnyRemarkEnabled(DEBUG_TYPE);
+    }
+}
@@ -0,0 +1,57 @@
+# Runs the RUN lines of a test, as lit would, for hosts without lit. Each line is run with bash,
+# so pipes fail if any of their commands does.
+#
+#   cmake -DTEST=<file> -DTEST_TMP=<prefix> -DOPT=<opt command> -DPLUGIN=<plugin>
+#         -DFILECHECK=<FileCheck> -DBASH=<bash> -P RunTest.cmake
+#
+# Substitutions: %opt, %plugin, %FileCheck, %s (the test), %S (its folder) and %t (a temporary
+# prefix of its own).
+
+# Semicolons would split the lists, and backslashes escape them, so both are only put back right
+# before running each command
+file(READ ${TEST} test_contents)
+string(REPLACE ";" "<semicolon>" test_contents "${test_contents}")
+string(REPLACE "\\" "<backslash>" test_contents "${test_contents}")
+string(REPLACE "\n" ";" test_lines "${test_contents}")
+get_filename_component(test_dir ${TEST} DIRECTORY)
+get_filename_component(tmp_dir ${TEST_TMP} DIRECTORY)
+file(MAKE_DIRECTORY ${tmp_dir})
+
+set(run_lines "")
+set(pending "")
+foreach(test_line IN LISTS test_lines)
+    if(NOT test_line MATCHES "^<semicolon> RUN: (.*)$")
+        continue()
+    endif()
+
+    # A trailing \ continues the command on the next RUN line
+    string(STRIP "${CMAKE_MATCH_1}" command)
+    if(command MATCHES "^(.*)<backslash>$")
+        string(APPEND pending "${CMAKE_MATCH_1} ")
+        continue()
+    endif()
+
+    list(APPEND run_lines "${pending}${command}")
+    set(pending "")
+endforeach()
+
+if(NOT run_lines)
+    message(FATAL_ERROR "[ERROR] ${TEST} has no RUN lines")
+endif()
+
+foreach(command IN LISTS run_lines)
+    string(REPLACE "%opt" "${OPT}" command "${command}")
+    string(REPLACE "%plugin" "${PLUGIN}" command "${command}")
+    string(REPLACE "%FileCheck" "${FILECHECK}" command "${command}")
+    string(REPLACE "%s" "${TEST}" command "${command}")
+    string(REPLACE "%S" "${test_dir}" command "${command}")
+    string(REPLACE "%t" "${TEST_TMP}" command "${command}")
+    string(REPLACE "<semicolon>" ";" command "${command}")
+    string(REPLACE "<backslash>" "\\" command "${command}")
+
+    message(STATUS "[INFO] ${command}")
+    execute_process(COMMAND ${BASH} -c "set -o pipefail; ${command}" RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "[ERROR] Failed (${result}): ${command}")
+    endif()
+endforeach()
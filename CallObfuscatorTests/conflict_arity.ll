@@ -0,0 +1,41 @@
+; A module that already has a fixed arity dispatcher, with another type, can not be obfuscated
+; by arity: the calls would be rewritten to it with the wrong signature. The pass must give up
+; before emitting any table, and leave the module as it was. The variadic dispatch never calls
+; it, so it is not affected.
+;
+; RUN: cp %S/Inputs/callobfuscator.conf %t.conf
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;tables=module;dispatch=arity>" -S %s -o %t.module.ll
+; RUN: %FileCheck %s < %t.module.ll
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;tables=fragments;dispatch=arity>" -S %s -o %t.fragments.ll
+; RUN: %FileCheck %s < %t.fragments.ll
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;tables=module;dispatch=variadic>" -S %s \
+; RUN:   | %FileCheck %s --check-prefix=VARIADIC
+
+target datalayout = "e-m:w-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-windows-msvc"
+
+; CHECK-NOT: @__callobf_
+; CHECK: define void @main(ptr %handle) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @Sleep(i32 100)
+; CHECK-NEXT: %status = call i32 @NtClose(ptr %handle)
+; CHECK-NOT: @__callobf_function
+; CHECK-NOT: @__callobf_dll
+
+; VARIADIC: @__callobf_functionTable =
+; VARIADIC: call i64 (i32, ...) @__callobf_callDispatcher(
+
+declare dllimport void @Sleep(i32)
+declare dllimport i32 @NtClose(ptr)
+
+define void @main(ptr %handle) {
+entry:
+  call void @Sleep(i32 100)
+  %status = call i32 @NtClose(ptr %handle)
+  call void @__callobf_callDispatcher1(i32 0)
+  call void @__callobf_callDispatcherFragment1(i32 0)
+  ret void
+}
+
+declare void @__callobf_callDispatcher1(i32)
+declare void @__callobf_callDispatcherFragment1(i32)
@@ -0,0 +1,74 @@
+; Calls rewritten to the dispatchers, variadic and by arity. With dispatch=arity, calls with up
+; to 4 arguments go to __callobf_callDispatcher<N>, their arguments widened to i64, and the rest
+; keep the variadic one. Bundles, tail and !dbg stay on the rewritten call either way.
+;
+; RUN: cp %S/Inputs/callobfuscator.conf %t.conf
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;dispatch=variadic>" -S %s \
+; RUN:   | %FileCheck %s --check-prefixes=CHECK,VARIADIC
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;dispatch=arity>" -S %s \
+; RUN:   | %FileCheck %s --check-prefixes=CHECK,ARITY
+
+target datalayout = "e-m:w-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-windows-msvc"
+
+declare dllimport void @Sleep(i32 noundef)
+declare dllimport i32 @GetTickCount()
+declare dllimport i32 @NtClose(ptr noundef)
+declare dllimport signext i8 @SetThreadPriority(ptr noundef, i16 signext)
+declare dllimport zeroext i1 @VirtualAlloc(i8 zeroext, i32)
+declare dllimport ptr @CreateFileA(ptr noundef, i32, i32, ptr, i32, i32, ptr)
+
+; CHECK-LABEL: define i32 @main(
+; VARIADIC: call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}, i32 noundef 10), !dbg [[SLEEP:![0-9]+]]
+; ARITY: call i64 @__callobf_callDispatcher1(i32 {{[0-9]+}}, i64 noundef 10), !dbg [[SLEEP:![0-9]+]]
+; VARIADIC: [[TICKS:%[0-9]+]] = tail call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}) [ "callobf.test"(i32 7) ], !dbg [[TICK:![0-9]+]]
+; ARITY: [[TICKS:%[0-9]+]] = tail call i64 @__callobf_callDispatcher0(i32 {{[0-9]+}}) [ "callobf.test"(i32 7) ], !dbg [[TICK:![0-9]+]]
+; CHECK: [[TICKS32:%[0-9]+]] = trunc i64 [[TICKS]] to i32, !dbg [[TICK]]
+; VARIADIC: call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}, ptr noundef %handle)
+; ARITY: [[HANDLE:%[0-9]+]] = ptrtoint ptr %handle to i64
+; ARITY: call i64 @__callobf_callDispatcher1(i32 {{[0-9]+}}, i64 noundef [[HANDLE]])
+; VARIADIC: call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}, ptr noundef %handle, i16 signext %priority)
+; ARITY: [[PRIORITY:%[0-9]+]] = sext i16 %priority to i64
+; ARITY: call i64 @__callobf_callDispatcher2(i32 {{[0-9]+}}, i64 noundef {{%[0-9]+}}, i64 [[PRIORITY]])
+; CHECK: trunc i64 {{%[0-9]+}} to i8
+; VARIADIC: call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}, i8 zeroext %flags, i32 [[TICKS32]])
+; ARITY-DAG: [[FLAGS:%[0-9]+]] = zext i8 %flags to i64
+; ARITY-DAG: [[SIZE:%[0-9]+]] = zext i32 [[TICKS32]] to i64
+; ARITY: call i64 @__callobf_callDispatcher2(i32 {{[0-9]+}}, i64 [[FLAGS]], i64 [[SIZE]])
+; CHECK: trunc i64 {{%[0-9]+}} to i1
+; CHECK: [[FILE:%[0-9]+]] = call i64 (i32, ...) @__callobf_callDispatcher(i32 {{[0-9]+}}, ptr noundef nonnull %name, i32 1, i32 2, ptr null, i32 3, i32 4, ptr null)
+; CHECK: inttoptr i64 [[FILE]] to ptr
+
+; Not nounwind, hooked functions may raise SEH exceptions through them
+; CHECK: declare noundef i64 @__callobf_callDispatcher(i32 noundef, ...){{$}}
+; ARITY-DAG: declare noundef i64 @__callobf_callDispatcher0(i32 noundef){{$}}
+; ARITY-DAG: declare noundef i64 @__callobf_callDispatcher1(i32 noundef, i64){{$}}
+; ARITY-DAG: declare noundef i64 @__callobf_callDispatcher2(i32 noundef, i64, i64){{$}}
+
+; CHECK-DAG: [[SLEEP]] = !DILocation(line: 2,
+; CHECK-DAG: [[TICK]] = !DILocation(line: 3,
+
+define i32 @main(ptr %handle, ptr %name, i16 %priority, i8 %flags) !dbg !5 {
+entry:
+  call void @Sleep(i32 noundef 10), !dbg !8
+  %ticks = tail call i32 @GetTickCount() [ "callobf.test"(i32 7) ], !dbg !9
+  %status = call i32 @NtClose(ptr noundef %handle)
+  %set = call signext i8 @SetThreadPriority(ptr noundef %handle, i16 signext %priority)
+  %allocated = call zeroext i1 @VirtualAlloc(i8 zeroext %flags, i32 %ticks)
+  %file = call ptr @CreateFileA(ptr noundef nonnull %name, i32 1, i32 2, ptr null, i32 3, i32 4, ptr null)
+  ret i32 %status
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "clang", isOptimized: false, runtimeVersion: 0, emissionKind: FullDebug, enums: !2)
+!1 = !DIFile(filename: "dispatch.c", directory: "/tmp")
+!2 = !{}
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 2, !"Dwarf Version", i32 4}
+!5 = distinct !DISubprogram(name: "main", scope: !1, file: !1, line: 1, type: !6, scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0, retainedNodes: !2)
+!6 = !DISubroutineType(types: !7)
+!7 = !{null}
+!8 = !DILocation(line: 2, column: 3, scope: !5)
+!9 = !DILocation(line: 3, column: 3, scope: !5)
@@ -0,0 +1,36 @@
+; Layout of the tables and the fragments the pass emits, which the helpers read with the
+; structs of callDispatcher.h. Both sides check the same sizes.
+;
+; RUN: cp %S/Inputs/callobfuscator.conf %t.conf
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;tables=module>" -S %s \
+; RUN:   | %FileCheck %s --check-prefix=TABLES
+; RUN: %opt -load-pass-plugin=%plugin -passes="callobfuscator-pass<config=%t.conf;tables=fragments>" -S %s \
+; RUN:   | %FileCheck %s --check-prefix=FRAGMENTS
+
+target datalayout = "e-m:w-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-windows-msvc"
+
+; TABLES-DAG: %_FUNCTION_TABLE_ENTRY = type <{ ptr, i16, i8, i8, i32 }>
+; TABLES-DAG: %_FUNCTION_LOAD_ENTRY = type <{ i32, i16, i16 }>
+; TABLES-DAG: %_DLL_TABLE_ENTRY = type <{ ptr, ptr, ptr, i32, i32 }>
+; TABLES-DAG: @__callobf_functionTable = global %_FUNCTION_TABLE {{.*}}, align 64
+; TABLES-DAG: @__callobf_functionLoadTable = global [{{[0-9]+}} x %_FUNCTION_LOAD_ENTRY]
+; TABLES-DAG: @__callobf_dllTable = global %_DLL_TABLE
+
+; FRAGMENTS-DAG: %_FUNCTION_TABLE_ENTRY = type <{ ptr, i16, i8, i8, i32 }>
+; FRAGMENTS-DAG: %_FUNCTION_FRAGMENT = type <{ %_FUNCTION_TABLE_ENTRY, i32, i32, ptr }>
+; FRAGMENTS-DAG: %_DLL_TABLE_ENTRY = type <{ ptr, ptr, ptr, i32, i32 }>
+; FRAGMENTS-DAG: @__callobf_function.Sleep = linkonce global %_FUNCTION_FRAGMENT {{.*}}, section ".callobf$m", comdat, align 16
+; FRAGMENTS-DAG: @__callobf_function.NtClose = linkonce global %_FUNCTION_FRAGMENT {{.*}}, section ".callobf$m", comdat, align 16
+; FRAGMENTS-DAG: @__callobf_dll.kernel32.dll = linkonce global %_DLL_TABLE_ENTRY {{.*}}, comdat, align 8
+; FRAGMENTS-NOT: @__callobf_functionTable =
+
+declare dllimport void @Sleep(i32)
+declare dllimport i32 @NtClose(ptr)
+
+define void @main(ptr %handle) {
+entry:
+  call void @Sleep(i32 100)
+  %status = call i32 @NtClose(ptr %handle)
+  ret void
+}